@@ -19,6 +19,12 @@
 /* #define FZ_PLOTTERS_CMYK 1 */
 /* #define FZ_PLOTTERS_N 1 */
 
+/*
+	Choose whether to use vector (SSE4.1/AVX2/NEON) versions of
+	the commonest span painters where the processor supports them.
+*/
+/* #define FZ_ENABLE_SIMD 1 */
+
 /*
 	Choose which document agents to include.
 	By default all but GPRF are enabled. To avoid building unwanted
@@ -88,6 +94,38 @@
 /* #define TOFU_BASE14 */
 /* (You probably really don't want to do that except for measurement purposes!) */
 
+/*
+	Choose the number of independently locked shards in the glyph
+	cache. Each shard takes its own lock (see FZ_LOCK_GLYPHCACHE in
+	context.h), so more shards means less contention between
+	rendering threads at the cost of a few more mutexes.
+*/
+/* #define FZ_GLYPH_CACHE_SHARDS 8 */
+
+/*
+	Choose the number of independently locked shards in the hash
+	table of the resource store (see FZ_LOCK_STORE_SHARD in
+	context.h). Lookups of different objects from different
+	threads only contend when they fall in the same shard.
+*/
+/* #define FZ_STORE_SHARDS 8 */
+
+/*
+	Choose whether fz_open_file maps files into memory (on systems
+	with mmap) rather than reading them through stdio. Note that
+	a mapped file that is truncated by another process while open
+	can cause a bus error when read.
+*/
+/* #define FZ_ENABLE_MMAP 1 */
+
+/*
+	Choose whether reference counts are updated with atomic
+	instructions (where the compiler offers them) rather than by
+	taking the FZ_LOCK_ALLOC lock around every keep and drop.
+	Define to 0 to always use the lock.
+*/
+/* #define FZ_ENABLE_ATOMIC_REFS 1 */
+
 /* ---------- DO NOT EDIT ANYTHING UNDER THIS LINE ---------- */
 
 #ifndef FZ_ENABLE_SPOT_RENDERING
@@ -121,6 +159,10 @@
 #define FZ_PLOTTERS_N 1
 #endif
 
+#ifndef FZ_ENABLE_SIMD
+#define FZ_ENABLE_SIMD 1
+#endif /* FZ_ENABLE_SIMD */
+
 #ifndef FZ_ENABLE_PDF
 #define FZ_ENABLE_PDF 1
 #endif /* FZ_ENABLE_PDF */
@@ -165,6 +207,32 @@
 #define FZ_ENABLE_ICC 1
 #endif /* FZ_ENABLE_ICC */
 
+#ifndef FZ_GLYPH_CACHE_SHARDS
+#define FZ_GLYPH_CACHE_SHARDS 8
+#endif /* FZ_GLYPH_CACHE_SHARDS */
+
+#if FZ_GLYPH_CACHE_SHARDS < 1
+#undef FZ_GLYPH_CACHE_SHARDS
+#define FZ_GLYPH_CACHE_SHARDS 1
+#endif
+
+#ifndef FZ_STORE_SHARDS
+#define FZ_STORE_SHARDS 8
+#endif /* FZ_STORE_SHARDS */
+
+#if FZ_STORE_SHARDS < 1
+#undef FZ_STORE_SHARDS
+#define FZ_STORE_SHARDS 1
+#endif
+
+#ifndef FZ_ENABLE_MMAP
+#define FZ_ENABLE_MMAP 1
+#endif /* FZ_ENABLE_MMAP */
+
+#ifndef FZ_ENABLE_ATOMIC_REFS
+#define FZ_ENABLE_ATOMIC_REFS 1
+#endif /* FZ_ENABLE_ATOMIC_REFS */
+
 /* If Epub and HTML are both disabled, disable SIL fonts */
 #if FZ_ENABLE_HTML == 0 && FZ_ENABLE_EPUB == 0
 #undef TOFU_SIL
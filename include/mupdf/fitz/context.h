@@ -2,6 +2,7 @@
 #define MUPDF_FITZ_CONTEXT_H
 
 #include "mupdf/fitz/version.h"
+#include "mupdf/fitz/config.h"
 #include "mupdf/fitz/system.h"
 #include "mupdf/fitz/geometry.h"
 
@@ -19,6 +20,8 @@ typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_tuning_context_s fz_tuning_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_glyph_front_cache_s fz_glyph_front_cache;
+typedef struct fz_image_cache_s fz_image_cache;
 typedef struct fz_document_handler_context_s fz_document_handler_context;
 typedef struct fz_output_context_s fz_output_context;
 typedef struct fz_context_s fz_context;
@@ -104,6 +107,24 @@ void fz_flush_warnings(fz_context *ctx);
 	when we already hold any lock i, where 0 <= i <= n. In order
 	to verify this, we have some debugging code, that can be
 	enabled by defining FITZ_DEBUG_LOCKING.
+
+	The resource store keeps its hash table in FZ_STORE_SHARDS
+	shards, each protected by one of the locks from
+	FZ_LOCK_STORE_SHARD up to FZ_LOCK_STORE_SHARD_LAST, and its
+	lists of items and size accounting under FZ_LOCK_STORE. These
+	are numbered low, so that the store can be used while holding
+	any of the later locks. At most one shard lock is ever held
+	at a time.
+
+	The glyph cache is split into FZ_GLYPH_CACHE_SHARDS shards,
+	each protected by its own lock, numbered from
+	FZ_LOCK_GLYPHCACHE up to FZ_LOCK_GLYPHCACHE_LAST. At most one
+	of these is ever held at a time.
+
+	FZ_LOCK_DOCUMENT protects documents that have been set up to be
+	used by several threads at once (see pdf_enable_threading). It
+	is numbered last so that it can be held while taking any of the
+	others.
 */
 
 struct fz_locks_context_s
@@ -115,8 +136,13 @@ struct fz_locks_context_s
 
 enum {
 	FZ_LOCK_ALLOC = 0,
+	FZ_LOCK_STORE_SHARD,
+	FZ_LOCK_STORE_SHARD_LAST = FZ_LOCK_STORE_SHARD + FZ_STORE_SHARDS - 1,
+	FZ_LOCK_STORE,
 	FZ_LOCK_FREETYPE,
 	FZ_LOCK_GLYPHCACHE,
+	FZ_LOCK_GLYPHCACHE_LAST = FZ_LOCK_GLYPHCACHE + FZ_GLYPH_CACHE_SHARDS - 1,
+	FZ_LOCK_DOCUMENT,
 	FZ_LOCK_MAX
 };
 
@@ -134,6 +160,8 @@ struct fz_context_s
 	fz_style_context *style;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_glyph_front_cache *glyph_front;
+	fz_image_cache *image_cache;
 	fz_tuning_context *tuning;
 	fz_document_handler_context *handler;
 	fz_output_context *output;
@@ -142,7 +170,10 @@ struct fz_context_s
 
 /*
 	Specifies the maximum size in bytes of the resource store in
-	fz_context. Given as argument to fz_new_context.
+	fz_context. Given as argument to fz_new_context. Half of it goes
+	to the cache of decoded image tiles (see fz_set_image_cache_limit)
+	and the rest to the other resources, so that together they keep
+	to the limit.
 
 	FZ_STORE_UNLIMITED: Let resource store grow unbounded.
 
@@ -5,6 +5,8 @@
 #include "mupdf/fitz/context.h"
 #include "mupdf/fitz/geometry.h"
 #include "mupdf/fitz/device.h"
+#include "mupdf/fitz/buffer.h"
+#include "mupdf/fitz/output.h"
 
 /*
 	Display list device -- record and play back device commands.
@@ -39,4 +41,28 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+/*
+	Save a display list to disk, and load it again later, to save
+	interpreting the page a second time. The file format is only
+	understood by the same version and build of the library.
+*/
+void fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename);
+void fz_write_display_list(fz_context *ctx, fz_output *out, fz_display_list *list);
+fz_display_list *fz_load_display_list(fz_context *ctx, const char *filename);
+fz_display_list *fz_new_display_list_from_buffer(fz_context *ctx, fz_buffer *buf);
+
+/*
+	fz_tile_renderer draws a display list into one pixmap from
+	several threads at once, by splitting the pixmap into tiles and
+	sharing them out between the threads. MuPDF does not create
+	threads itself: create the renderer, call fz_run_tile_renderer
+	from each worker thread (each with a cloned context), wait for
+	them all to return, then drop the renderer.
+*/
+typedef struct fz_tile_renderer_s fz_tile_renderer;
+
+fz_tile_renderer *fz_new_tile_renderer(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, int tile_size, int nworkers);
+int fz_run_tile_renderer(fz_context *ctx, fz_tile_renderer *tr, int worker, fz_cookie *cookie);
+void fz_drop_tile_renderer(fz_context *ctx, fz_tile_renderer *tr);
+
 #endif
@@ -53,6 +53,8 @@ typedef struct fz_font_s fz_font;
 
 void *fz_font_ft_face(fz_context *ctx, fz_font *font);
 
+int fz_font_ft_face_index(fz_context *ctx, fz_font *font);
+
 fz_buffer **fz_font_t3_procs(fz_context *ctx, fz_font *font);
 
 const char *ft_error_string(int err);
@@ -149,6 +151,8 @@ void fz_install_load_system_font_funcs(fz_context *ctx,
 	fz_load_system_cjk_font_fn *f_cjk,
 	fz_load_system_fallback_font_fn *f_fallback);
 
+void fz_set_font_face_pool_size(fz_context *ctx, int n);
+
 fz_font *fz_load_system_font(fz_context *ctx, const char *name, int bold, int italic, int needs_exact_metrics);
 
 fz_font *fz_load_system_cjk_font(fz_context *ctx, const char *name, int ordering, int serif);
@@ -7,6 +7,7 @@
 #include "mupdf/fitz/pixmap.h"
 
 void fz_purge_glyph_cache(fz_context *ctx);
+void fz_set_glyph_cache_limits(fz_context *ctx, size_t max_size, int max_glyph_size);
 fz_pixmap *fz_render_glyph_pixmap(fz_context *ctx, fz_font*, int, fz_matrix *, const fz_irect *scissor, int aa);
 void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, int gid, fz_matrix trm, void *gstate, fz_default_colorspaces *def_cs);
 void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid);
@@ -29,6 +29,14 @@ fz_image *fz_keep_image(fz_context *ctx, fz_image *image);
 fz_image *fz_keep_image_store_key(fz_context *ctx, fz_image *image);
 void fz_drop_image_store_key(fz_context *ctx, fz_image *image);
 
+/*
+	Decoded image tiles are kept in a cache of their own, separate
+	from the resource store.
+*/
+void fz_purge_image_cache(fz_context *ctx);
+void fz_set_image_cache_limit(fz_context *ctx, size_t max);
+void fz_dump_image_cache_stats(fz_context *ctx);
+
 /*
 	Function type to destroy an images data
 	when it's reference count reaches zero.
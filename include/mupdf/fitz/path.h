@@ -70,6 +70,8 @@ void fz_trim_path(fz_context *ctx, fz_path *path);
 
 int fz_packed_path_size(const fz_path *path);
 
+int fz_packed_path_is_open(const fz_path *path);
+
 int fz_pack_path(fz_context *ctx, uint8_t *pack, int max, const fz_path *path);
 
 fz_path *fz_clone_path(fz_context *ctx, fz_path *path);
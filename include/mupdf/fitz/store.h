@@ -179,8 +179,12 @@ typedef int (fz_store_filter_fn)(fz_context *ctx, void *arg, void *key);
 
 void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const fz_store_type *type);
 
+void fz_set_store_type_max(fz_context *ctx, const fz_store_type *type, size_t max);
+
 void fz_debug_store(fz_context *ctx);
 
+void fz_dump_store_stats(fz_context *ctx);
+
 void fz_defer_reap_start(fz_context *ctx);
 
 void fz_defer_reap_end(fz_context *ctx);
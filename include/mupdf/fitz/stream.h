@@ -7,6 +7,8 @@
 
 int fz_file_exists(fz_context *ctx, const char *path);
 
+int64_t fz_stat_mtime(const char *path);
+
 /*
 	fz_stream is a buffered reader capable of seeking in both
 	directions.
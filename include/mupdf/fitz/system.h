@@ -145,6 +145,7 @@ wchar_t *fz_wchar_from_utf8(const char *s);
 /* really a FILE* but we don't want to include stdio.h here */
 void *fz_fopen_utf8(const char *name, const char *mode);
 int fz_remove_utf8(const char *name);
+int fz_rename_utf8(const char *oldname, const char *newname);
 
 char **fz_argv_from_wargv(int argc, wchar_t **wargv);
 void fz_free_argv(int argc, char **argv);
@@ -5,6 +5,7 @@ typedef struct pdf_lexbuf_s pdf_lexbuf;
 typedef struct pdf_lexbuf_large_s pdf_lexbuf_large;
 typedef struct pdf_xref_s pdf_xref;
 typedef struct pdf_ocg_descriptor_s pdf_ocg_descriptor;
+typedef struct pdf_mark_list_s pdf_mark_list;
 
 typedef struct pdf_page_s pdf_page;
 typedef struct pdf_annot_s pdf_annot;
@@ -46,12 +47,45 @@ typedef struct pdf_doc_event_s pdf_doc_event;
 */
 typedef void (pdf_doc_event_cb)(fz_context *ctx, pdf_document *doc, pdf_doc_event *event, void *data);
 
+/*
+	A function to run work on several threads at once, for compressing
+	streams in parallel while saving, or scanning a broken file for
+	objects while repairing it. It should call work(ctx, arg) on each
+	of its threads, each with its own clone of ctx, and return when
+	they have all returned. The work is shared out between however
+	many threads call it, so calling it just once on the calling thread
+	is also correct.
+*/
+typedef void (pdf_parallel_fn)(fz_context *ctx, void *opaque, void (*work)(fz_context *ctx, void *arg), void *arg);
+
 pdf_document *pdf_open_document(fz_context *ctx, const char *filename);
 
 pdf_document *pdf_open_document_with_stream(fz_context *ctx, fz_stream *file);
 
+pdf_document *pdf_open_document_with_xref_index(fz_context *ctx, const char *filename, const char *index);
+
+pdf_document *pdf_open_document_with_parallel_repair(fz_context *ctx, const char *filename, pdf_parallel_fn *parallel, void *opaque);
+
 void pdf_drop_document(fz_context *ctx, pdf_document *doc);
 
+/*
+	Allow several threads, each with its own clone of the context,
+	to load and run different pages of the document at once. Loading
+	objects and reading the file is then serialised by
+	FZ_LOCK_DOCUMENT, and streams are read into memory before they
+	are decoded. The document must not be edited while it is being
+	used like this. Call before starting the other threads.
+*/
+void pdf_enable_threading(fz_context *ctx, pdf_document *doc);
+
+/*
+	Take and release the document lock, if threading has been
+	enabled for the document. The lock can be taken again by the
+	thread (context) that holds it.
+*/
+void pdf_lock_document(fz_context *ctx, pdf_document *doc);
+void pdf_unlock_document(fz_context *ctx, pdf_document *doc);
+
 pdf_document *pdf_keep_document(fz_context *ctx, pdf_document *doc);
 
 pdf_document *pdf_specifics(fz_context *ctx, fz_document *doc);
@@ -213,7 +247,19 @@ struct pdf_document_s
 	int rev_page_count;
 	pdf_rev_page_map *rev_page_map;
 
+	int fwd_page_count;
+	pdf_obj **fwd_page_map; /* Page objects, from an xref index */
+	int fwd_page_map_stale; /* Set once the document has changed */
+
 	int repair_attempted;
+	pdf_parallel_fn *repair_parallel; /* If set, used to scan for objects on several threads when repairing. */
+	void *repair_parallel_opaque; /* Passed to repair_parallel. */
+
+	/* Set by pdf_enable_threading */
+	int threaded;
+	fz_context *lock_owner; /* Context holding FZ_LOCK_DOCUMENT for us */
+	int lock_depth;
+	pdf_mark_list *marks; /* Each thread's marked objects */
 
 	/* State indicating which file parsing method we are using */
 	int file_reading_linearly;
@@ -336,6 +382,10 @@ struct pdf_write_options_s
 	int do_sanitize; /* Sanitize content streams. */
 	int do_decrypt; /* Save without decryption. */
 	int do_appearance; /* (Re)create appearance streams. */
+	int do_objstms; /* Pack objects into object streams, with an xref stream. */
+	pdf_parallel_fn *parallel; /* If set, used to deflate streams on several threads. */
+	void *parallel_opaque; /* Passed to parallel. */
+	int do_low_memory; /* Drop objects from memory as they are written. Not with garbage >= 2 or do_linear. */
 	int continue_on_error; /* If set, errors are (optionally) counted and writing continues. */
 	int *errors; /* Pointer to a place to store a count of errors */
 };
@@ -29,6 +29,23 @@ pdf_obj *pdf_copy_array(fz_context *ctx, pdf_obj *array);
 pdf_obj *pdf_copy_dict(fz_context *ctx, pdf_obj *dict);
 pdf_obj *pdf_deep_copy_obj(fz_context *ctx, pdf_obj *obj);
 
+/*
+	Arenas let the objects of one parsed tree share a few blocks of
+	memory. The objects are refcounted as usual, and the memory goes
+	once they have all been dropped. A NULL arena means the heap.
+*/
+typedef struct pdf_obj_arena_s pdf_obj_arena;
+
+pdf_obj_arena *pdf_new_obj_arena(fz_context *ctx);
+void pdf_drop_obj_arena(fz_context *ctx, pdf_obj_arena *arena);
+pdf_obj *pdf_new_arena_int(fz_context *ctx, pdf_obj_arena *arena, int64_t i);
+pdf_obj *pdf_new_arena_real(fz_context *ctx, pdf_obj_arena *arena, float f);
+pdf_obj *pdf_new_arena_name(fz_context *ctx, pdf_obj_arena *arena, const char *str);
+pdf_obj *pdf_new_arena_string(fz_context *ctx, pdf_obj_arena *arena, const char *str, size_t len);
+pdf_obj *pdf_new_arena_indirect(fz_context *ctx, pdf_obj_arena *arena, pdf_document *doc, int num, int gen);
+pdf_obj *pdf_new_arena_array(fz_context *ctx, pdf_obj_arena *arena, pdf_document *doc, int initialcap);
+pdf_obj *pdf_new_arena_dict(fz_context *ctx, pdf_obj_arena *arena, pdf_document *doc, int initialcap);
+
 pdf_obj *pdf_keep_obj(fz_context *ctx, pdf_obj *obj);
 void pdf_drop_obj(fz_context *ctx, pdf_obj *obj);
 
@@ -31,6 +31,7 @@ struct pdf_xref_entry_s
 };
 
 typedef struct pdf_xref_subsec_s pdf_xref_subsec;
+typedef struct pdf_xref_lazy_s pdf_xref_lazy;
 
 struct pdf_xref_subsec_s
 {
@@ -44,6 +45,7 @@ struct pdf_xref_s
 {
 	int num_objects;
 	pdf_xref_subsec *subsec;
+	pdf_xref_lazy *lazy; /* entries still to be read in on demand */
 	pdf_obj *trailer;
 	pdf_obj *pre_repair_trailer;
 	pdf_unsaved_sig *unsaved_sigs;
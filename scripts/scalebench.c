@@ -0,0 +1,171 @@
+/*
+	scalebench -- time the smooth scaler (draw-scale-simple.c)
+
+	Built and run by "make scalebench". Scales a set of synthetic
+	images (a 1-bit A4 scan at 300dpi, an 8-bit RGB photo and a CMYK
+	page), and any image files named on the command line, at the
+	ratios in the table below, and prints the best time of several
+	runs for each.
+*/
+
+#include "mupdf/fitz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+struct timeval;
+struct timezone;
+int gettimeofday(struct timeval *tv, struct timezone *tz);
+#else
+#include <sys/time.h>
+#endif
+
+static const float ratios[] = { 0.75f, 0.5f, 0.333f, 0.25f, 0.125f, 0.05f, 1.5f };
+
+static int iterations = 5;
+
+static double gettime(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: scalebench [-n iterations] [image files]\n"
+		"\t-n -\ttimes to run each scale (default 5)\n"
+		);
+	exit(1);
+}
+
+/* Black text on white, as decoded from a 1-bit scan. */
+static fz_pixmap *
+new_scan(fz_context *ctx, int w, int h)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, fz_device_gray(ctx), w, h, NULL, 0);
+	unsigned char *p = pix->samples;
+	int x, y;
+
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			*p++ = ((y % 50) < 30 && ((x * 7 + y * 3) % 23) < 5) ? 0 : 255;
+	return pix;
+}
+
+/* Smooth gradients with some noise, for photographs. */
+static fz_pixmap *
+new_photo(fz_context *ctx, fz_colorspace *cs, int w, int h)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, w, h, NULL, 0);
+	unsigned char *p = pix->samples;
+	int n = pix->n;
+	int x, y, k;
+
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			for (k = 0; k < n; k++)
+				*p++ = (unsigned char)(((x * (k + 1)) / 8 + (y * (n - k)) / 8 + (rand() & 15)) & 255);
+	return pix;
+}
+
+static void
+bench(fz_context *ctx, const char *name, fz_pixmap *src)
+{
+	int i, k;
+
+	for (i = 0; i < (int)nelem(ratios); i++)
+	{
+		float w = src->w * ratios[i];
+		float h = src->h * ratios[i];
+		double best = 0;
+
+		for (k = 0; k < iterations; k++)
+		{
+			double start = gettime();
+			fz_pixmap *dst = fz_scale_pixmap(ctx, src, 0, 0, w, h, NULL);
+			double t = gettime() - start;
+			fz_drop_pixmap(ctx, dst);
+			if (k == 0 || t < best)
+				best = t;
+		}
+
+		printf("%-24s n=%d %5dx%-5d x%-5g %8.2f ms %8.1f Mpix/s\n",
+			name, src->n, src->w, src->h, ratios[i], best,
+			best > 0 ? (double)src->w * src->h / best / 1000 : 0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	fz_pixmap *pix = NULL;
+	fz_image *image = NULL;
+	int c;
+
+	while ((c = fz_getopt(argc, argv, "n:")) != -1)
+	{
+		switch (c)
+		{
+		default: usage(); break;
+		case 'n': iterations = fz_atoi(fz_optarg); break;
+		}
+	}
+	if (iterations < 1)
+		iterations = 1;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot initialise context\n");
+		exit(1);
+	}
+
+	fz_var(pix);
+	fz_var(image);
+
+	fz_try(ctx)
+	{
+		pix = new_scan(ctx, 2480, 3508);
+		bench(ctx, "scan (1-bit)", pix);
+		fz_drop_pixmap(ctx, pix);
+		pix = NULL;
+
+		pix = new_photo(ctx, fz_device_rgb(ctx), 3000, 2000);
+		bench(ctx, "photo (rgb)", pix);
+		fz_drop_pixmap(ctx, pix);
+		pix = NULL;
+
+		pix = new_photo(ctx, fz_device_cmyk(ctx), 2480, 3508);
+		bench(ctx, "page (cmyk)", pix);
+		fz_drop_pixmap(ctx, pix);
+		pix = NULL;
+
+		for (; fz_optind < argc; fz_optind++)
+		{
+			image = fz_new_image_from_file(ctx, argv[fz_optind]);
+			pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+			bench(ctx, argv[fz_optind], pix);
+			fz_drop_pixmap(ctx, pix);
+			pix = NULL;
+			fz_drop_image(ctx, image);
+			image = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_image(ctx, image);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "scalebench: %s\n", fz_caught_message(ctx));
+		fz_drop_context(ctx);
+		return 1;
+	}
+
+	fz_drop_context(ctx);
+	return 0;
+}
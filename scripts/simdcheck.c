@@ -0,0 +1,186 @@
+/*
+	Check that the vector span painters (draw-simd.c) give exactly the
+	same results as the scalar ones (draw-paint.c) that they replace.
+
+	Built and run by "make simdcheck", which links this against a
+	second copy of draw-paint.c compiled with FZ_ENABLE_SIMD=0 and its
+	entry points renamed from fz_* to scalar_*.
+
+	Every painter is run on the same random data (seeded from the
+	first argument, if given) for 1, 3 and 4 components, with and
+	without alpha, for all widths up to MAXW (so every length of tail
+	is covered) and at every alignment of the buffers within a 16
+	byte lane. The bytes after the end of each span must be left
+	untouched.
+*/
+
+#include "mupdf/fitz.h"
+#include "draw-imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXW 200
+#define SLACK 32
+
+fz_solid_color_painter_t *scalar_get_solid_color_painter(int n, const unsigned char *color, int da, const fz_overprint *eop);
+fz_span_painter_t *scalar_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint *eop);
+fz_span_color_painter_t *scalar_get_span_color_painter(int n, int da, const unsigned char *color, const fz_overprint *eop);
+void scalar_paint_pixmap_with_mask(fz_pixmap *dst, const fz_pixmap *src, const fz_pixmap *msk);
+
+/* The scalar copy of draw-paint.c must never pick a vector painter. */
+fz_solid_color_painter_t *scalar_get_solid_color_painter_simd(int n, const unsigned char *color, int da) { return NULL; }
+fz_span_painter_t *scalar_get_span_painter_simd(int da, int sa, int n, int alpha) { return NULL; }
+fz_span_color_painter_t *scalar_get_span_color_painter_simd(int n, int da, const unsigned char *color) { return NULL; }
+fz_span_mask_painter_t *scalar_get_span_mask_painter_simd(int a, int n) { return NULL; }
+
+static int checks = 0;
+static int failures = 0;
+
+/* Random bytes, with plenty of the 0 and 255 edge cases. */
+static unsigned char
+rnd(void)
+{
+	int r = rand() % 10;
+	if (r == 0)
+		return 0;
+	if (r == 1)
+		return 255;
+	return rand() & 255;
+}
+
+static void
+fill(unsigned char *p, int len)
+{
+	int i;
+	for (i = 0; i < len; i++)
+		p[i] = rnd();
+}
+
+/* Make pixels with alpha valid premultiplied values. */
+static void
+premultiply(unsigned char *p, int n, int a, int w)
+{
+	int i, k;
+
+	if (!a)
+		return;
+	for (i = 0; i < w; i++, p += n + 1)
+		for (k = 0; k < n; k++)
+			if (p[k] > p[n])
+				p[k] = p[n] ? p[k] % (p[n] + 1) : 0;
+}
+
+static void
+compare(const char *what, int n, int da, int sa, int w, int alpha, int align,
+	const unsigned char *orig, const unsigned char *a, const unsigned char *b, int len)
+{
+	int i;
+
+	checks++;
+	for (i = 0; i < len + SLACK; i++)
+	{
+		if (a[i] != b[i] || (i >= len && b[i] != orig[i]))
+		{
+			if (failures++ < 20)
+				fprintf(stderr, "%s n=%d da=%d sa=%d w=%d alpha=%d align=%d: byte %d is %d, expected %d\n",
+					what, n, da, sa, w, alpha, align, i, b[i], a[i]);
+			return;
+		}
+	}
+}
+
+static void
+check_layout(int n, int da, int sa, int w, int align, int alpha)
+{
+	static unsigned char orig[MAXW * 5 + SLACK];
+	static unsigned char buf0[MAXW * 5 + SLACK + 16];
+	static unsigned char buf1[MAXW * 5 + SLACK + 16];
+	static unsigned char sbuf[MAXW * 5 + 16];
+	static unsigned char mbuf[MAXW + 16];
+	unsigned char color[8];
+	unsigned char *d0 = buf0 + align;
+	unsigned char *d1 = buf1 + align;
+	unsigned char *s = sbuf + align;
+	unsigned char *m = mbuf + align;
+	int dlen = w * (n + da);
+
+	fill(orig, sizeof orig);
+	fill(sbuf, sizeof sbuf);
+	fill(mbuf, sizeof mbuf);
+	fill(color, sizeof color);
+	premultiply(orig, n, da, w);
+	premultiply(s, n, sa, w);
+
+	memcpy(d0, orig, sizeof orig);
+	memcpy(d1, orig, sizeof orig);
+	scalar_get_span_painter(da, sa, n, alpha, NULL)(d0, da, s, sa, n, w, alpha, NULL);
+	fz_get_span_painter(da, sa, n, alpha, NULL)(d1, da, s, sa, n, w, alpha, NULL);
+	compare("span", n, da, sa, w, alpha, align, orig, d0, d1, dlen);
+
+	if (sa == 0)
+	{
+		color[n] = alpha;
+
+		memcpy(d0, orig, sizeof orig);
+		memcpy(d1, orig, sizeof orig);
+		scalar_get_span_color_painter(n + da, da, color, NULL)(d0, m, n + da, w, color, da, NULL);
+		fz_get_span_color_painter(n + da, da, color, NULL)(d1, m, n + da, w, color, da, NULL);
+		compare("span color", n, da, 0, w, alpha, align, orig, d0, d1, dlen);
+
+		memcpy(d0, orig, sizeof orig);
+		memcpy(d1, orig, sizeof orig);
+		scalar_get_solid_color_painter(n + da, color, da, NULL)(d0, n + da, w, color, da, NULL);
+		fz_get_solid_color_painter(n + da, color, da, NULL)(d1, n + da, w, color, da, NULL);
+		compare("solid color", n, da, 0, w, alpha, align, orig, d0, d1, dlen);
+	}
+
+	if (sa == da)
+	{
+		fz_pixmap dst, src, msk;
+
+		memset(&dst, 0, sizeof dst);
+		memset(&src, 0, sizeof src);
+		memset(&msk, 0, sizeof msk);
+		dst.w = src.w = msk.w = w;
+		dst.h = src.h = msk.h = 1;
+		dst.n = src.n = n + da;
+		dst.alpha = src.alpha = da;
+		dst.stride = src.stride = dlen;
+		msk.n = 1;
+		msk.stride = w;
+		src.samples = s;
+		msk.samples = m;
+
+		memcpy(d0, orig, sizeof orig);
+		memcpy(d1, orig, sizeof orig);
+		dst.samples = d0;
+		scalar_paint_pixmap_with_mask(&dst, &src, &msk);
+		dst.samples = d1;
+		fz_paint_pixmap_with_mask(&dst, &src, &msk);
+		compare("span mask", n, da, sa, w, 255, align, orig, d0, d1, dlen);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int ns[] = { 1, 3, 4 };
+	int i, da, sa, w, align;
+
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	for (i = 0; i < (int)nelem(ns); i++)
+		for (da = 0; da <= 1; da++)
+			for (sa = 0; sa <= 1; sa++)
+				for (w = 1; w <= MAXW; w++)
+					for (align = 0; align < 16; align++)
+					{
+						check_layout(ns[i], da, sa, w, align, 255);
+						check_layout(ns[i], da, sa, w, align, 1 + rand() % 254);
+					}
+
+	printf("simdcheck: %d checks, %d failures\n", checks, failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
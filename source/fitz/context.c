@@ -162,6 +162,7 @@ fz_drop_context(fz_context *ctx)
 	/* Other finalisation calls go here (in reverse order) */
 	fz_drop_document_handler_context(ctx);
 	fz_drop_glyph_cache_context(ctx);
+	fz_drop_image_cache_context(ctx);
 	fz_drop_store_context(ctx);
 	fz_drop_aa_context(ctx);
 	fz_drop_style_context(ctx);
@@ -260,7 +261,9 @@ cleanup:
 	max_store: Maximum size in bytes of the resource store, before
 	it will start evicting cached resources such as fonts and
 	images. FZ_STORE_UNLIMITED can be used if a hard limit is not
-	desired. Use FZ_STORE_DEFAULT to get a reasonable size.
+	desired. Use FZ_STORE_DEFAULT to get a reasonable size. Decoded
+	images are cached separately, in half of this (see
+	fz_set_image_cache_limit); the other resources get the rest.
 
 	May return NULL.
 */
@@ -268,6 +271,8 @@ fz_context *
 fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks, size_t max_store, const char *version)
 {
 	fz_context *ctx;
+	size_t image_max = max_store / 2;
+	size_t store_max = max_store - image_max;
 
 	if (strcmp(version, FZ_VERSION))
 	{
@@ -285,11 +290,16 @@ fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks,
 	if (!ctx)
 		return NULL;
 
+	/* A limit too small to halve still must not become unlimited. */
+	if (max_store != FZ_STORE_UNLIMITED && image_max == 0)
+		image_max = 1;
+
 	/* Now initialise sections that are shared */
 	fz_try(ctx)
 	{
 		fz_new_output_context(ctx);
-		fz_new_store_context(ctx, max_store);
+		fz_new_store_context(ctx, store_max);
+		fz_new_image_cache_context(ctx, image_max);
 		fz_new_glyph_cache_context(ctx);
 		fz_new_cmm_context(ctx);
 		fz_new_colorspace_context(ctx);
@@ -354,6 +364,8 @@ fz_clone_context_internal(fz_context *ctx)
 	new_ctx->user = ctx->user;
 	new_ctx->store = ctx->store;
 	new_ctx->store = fz_keep_store_context(new_ctx);
+	new_ctx->image_cache = ctx->image_cache;
+	new_ctx->image_cache = fz_keep_image_cache_context(new_ctx);
 	new_ctx->glyph_cache = ctx->glyph_cache;
 	new_ctx->glyph_cache = fz_keep_glyph_cache(new_ctx);
 	new_ctx->colorspace = ctx->colorspace;
@@ -456,9 +456,20 @@ fz_load_page(fz_context *ctx, fz_document *doc, int number)
 
 	fz_ensure_layout(ctx, doc);
 
+	/* The list of open pages is guarded by the alloc lock, so that
+	 * threads with cloned contexts can load pages of the same document.
+	 * Pages that are being dropped are skipped. */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
 	for (page = doc->open; page; page = page->next)
-		if (page->number == number)
-			return fz_keep_page(ctx, page);
+	{
+		if (page->number == number && fz_keep_refs(&page->refs) > 0)
+		{
+			(void)Memento_takeRef(page);
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			return page;
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	if (doc && doc->load_page)
 	{
@@ -466,10 +477,12 @@ fz_load_page(fz_context *ctx, fz_document *doc, int number)
 		page->number = number;
 
 		/* Insert new page at the head of the list of open pages. */
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if ((page->next = doc->open) != NULL)
 			doc->open->prev = &page->next;
 		doc->open = page;
 		page->prev = &doc->open;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		return page;
 	}
 
@@ -608,10 +621,12 @@ fz_drop_page(fz_context *ctx, fz_page *page)
 	if (fz_drop_imp(ctx, page, &page->refs))
 	{
 		/* Remove page from the list of open pages */
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (page->next != NULL)
 			page->next->prev = page->prev;
 		if (page->prev != NULL)
 			*page->prev = page->next;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 		if (page->drop_page)
 			page->drop_page(ctx, page);
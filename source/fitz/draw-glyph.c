@@ -9,9 +9,15 @@
 #define MAX_GLYPH_SIZE 256
 #define MAX_CACHE_SIZE (1024*1024)
 
-#define GLYPH_HASH_LEN 509
+/* Initial number of slots in each shard's table; must be a power of 2. */
+#define GLYPH_HASH_INITIAL 64
+
+/* Size of the per-context front cache; must be a power of 2. */
+#define GLYPH_FRONT_LEN 64
 
 typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
+typedef struct fz_glyph_cache_shard_s fz_glyph_cache_shard;
+typedef struct fz_glyph_front_entry_s fz_glyph_front_entry;
 typedef struct fz_glyph_key_s fz_glyph_key;
 
 struct fz_glyph_key_s
@@ -30,100 +36,336 @@ struct fz_glyph_cache_entry_s
 	unsigned hash;
 	fz_glyph_cache_entry *lru_prev;
 	fz_glyph_cache_entry *lru_next;
-	fz_glyph_cache_entry *bucket_next;
-	fz_glyph_cache_entry *bucket_prev;
 	fz_glyph *val;
 };
 
-struct fz_glyph_cache_s
+/*
+	Each shard is an independent hash table and LRU list with its
+	own share of the cache size. A glyph lives in the shard
+	selected by its key hash, and that shard is only ever touched
+	with its own lock (FZ_LOCK_GLYPHCACHE + shard index) held.
+
+	The table uses open addressing with linear probing, and doubles
+	in size whenever it becomes more than half full, so lookups stay
+	short however many glyphs the size limit allows.
+*/
+struct fz_glyph_cache_shard_s
 {
-	int refs;
 	size_t total;
-#ifndef NDEBUG
+	int busy;
+	int contended;
+	int hits;
+	int misses;
+	int uncacheable;
 	int num_evictions;
-	ptrdiff_t evicted;
-#endif
-	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
+	size_t evicted;
+	int len, cap;
+	fz_glyph_cache_entry **table;
 	fz_glyph_cache_entry *lru_head;
 	fz_glyph_cache_entry *lru_tail;
 };
 
+struct fz_glyph_cache_s
+{
+	int refs;
+	int generation;
+	size_t max_size;
+	int max_glyph_size;
+	fz_glyph_cache_shard shard[FZ_GLYPH_CACHE_SHARDS];
+};
+
+/*
+	Each context keeps a small direct mapped cache of the glyphs it
+	has recently fetched from the shared cache. Hits in here need no
+	glyph cache lock at all. Entries hold references to both the
+	glyph and the font, and are only trusted while the generation
+	matches that of the shared cache (which is bumped whenever the
+	shared cache is purged).
+*/
+struct fz_glyph_front_entry_s
+{
+	fz_glyph_key key;
+	int generation;
+	fz_glyph *val;
+};
+
+struct fz_glyph_front_cache_s
+{
+	int hits;
+	fz_glyph_front_entry entry[GLYPH_FRONT_LEN];
+};
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
 	cache->refs = 1;
+	cache->max_size = MAX_CACHE_SIZE;
+	cache->max_glyph_size = MAX_GLYPH_SIZE;
 
 	ctx->glyph_cache = cache;
 }
 
 static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+lock_shard(fz_context *ctx, fz_glyph_cache *cache, int idx)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_cache_shard *shard = &cache->shard[idx];
+
+	/* This unlocked read is only a hint; if it says another thread
+	 * is in the shard, we are (very probably) about to wait. */
+	int busy = shard->busy;
 
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE + idx);
+	if (busy)
+		shard->contended++;
+	shard->busy = 1;
+}
+
+static void
+unlock_shard(fz_context *ctx, fz_glyph_cache *cache, int idx)
+{
+	cache->shard[idx].busy = 0;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + idx);
+}
+
+/* The lock for the shard is always held when the following are called. */
+static int
+find_slot(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
+{
+	int mask = shard->cap - 1;
+	int i = entry->hash & mask;
+
+	while (shard->table[i] != entry)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void
+remove_from_table(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
+{
+	int mask = shard->cap - 1;
+	int i = find_slot(shard, entry);
+	int j = i;
+
+	/* Shift back any following entries that would otherwise become
+	 * unreachable from their home slot. */
+	shard->table[i] = NULL;
+	for (;;)
+	{
+		int k;
+		j = (j + 1) & mask;
+		if (shard->table[j] == NULL)
+			break;
+		k = shard->table[j]->hash & mask;
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		shard->table[i] = shard->table[j];
+		shard->table[j] = NULL;
+		i = j;
+	}
+	shard->len--;
+}
+
+static void
+insert_into_table(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
+{
+	int mask = shard->cap - 1;
+	int i = entry->hash & mask;
+
+	while (shard->table[i])
+		i = (i + 1) & mask;
+	shard->table[i] = entry;
+	shard->len++;
+}
+
+/* Make room for one more entry, growing the table if needed. */
+static void
+reserve_table(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+	fz_glyph_cache_entry **old_table = shard->table;
+	int old_cap = shard->cap;
+	int i;
+
+	if (shard->table && (shard->len + 1) * 2 <= shard->cap)
+		return;
+
+	shard->table = fz_calloc(ctx, old_cap ? old_cap * 2 : GLYPH_HASH_INITIAL, sizeof(*shard->table));
+	shard->cap = old_cap ? old_cap * 2 : GLYPH_HASH_INITIAL;
+	shard->len = 0;
+	for (i = 0; i < old_cap; i++)
+		if (old_table[i])
+			insert_into_table(shard, old_table[i]);
+	fz_free(ctx, old_table);
+}
+
+static fz_glyph_cache_entry *
+lookup_table(fz_glyph_cache_shard *shard, fz_glyph_key *key, unsigned hash)
+{
+	fz_glyph_cache_entry *entry;
+	int mask = shard->cap - 1;
+	int i;
+
+	if (!shard->table)
+		return NULL;
+	i = hash & mask;
+	while ((entry = shard->table[i]) != NULL)
+	{
+		if (entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+			return entry;
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
+{
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	if (entry->lru_prev)
 		entry->lru_prev->lru_next = entry->lru_next;
 	else
-		cache->lru_head = entry->lru_next;
-	cache->total -= fz_glyph_size(ctx, entry->val);
-	if (entry->bucket_next)
-		entry->bucket_next->bucket_prev = entry->bucket_prev;
-	if (entry->bucket_prev)
-		entry->bucket_prev->bucket_next = entry->bucket_next;
-	else
-		cache->entry[entry->hash] = entry->bucket_next;
+		shard->lru_head = entry->lru_next;
+	shard->total -= fz_glyph_size(ctx, entry->val);
+	remove_from_table(shard, entry);
 	fz_drop_font(ctx, entry->key.font);
 	fz_drop_glyph(ctx, entry->val);
 	fz_free(ctx, entry);
 }
 
-/* The glyph cache lock is always held when this function is called. */
 static void
-do_purge(fz_context *ctx)
+evict_shard(fz_context *ctx, fz_glyph_cache_shard *shard, size_t budget, fz_glyph_cache_entry *keep)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
-	int i;
+	while (shard->total > budget && shard->lru_tail && shard->lru_tail != keep)
+	{
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, shard->lru_tail->val);
+		drop_glyph_cache_entry(ctx, shard, shard->lru_tail);
+	}
+}
+
+static void
+do_purge_shard(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+	while (shard->lru_head)
+		drop_glyph_cache_entry(ctx, shard, shard->lru_head);
+
+	fz_free(ctx, shard->table);
+	shard->table = NULL;
+	shard->cap = 0;
+	shard->len = 0;
+	shard->total = 0;
+}
 
-	for (i = 0; i < GLYPH_HASH_LEN; i++)
+static void
+drop_front_entry(fz_context *ctx, fz_glyph_front_entry *fe)
+{
+	if (fe->val)
 	{
-		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+		fz_drop_glyph(ctx, fe->val);
+		fz_drop_font(ctx, fe->key.font);
+		fe->val = NULL;
 	}
+}
+
+static void
+purge_front_cache(fz_context *ctx)
+{
+	fz_glyph_front_cache *front = ctx->glyph_front;
+	int i;
 
-	cache->total = 0;
+	if (!front)
+		return;
+	for (i = 0; i < GLYPH_FRONT_LEN; i++)
+		drop_front_entry(ctx, &front->entry[i]);
 }
 
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	purge_front_cache(ctx);
+
+	/* Front caches in other contexts notice the new generation
+	 * and discard their entries on their next lookup. */
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		lock_shard(ctx, cache, i);
+		if (i == 0)
+			cache->generation++;
+		do_purge_shard(ctx, &cache->shard[i]);
+		unlock_shard(ctx, cache, i);
+	}
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
+	int i, drop;
+
 	if (!ctx || !ctx->glyph_cache)
 		return;
 
+	purge_front_cache(ctx);
+	fz_free(ctx, ctx->glyph_front);
+	ctx->glyph_front = NULL;
+
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	drop = --ctx->glyph_cache->refs == 0;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	/* Nobody else can see the cache any more, so the shards can
+	 * be emptied without taking their locks. */
+	if (drop)
 	{
-		do_purge(ctx);
+		for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+			do_purge_shard(ctx, &ctx->glyph_cache->shard[i]);
 		fz_free(ctx, ctx->glyph_cache);
-		ctx->glyph_cache = NULL;
 	}
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache = NULL;
+}
+
+/*
+	Set the limits of the glyph cache.
+
+	max_size: The total number of bytes of rendered glyphs to keep
+	cached (0 for the default of 1MB). The budget is shared equally
+	between the shards of the cache. If the cache currently holds
+	more than this, the least recently used glyphs are evicted
+	immediately.
+
+	max_glyph_size: The largest glyph size (in pixels) that will be
+	rendered into the cache (0 for the default of 256). Larger
+	glyphs are drawn as paths (or uncached, for type 3 fonts).
+*/
+void
+fz_set_glyph_cache_limits(fz_context *ctx, size_t max_size, int max_glyph_size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	if (max_size == 0)
+		max_size = MAX_CACHE_SIZE;
+	if (max_glyph_size <= 0)
+		max_glyph_size = MAX_GLYPH_SIZE;
+
+	/* The limits are only ever read as hints outside the shard
+	 * locks, so it is safe to change them at any time. */
+	cache->max_size = max_size;
+	cache->max_glyph_size = max_glyph_size;
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		lock_shard(ctx, cache, i);
+		evict_shard(ctx, &cache->shard[i], max_size / FZ_GLYPH_CACHE_SHARDS, NULL);
+		unlock_shard(ctx, cache, i);
+	}
 }
 
 fz_glyph_cache *
@@ -226,7 +468,7 @@ static unsigned do_hash(unsigned char *s, int len)
 }
 
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -236,36 +478,85 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	/* Relink */
-	entry->lru_next = cache->lru_head;
+	entry->lru_next = shard->lru_head;
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry;
-	cache->lru_head = entry;
+	shard->lru_head = entry;
 	entry->lru_prev = NULL;
 }
 
+static fz_glyph *
+lookup_front_cache(fz_context *ctx, fz_glyph_key *key, unsigned hash)
+{
+	fz_glyph_front_cache *front = ctx->glyph_front;
+	fz_glyph_front_entry *fe;
+
+	if (!front)
+		return NULL;
+	fe = &front->entry[hash & (GLYPH_FRONT_LEN-1)];
+	if (!fe->val)
+		return NULL;
+	if (fe->generation != ctx->glyph_cache->generation)
+	{
+		drop_front_entry(ctx, fe);
+		return NULL;
+	}
+	if (memcmp(&fe->key, key, sizeof(*key)) != 0)
+		return NULL;
+	front->hits++;
+	return fz_keep_glyph(ctx, fe->val);
+}
+
+/* Never called with a glyph cache lock held. */
+static void
+insert_front_cache(fz_context *ctx, fz_glyph_key *key, unsigned hash, int generation, fz_glyph *val)
+{
+	fz_glyph_front_entry *fe;
+
+	if (!ctx->glyph_front)
+	{
+		ctx->glyph_front = fz_malloc_no_throw(ctx, sizeof(fz_glyph_front_cache));
+		if (!ctx->glyph_front)
+			return;
+		memset(ctx->glyph_front, 0, sizeof(fz_glyph_front_cache));
+	}
+	fe = &ctx->glyph_front->entry[hash & (GLYPH_FRONT_LEN-1)];
+	drop_front_entry(ctx, fe);
+	fe->key = *key;
+	fe->generation = generation;
+	fe->val = fz_keep_glyph(ctx, val);
+	fz_keep_font(ctx, key->font);
+}
+
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor, int alpha, int aa)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *shard;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
 	float size;
 	fz_glyph *val;
-	int do_cache, locked, caching;
+	int do_cache, locked, caching, encached, generation;
 	fz_glyph_cache_entry *entry;
-	unsigned hash;
+	unsigned full_hash, hash;
+	int idx, max_glyph_size;
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
 
 	fz_var(locked);
 	fz_var(caching);
+	fz_var(encached);
 	fz_var(val);
 
+	cache = ctx->glyph_cache;
+	max_glyph_size = cache->max_glyph_size;
+
 	memset(&key, 0, sizeof key);
 	size = fz_subpixel_adjust(ctx, ctm, &subpix_ctm, &key.e, &key.f);
-	if (size <= MAX_GLYPH_SIZE)
+	if (size <= max_glyph_size)
 	{
 		scissor = &fz_infinite_irect;
 		do_cache = 1;
@@ -282,8 +573,6 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		do_cache = 0;
 	}
 
-	cache = ctx->glyph_cache;
-
 	key.font = font;
 	key.gid = gid;
 	key.a = subpix_ctm.a * 65536;
@@ -292,47 +581,61 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = aa;
 
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	entry = cache->entry[hash];
-	while (entry)
+	full_hash = do_hash((unsigned char *)&key, sizeof(key));
+
+	/* Type 3 fonts refer back to their document, so they are kept
+	 * out of the front caches which may outlive it. */
+	if (is_ft_font)
 	{
-		if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-		{
-			move_to_front(cache, entry);
-			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+		val = lookup_front_cache(ctx, &key, full_hash);
+		if (val)
 			return val;
-		}
-		entry = entry->bucket_next;
 	}
 
+	idx = full_hash % FZ_GLYPH_CACHE_SHARDS;
+	hash = full_hash / FZ_GLYPH_CACHE_SHARDS;
+	shard = &cache->shard[idx];
+
+	lock_shard(ctx, cache, idx);
+	generation = cache->generation;
+	entry = lookup_table(shard, &key, hash);
+	if (entry)
+	{
+		move_to_front(shard, entry);
+		shard->hits++;
+		val = fz_keep_glyph(ctx, entry->val);
+		unlock_shard(ctx, cache, idx);
+		if (is_ft_font)
+			insert_front_cache(ctx, &key, full_hash, generation, val);
+		return val;
+	}
+	shard->misses++;
+
 	locked = 1;
 	caching = 0;
+	encached = 0;
 	val = NULL;
 
 	fz_try(ctx)
 	{
+		/* We drop the shard lock while rendering, so that other
+		 * threads using the shard are not held up by the slowest
+		 * step. The danger here is that some other thread will
+		 * come along, and want the same glyph too. If it does, we
+		 * may both end up rendering pixmaps. We cope with this
+		 * later on, by ensuring that only one gets inserted into
+		 * the cache. If we insert ours to find one already there,
+		 * we abandon ours, and use the one there already.
+		 */
+		unlock_shard(ctx, cache, idx);
+		locked = 0;
 		if (is_ft_font)
 		{
 			val = fz_render_ft_glyph(ctx, font, gid, subpix_ctm, aa);
 		}
 		else if (fz_font_t3_procs(ctx, font))
 		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 0;
 			val = fz_render_t3_glyph(ctx, font, gid, subpix_ctm, model, scissor, aa);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 1;
 		}
 		else
 		{
@@ -340,55 +643,49 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		}
 		if (val && do_cache)
 		{
-			if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
+			if (val->w < max_glyph_size && val->h < max_glyph_size)
 			{
 				/* If we throw an exception whilst caching,
 				 * just ignore the exception and carry on. */
 				caching = 1;
-				if (!is_ft_font)
+				lock_shard(ctx, cache, idx);
+				locked = 1;
+
+				/* We had to unlock. Someone else might
+				 * have rendered in the meantime */
+				entry = lookup_table(shard, &key, hash);
+				if (entry)
 				{
-					/* We had to unlock. Someone else might
-					 * have rendered in the meantime */
-					entry = cache->entry[hash];
-					while (entry)
-					{
-						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-						{
-							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
-							val = fz_keep_glyph(ctx, entry->val);
-							goto unlock_and_return_val;
-						}
-						entry = entry->bucket_next;
-					}
+					fz_drop_glyph(ctx, val);
+					move_to_front(shard, entry);
+					val = fz_keep_glyph(ctx, entry->val);
+					goto unlock_and_return_val;
 				}
 
+				reserve_table(ctx, shard);
 				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
 				entry->key = key;
 				entry->hash = hash;
-				entry->bucket_next = cache->entry[hash];
-				if (entry->bucket_next)
-					entry->bucket_next->bucket_prev = entry;
-				cache->entry[hash] = entry;
+				insert_into_table(shard, entry);
 				entry->val = fz_keep_glyph(ctx, val);
 				fz_keep_font(ctx, key.font);
 
-				entry->lru_next = cache->lru_head;
+				entry->lru_next = shard->lru_head;
 				if (entry->lru_next)
 					entry->lru_next->lru_prev = entry;
 				else
-					cache->lru_tail = entry;
-				cache->lru_head = entry;
+					shard->lru_tail = entry;
+				shard->lru_head = entry;
+				encached = 1;
 
-				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
+				shard->total += fz_glyph_size(ctx, val);
+				evict_shard(ctx, shard, cache->max_size / FZ_GLYPH_CACHE_SHARDS, entry);
+			}
+			else
+			{
+				lock_shard(ctx, cache, idx);
+				locked = 1;
+				shard->uncacheable++;
 			}
 		}
 unlock_and_return_val:
@@ -398,7 +695,7 @@ unlock_and_return_val:
 	fz_always(ctx)
 	{
 		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			unlock_shard(ctx, cache, idx);
 	}
 	fz_catch(ctx)
 	{
@@ -408,6 +705,9 @@ unlock_and_return_val:
 			fz_rethrow(ctx);
 	}
 
+	if (encached && is_ft_font)
+		insert_front_cache(ctx, &key, full_hash, generation, val);
+
 	return val;
 }
 
@@ -420,7 +720,7 @@ fz_render_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm,
 	float size = fz_subpixel_adjust(ctx, ctm, &subpix_ctm, &qe, &qf);
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
 
-	if (size <= MAX_GLYPH_SIZE)
+	if (size <= ctx->glyph_cache->max_glyph_size)
 	{
 		scissor = &fz_infinite_irect;
 	}
@@ -451,9 +751,32 @@ void
 fz_dump_glyph_cache_stats(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	size_t total = 0, evicted = 0;
+	int hits = 0, misses = 0, uncacheable = 0, contended = 0;
+	int num_evictions = 0, len = 0, cap = 0;
+	int i;
+
+	/* The counters are read without taking the shard locks, so
+	 * the figures may be slightly stale if other threads are still
+	 * rendering. */
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+		total += shard->total;
+		hits += shard->hits;
+		misses += shard->misses;
+		uncacheable += shard->uncacheable;
+		contended += shard->contended;
+		num_evictions += shard->num_evictions;
+		evicted += shard->evicted;
+		len += shard->len;
+		cap += shard->cap;
+	}
 
-	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Size: %zu\n", cache->total);
-#ifndef NDEBUG
-	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Evictions: %d (%zu bytes)\n", cache->num_evictions, cache->evicted);
-#endif
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Size: %zu (limit %zu)\n", total, cache->max_size);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Entries: %d (%d slots in %d shards)\n", len, cap, FZ_GLYPH_CACHE_SHARDS);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Hits: %d (%d in front cache)\n", hits, ctx->glyph_front ? ctx->glyph_front->hits : 0);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Misses: %d (%d larger than %dpx)\n", misses, uncacheable, cache->max_glyph_size);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Evictions: %d (%zu bytes)\n", num_evictions, evicted);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Lock Contention: %d\n", contended);
 }
@@ -4,6 +4,15 @@
 #define BBOX_MIN -(1<<20)
 #define BBOX_MAX (1<<20)
 
+/* Which vector instruction sets the drawing code may use. */
+#if FZ_ENABLE_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_X86
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define HAVE_SIMD_NEON
+#endif
+#endif /* FZ_ENABLE_SIMD */
+
 /* divide and floor towards -inf */
 static inline int fz_idiv(int a, int b)
 {
@@ -439,11 +448,17 @@ typedef void (fz_solid_color_painter_t)(unsigned char * FZ_RESTRICT dp, int n, i
 
 typedef void (fz_span_painter_t)(unsigned char * FZ_RESTRICT dp, int da, const unsigned char * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint *eop);
 typedef void (fz_span_color_painter_t)(unsigned char * FZ_RESTRICT dp, const unsigned char * FZ_RESTRICT mp, int n, int w, const unsigned char * FZ_RESTRICT color, int da, const fz_overprint *eop);
+typedef void (fz_span_mask_painter_t)(unsigned char * FZ_RESTRICT dp, const unsigned char * FZ_RESTRICT sp, const unsigned char * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint *eop);
 
 fz_solid_color_painter_t *fz_get_solid_color_painter(int n, const unsigned char *color, int da, const fz_overprint *eop);
 fz_span_painter_t *fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint *eop);
 fz_span_color_painter_t *fz_get_span_color_painter(int n, int da, const unsigned char *color, const fz_overprint *eop);
 
+fz_solid_color_painter_t *fz_get_solid_color_painter_simd(int n, const unsigned char *color, int da);
+fz_span_painter_t *fz_get_span_painter_simd(int da, int sa, int n, int alpha);
+fz_span_color_painter_t *fz_get_span_color_painter_simd(int n, int da, const unsigned char *color);
+fz_span_mask_painter_t *fz_get_span_mask_painter_simd(int a, int n);
+
 void fz_paint_image(fz_context *ctx, fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *group_alpha, fz_pixmap *img, fz_matrix ctm, int alpha, int lerp_allowed, int gridfit_as_tiled, const fz_overprint *eop);
 void fz_paint_image_with_color(fz_context *ctx, fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *group_alpha, fz_pixmap *img, fz_matrix ctm, const unsigned char *colorbv, int lerp_allowed, int gridfit_as_tiled, const fz_overprint *eop);
 
@@ -571,6 +571,8 @@ static void paint_solid_color_N_da_op(byte * FZ_RESTRICT dp, int n, int w, const
 fz_solid_color_painter_t *
 fz_get_solid_color_painter(int n, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
 {
+	fz_solid_color_painter_t *simd;
+
 #if FZ_ENABLE_SPOT_RENDERING
 	if (fz_overprint_required(eop))
 	{
@@ -582,6 +584,10 @@ fz_get_solid_color_painter(int n, const byte * FZ_RESTRICT color, int da, const
 			return paint_solid_color_N_alpha_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+	simd = fz_get_solid_color_painter_simd(n, color, da);
+	if (simd)
+		return simd;
+
 	switch (n-da)
 	{
 		case 0:
@@ -1014,12 +1020,18 @@ paint_span_with_color_N_da_op(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp
 fz_span_color_painter_t *
 fz_get_span_color_painter(int n, int da, const byte * FZ_RESTRICT color, const fz_overprint * FZ_RESTRICT eop)
 {
+	fz_span_color_painter_t *simd;
+
 #if FZ_ENABLE_SPOT_RENDERING
 	if (fz_overprint_required(eop))
 	{
 		return da ? paint_span_with_color_N_da_op : paint_span_with_color_N_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+	simd = fz_get_span_color_painter_simd(n, da, color);
+	if (simd)
+		return simd;
+
 	switch(n-da)
 	{
 	case 0: return da ? paint_span_with_color_0_da : NULL;
@@ -1304,11 +1316,13 @@ paint_span_with_mask_N(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const
 }
 #endif /* FZ_PLOTTERS_N */
 
-typedef void (fz_span_mask_painter_t)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop);
-
 static fz_span_mask_painter_t *
 fz_get_span_mask_painter(int a, int n)
 {
+	fz_span_mask_painter_t *simd = fz_get_span_mask_painter_simd(a, n);
+	if (simd)
+		return simd;
+
 	switch(n)
 	{
 		case 0:
@@ -1995,6 +2009,8 @@ paint_span_N_general_alpha_op(byte * FZ_RESTRICT dp, int da, const byte * FZ_RES
 fz_span_painter_t *
 fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RESTRICT eop)
 {
+	fz_span_painter_t *simd;
+
 #if FZ_ENABLE_SPOT_RENDERING
 	if (fz_overprint_required(eop))
 	{
@@ -2006,6 +2022,10 @@ fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RE
 			return NULL;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+	simd = fz_get_span_painter_simd(da, sa, n, alpha);
+	if (simd)
+		return simd;
+
 	switch (n)
 	{
 	case 0:
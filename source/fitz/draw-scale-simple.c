@@ -18,6 +18,10 @@ intermediate results rather than ints.
 #include <assert.h>
 #include <limits.h>
 
+#ifdef HAVE_SIMD_X86
+#include <immintrin.h>
+#endif
+
 /* Do we special case handling of single pixel high/wide images? The
  * 'purest' handling is given by not special casing them, but certain
  * files that use such images 'stack' them to give full images. Not
@@ -1259,6 +1263,448 @@ scale_row_from_temp_alpha(unsigned char * FZ_RESTRICT dst, const unsigned char *
 }
 #endif
 
+#ifdef HAVE_SIMD_X86
+
+/*
+	x86 vector versions of the row scalers above, chosen at run time
+	(see pick_simd_scalers). The products are formed 2 at a time by
+	pmaddwd, which needs every weight to fit in 16 bits; this is
+	checked for each set of weights before they are used. The sums
+	are the same as in the C versions, so the results are identical.
+*/
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* Pack two weights into the low and high halves of an int. */
+static inline int
+weight_pair(int a, int b)
+{
+	return (int)(((unsigned int)a & 0xffff) | ((unsigned int)b << 16));
+}
+
+static int
+weights_fit_16(const fz_weights *weights)
+{
+	int i, j;
+
+	for (i = 0; i < weights->count; i++)
+	{
+		const int *contrib = &weights->index[weights->index[i]];
+		int len = contrib[1];
+
+		contrib += 2;
+		for (j = 0; j < len; j++)
+			if (contrib[j] < -32768 || contrib[j] > 32767)
+				return 0;
+	}
+	return 1;
+}
+
+static SSE2 void
+scale_row_to_temp1_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i zero = _mm_setzero_si128();
+	int len, i, step = 1;
+	const unsigned char *min;
+
+	assert(weights->n == 1);
+	if (weights->flip)
+	{
+		dst += weights->count - 1;
+		step = -1;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = zero;
+		int val;
+		min = &src[*contrib++];
+		len = *contrib++;
+		while (len >= 8)
+		{
+			__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			__m128i w = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), _mm_loadu_si128((const __m128i *)(contrib + 4)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, w));
+			min += 8;
+			contrib += 8;
+			len -= 8;
+		}
+		if (len >= 4)
+		{
+			__m128i s;
+			memcpy(&val, min, 4);
+			s = _mm_unpacklo_epi8(_mm_cvtsi32_si128(val), zero);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), zero)));
+			min += 4;
+			contrib += 4;
+			len -= 4;
+		}
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+		val = 128 + _mm_cvtsi128_si32(acc);
+		while (len-- > 0)
+		{
+			val += *min++ * *contrib++;
+		}
+		*dst = (unsigned char)(val>>8);
+		dst += step;
+	}
+}
+
+static SSE2 void
+scale_row_to_temp2_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i zero = _mm_setzero_si128();
+	int len, i, step = 2;
+	const unsigned char *min;
+
+	assert(weights->n == 2);
+	if (weights->flip)
+	{
+		dst += 2 * (weights->count - 1);
+		step = -2;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = zero;
+		int c1, c2;
+		min = &src[2 * *contrib++];
+		len = *contrib++;
+		while (len >= 4)
+		{
+			/* c1 c2 c1 c2 ... to c1 c1 c2 c2 ..., to pair up with the weights */
+			__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			s = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 1, 2, 0));
+			s = _mm_shufflehi_epi16(s, _MM_SHUFFLE(3, 1, 2, 0));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, _mm_set_epi32(
+				weight_pair(contrib[2], contrib[3]), weight_pair(contrib[2], contrib[3]),
+				weight_pair(contrib[0], contrib[1]), weight_pair(contrib[0], contrib[1]))));
+			min += 8;
+			contrib += 4;
+			len -= 4;
+		}
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+		c1 = 128 + _mm_cvtsi128_si32(acc);
+		c2 = 128 + _mm_cvtsi128_si32(_mm_srli_si128(acc, 4));
+		while (len-- > 0)
+		{
+			c1 += *min++ * *contrib;
+			c2 += *min++ * *contrib++;
+		}
+		dst[0] = (unsigned char)(c1>>8);
+		dst[1] = (unsigned char)(c2>>8);
+		dst += step;
+	}
+}
+
+static SSE2 void
+scale_row_to_temp3_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i zero = _mm_setzero_si128();
+	int len, i, step = 3;
+	const unsigned char *min;
+
+	assert(weights->n == 3);
+	if (weights->flip)
+	{
+		dst += 3 * (weights->count - 1);
+		step = -3;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = zero;
+		int c1, c2, c3;
+		min = &src[3 * *contrib++];
+		len = *contrib++;
+		/* Two pixels at a time, from an 8 byte load that ends
+		 * inside a third, so never reads past the last one. */
+		while (len >= 3)
+		{
+			__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			s = _mm_unpacklo_epi16(s, _mm_srli_si128(s, 6));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, _mm_set1_epi32(weight_pair(contrib[0], contrib[1]))));
+			min += 6;
+			contrib += 2;
+			len -= 2;
+		}
+		c1 = 128 + _mm_cvtsi128_si32(acc);
+		c2 = 128 + _mm_cvtsi128_si32(_mm_srli_si128(acc, 4));
+		c3 = 128 + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+		while (len-- > 0)
+		{
+			int c = *contrib++;
+			c1 += *min++ * c;
+			c2 += *min++ * c;
+			c3 += *min++ * c;
+		}
+		dst[0] = (unsigned char)(c1>>8);
+		dst[1] = (unsigned char)(c2>>8);
+		dst[2] = (unsigned char)(c3>>8);
+		dst += step;
+	}
+}
+
+static SSE2 void
+scale_row_to_temp4_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+	const __m128i mask = _mm_set1_epi32(255);
+	int len, i, step = 4;
+	const unsigned char *min;
+
+	assert(weights->n == 4);
+	if (weights->flip)
+	{
+		dst += 4 * (weights->count - 1);
+		step = -4;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = round;
+		int val;
+		min = &src[4 * *contrib++];
+		len = *contrib++;
+		while (len >= 4)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)min);
+			__m128i lo = _mm_unpacklo_epi8(s, zero);
+			__m128i hi = _mm_unpackhi_epi8(s, zero);
+			lo = _mm_unpacklo_epi16(lo, _mm_srli_si128(lo, 8));
+			hi = _mm_unpacklo_epi16(hi, _mm_srli_si128(hi, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, _mm_set1_epi32(weight_pair(contrib[0], contrib[1]))));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, _mm_set1_epi32(weight_pair(contrib[2], contrib[3]))));
+			min += 16;
+			contrib += 4;
+			len -= 4;
+		}
+		if (len >= 2)
+		{
+			__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			s = _mm_unpacklo_epi16(s, _mm_srli_si128(s, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, _mm_set1_epi32(weight_pair(contrib[0], contrib[1]))));
+			min += 8;
+			contrib += 2;
+			len -= 2;
+		}
+		if (len > 0)
+		{
+			__m128i s;
+			memcpy(&val, min, 4);
+			s = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(val), zero), zero);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, _mm_set1_epi32(weight_pair(*contrib++, 0))));
+		}
+		acc = _mm_and_si128(_mm_srai_epi32(acc, 8), mask);
+		acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+		val = _mm_cvtsi128_si32(acc);
+		memcpy(dst, &val, 4);
+		dst += step;
+	}
+}
+
+/*
+	Scale bytes x onwards of rows of width bytes from len rows of the
+	temporary buffer, for as long as there are whole vectors of them.
+	Returns how far it got.
+*/
+static SSE2 int
+scale_from_temp_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const int * FZ_RESTRICT contrib, int len, int width, int x)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+	const __m128i mask = _mm_set1_epi32(255);
+	int k;
+
+	for (; x + 16 <= width; x += 16)
+	{
+		const unsigned char *min = src + x;
+		__m128i a0 = round, a1 = round, a2 = round, a3 = round;
+
+		/* Interleave the bytes of 2 rows, so that pmaddwd can
+		 * apply both their weights at once. */
+		for (k = 0; k < len; k += 2)
+		{
+			__m128i r0 = _mm_loadu_si128((const __m128i *)min);
+			__m128i r1 = zero;
+			__m128i w, lo, hi;
+			int w1 = 0;
+			if (k + 1 < len)
+			{
+				r1 = _mm_loadu_si128((const __m128i *)(min + width));
+				w1 = contrib[k+1];
+			}
+			w = _mm_set1_epi32(weight_pair(contrib[k], w1));
+			lo = _mm_unpacklo_epi8(r0, r1);
+			hi = _mm_unpackhi_epi8(r0, r1);
+			a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+			a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+			a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+			a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+			min += 2 * width;
+		}
+		a0 = _mm_and_si128(_mm_srai_epi32(a0, 8), mask);
+		a1 = _mm_and_si128(_mm_srai_epi32(a1, 8), mask);
+		a2 = _mm_and_si128(_mm_srai_epi32(a2, 8), mask);
+		a3 = _mm_and_si128(_mm_srai_epi32(a3, 8), mask);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3)));
+	}
+	return x;
+}
+
+static AVX2 int
+scale_from_temp_avx2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const int * FZ_RESTRICT contrib, int len, int width, int x)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i round = _mm256_set1_epi32(128);
+	const __m256i mask = _mm256_set1_epi32(255);
+	int k;
+
+	/* As for SSE2; the unpacks and packs both work within each 16
+	 * byte lane, so the bytes come back out in the right order. */
+	for (; x + 32 <= width; x += 32)
+	{
+		const unsigned char *min = src + x;
+		__m256i a0 = round, a1 = round, a2 = round, a3 = round;
+
+		for (k = 0; k < len; k += 2)
+		{
+			__m256i r0 = _mm256_loadu_si256((const __m256i *)min);
+			__m256i r1 = zero;
+			__m256i w, lo, hi;
+			int w1 = 0;
+			if (k + 1 < len)
+			{
+				r1 = _mm256_loadu_si256((const __m256i *)(min + width));
+				w1 = contrib[k+1];
+			}
+			w = _mm256_set1_epi32(weight_pair(contrib[k], w1));
+			lo = _mm256_unpacklo_epi8(r0, r1);
+			hi = _mm256_unpackhi_epi8(r0, r1);
+			a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+			a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+			a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+			a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+			min += 2 * width;
+		}
+		a0 = _mm256_and_si256(_mm256_srai_epi32(a0, 8), mask);
+		a1 = _mm256_and_si256(_mm256_srai_epi32(a1, 8), mask);
+		a2 = _mm256_and_si256(_mm256_srai_epi32(a2, 8), mask);
+		a3 = _mm256_and_si256(_mm256_srai_epi32(a3, 8), mask);
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(_mm256_packs_epi32(a0, a1), _mm256_packs_epi32(a2, a3)));
+	}
+	return scale_from_temp_sse2(dst, src, contrib, len, width, x);
+}
+
+/* Finish off the bytes from x onwards. */
+static void
+scale_from_temp_tail(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const int * FZ_RESTRICT contrib, int len, int width, int x)
+{
+	for (; x < width; x++)
+	{
+		const unsigned char *min = src + x;
+		int val = 128;
+		int k;
+
+		for (k = 0; k < len; k++)
+		{
+			val += *min * contrib[k];
+			min += width;
+		}
+		dst[x] = (unsigned char)(val>>8);
+	}
+}
+
+/*
+	For the alpha versions, the row is first scaled into the last
+	w*n bytes of dst, and then spread out forwards to make room for
+	the alpha. Pixel i is read from w+i*n onwards, and written from
+	i*(n+1), so nothing is overwritten before it has been read.
+*/
+static void
+spread_alpha(unsigned char *dst, int w, int n)
+{
+	const unsigned char *src = dst + w;
+	int x, k;
+
+	for (x = w; x > 0; x--)
+	{
+		for (k = n; k > 0; k--)
+			*dst++ = *src++;
+		*dst++ = 255;
+	}
+}
+
+static void
+scale_row_from_temp_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int len = contrib[1];
+	int x = scale_from_temp_sse2(dst, src, contrib + 2, len, w * n, 0);
+	scale_from_temp_tail(dst, src, contrib + 2, len, w * n, x);
+}
+
+static void
+scale_row_from_temp_alpha_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	scale_row_from_temp_sse2(dst + w, src, weights, w, n, row);
+	spread_alpha(dst, w, n);
+}
+
+static void
+scale_row_from_temp_avx2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int len = contrib[1];
+	int x = scale_from_temp_avx2(dst, src, contrib + 2, len, w * n, 0);
+	scale_from_temp_tail(dst, src, contrib + 2, len, w * n, x);
+}
+
+static void
+scale_row_from_temp_alpha_avx2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	scale_row_from_temp_avx2(dst + w, src, weights, w, n, row);
+	spread_alpha(dst, w, n);
+}
+
+typedef void (fz_scale_row_in_fn)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights);
+typedef void (fz_scale_row_out_fn)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row);
+
+/* Replace the C row scalers with vector ones where we can. */
+static void
+pick_simd_scalers(const fz_weights *cols, const fz_weights *rows, int forcealpha, fz_scale_row_in_fn **in, fz_scale_row_out_fn **out)
+{
+	if (!__builtin_cpu_supports("sse2"))
+		return;
+
+	if (weights_fit_16(cols))
+	{
+		switch (cols->n)
+		{
+		case 1: *in = scale_row_to_temp1_sse2; break;
+		case 2: *in = scale_row_to_temp2_sse2; break;
+		case 3: *in = scale_row_to_temp3_sse2; break;
+		case 4: *in = scale_row_to_temp4_sse2; break;
+		}
+	}
+
+	if (weights_fit_16(rows))
+	{
+		if (__builtin_cpu_supports("avx2"))
+			*out = forcealpha ? scale_row_from_temp_alpha_avx2 : scale_row_from_temp_avx2;
+		else
+			*out = forcealpha ? scale_row_from_temp_alpha_sse2 : scale_row_from_temp_sse2;
+	}
+}
+
+#undef SSE2
+#undef AVX2
+
+#endif /* HAVE_SIMD_X86 */
+
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
 duplicate_single_pixel(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, int n, int forcealpha, int w, int h, int stride)
@@ -1790,6 +2236,9 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			break;
 		}
 		row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
+#ifdef HAVE_SIMD_X86
+		pick_simd_scalers(contrib_cols, contrib_rows, forcealpha, &row_scale_in, &row_scale_out);
+#endif
 		max_row = contrib_rows->index[contrib_rows->index[0]];
 		for (row = 0; row < contrib_rows->count; row++)
 		{
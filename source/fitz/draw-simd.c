@@ -0,0 +1,384 @@
+#include "mupdf/fitz.h"
+#include "draw-imp.h"
+
+/*
+	Vector versions of the commonest span painters, for 1, 3 and 4
+	color components with or without alpha.
+
+	The x86 versions (SSE4.1 and AVX2) are compiled with per-function
+	target attributes, and chosen at run time according to what the
+	processor supports, so the library as a whole needs no special
+	compiler flags. NEON is always present on 64-bit ARM.
+
+	Every painter gives exactly the same results as the scalar one
+	in draw-paint.c that it replaces.
+*/
+
+typedef unsigned char byte;
+
+#if defined(HAVE_SIMD_X86)
+#include <immintrin.h>
+#elif defined(HAVE_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(HAVE_SIMD_X86) || defined(HAVE_SIMD_NEON)
+
+/*
+	How the pixels of a span are laid out in a 16 byte lane.
+	All the tables are indexed by the destination byte.
+
+	k: the number of whole pixels in the lane.
+	shuf_s: where to find each byte in the source.
+	or_s: a value to set (the alpha, for a source without one).
+	shuf_a: where to find the source alpha of the pixel.
+	shuf_m: where to find the mask value of the pixel.
+	alpha_pos: 0xff for the destination alpha bytes.
+	tail: 0xff for the bytes after the last whole pixel.
+
+	A shuffle index of 0x80 gives 0.
+*/
+typedef struct
+{
+	int k;
+	byte shuf_s[16];
+	byte or_s[16];
+	byte shuf_a[16];
+	byte shuf_m[16];
+	byte alpha_pos[16];
+	byte tail[16];
+} fz_simd_layout;
+
+#define L_K(n,da,sa) (16 / ((n) + ((da) > (sa) ? (da) : (sa))))
+#define L_PIX(n,da,j) ((j) / ((n) + (da)))
+#define L_CHAN(n,da,j) ((j) % ((n) + (da)))
+#define L_IN(n,da,sa,j) (L_PIX(n,da,j) < L_K(n,da,sa))
+#define L_SRC(n,da,sa,j,c) (L_PIX(n,da,j) * ((n) + (sa)) + (c))
+
+#define L_SHUF_S(n,da,sa,j) \
+	(!L_IN(n,da,sa,j) ? 0x80 : \
+	L_CHAN(n,da,j) < (n) ? L_SRC(n,da,sa,j,L_CHAN(n,da,j)) : \
+	(sa) ? L_SRC(n,da,sa,j,n) : 0x80)
+#define L_OR_S(n,da,sa,j) \
+	(L_IN(n,da,sa,j) && L_CHAN(n,da,j) == (n) && !(sa) ? 0xff : 0)
+#define L_SHUF_A(n,da,sa,j) \
+	(L_IN(n,da,sa,j) && (sa) ? L_SRC(n,da,sa,j,n) : 0x80)
+#define L_SHUF_M(n,da,sa,j) \
+	(L_IN(n,da,sa,j) ? L_PIX(n,da,j) : 0x80)
+#define L_ALPHA_POS(n,da,sa,j) \
+	(L_IN(n,da,sa,j) && L_CHAN(n,da,j) == (n) ? 0xff : 0)
+#define L_TAIL(n,da,sa,j) \
+	(L_IN(n,da,sa,j) ? 0 : 0xff)
+
+#define L_ROW(F,n,da,sa) { \
+	F(n,da,sa,0), F(n,da,sa,1), F(n,da,sa,2), F(n,da,sa,3), \
+	F(n,da,sa,4), F(n,da,sa,5), F(n,da,sa,6), F(n,da,sa,7), \
+	F(n,da,sa,8), F(n,da,sa,9), F(n,da,sa,10), F(n,da,sa,11), \
+	F(n,da,sa,12), F(n,da,sa,13), F(n,da,sa,14), F(n,da,sa,15) }
+
+#define LAYOUT(n,da,sa) { L_K(n,da,sa), \
+	L_ROW(L_SHUF_S,n,da,sa), L_ROW(L_OR_S,n,da,sa), \
+	L_ROW(L_SHUF_A,n,da,sa), L_ROW(L_SHUF_M,n,da,sa), \
+	L_ROW(L_ALPHA_POS,n,da,sa), L_ROW(L_TAIL,n,da,sa) }
+
+#define LAYOUTS(n) { { LAYOUT(n,0,0), LAYOUT(n,0,1) }, { LAYOUT(n,1,0), LAYOUT(n,1,1) } }
+
+/* Indexed by [SIMD_LAYOUT(n)][da][sa] */
+static const fz_simd_layout span_layouts[3][2][2] = { LAYOUTS(1), LAYOUTS(3), LAYOUTS(4) };
+
+#define SIMD_LAYOUT(n) ((n) == 1 ? 0 : (n) - 2)
+
+/* How many pixels must be left for one pass of a vector loop. */
+static inline int
+simd_need(const fz_simd_layout *L, int dn, int sn, int mp, int lanes)
+{
+	int need = (16 + dn - 1) / dn;
+	if (sn && need < (16 + sn - 1) / sn)
+		need = (16 + sn - 1) / sn;
+	if (mp && need < 16)
+		need = 16;
+	return need + (lanes - 1) * L->k;
+}
+
+/* Scalar versions for the ends of spans. These follow the templates in draw-paint.c. */
+
+static void
+span_tail(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w)
+{
+	do
+	{
+		int t = (sa ? FZ_EXPAND(sp[n]) : 256);
+		int k;
+		if (t != 0)
+		{
+			t = 256 - t;
+			for (k = 0; k < n; k++)
+				dp[k] = sp[k] + FZ_COMBINE(dp[k], t);
+			if (da)
+				dp[n] = (sa ? sp[n] + FZ_COMBINE(dp[n], t) : 255);
+		}
+		dp += n + da;
+		sp += n + sa;
+	}
+	while (--w);
+}
+
+static void
+span_alpha_tail(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha)
+{
+	if (sa)
+		alpha = FZ_EXPAND(alpha);
+	do
+	{
+		int masa = (sa ? FZ_COMBINE(sp[n], alpha) : alpha);
+		int t = FZ_EXPAND(255-masa);
+		int k;
+		for (k = 0; k < n; k++)
+			dp[k] = FZ_COMBINE(sp[k], alpha) + FZ_COMBINE(dp[k], t);
+		if (da)
+			dp[n] = masa + FZ_COMBINE(dp[n], t);
+		dp += n + da;
+		sp += n + sa;
+	}
+	while (--w);
+}
+
+static void
+color_tail(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n1, int da, int w, const byte * FZ_RESTRICT color, int sa)
+{
+	do
+	{
+		int ma = sa;
+		int k;
+		if (mp)
+		{
+			ma = FZ_EXPAND(*mp);
+			if (sa != 256)
+				ma = FZ_COMBINE(ma, sa);
+			mp++;
+		}
+		for (k = 0; k < n1; k++)
+			dp[k] = FZ_BLEND(color[k], dp[k], ma);
+		if (da)
+			dp[n1] = FZ_BLEND(255, dp[n1], ma);
+		dp += n1 + da;
+	}
+	while (--w);
+}
+
+static void
+mask_tail(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int n, int a, int w)
+{
+	do
+	{
+		int ma = FZ_EXPAND(*mp);
+		int k;
+		if (!(a && sp[n] == 0))
+			for (k = 0; k < n + a; k++)
+				dp[k] = FZ_BLEND(sp[k], dp[k], ma);
+		dp += n + a;
+		sp += n + a;
+		mp++;
+	}
+	while (--w);
+}
+
+#endif /* HAVE_SIMD_X86 || HAVE_SIMD_NEON */
+
+#ifdef HAVE_SIMD_X86
+
+/* SSE4.1: one lane. */
+#define SIMD_NAME(x) x##_sse4
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+#define SIMD_LANES 1
+#define V __m128i
+#define W __m128i
+#define V_TABLE(t) _mm_loadu_si128((const __m128i *)(t))
+#define V_LOAD(p,step) _mm_loadu_si128((const __m128i *)(p))
+#define V_STORE(p,step,v) _mm_storeu_si128((__m128i *)(p), v)
+#define V_SHUF(v,m) _mm_shuffle_epi8(v, m)
+#define V_LO(v) _mm_unpacklo_epi8(v, _mm_setzero_si128())
+#define V_HI(v) _mm_unpackhi_epi8(v, _mm_setzero_si128())
+#define V_NARROW(lo,hi) _mm_packus_epi16(_mm_and_si128(lo, _mm_set1_epi16(255)), _mm_and_si128(hi, _mm_set1_epi16(255)))
+#define V_SELECT(m,a,b) _mm_blendv_epi8(b, a, m)
+#define V_ISZERO(v) _mm_cmpeq_epi8(v, _mm_setzero_si128())
+#define V_OR(a,b) _mm_or_si128(a, b)
+#define V_SET0() _mm_setzero_si128()
+#define W_SET(x) _mm_set1_epi16(x)
+#define W_ADD(a,b) _mm_add_epi16(a, b)
+#define W_SUB(a,b) _mm_sub_epi16(a, b)
+#define W_MUL(a,b) _mm_mullo_epi16(a, b)
+#define W_SHR(a,s) _mm_srli_epi16(a, s)
+#define W_MASK_LO(m) _mm_unpacklo_epi8(m, m)
+#define W_MASK_HI(m) _mm_unpackhi_epi8(m, m)
+#define W_SELECT(m,a,b) _mm_blendv_epi8(b, a, m)
+#include "paint-simd.h"
+
+/*
+	AVX2: two lanes, loaded from and stored to separate addresses,
+	so that each holds whole pixels. The first lane is stored
+	before the second, so that the second overwrites the tail of
+	the first.
+*/
+#define SIMD_NAME(x) x##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_LANES 2
+#define V __m256i
+#define W __m256i
+#define V_TABLE(t) _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t)))
+#define V_LOAD(p,step) _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p))), _mm_loadu_si128((const __m128i *)((p) + (step))), 1)
+#define V_STORE(p,step,v) do { __m256i v_ = (v); _mm_storeu_si128((__m128i *)(p), _mm256_castsi256_si128(v_)); _mm_storeu_si128((__m128i *)((p) + (step)), _mm256_extracti128_si256(v_, 1)); } while (0)
+#define V_SHUF(v,m) _mm256_shuffle_epi8(v, m)
+#define V_LO(v) _mm256_unpacklo_epi8(v, _mm256_setzero_si256())
+#define V_HI(v) _mm256_unpackhi_epi8(v, _mm256_setzero_si256())
+#define V_NARROW(lo,hi) _mm256_packus_epi16(_mm256_and_si256(lo, _mm256_set1_epi16(255)), _mm256_and_si256(hi, _mm256_set1_epi16(255)))
+#define V_SELECT(m,a,b) _mm256_blendv_epi8(b, a, m)
+#define V_ISZERO(v) _mm256_cmpeq_epi8(v, _mm256_setzero_si256())
+#define V_OR(a,b) _mm256_or_si256(a, b)
+#define V_SET0() _mm256_setzero_si256()
+#define W_SET(x) _mm256_set1_epi16(x)
+#define W_ADD(a,b) _mm256_add_epi16(a, b)
+#define W_SUB(a,b) _mm256_sub_epi16(a, b)
+#define W_MUL(a,b) _mm256_mullo_epi16(a, b)
+#define W_SHR(a,s) _mm256_srli_epi16(a, s)
+#define W_MASK_LO(m) _mm256_unpacklo_epi8(m, m)
+#define W_MASK_HI(m) _mm256_unpackhi_epi8(m, m)
+#define W_SELECT(m,a,b) _mm256_blendv_epi8(b, a, m)
+#include "paint-simd.h"
+
+#endif /* HAVE_SIMD_X86 */
+
+#ifdef HAVE_SIMD_NEON
+
+#define SIMD_NAME(x) x##_neon
+#define SIMD_TARGET
+#define SIMD_LANES 1
+#define V uint8x16_t
+#define W uint16x8_t
+#define V_TABLE(t) vld1q_u8(t)
+#define V_LOAD(p,step) vld1q_u8(p)
+#define V_STORE(p,step,v) vst1q_u8(p, v)
+#define V_SHUF(v,m) vqtbl1q_u8(v, m)
+#define V_LO(v) vmovl_u8(vget_low_u8(v))
+#define V_HI(v) vmovl_u8(vget_high_u8(v))
+#define V_NARROW(lo,hi) vcombine_u8(vmovn_u16(lo), vmovn_u16(hi))
+#define V_SELECT(m,a,b) vbslq_u8(m, a, b)
+#define V_ISZERO(v) vceqq_u8(v, vdupq_n_u8(0))
+#define V_OR(a,b) vorrq_u8(a, b)
+#define V_SET0() vdupq_n_u8(0)
+#define W_SET(x) vdupq_n_u16(x)
+#define W_ADD(a,b) vaddq_u16(a, b)
+#define W_SUB(a,b) vsubq_u16(a, b)
+#define W_MUL(a,b) vmulq_u16(a, b)
+#define W_SHR(a,s) vshrq_n_u16(a, s)
+#define W_MASK_LO(m) vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vget_low_u8(m))))
+#define W_MASK_HI(m) vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vget_high_u8(m))))
+#define W_SELECT(m,a,b) vbslq_u16(m, a, b)
+#include "paint-simd.h"
+
+#endif /* HAVE_SIMD_NEON */
+
+#ifdef HAVE_SIMD_X86
+enum
+{
+	SIMD_NONE,
+	SIMD_SSE4,
+	SIMD_AVX2
+};
+
+/* Which x86 vector instruction set the processor supports. */
+static int
+simd_level(void)
+{
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SIMD_SSE4;
+	return SIMD_NONE;
+}
+#endif /* HAVE_SIMD_X86 */
+
+/* Whether there are vector painters for n color components. */
+static int
+simd_n(int n)
+{
+	switch (n)
+	{
+#if FZ_PLOTTERS_G
+	case 1: return 1;
+#endif
+#if FZ_PLOTTERS_RGB
+	case 3: return 1;
+#endif
+#if FZ_PLOTTERS_CMYK
+	case 4: return 1;
+#endif
+	default: return 0;
+	}
+}
+
+#if defined(HAVE_SIMD_X86)
+#define SIMD_PICK(x) \
+	switch (simd_level()) { \
+	case SIMD_AVX2: return x##_avx2; \
+	case SIMD_SSE4: return x##_sse4; \
+	}
+#elif defined(HAVE_SIMD_NEON)
+#define SIMD_PICK(x) \
+	return x##_neon;
+#else
+#define SIMD_PICK(x)
+#endif
+
+/*
+	Return a vector painter to use in place of the given scalar
+	one, or NULL if there is none (in which case the scalar one
+	should be used). The arguments are as for fz_get_span_painter.
+*/
+fz_span_painter_t *
+fz_get_span_painter_simd(int da, int sa, int n, int alpha)
+{
+	if (!simd_n(n) || alpha <= 0)
+		return NULL;
+	if (alpha == 255)
+	{
+		SIMD_PICK(paint_span)
+	}
+	else
+	{
+		SIMD_PICK(paint_span_alpha)
+	}
+	return NULL;
+}
+
+fz_span_color_painter_t *
+fz_get_span_color_painter_simd(int n, int da, const byte *color)
+{
+	if (!simd_n(n - da))
+		return NULL;
+	SIMD_PICK(paint_span_with_color)
+	return NULL;
+}
+
+fz_span_mask_painter_t *
+fz_get_span_mask_painter_simd(int a, int n)
+{
+	if (!simd_n(n))
+		return NULL;
+	SIMD_PICK(paint_span_with_mask)
+	return NULL;
+}
+
+/*
+	Only solid fills that blend are done here; opaque ones are
+	simple stores already. The scalar 4 component painter with
+	destination alpha is left alone.
+*/
+fz_solid_color_painter_t *
+fz_get_solid_color_painter_simd(int n, const byte *color, int da)
+{
+	if (!simd_n(n - da) || color[n - da] == 255 || (da && n - da == 4))
+		return NULL;
+	SIMD_PICK(paint_solid_color)
+	return NULL;
+}
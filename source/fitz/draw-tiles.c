@@ -0,0 +1,211 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+#include <string.h>
+
+#define DEFAULT_TILE_SIZE 256
+
+/*
+	Render a display list into a single pixmap using several
+	threads at once.
+
+	The destination is cut into a grid of square tiles, and each
+	tile is drawn directly into the destination through a sub-pixmap
+	that shares its samples, so no copying or merging is needed
+	afterwards.
+
+	Each worker starts with an equal share of the tiles, taken in
+	row order so that neighbouring tiles (and hence most of the
+	same display list nodes and glyphs) stay on the same thread.
+	A worker that runs out steals the second half of the largest
+	remaining share of another worker.
+*/
+
+typedef struct
+{
+	int next, end;
+} fz_tile_range;
+
+struct fz_tile_renderer_s
+{
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *pix;
+	int tile_size;
+	int cols, rows;
+	int nworkers;
+	fz_tile_range *range;
+};
+
+/*
+	Create a renderer to draw a display list into a pixmap from
+	several threads at once.
+
+	list: The display list to draw.
+
+	ctm: The transform from the display list into the pixmap.
+
+	pix: The destination pixmap. It is drawn over, so will usually
+	need clearing first. No other drawing into it should happen
+	until all the workers have finished.
+
+	tile_size: The width and height of each tile in pixels (0 for
+	a reasonable default).
+
+	nworkers: The number of threads that will call
+	fz_run_tile_renderer.
+*/
+fz_tile_renderer *
+fz_new_tile_renderer(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, int tile_size, int nworkers)
+{
+	fz_tile_renderer *tr;
+	int i, n;
+
+	if (nworkers < 1)
+		nworkers = 1;
+	if (tile_size <= 0)
+		tile_size = DEFAULT_TILE_SIZE;
+
+	tr = fz_malloc_struct(ctx, fz_tile_renderer);
+	fz_try(ctx)
+		tr->range = fz_malloc_array(ctx, nworkers, sizeof(*tr->range));
+	fz_catch(ctx)
+	{
+		fz_free(ctx, tr);
+		fz_rethrow(ctx);
+	}
+
+	tr->list = fz_keep_display_list(ctx, list);
+	tr->pix = fz_keep_pixmap(ctx, pix);
+	tr->ctm = ctm;
+	tr->tile_size = tile_size;
+	tr->cols = (pix->w + tile_size - 1) / tile_size;
+	tr->rows = (pix->h + tile_size - 1) / tile_size;
+	tr->nworkers = nworkers;
+
+	n = tr->cols * tr->rows;
+	for (i = 0; i < nworkers; i++)
+	{
+		tr->range[i].next = (int)((int64_t)n * i / nworkers);
+		tr->range[i].end = (int)((int64_t)n * (i + 1) / nworkers);
+	}
+
+	return tr;
+}
+
+void
+fz_drop_tile_renderer(fz_context *ctx, fz_tile_renderer *tr)
+{
+	if (!tr)
+		return;
+	fz_drop_display_list(ctx, tr->list);
+	fz_drop_pixmap(ctx, tr->pix);
+	fz_free(ctx, tr->range);
+	fz_free(ctx, tr);
+}
+
+/* Claim the next tile for a worker, stealing one if needed. Returns -1 when all are done. */
+static int
+next_tile(fz_context *ctx, fz_tile_renderer *tr, int worker)
+{
+	fz_tile_range *mine = &tr->range[worker];
+	int i, tile = -1;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (mine->next >= mine->end)
+	{
+		fz_tile_range *victim = NULL;
+		int most = 0;
+
+		for (i = 0; i < tr->nworkers; i++)
+		{
+			int left = tr->range[i].end - tr->range[i].next;
+			if (left > most)
+			{
+				most = left;
+				victim = &tr->range[i];
+			}
+		}
+		if (victim)
+		{
+			mine->end = victim->end;
+			victim->end -= (most + 1) / 2;
+			mine->next = victim->end;
+		}
+	}
+	if (mine->next < mine->end)
+		tile = mine->next++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return tile;
+}
+
+static void
+draw_tile(fz_context *ctx, fz_tile_renderer *tr, int tile, fz_cookie *cookie)
+{
+	fz_pixmap *pix = tr->pix;
+	fz_pixmap *sub = NULL;
+	fz_device *dev = NULL;
+	fz_irect area;
+
+	fz_var(sub);
+	fz_var(dev);
+
+	area.x0 = pix->x + (tile % tr->cols) * tr->tile_size;
+	area.y0 = pix->y + (tile / tr->cols) * tr->tile_size;
+	area.x1 = fz_mini(area.x0 + tr->tile_size, pix->x + pix->w);
+	area.y1 = fz_mini(area.y0 + tr->tile_size, pix->y + pix->h);
+
+	fz_try(ctx)
+	{
+		sub = fz_new_pixmap_from_pixmap(ctx, pix, &area);
+		dev = fz_new_draw_device(ctx, fz_identity, sub);
+		fz_run_display_list(ctx, tr->list, dev, tr->ctm, fz_rect_from_irect(area), cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, sub);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+	Draw tiles until there are none left.
+
+	Call this once from each of the nworkers threads, each with its
+	own cloned context and a distinct worker number from 0 to
+	nworkers-1. The calls may also be made one after another from a
+	single thread.
+
+	cookie: Optional cookie for progress and aborting. Each worker
+	should use its own.
+
+	Returns the number of tiles that failed to draw (which are
+	reported as warnings); the rest of the pixmap is still drawn.
+*/
+int
+fz_run_tile_renderer(fz_context *ctx, fz_tile_renderer *tr, int worker, fz_cookie *cookie)
+{
+	int tile, failed = 0;
+
+	if (worker < 0 || worker >= tr->nworkers)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "invalid tile renderer worker number");
+
+	while ((tile = next_tile(ctx, tr, worker)) >= 0)
+	{
+		if (cookie && cookie->abort)
+			break;
+		fz_try(ctx)
+			draw_tile(ctx, tr, tile, cookie);
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "cannot draw tile %d: %s", tile, fz_caught_message(ctx));
+			failed++;
+		}
+	}
+
+	return failed;
+}
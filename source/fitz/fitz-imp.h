@@ -66,6 +66,15 @@ void fz_new_glyph_cache_context(fz_context *ctx);
 fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 
+void fz_new_image_cache_context(fz_context *ctx, size_t max);
+fz_image_cache *fz_keep_image_cache_context(fz_context *ctx);
+void fz_drop_image_cache_context(fz_context *ctx);
+fz_pixmap *fz_find_cached_image_tile(fz_context *ctx, fz_image *image, int *l2factor, fz_irect *rect);
+fz_pixmap *fz_store_image_tile(fz_context *ctx, fz_image *image, int l2factor, const fz_irect *rect, fz_pixmap *pix, float cost);
+void fz_reap_image_cache(fz_context *ctx, const fz_key_storable *ks);
+int fz_scavenge_image_cache(fz_context *ctx, size_t size);
+int fz_shrink_image_cache(fz_context *ctx, unsigned int percent);
+
 void fz_new_document_handler_context(fz_context *ctx);
 void fz_drop_document_handler_context(fz_context *ctx);
 fz_document_handler_context *fz_keep_document_handler_context(fz_context *ctx);
@@ -110,19 +119,89 @@ fz_unlock(fz_context *ctx, int lock)
 	ctx->locks.unlock(ctx->locks.user, lock);
 }
 
+/*
+	Reference counts are changed with atomic compare-and-swap loops
+	where the compiler gives us a way to do that, so that keeping and
+	dropping objects does not need to take FZ_LOCK_ALLOC. Otherwise we
+	fall back to doing the same under the lock.
+
+	fz_keep_refs and fz_drop_refs increment/decrement *refs only if it
+	is greater than zero, and return the value it had beforehand. Code
+	that changes the reference count of an object directly (such as the
+	store, with FZ_LOCK_ALLOC held) must use them too, so that it cannot
+	race with a lock free fz_keep_imp or fz_drop_imp in another thread.
+
+	fz_atomic_load and fz_atomic_store (acquire/release) may also be
+	used to publish other data to lock free readers. Without atomics
+	they are plain accesses, and readers must use FZ_REFS_LOCK.
+*/
+#if FZ_ENABLE_ATOMIC_REFS && defined(_MSC_VER) && _MSC_VER >= 1700
+#define FZ_ATOMIC_REFS 1
+#include <intrin.h>
+#define fz_atomic_load(T, p) (*(T volatile *)(p))
+#define fz_atomic_store(T, p, val) (*(T volatile *)(p) = (val))
+#define fz_atomic_cas(T, p, old, val) \
+	(sizeof(T) == 1 ? _InterlockedCompareExchange8((volatile char *)(p), (char)(val), (char)(old)) == (char)(old) : \
+	sizeof(T) == 2 ? _InterlockedCompareExchange16((volatile short *)(p), (short)(val), (short)(old)) == (short)(old) : \
+	_InterlockedCompareExchange((volatile long *)(p), (long)(val), (long)(old)) == (long)(old))
+#elif FZ_ENABLE_ATOMIC_REFS && defined(__ATOMIC_ACQ_REL)
+#define FZ_ATOMIC_REFS 1
+#define fz_atomic_load(T, p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define fz_atomic_store(T, p, val) __atomic_store_n((p), (T)(val), __ATOMIC_RELEASE)
+#define fz_atomic_cas(T, p, old, val) \
+	__atomic_compare_exchange_n((p), &(old), (T)(val), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define FZ_ATOMIC_REFS 0
+#define fz_atomic_load(T, p) (*(T *)(p))
+#define fz_atomic_store(T, p, val) (*(T *)(p) = (val))
+#define FZ_REFS_LOCK(ctx) fz_lock(ctx, FZ_LOCK_ALLOC)
+#define FZ_REFS_UNLOCK(ctx) fz_unlock(ctx, FZ_LOCK_ALLOC)
+#endif
+
+#if FZ_ATOMIC_REFS
+#define FZ_REFS_LOCK(ctx) (void)(ctx)
+#define FZ_REFS_UNLOCK(ctx) (void)(ctx)
+#define FZ_DEFINE_REFS(NAME, T) \
+static inline int fz_keep_ ## NAME(T *refs) \
+{ \
+	T old = fz_atomic_load(T, refs); \
+	while (old > 0 && !fz_atomic_cas(T, refs, old, old + 1)) \
+		old = fz_atomic_load(T, refs); \
+	return old; \
+} \
+static inline int fz_drop_ ## NAME(T *refs) \
+{ \
+	T old = fz_atomic_load(T, refs); \
+	while (old > 0 && !fz_atomic_cas(T, refs, old, old - 1)) \
+		old = fz_atomic_load(T, refs); \
+	return old; \
+}
+#else
+#define FZ_DEFINE_REFS(NAME, T) \
+static inline int fz_keep_ ## NAME(T *refs) \
+{ \
+	return *refs > 0 ? (*refs)++ : *refs; \
+} \
+static inline int fz_drop_ ## NAME(T *refs) \
+{ \
+	return *refs > 0 ? (*refs)-- : *refs; \
+}
+#endif
+
+FZ_DEFINE_REFS(refs, int)
+FZ_DEFINE_REFS(refs8, int8_t)
+FZ_DEFINE_REFS(refs16, int16_t)
+
 static inline void *
 fz_keep_imp(fz_context *ctx, void *p, int *refs)
 {
 	if (p)
 	{
 		(void)Memento_checkIntPointerOrNull(refs);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (*refs > 0)
-		{
+		FZ_REFS_LOCK(ctx);
+		if (fz_keep_refs(refs) > 0)
 			(void)Memento_takeRef(p);
-			++*refs;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		FZ_REFS_UNLOCK(ctx);
 	}
 	return p;
 }
@@ -133,13 +212,10 @@ fz_keep_imp8(fz_context *ctx, void *p, int8_t *refs)
 	if (p)
 	{
 		(void)Memento_checkBytePointerOrNull(refs);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (*refs > 0)
-		{
+		FZ_REFS_LOCK(ctx);
+		if (fz_keep_refs8(refs) > 0)
 			(void)Memento_takeRef(p);
-			++*refs;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		FZ_REFS_UNLOCK(ctx);
 	}
 	return p;
 }
@@ -150,13 +226,10 @@ fz_keep_imp16(fz_context *ctx, void *p, int16_t *refs)
 	if (p)
 	{
 		(void)Memento_checkShortPointerOrNull(refs);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (*refs > 0)
-		{
+		FZ_REFS_LOCK(ctx);
+		if (fz_keep_refs16(refs) > 0)
 			(void)Memento_takeRef(p);
-			++*refs;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		FZ_REFS_UNLOCK(ctx);
 	}
 	return p;
 }
@@ -166,18 +239,14 @@ fz_drop_imp(fz_context *ctx, void *p, int *refs)
 {
 	if (p)
 	{
-		int drop;
+		int old;
 		(void)Memento_checkIntPointerOrNull(refs);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (*refs > 0)
-		{
+		FZ_REFS_LOCK(ctx);
+		old = fz_drop_refs(refs);
+		if (old > 0)
 			(void)Memento_dropIntRef(p);
-			drop = --*refs == 0;
-		}
-		else
-			drop = 0;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return drop;
+		FZ_REFS_UNLOCK(ctx);
+		return old == 1;
 	}
 	return 0;
 }
@@ -187,18 +256,14 @@ fz_drop_imp8(fz_context *ctx, void *p, int8_t *refs)
 {
 	if (p)
 	{
-		int drop;
+		int old;
 		(void)Memento_checkBytePointerOrNull(refs);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (*refs > 0)
-		{
+		FZ_REFS_LOCK(ctx);
+		old = fz_drop_refs8(refs);
+		if (old > 0)
 			(void)Memento_dropByteRef(p);
-			drop = --*refs == 0;
-		}
-		else
-			drop = 0;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return drop;
+		FZ_REFS_UNLOCK(ctx);
+		return old == 1;
 	}
 	return 0;
 }
@@ -208,18 +273,14 @@ fz_drop_imp16(fz_context *ctx, void *p, int16_t *refs)
 {
 	if (p)
 	{
-		int drop;
+		int old;
 		(void)Memento_checkShortPointerOrNull(refs);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (*refs > 0)
-		{
+		FZ_REFS_LOCK(ctx);
+		old = fz_drop_refs16(refs);
+		if (old > 0)
 			(void)Memento_dropShortRef(p);
-			drop = --*refs == 0;
-		}
-		else
-			drop = 0;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return drop;
+		FZ_REFS_UNLOCK(ctx);
+		return old == 1;
 	}
 	return 0;
 }
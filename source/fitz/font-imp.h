@@ -1,6 +1,8 @@
 #ifndef MUPDF_FITZ_FONT_IMP_H
 #define MUPDF_FITZ_FONT_IMP_H
 
+typedef struct fz_ft_clone_s fz_ft_clone;
+
 struct fz_font_s
 {
 	int refs;
@@ -10,6 +12,8 @@ struct fz_font_s
 	fz_font_flags_t flags;
 
 	void *ft_face; /* has an FT_Face if used */
+	fz_ft_clone *ft_clones; /* idle private copies of ft_face */
+	int ft_clone_count; /* number of copies created (idle or in use) */
 	fz_shaper_data_t shaper_data;
 
 	fz_matrix t3matrix;
@@ -26,16 +30,16 @@ struct fz_font_s
 
 	int glyph_count;
 
-	/* per glyph bounding box cache */
-	fz_rect *bbox_table;
+	/* per glyph bounding box cache, in lazily allocated pages */
+	struct fz_glyph_bbox_page_s **bbox_table;
 
 	/* substitute metrics */
 	int width_count;
 	short width_default; /* in 1000 units */
 	short *width_table; /* in 1000 units */
 
-	/* cached glyph metrics */
-	float *advance_cache;
+	/* cached glyph advances for each wmode, in lazily filled pages */
+	float **advance_cache[2];
 
 	/* cached encoding lookup */
 	uint16_t *encoding_cache[256];
@@ -18,8 +18,17 @@
 #include FT_TRUETYPE_TABLES_H
 #include FT_TRUETYPE_TAGS_H
 
-#define MAX_BBOX_TABLE_SIZE 4096
-#define MAX_ADVANCE_CACHE 4096
+/* Glyph metrics are cached in pages of this many glyphs. */
+#define GLYPH_PAGE_BITS 8
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_BITS)
+
+/* A page of cached glyph bboxes. An entry may only be read once its
+ * valid flag is set, and is never changed after that. */
+typedef struct fz_glyph_bbox_page_s
+{
+	fz_rect rect[GLYPH_PAGE_SIZE];
+	unsigned char valid[GLYPH_PAGE_SIZE];
+} fz_glyph_bbox_page;
 
 #ifndef FT_SFNT_OS2
 #define FT_SFNT_OS2 ft_sfnt_os2
@@ -28,6 +37,20 @@
 /* 20 degrees */
 #define SHEAR 0.36397f
 
+/*
+	Private face clones (see fz_set_font_face_pool_size). Each clone
+	is an extra FT_Face in the context's shared FT_Library. FreeType
+	(since 2.6) allows faces of one library to be used by different
+	threads at once, provided that faces are only created and
+	destroyed under a lock, so a clone can be used without
+	FZ_LOCK_FREETYPE once it has been checked out.
+*/
+struct fz_ft_clone_s
+{
+	fz_ft_clone *next;
+	FT_Face face;
+};
+
 int ft_char_index(void *face, int cid)
 {
 	int gid = FT_Get_Char_Index(face, cid);
@@ -69,12 +92,13 @@ int ft_name_index(void *face, const char *name)
 }
 
 static void fz_drop_freetype(fz_context *ctx);
+static void drop_ft_clone(fz_context *ctx, fz_ft_clone *clone);
 
 static fz_font *
 fz_new_font(fz_context *ctx, const char *name, int use_glyph_bbox, int glyph_count)
 {
 	fz_font *font;
-	int i;
+	int pages;
 
 	font = fz_malloc_struct(ctx, fz_font);
 	font->refs = 1;
@@ -106,15 +130,26 @@ fz_new_font(fz_context *ctx, const char *name, int use_glyph_bbox, int glyph_cou
 
 	font->glyph_count = glyph_count;
 
-	if (use_glyph_bbox && glyph_count <= MAX_BBOX_TABLE_SIZE)
+	/* Only the page directories are allocated here; the pages
+	 * themselves are filled in on demand. */
+	pages = (glyph_count + GLYPH_PAGE_SIZE - 1) >> GLYPH_PAGE_BITS;
+	fz_try(ctx)
 	{
-		font->bbox_table = fz_malloc_array(ctx, glyph_count, sizeof(fz_rect));
-		for (i = 0; i < glyph_count; i++)
-			font->bbox_table[i] = fz_infinite_rect;
+		if (use_glyph_bbox && pages > 0)
+			font->bbox_table = fz_calloc(ctx, pages, sizeof(*font->bbox_table));
+		if (pages > 0)
+		{
+			font->advance_cache[0] = fz_calloc(ctx, pages, sizeof(*font->advance_cache[0]));
+			font->advance_cache[1] = fz_calloc(ctx, pages, sizeof(*font->advance_cache[1]));
+		}
 	}
-	else
+	fz_catch(ctx)
 	{
-		font->bbox_table = NULL;
+		fz_free(ctx, font->bbox_table);
+		fz_free(ctx, font->advance_cache[0]);
+		fz_free(ctx, font->advance_cache[1]);
+		fz_free(ctx, font);
+		fz_rethrow(ctx);
 	}
 
 	font->width_count = 0;
@@ -123,6 +158,93 @@ fz_new_font(fz_context *ctx, const char *name, int use_glyph_bbox, int glyph_cou
 	return font;
 }
 
+static void
+drop_glyph_pages(fz_context *ctx, void **table, int glyph_count)
+{
+	int i, pages = (glyph_count + GLYPH_PAGE_SIZE - 1) >> GLYPH_PAGE_BITS;
+
+	if (!table)
+		return;
+	for (i = 0; i < pages; i++)
+		fz_free(ctx, table[i]);
+	fz_free(ctx, table);
+}
+
+/*
+	Install a freshly filled page into a page directory, unless
+	another thread got there first, in which case ours is discarded.
+	Pages are never changed once installed (bar the bbox entries
+	that are filled in lazily, see set_glyph_bbox), so they can be
+	read without a lock.
+*/
+static void *
+install_glyph_page(fz_context *ctx, void **slot, void *page)
+{
+	void *old;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	old = *slot;
+	if (!old)
+		fz_atomic_store(void *, slot, page);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (old)
+	{
+		fz_free(ctx, page);
+		return old;
+	}
+	return page;
+}
+
+/* Fetch the cached bbox for a glyph. Returns 0 if it is not known yet. */
+static int
+get_glyph_bbox(fz_context *ctx, fz_font *font, int gid, fz_rect *r)
+{
+	fz_glyph_bbox_page *page = fz_atomic_load(fz_glyph_bbox_page *, &font->bbox_table[gid >> GLYPH_PAGE_BITS]);
+	int i = gid & (GLYPH_PAGE_SIZE - 1);
+	int valid = 0;
+
+	if (!page)
+		return 0;
+
+	FZ_REFS_LOCK(ctx);
+	if (fz_atomic_load(unsigned char, &page->valid[i]))
+	{
+		*r = page->rect[i];
+		valid = 1;
+	}
+	FZ_REFS_UNLOCK(ctx);
+
+	return valid;
+}
+
+/*
+	Publish the bbox for a glyph, unless another thread already has.
+	The entry is written whole under the lock before its valid flag
+	is set, so lock free readers never see a partial rect.
+*/
+static void
+set_glyph_bbox(fz_context *ctx, fz_font *font, int gid, fz_rect r)
+{
+	void **slot = (void **)&font->bbox_table[gid >> GLYPH_PAGE_BITS];
+	fz_glyph_bbox_page *page = fz_atomic_load(void *, slot);
+	int i = gid & (GLYPH_PAGE_SIZE - 1);
+
+	if (!page)
+	{
+		page = fz_malloc_struct(ctx, fz_glyph_bbox_page);
+		page = install_glyph_page(ctx, slot, page);
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (!page->valid[i])
+	{
+		page->rect[i] = r;
+		fz_atomic_store(unsigned char, &page->valid[i], 1);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
 /*
 	Add a reference to an existing fz_font.
 
@@ -210,6 +332,13 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 		fz_free(ctx, font->t3flags);
 	}
 
+	while (font->ft_clones)
+	{
+		fz_ft_clone *clone = font->ft_clones;
+		font->ft_clones = clone->next;
+		drop_ft_clone(ctx, clone);
+	}
+
 	if (font->ft_face)
 	{
 		fz_lock(ctx, FZ_LOCK_FREETYPE);
@@ -224,9 +353,10 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 		fz_free(ctx, font->encoding_cache[i]);
 
 	fz_drop_buffer(ctx, font->buffer);
-	fz_free(ctx, font->bbox_table);
+	drop_glyph_pages(ctx, (void **)font->bbox_table, font->glyph_count);
+	drop_glyph_pages(ctx, (void **)font->advance_cache[0], font->glyph_count);
+	drop_glyph_pages(ctx, (void **)font->advance_cache[1], font->glyph_count);
 	fz_free(ctx, font->width_table);
-	fz_free(ctx, font->advance_cache);
 	if (font->shaper_data.destroy && font->shaper_data.shaper_handle)
 	{
 		font->shaper_data.destroy(ctx, font->shaper_data.shaper_handle);
@@ -304,6 +434,8 @@ struct fz_font_context_s
 	FT_Library ftlib;
 	struct FT_MemoryRec_ ftmemory;
 	int ftlib_refs;
+	int ft_pool_size;
+	int ft_shared_faces_ok;
 	fz_load_system_font_fn *load_font;
 	fz_load_system_cjk_font_fn *load_cjk_font;
 	fz_load_system_fallback_font_fn *load_fallback_font;
@@ -400,6 +532,32 @@ void fz_drop_font_context(fz_context *ctx)
 	}
 }
 
+/*
+	Set the number of private FreeType faces each font may create.
+
+	Normally every font has a single FreeType face, and all glyph
+	rendering, outlining and measuring is serialised on
+	FZ_LOCK_FREETYPE. With a pool size of n > 0, up to n clones of
+	the face (sharing the font data and the context's FT_Library)
+	are created on demand, so that up to n threads can work on the
+	glyphs of a font at once. When all clones are busy, callers
+	fall back to the shared face and the lock.
+
+	Each clone is a complete FT_Face with its own glyph slot, size
+	objects and parsed font tables; expect a few tens of kilobytes
+	per clone (more for CFF and CJK fonts), for every font that is
+	used from several threads. With a FreeType older than 2.6, faces
+	of one library may not be used concurrently and the pool is
+	ignored.
+
+	0 (the default) disables the pool. This should only be enabled
+	by multi-threaded clients.
+*/
+void fz_set_font_face_pool_size(fz_context *ctx, int n)
+{
+	ctx->font->ft_pool_size = n > 0 ? n : 0;
+}
+
 /*
 	Install functions to allow
 	MuPDF to request fonts from the system.
@@ -656,6 +814,7 @@ fz_keep_freetype(fz_context *ctx)
 		fz_unlock(ctx, FZ_LOCK_FREETYPE);
 		fz_throw(ctx, FZ_ERROR_GENERIC, "freetype version too old: %d.%d.%d", maj, min, pat);
 	}
+	fct->ft_shared_faces_ok = (maj > 2 || (maj == 2 && min >= 6));
 
 	fct->ftlib_refs++;
 	fz_unlock(ctx, FZ_LOCK_FREETYPE);
@@ -678,6 +837,96 @@ fz_drop_freetype(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_FREETYPE);
 }
 
+static fz_ft_clone *
+new_ft_clone(fz_context *ctx, fz_font *font)
+{
+	fz_ft_clone *clone;
+	int fterr;
+
+	clone = fz_malloc_no_throw(ctx, sizeof(*clone));
+	if (!clone)
+		return NULL;
+	clone->next = NULL;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fterr = FT_New_Memory_Face(ctx->font->ftlib, font->buffer->data, (FT_Long)font->buffer->len,
+		((FT_Face)font->ft_face)->face_index, &clone->face);
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (fterr)
+	{
+		fz_warn(ctx, "freetype: cannot clone font: %s", ft_error_string(fterr));
+		fz_free(ctx, clone);
+		return NULL;
+	}
+
+	return clone;
+}
+
+static void
+drop_ft_clone(fz_context *ctx, fz_ft_clone *clone)
+{
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	FT_Done_Face(clone->face);
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_free(ctx, clone);
+}
+
+/*
+	Get a face to load glyphs from. If *clonep is set on return,
+	the caller has exclusive use of a private clone of the font's
+	face. Otherwise this returns the font's own face with
+	FZ_LOCK_FREETYPE held. Either way, release it with
+	unlock_ft_face.
+*/
+static FT_Face
+lock_ft_face(fz_context *ctx, fz_font *font, fz_ft_clone **clonep)
+{
+	fz_ft_clone *clone;
+
+	*clonep = NULL;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (!font->buffer)
+		return font->ft_face;
+
+	clone = font->ft_clones;
+	if (clone)
+	{
+		font->ft_clones = clone->next;
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		*clonep = clone;
+		return clone->face;
+	}
+
+	if (font->ft_clone_count >= ctx->font->ft_pool_size || !ctx->font->ft_shared_faces_ok)
+		return font->ft_face;
+	font->ft_clone_count++;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	clone = new_ft_clone(ctx, font);
+
+	if (!clone)
+	{
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		font->ft_clone_count--;
+		return font->ft_face;
+	}
+	*clonep = clone;
+	return clone->face;
+}
+
+static void
+unlock_ft_face(fz_context *ctx, fz_font *font, fz_ft_clone *clone)
+{
+	if (clone)
+	{
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		clone->next = font->ft_clones;
+		font->ft_clones = clone;
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+}
+
 /*
 	Create a new font from a font
 	file in a fz_buffer.
@@ -913,8 +1162,9 @@ fz_new_builtin_font(fz_context *ctx, const char *name, int is_bold, int is_itali
 	return fz_new_font_from_memory(ctx, NULL, data, size, 0, 0);
 }
 
+/* The face must have been obtained from lock_ft_face. */
 static fz_matrix *
-fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm)
+fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, FT_Face face, int gid, fz_matrix *trm)
 {
 	/* Fudge the font matrix to stretch the glyph if we've substituted the font. */
 	if (font->flags.ft_stretch && font->width_table /* && font->wmode == 0 */)
@@ -924,13 +1174,11 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm
 		float subw;
 		float realw;
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
-		fterr = FT_Get_Advance(font->ft_face, gid, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM, &adv);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fterr = FT_Get_Advance(face, gid, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM, &adv);
 		if (fterr)
 			fz_warn(ctx, "freetype getting character advance: %s", ft_error_string(fterr));
 
-		realw = adv * 1000.0f / ((FT_Face)font->ft_face)->units_per_EM;
+		realw = adv * 1000.0f / face->units_per_EM;
 		if (gid < font->width_count)
 			subw = font->width_table[gid];
 		else
@@ -962,18 +1210,20 @@ pixmap_from_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 		return fz_new_pixmap_from_8bpp_data(ctx, left, top - bitmap->rows, bitmap->width, bitmap->rows, bitmap->buffer + (bitmap->rows-1)*bitmap->pitch, -bitmap->pitch);
 }
 
-/* Takes the freetype lock, and returns with it held */
+/* Locks a face (see lock_ft_face), and returns with it held */
 static FT_GlyphSlot
-do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
+do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa, fz_ft_clone **clonep)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Matrix m;
 	FT_Vector v;
 	FT_Error fterr;
 
 	float strength = fz_matrix_expansion(trm) * 0.02f;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &trm);
+	face = lock_ft_face(ctx, font, clonep);
+
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &trm);
 
 	if (font->flags.fake_italic)
 		trm = fz_pre_shear(trm, SHEAR, 0);
@@ -993,7 +1243,6 @@ do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -1049,12 +1298,13 @@ retry_unhinted:
 fz_pixmap *
 fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
 {
-	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa);
+	fz_ft_clone *clone;
+	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa, &clone);
 	fz_pixmap *pixmap = NULL;
 
 	if (slot == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 		return NULL;
 	}
 
@@ -1064,7 +1314,7 @@ fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 	}
 	fz_catch(ctx)
 	{
@@ -1078,12 +1328,13 @@ fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm
 fz_glyph *
 fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
 {
-	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa);
+	fz_ft_clone *clone;
+	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa, &clone);
 	fz_glyph *glyph = NULL;
 
 	if (slot == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 		return NULL;
 	}
 
@@ -1093,7 +1344,7 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 	}
 	fz_catch(ctx)
 	{
@@ -1103,11 +1354,11 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	return glyph;
 }
 
-/* Takes the freetype lock, and returns with it held */
+/* Locks a face (see lock_ft_face), and returns with it held */
 static FT_Glyph
-do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa)
+do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa, fz_ft_clone **clonep)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	float expansion = fz_matrix_expansion(ctm);
 	int linewidth = state->linewidth * expansion * 64 / 2;
 	FT_Matrix m;
@@ -1118,7 +1369,9 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	FT_Stroker_LineJoin line_join;
 	FT_Stroker_LineCap line_cap;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &trm);
+	face = lock_ft_face(ctx, font, clonep);
+
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &trm);
 
 	if (font->flags.fake_italic)
 		trm = fz_pre_shear(trm, SHEAR, 0);
@@ -1130,7 +1383,6 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 	{
@@ -1200,13 +1452,14 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 fz_pixmap *
 fz_render_ft_stroked_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa)
 {
-	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa);
+	fz_ft_clone *clone;
+	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa, &clone);
 	FT_BitmapGlyph bitmap = (FT_BitmapGlyph)glyph;
 	fz_pixmap *pixmap = NULL;
 
 	if (bitmap == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 		return NULL;
 	}
 
@@ -1217,7 +1470,7 @@ fz_render_ft_stroked_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_ma
 	fz_always(ctx)
 	{
 		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 	}
 	fz_catch(ctx)
 	{
@@ -1230,13 +1483,14 @@ fz_render_ft_stroked_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_ma
 fz_glyph *
 fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, const fz_stroke_state *state, int aa)
 {
-	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa);
+	fz_ft_clone *clone;
+	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa, &clone);
 	FT_BitmapGlyph bitmap = (FT_BitmapGlyph)glyph;
 	fz_glyph *result = NULL;
 
 	if (bitmap == NULL)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 		return NULL;
 	}
 
@@ -1247,7 +1501,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	fz_always(ctx)
 	{
 		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 	}
 	fz_catch(ctx)
 	{
@@ -1257,25 +1511,27 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	return result;
 }
 
-static fz_rect *
+static fz_rect
 fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 {
-	FT_Face face = font->ft_face;
+	fz_ft_clone *clone;
+	FT_Face face;
 	FT_Error fterr;
 	FT_BBox cbox;
 	FT_Matrix m;
 	FT_Vector v;
-	fz_rect *bounds = &font->bbox_table[gid];
+	fz_rect bounds;
 
 	// TODO: refactor loading into fz_load_ft_glyph
-	// TODO: cache results
 
-	const int scale = face->units_per_EM;
+	const int scale = ((FT_Face)font->ft_face)->units_per_EM;
 	const float recip = 1.0f / scale;
 	const float strength = 0.02f;
 	fz_matrix trm = fz_identity;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &trm);
+	face = lock_ft_face(ctx, font, &clone);
+
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &trm);
 
 	if (font->flags.fake_italic)
 		trm = fz_pre_shear(trm, SHEAR, 0);
@@ -1287,7 +1543,6 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	v.x = trm.e * 65536;
 	v.y = trm.f * 65536;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	/* Set the char size to scale=face->units_per_EM to effectively give
 	 * us unscaled results. This avoids quantisation. We then apply the
 	 * scale ourselves below. */
@@ -1300,9 +1555,9 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
-		bounds->x0 = bounds->x1 = trm.e;
-		bounds->y0 = bounds->y1 = trm.f;
+		unlock_ft_face(ctx, font, clone);
+		bounds.x0 = bounds.x1 = trm.e;
+		bounds.y0 = bounds.y1 = trm.f;
 		return bounds;
 	}
 
@@ -1313,16 +1568,16 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	}
 
 	FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
-	bounds->x0 = cbox.xMin * recip;
-	bounds->y0 = cbox.yMin * recip;
-	bounds->x1 = cbox.xMax * recip;
-	bounds->y1 = cbox.yMax * recip;
+	unlock_ft_face(ctx, font, clone);
+	bounds.x0 = cbox.xMin * recip;
+	bounds.y0 = cbox.yMin * recip;
+	bounds.x1 = cbox.xMax * recip;
+	bounds.y1 = cbox.yMax * recip;
 
-	if (fz_is_empty_rect(*bounds))
+	if (fz_is_empty_rect(bounds))
 	{
-		bounds->x0 = bounds->x1 = trm.e;
-		bounds->y0 = bounds->y1 = trm.f;
+		bounds.x0 = bounds.x1 = trm.e;
+		bounds.y0 = bounds.y1 = trm.f;
 	}
 
 	return bounds;
@@ -1397,25 +1652,26 @@ fz_path *
 fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
 	struct closure cc;
-	FT_Face face = font->ft_face;
+	fz_ft_clone *clone;
+	FT_Face face;
 	int fterr;
 
-	const int scale = face->units_per_EM;
+	const int scale = ((FT_Face)font->ft_face)->units_per_EM;
 	const float recip = 1.0f / scale;
 	const float strength = 0.02f;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &trm);
+	face = lock_ft_face(ctx, font, &clone);
+
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &trm);
 
 	if (font->flags.fake_italic)
 		trm = fz_pre_shear(trm, SHEAR, 0);
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
-
 	fterr = FT_Load_Glyph(face, gid, FT_LOAD_NO_SCALE | FT_LOAD_IGNORE_TRANSFORM);
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 		return NULL;
 	}
 
@@ -1437,7 +1693,7 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		unlock_ft_face(ctx, font, clone);
 	}
 	fz_catch(ctx)
 	{
@@ -1487,20 +1743,18 @@ fz_new_type3_font(fz_context *ctx, const char *name, fz_matrix matrix)
 	return font;
 }
 
-static void
+static fz_rect
 fz_bound_t3_glyph(fz_context *ctx, fz_font *font, int gid)
 {
 	fz_display_list *list;
 	fz_device *dev;
+	fz_rect bbox;
 
 	list = font->t3lists[gid];
 	if (!list)
-	{
-		font->bbox_table[gid] = fz_empty_rect;
-		return;
-	}
+		return fz_empty_rect;
 
-	dev = fz_new_bbox_device(ctx, &font->bbox_table[gid]);
+	dev = fz_new_bbox_device(ctx, &bbox);
 	fz_try(ctx)
 	{
 		fz_run_display_list(ctx, list, dev, font->t3matrix, fz_infinite_rect, NULL);
@@ -1517,7 +1771,9 @@ fz_bound_t3_glyph(fz_context *ctx, fz_font *font, int gid)
 
 	/* Update font bbox with glyph's computed bbox if the font bbox is invalid */
 	if (font->flags.invalid_bbox)
-		font->bbox = fz_union_rect(font->bbox, font->bbox_table[gid]);
+		font->bbox = fz_union_rect(font->bbox, bbox);
+
+	return bbox;
 }
 
 void
@@ -1525,7 +1781,7 @@ fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid)
 {
 	fz_buffer *contents;
 	fz_device *dev;
-	fz_rect d1_rect;
+	fz_rect d1_rect, bbox;
 
 	contents = font->t3procs[gid];
 	if (!contents)
@@ -1560,30 +1816,33 @@ fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid)
 	{
 		/* If empty, no need for a huge bbox, especially as the logic
 		 * in the 'else if' can make it huge. */
-		font->bbox_table[gid].x0 = font->bbox.x0;
-		font->bbox_table[gid].y0 = font->bbox.y0;
-		font->bbox_table[gid].x1 = font->bbox.x0 + .00001f;
-		font->bbox_table[gid].y1 = font->bbox.y0 + .00001f;
+		bbox.x0 = font->bbox.x0;
+		bbox.y0 = font->bbox.y0;
+		bbox.x1 = font->bbox.x0 + .00001f;
+		bbox.y1 = font->bbox.y0 + .00001f;
 	}
 	else if (font->t3flags[gid] & FZ_DEVFLAG_BBOX_DEFINED)
 	{
 		assert(font->bbox_table != NULL);
 		assert(font->glyph_count > gid);
-		font->bbox_table[gid] = fz_transform_rect(d1_rect, font->t3matrix);
-
 		if (font->flags.invalid_bbox || !fz_contains_rect(font->bbox, d1_rect))
 		{
 			/* Either the font bbox is invalid, or the d1_rect returned is
 			 * incompatible with it. Either way, don't trust the d1 rect
 			 * and calculate it from the contents. */
-			fz_bound_t3_glyph(ctx, font, gid);
+			bbox = fz_bound_t3_glyph(ctx, font, gid);
 		}
+		else
+			bbox = fz_transform_rect(d1_rect, font->t3matrix);
 	}
 	else
 	{
 		/* No bbox has been defined for this glyph, so compute it. */
-		fz_bound_t3_glyph(ctx, font, gid);
+		bbox = fz_bound_t3_glyph(ctx, font, gid);
 	}
+
+	if (font->bbox_table)
+		set_glyph_bbox(ctx, font, gid, bbox);
 }
 
 /*
@@ -1746,18 +2005,18 @@ fz_rect
 fz_bound_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
 	fz_rect rect;
-	if (font->bbox_table && gid < font->glyph_count)
+	if (font->bbox_table && gid >= 0 && gid < font->glyph_count)
 	{
-		if (fz_is_infinite_rect(font->bbox_table[gid]))
+		if (!get_glyph_bbox(ctx, font, gid, &rect))
 		{
 			if (font->ft_face)
-				fz_bound_ft_glyph(ctx, font, gid);
+				rect = fz_bound_ft_glyph(ctx, font, gid);
 			else if (font->t3lists)
-				fz_bound_t3_glyph(ctx, font, gid);
+				rect = fz_bound_t3_glyph(ctx, font, gid);
 			else
-				font->bbox_table[gid] = fz_empty_rect;
+				rect = fz_empty_rect;
+			set_glyph_bbox(ctx, font, gid, rect);
 		}
-		rect = font->bbox_table[gid];
 		if (fz_is_empty_rect(rect))
 			rect = font->bbox;
 	}
@@ -1796,33 +2055,55 @@ int fz_glyph_cacheable(fz_context *ctx, fz_font *font, int gid)
 	return (font->t3flags[gid] & FZ_DEVFLAG_UNCACHEABLE) == 0;
 }
 
-static float
-fz_advance_ft_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
+/* Find the advances of glyphs gid to gid+n-1, locking the face just once. */
+static void
+fz_advance_ft_glyphs(fz_context *ctx, fz_font *font, int gid, int n, int wmode, float *advances)
 {
+	fz_ft_clone *clone;
+	FT_Face face;
 	FT_Error fterr;
-	FT_Fixed adv = 0;
-	int mask;
+	FT_Fixed adv;
+	float scale;
+	int i, mask;
 
 	/* PDF and substitute font widths. */
 	if (font->flags.ft_stretch)
 	{
 		if (font->width_table)
 		{
-			if (gid < font->width_count)
-				return font->width_table[gid] / 1000.0f;
-			return font->width_default / 1000.0f;
+			for (i = 0; i < n; i++)
+			{
+				if (gid + i < font->width_count)
+					advances[i] = font->width_table[gid + i] / 1000.0f;
+				else
+					advances[i] = font->width_default / 1000.0f;
+			}
+			return;
 		}
 	}
 
 	mask = FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM;
 	if (wmode)
 		mask |= FT_LOAD_VERTICAL_LAYOUT;
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
-	fterr = FT_Get_Advance(font->ft_face, gid, mask, &adv);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
-	if (fterr)
-		fz_warn(ctx, "freetype getting character advance: %s", ft_error_string(fterr));
-	return (float) adv / ((FT_Face)font->ft_face)->units_per_EM;
+	scale = 1.0f / ((FT_Face)font->ft_face)->units_per_EM;
+	face = lock_ft_face(ctx, font, &clone);
+	for (i = 0; i < n; i++)
+	{
+		adv = 0;
+		fterr = FT_Get_Advance(face, gid + i, mask, &adv);
+		if (fterr)
+			fz_warn(ctx, "freetype getting character advance: %s", ft_error_string(fterr));
+		advances[i] = adv * scale;
+	}
+	unlock_ft_face(ctx, font, clone);
+}
+
+static float
+fz_advance_ft_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
+{
+	float adv;
+	fz_advance_ft_glyphs(ctx, font, gid, 1, wmode, &adv);
+	return adv;
 }
 
 static float
@@ -1886,21 +2167,28 @@ fz_advance_glyph(fz_context *ctx, fz_font *font, int gid, int wmode)
 {
 	if (font->ft_face)
 	{
-		if (wmode)
-			return fz_advance_ft_glyph(ctx, font, gid, 1);
-		if (gid >= 0 && gid < font->glyph_count && gid < MAX_ADVANCE_CACHE)
+		wmode = !!wmode;
+		if (gid >= 0 && gid < font->glyph_count)
 		{
-			if (!font->advance_cache)
+			float **slot = &font->advance_cache[wmode][gid >> GLYPH_PAGE_BITS];
+			float *page = fz_atomic_load(float *, slot);
+			if (!page)
 			{
-				int i;
-				font->advance_cache = fz_malloc_array(ctx, font->glyph_count, sizeof(float));
-				for (i = 0; i < font->glyph_count; ++i)
-					font->advance_cache[i] = fz_advance_ft_glyph(ctx, font, i, 0);
+				int first = gid & ~(GLYPH_PAGE_SIZE - 1);
+				page = fz_malloc_array(ctx, GLYPH_PAGE_SIZE, sizeof(float));
+				fz_try(ctx)
+					fz_advance_ft_glyphs(ctx, font, first, fz_mini(GLYPH_PAGE_SIZE, font->glyph_count - first), wmode, page);
+				fz_catch(ctx)
+				{
+					fz_free(ctx, page);
+					fz_rethrow(ctx);
+				}
+				page = install_glyph_page(ctx, (void **)slot, page);
 			}
-			return font->advance_cache[gid];
+			return page[gid & (GLYPH_PAGE_SIZE - 1)];
 		}
 
-		return fz_advance_ft_glyph(ctx, font, gid, 0);
+		return fz_advance_ft_glyph(ctx, font, gid, wmode);
 	}
 	if (font->t3procs)
 		return fz_advance_t3_glyph(ctx, font, gid);
@@ -2149,6 +2437,17 @@ void *fz_font_ft_face(fz_context *ctx, fz_font *font)
 	return font ? font->ft_face : NULL;
 }
 
+/*
+	Retrieve the index of the face within the font
+	file that a freetype handled font was loaded from.
+
+	Returns 0 if not a freetype handled font.
+*/
+int fz_font_ft_face_index(fz_context *ctx, fz_font *font)
+{
+	return (font && font->ft_face) ? (int)((FT_Face)font->ft_face)->face_index : 0;
+}
+
 /*
 	Retrieve a pointer to the font flags
 	for a given font. These can then be updated as required.
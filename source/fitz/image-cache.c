@@ -0,0 +1,716 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+#include <assert.h>
+#include <string.h>
+
+/*
+	The image tile cache.
+
+	Decoded image tiles are kept here rather than in the general
+	store, with a size limit of their own, so that one large scan
+	cannot push the fonts, colorspace links and objects out of the
+	store (nor be pushed out by them). The two limits are carved out
+	of the max_store given to fz_new_context, so that together they
+	still keep to it, and fz_shrink_store shrinks both.
+
+	For each image we keep a chain of the tiles decoded from it. Any
+	tile that covers the area wanted, at the same or a finer
+	subsampling, can be used for a request; the caller scales it
+	down as it would a freshly decoded one.
+
+	When the cache is full, tiles are evicted in 'GreedyDual-Size'
+	order. Each tile has a priority of L + cost/size, where cost is
+	an estimate of the work needed to decode it again and L is the
+	priority of the last tile to be evicted, and the tile with the
+	lowest priority goes first. Using a tile renews its priority, so
+	it is the tiles that are cheap to decode for their size, or that
+	have not been used for a while, that go. The tiles are kept in a
+	binary min-heap on their priority, so that finding the next one
+	to go, or renewing one, costs O(log n).
+
+	The first tile of each image's chain is also on a list of the
+	images in the cache, so that reaping looks at each image once
+	rather than at every tile.
+
+	Everything here is protected by FZ_LOCK_ALLOC, as for the store,
+	so that the scavenging allocator can evict tiles when memory is
+	short.
+*/
+
+typedef struct fz_image_tile_s fz_image_tile;
+
+struct fz_image_tile_s
+{
+	fz_image *image;
+	int l2factor;
+	fz_irect rect;
+	fz_pixmap *pix;
+	size_t size;
+	float cost;
+	double priority;
+	int heap_index; /* -1 when not in the heap */
+	fz_image_tile *prev, *next; /* the first tile of every image */
+	fz_image_tile *chain; /* the other tiles of the same image */
+	fz_image_tile *aside; /* used while picking victims */
+};
+
+struct fz_image_cache_s
+{
+	int refs;
+	size_t max;
+	size_t size;
+	double inflation;
+	fz_hash_table *hash;
+	fz_image_tile *head;
+	fz_image_tile **heap;
+	int heap_len;
+	int heap_cap;
+	int count;
+	int hits;
+	int near_hits;
+	int misses;
+	int num_evictions;
+	size_t evicted;
+};
+
+/*
+	Create the image tile cache for a new context.
+
+	max: The maximum size (in bytes) that the decoded tiles may add
+	up to. FZ_STORE_UNLIMITED means no limit.
+*/
+void
+fz_new_image_cache_context(fz_context *ctx, size_t max)
+{
+	fz_image_cache *cache;
+
+	cache = fz_malloc_struct(ctx, fz_image_cache);
+	fz_try(ctx)
+		cache->hash = fz_new_hash_table(ctx, 256, sizeof(fz_image *), FZ_LOCK_ALLOC, NULL);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, cache);
+		fz_rethrow(ctx);
+	}
+	cache->refs = 1;
+	cache->max = max;
+	ctx->image_cache = cache;
+}
+
+fz_image_cache *
+fz_keep_image_cache_context(fz_context *ctx)
+{
+	if (ctx == NULL || ctx->image_cache == NULL)
+		return NULL;
+	return fz_keep_imp(ctx, ctx->image_cache, &ctx->image_cache->refs);
+}
+
+void
+fz_drop_image_cache_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->image_cache)
+		return;
+	if (fz_drop_imp(ctx, ctx->image_cache, &ctx->image_cache->refs))
+	{
+		fz_purge_image_cache(ctx);
+		assert(ctx->image_cache->head == NULL);
+		fz_drop_hash_table(ctx, ctx->image_cache->hash);
+		fz_free(ctx, ctx->image_cache->heap);
+		fz_free(ctx, ctx->image_cache);
+	}
+	ctx->image_cache = NULL;
+}
+
+static double
+tile_priority(fz_image_cache *cache, fz_image_tile *tile)
+{
+	return cache->inflation + tile->cost / (tile->size ? tile->size : 1);
+}
+
+/* The heap. All of these are called with FZ_LOCK_ALLOC held. */
+
+static void
+heap_set(fz_image_cache *cache, int i, fz_image_tile *tile)
+{
+	cache->heap[i] = tile;
+	tile->heap_index = i;
+}
+
+static void
+heap_sift_up(fz_image_cache *cache, int i)
+{
+	fz_image_tile *tile = cache->heap[i];
+
+	while (i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if (cache->heap[parent]->priority <= tile->priority)
+			break;
+		heap_set(cache, i, cache->heap[parent]);
+		i = parent;
+	}
+	heap_set(cache, i, tile);
+}
+
+static void
+heap_sift_down(fz_image_cache *cache, int i)
+{
+	fz_image_tile *tile = cache->heap[i];
+
+	while (1)
+	{
+		int child = 2 * i + 1;
+		if (child >= cache->heap_len)
+			break;
+		if (child + 1 < cache->heap_len && cache->heap[child + 1]->priority < cache->heap[child]->priority)
+			child++;
+		if (tile->priority <= cache->heap[child]->priority)
+			break;
+		heap_set(cache, i, cache->heap[child]);
+		i = child;
+	}
+	heap_set(cache, i, tile);
+}
+
+/* There must be room (see grow_heap). */
+static void
+heap_insert(fz_image_cache *cache, fz_image_tile *tile)
+{
+	heap_set(cache, cache->heap_len++, tile);
+	heap_sift_up(cache, tile->heap_index);
+}
+
+static void
+heap_remove(fz_image_cache *cache, fz_image_tile *tile)
+{
+	int i = tile->heap_index;
+	fz_image_tile *last = cache->heap[--cache->heap_len];
+
+	tile->heap_index = -1;
+	if (last != tile)
+	{
+		heap_set(cache, i, last);
+		heap_sift_up(cache, i);
+		heap_sift_down(cache, last->heap_index);
+	}
+}
+
+/* Renew the priority of a tile that has just been used. */
+static void
+renew_tile(fz_image_cache *cache, fz_image_tile *tile)
+{
+	tile->priority = tile_priority(cache, tile);
+	if (tile->heap_index >= 0)
+		heap_sift_down(cache, tile->heap_index);
+}
+
+/*
+	Make room in the heap for another tile. Entered with FZ_LOCK_ALLOC
+	held, which is dropped and retaken. Returns 0 if out of memory.
+*/
+static int
+grow_heap(fz_context *ctx, fz_image_cache *cache)
+{
+	int cap = cache->heap_cap ? cache->heap_cap * 2 : 64;
+	fz_image_tile **heap;
+
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	heap = fz_malloc_no_throw(ctx, cap * sizeof(*heap));
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (!heap)
+		return 0;
+
+	/* Another thread may have grown it meanwhile. */
+	if (cache->heap_cap < cap)
+	{
+		fz_image_tile **old = cache->heap;
+		if (cache->heap_len)
+			memcpy(heap, old, cache->heap_len * sizeof(*heap));
+		cache->heap = heap;
+		cache->heap_cap = cap;
+		heap = old;
+	}
+
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_free(ctx, heap);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	return 1;
+}
+
+/* Take a reference to a pixmap with FZ_LOCK_ALLOC already held. */
+static fz_pixmap *
+keep_tile_pixmap(fz_pixmap *pix)
+{
+	if (fz_keep_refs(&pix->storable.refs) > 0)
+		(void)Memento_takeRef(pix);
+	return pix;
+}
+
+/* Remove a tile from the cache. Called with FZ_LOCK_ALLOC held. */
+static void
+unlink_tile(fz_context *ctx, fz_image_cache *cache, fz_image_tile *tile)
+{
+	fz_image_tile *first = fz_hash_find(ctx, cache->hash, &tile->image);
+
+	if (first == tile)
+	{
+		/* Removing an entry and putting one back can never need
+		 * the table to grow, so this cannot drop the lock. */
+		fz_hash_remove(ctx, cache->hash, &tile->image);
+		if (tile->chain)
+			fz_hash_insert(ctx, cache->hash, &tile->image, tile->chain);
+
+		/* The next tile of the image (if any) takes our place on
+		 * the list of images. */
+		first = tile->chain;
+		if (first)
+		{
+			first->prev = tile->prev;
+			first->next = tile->next;
+		}
+		else
+			first = tile->next;
+		if (tile->next)
+			tile->next->prev = tile->chain ? tile->chain : tile->prev;
+		if (tile->prev)
+			tile->prev->next = first;
+		else
+			cache->head = first;
+	}
+	else
+	{
+		while (first->chain != tile)
+			first = first->chain;
+		first->chain = tile->chain;
+	}
+
+	if (tile->heap_index >= 0)
+		heap_remove(cache, tile);
+	cache->size -= tile->size;
+	cache->count--;
+}
+
+/* Free a list of tiles (linked by next) that have been unlinked. Called without the lock. */
+static void
+free_tiles(fz_context *ctx, fz_image_tile *tile)
+{
+	while (tile)
+	{
+		fz_image_tile *next = tile->next;
+		fz_drop_pixmap(ctx, tile->pix);
+		fz_drop_image_store_key(ctx, tile->image);
+		fz_free(ctx, tile);
+		tile = next;
+	}
+}
+
+/*
+	Unlink tiles that nothing else is using, lowest priority first,
+	until at least tofree bytes have gone (or there are none left to
+	go). If all is 0, then nothing is unlinked unless enough can be.
+	Called with FZ_LOCK_ALLOC held. Returns the tiles to be freed.
+*/
+static fz_image_tile *
+pick_victims(fz_context *ctx, fz_image_cache *cache, size_t tofree, int all)
+{
+	fz_image_tile *victims = NULL;
+	fz_image_tile *picked = NULL;
+	fz_image_tile *busy = NULL;
+	fz_image_tile *tile, *next;
+	size_t count = 0;
+
+	/* Take tiles off the heap, lowest priority first, setting
+	 * aside those that are in use. */
+	while (count < tofree && cache->heap_len > 0)
+	{
+		tile = cache->heap[0];
+		heap_remove(cache, tile);
+		if (tile->pix->storable.refs == 1)
+		{
+			tile->aside = picked;
+			picked = tile;
+			count += tile->size;
+		}
+		else
+		{
+			tile->aside = busy;
+			busy = tile;
+		}
+	}
+
+	/* The tiles in use go back, as do the others if there are
+	 * not enough of them. */
+	if (!all && count < tofree)
+	{
+		for (tile = picked; tile; tile = tile->aside)
+			heap_insert(cache, tile);
+		picked = NULL;
+	}
+	for (tile = busy; tile; tile = tile->aside)
+		heap_insert(cache, tile);
+
+	for (tile = picked; tile; tile = next)
+	{
+		next = tile->aside;
+		unlink_tile(ctx, cache, tile);
+		if (tile->priority > cache->inflation)
+			cache->inflation = tile->priority;
+		cache->num_evictions++;
+		cache->evicted += tile->size;
+		tile->next = victims;
+		victims = tile;
+	}
+
+	return victims;
+}
+
+/*
+	Look for a tile of an image that can be used in place of
+	decoding the given area of it at the given subsampling.
+
+	l2factor, rect: On entry, what is wanted. If a tile is found,
+	these are updated to describe it.
+
+	Returns a new reference to the tile, or NULL if there is none.
+*/
+fz_pixmap *
+fz_find_cached_image_tile(fz_context *ctx, fz_image *image, int *l2factor, fz_irect *rect)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *tile, *best = NULL;
+	fz_pixmap *pix = NULL;
+
+	if (!cache)
+		return NULL;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (tile = fz_hash_find(ctx, cache->hash, &image); tile; tile = tile->chain)
+	{
+		if (tile->l2factor > *l2factor ||
+			tile->rect.x0 > rect->x0 || tile->rect.y0 > rect->y0 ||
+			tile->rect.x1 < rect->x1 || tile->rect.y1 < rect->y1)
+			continue;
+		/* Prefer the most subsampled, and then the smallest, tile. */
+		if (!best || tile->l2factor > best->l2factor ||
+			(tile->l2factor == best->l2factor && tile->size < best->size))
+			best = tile;
+	}
+	if (best)
+	{
+		if (best->l2factor == *l2factor &&
+			best->rect.x0 == rect->x0 && best->rect.y0 == rect->y0 &&
+			best->rect.x1 == rect->x1 && best->rect.y1 == rect->y1)
+			cache->hits++;
+		else
+			cache->near_hits++;
+		renew_tile(cache, best);
+		*l2factor = best->l2factor;
+		*rect = best->rect;
+		pix = keep_tile_pixmap(best->pix);
+	}
+	else
+		cache->misses++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return pix;
+}
+
+/*
+	Put a decoded tile of an image into the cache.
+
+	Returns NULL for success. If an identical tile is already there
+	(put there by another thread), then ours is not added, and a new
+	reference to that one is returned instead. Failure to cache the
+	tile is not an error.
+
+	cost: An estimate of the work needed to decode the tile again,
+	in the same units for every tile.
+*/
+fz_pixmap *
+fz_store_image_tile(fz_context *ctx, fz_image *image, int l2factor, const fz_irect *rect, fz_pixmap *pix, float cost)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *tile = NULL;
+	fz_image_tile *first, *victims;
+
+	if (!cache)
+		return NULL;
+
+	fz_try(ctx)
+		tile = fz_malloc_struct(ctx, fz_image_tile);
+	fz_catch(ctx)
+		return NULL;
+
+	tile->image = fz_keep_image_store_key(ctx, image);
+	tile->l2factor = l2factor;
+	tile->rect = *rect;
+	tile->pix = fz_keep_pixmap(ctx, pix);
+	tile->size = fz_pixmap_size(ctx, pix);
+	tile->cost = cost;
+	tile->heap_index = -1;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	while (1)
+	{
+		first = fz_hash_find(ctx, cache->hash, &image);
+		for (; first; first = first->chain)
+		{
+			if (first->l2factor == l2factor &&
+				first->rect.x0 == rect->x0 && first->rect.y0 == rect->y0 &&
+				first->rect.x1 == rect->x1 && first->rect.y1 == rect->y1)
+			{
+				fz_pixmap *existing = keep_tile_pixmap(first->pix);
+				renew_tile(cache, first);
+				fz_unlock(ctx, FZ_LOCK_ALLOC);
+				free_tiles(ctx, tile);
+				return existing;
+			}
+		}
+
+		if (cache->heap_len == cache->heap_cap)
+		{
+			if (!grow_heap(ctx, cache))
+			{
+				fz_unlock(ctx, FZ_LOCK_ALLOC);
+				free_tiles(ctx, tile);
+				return NULL;
+			}
+			continue;
+		}
+
+		/* Make room if we can. If we can't, the tile goes in
+		 * anyway, and the cache shrinks again as tiles fall out of
+		 * use and others are stored. */
+		if (cache->max == FZ_STORE_UNLIMITED || cache->size + tile->size <= cache->max)
+			break;
+		victims = pick_victims(ctx, cache, cache->size + tile->size - cache->max, 0);
+		if (!victims)
+			break;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		free_tiles(ctx, victims);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
+
+	first = fz_hash_find(ctx, cache->hash, &image);
+	if (!first)
+	{
+		fz_try(ctx)
+		{
+			/* May drop and retake the lock, in which case another
+			 * thread may have started a chain for this image. */
+			first = fz_hash_insert(ctx, cache->hash, &image, tile);
+		}
+		fz_catch(ctx)
+		{
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			free_tiles(ctx, tile);
+			return NULL;
+		}
+	}
+	if (first)
+	{
+		tile->chain = first->chain;
+		first->chain = tile;
+	}
+	else
+	{
+		tile->next = cache->head;
+		if (tile->next)
+			tile->next->prev = tile;
+		cache->head = tile;
+	}
+
+	tile->priority = tile_priority(cache, tile);
+	heap_insert(cache, tile);
+	cache->size += tile->size;
+	cache->count++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return NULL;
+}
+
+/*
+	Unlink all the tiles of an image, given the first, if the cache
+	is all that is keeping the image alive. Called with FZ_LOCK_ALLOC
+	held.
+*/
+static fz_image_tile *
+reap_image(fz_context *ctx, fz_image_cache *cache, fz_image_tile *first, fz_image_tile *remove)
+{
+	fz_key_storable *ks = &first->image->key_storable;
+	fz_image_tile *next;
+
+	if (ks->store_key_refs != ks->storable.refs)
+		return remove;
+
+	while (first)
+	{
+		next = first->chain;
+		unlink_tile(ctx, cache, first);
+		first->next = remove;
+		remove = first;
+		first = next;
+	}
+	return remove;
+}
+
+/*
+	Drop the tiles of any images that are only being kept alive by
+	the cache (see fz_drop_key_storable). If ks is not NULL, only
+	that image (if it is one) can need reaping. Entered with
+	FZ_LOCK_ALLOC held, which is dropped and retaken.
+*/
+void
+fz_reap_image_cache(fz_context *ctx, const fz_key_storable *ks)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *tile, *next, *remove = NULL;
+
+	if (!cache)
+		return;
+
+	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+
+	if (ks)
+	{
+		/* An image's key_storable is its first member. */
+		fz_image *image = (fz_image *)ks;
+		tile = fz_hash_find(ctx, cache->hash, &image);
+		if (tile)
+			remove = reap_image(ctx, cache, tile, remove);
+	}
+	else
+	{
+		for (tile = cache->head; tile; tile = next)
+		{
+			next = tile->next;
+			remove = reap_image(ctx, cache, tile, remove);
+		}
+	}
+
+	if (remove)
+	{
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		free_tiles(ctx, remove);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
+}
+
+/*
+	Evict tiles that nothing else is using to free at least size
+	bytes, for the scavenging allocator. Entered with FZ_LOCK_ALLOC
+	held, which is dropped and retaken.
+
+	Returns non zero if any memory was freed.
+*/
+int
+fz_scavenge_image_cache(fz_context *ctx, size_t size)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *victims;
+
+	if (!cache)
+		return 0;
+
+	victims = pick_victims(ctx, cache, size, 1);
+	if (!victims)
+		return 0;
+
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	free_tiles(ctx, victims);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	return 1;
+}
+
+/*
+	Evict tiles that nothing else is using until the cache is down to
+	the given percentage of its current size, as fz_shrink_store does
+	for the store.
+
+	Returns non zero if the cache is now that small, zero otherwise.
+*/
+int
+fz_shrink_image_cache(fz_context *ctx, unsigned int percent)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *victims = NULL;
+	size_t new_size;
+	int success;
+
+	if (!cache || percent >= 100)
+		return 1;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	new_size = (size_t)(((uint64_t)cache->size * percent) / 100);
+	if (cache->size > new_size)
+		victims = pick_victims(ctx, cache, cache->size - new_size, 1);
+	success = (cache->size <= new_size) ? 1 : 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	free_tiles(ctx, victims);
+
+	return success;
+}
+
+/*
+	Empty the image cache. Tiles that are in use elsewhere live on
+	until they are dropped, but will not be found again.
+*/
+void
+fz_purge_image_cache(fz_context *ctx)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *tile, *remove = NULL;
+
+	if (!cache)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	while ((tile = cache->head) != NULL)
+	{
+		/* Unlinking the first tile of an image puts the next one
+		 * at the head. */
+		unlink_tile(ctx, cache, tile);
+		tile->next = remove;
+		remove = tile;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	free_tiles(ctx, remove);
+}
+
+/*
+	Set the maximum size (in bytes) of the image cache, evicting
+	tiles as needed to bring it down to size. FZ_STORE_UNLIMITED
+	means no limit.
+*/
+void
+fz_set_image_cache_limit(fz_context *ctx, size_t max)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_tile *victims = NULL;
+
+	if (!cache)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	cache->max = max;
+	if (max != FZ_STORE_UNLIMITED && cache->size > max)
+		victims = pick_victims(ctx, cache, cache->size - max, 1);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	free_tiles(ctx, victims);
+}
+
+void
+fz_dump_image_cache_stats(fz_context *ctx)
+{
+	fz_image_cache *cache = ctx->image_cache;
+
+	if (!cache)
+		return;
+
+	fz_write_printf(ctx, fz_stderr(ctx), "Image Cache Size: %zu (limit %zu)\n", cache->size, cache->max);
+	fz_write_printf(ctx, fz_stderr(ctx), "Image Cache Tiles: %d\n", cache->count);
+	fz_write_printf(ctx, fz_stderr(ctx), "Image Cache Hits: %d (%d from larger tiles)\n", cache->hits + cache->near_hits, cache->near_hits);
+	fz_write_printf(ctx, fz_stderr(ctx), "Image Cache Misses: %d\n", cache->misses);
+	fz_write_printf(ctx, fz_stderr(ctx), "Image Cache Evictions: %d (%zu bytes)\n", cache->num_evictions, cache->evicted);
+}
@@ -4,13 +4,6 @@
 #include <math.h>
 #include <assert.h>
 
-/* TODO: here or public? */
-static int
-fz_key_storable_needs_reaping(fz_context *ctx, const fz_key_storable *ks)
-{
-	return ks == NULL ? 0 : (ks->store_key_refs == ks->storable.refs);
-}
-
 #define SANE_DPI 72.0f
 #define INSANE_DPI 4800.0f
 
@@ -32,8 +25,6 @@ struct fz_pixmap_image_s
 typedef struct fz_image_key_s fz_image_key;
 
 struct fz_image_key_s {
-	int refs;
-	fz_image *image;
 	int l2factor;
 	fz_irect rect;
 };
@@ -56,67 +47,6 @@ fz_drop_image_store_key(fz_context *ctx, fz_image *image)
 	fz_drop_key_storable_key(ctx, &image->key_storable);
 }
 
-static int
-fz_make_hash_image_key(fz_context *ctx, fz_store_hash *hash, void *key_)
-{
-	fz_image_key *key = (fz_image_key *)key_;
-	hash->u.pir.ptr = key->image;
-	hash->u.pir.i = key->l2factor;
-	hash->u.pir.r = key->rect;
-	return 1;
-}
-
-static void *
-fz_keep_image_key(fz_context *ctx, void *key_)
-{
-	fz_image_key *key = (fz_image_key *)key_;
-	return fz_keep_imp(ctx, key, &key->refs);
-}
-
-static void
-fz_drop_image_key(fz_context *ctx, void *key_)
-{
-	fz_image_key *key = (fz_image_key *)key_;
-	if (fz_drop_imp(ctx, key, &key->refs))
-	{
-		fz_drop_image_store_key(ctx, key->image);
-		fz_free(ctx, key);
-	}
-}
-
-static int
-fz_cmp_image_key(fz_context *ctx, void *k0_, void *k1_)
-{
-	fz_image_key *k0 = (fz_image_key *)k0_;
-	fz_image_key *k1 = (fz_image_key *)k1_;
-	return k0->image == k1->image && k0->l2factor == k1->l2factor && k0->rect.x0 == k1->rect.x0 && k0->rect.y0 == k1->rect.y0 && k0->rect.x1 == k1->rect.x1 && k0->rect.y1 == k1->rect.y1;
-}
-
-static void
-fz_format_image_key(fz_context *ctx, char *s, int n, void *key_)
-{
-	fz_image_key *key = (fz_image_key *)key_;
-	fz_snprintf(s, n, "(image %d x %d sf=%d)", key->image->w, key->image->h, key->l2factor);
-}
-
-static int
-fz_needs_reap_image_key(fz_context *ctx, void *key_)
-{
-	fz_image_key *key = (fz_image_key *)key_;
-
-	return fz_key_storable_needs_reaping(ctx, &key->image->key_storable);
-}
-
-static const fz_store_type fz_image_store_type =
-{
-	fz_make_hash_image_key,
-	fz_keep_image_key,
-	fz_drop_image_key,
-	fz_cmp_image_key,
-	fz_format_image_key,
-	fz_needs_reap_image_key
-};
-
 void
 fz_drop_image(fz_context *ctx, fz_image *image)
 {
@@ -262,32 +192,13 @@ static void fz_adjust_image_subarea(fz_context *ctx, fz_image *image, fz_irect *
 		subarea->y1 = image->h;
 }
 
-static void fz_compute_image_key(fz_context *ctx, fz_image *image, fz_matrix *ctm,
-	fz_image_key *key, const fz_irect *subarea, int l2factor, int *w, int *h, int *dw, int *dh)
+/* Work out the size at which the given area of an image will be drawn. */
+static void fz_compute_image_extent(fz_image *image, const fz_matrix *ctm, const fz_irect *rect, int *w, int *h, int *dw, int *dh)
 {
-	key->refs = 1;
-	key->image = image;
-	key->l2factor = l2factor;
-
-	if (subarea == NULL)
-	{
-		key->rect.x0 = 0;
-		key->rect.y0 = 0;
-		key->rect.x1 = image->w;
-		key->rect.y1 = image->h;
-	}
-	else
-	{
-		key->rect = *subarea;
-		ctx->tuning->image_decode(ctx->tuning->image_decode_arg, image->w, image->h, key->l2factor, &key->rect);
-		fz_adjust_image_subarea(ctx, image, &key->rect, key->l2factor);
-	}
-
-	/* Based on that subarea, recalculate the extents */
 	if (ctm)
 	{
-		float frac_w = (float) (key->rect.x1 - key->rect.x0) / image->w;
-		float frac_h = (float) (key->rect.y1 - key->rect.y0) / image->h;
+		float frac_w = (float) (rect->x1 - rect->x0) / image->w;
+		float frac_h = (float) (rect->y1 - rect->y0) / image->h;
 		float a = ctm->a * frac_w;
 		float b = ctm->b * frac_h;
 		float c = ctm->c * frac_w;
@@ -310,6 +221,29 @@ static void fz_compute_image_key(fz_context *ctx, fz_image *image, fz_matrix *ct
 		*w = image->w;
 	if (*h > image->h)
 		*h = image->h;
+}
+
+static void fz_compute_image_key(fz_context *ctx, fz_image *image, fz_matrix *ctm,
+	fz_image_key *key, const fz_irect *subarea, int l2factor, int *w, int *h, int *dw, int *dh)
+{
+	key->l2factor = l2factor;
+
+	if (subarea == NULL)
+	{
+		key->rect.x0 = 0;
+		key->rect.y0 = 0;
+		key->rect.x1 = image->w;
+		key->rect.y1 = image->h;
+	}
+	else
+	{
+		key->rect = *subarea;
+		ctx->tuning->image_decode(ctx->tuning->image_decode_arg, image->w, image->h, key->l2factor, &key->rect);
+		fz_adjust_image_subarea(ctx, image, &key->rect, key->l2factor);
+	}
+
+	/* Based on that subarea, recalculate the extents */
+	fz_compute_image_extent(image, ctm, &key->rect, w, h, dw, dh);
 
 	if (*w == 0 || *h == 0)
 		key->l2factor = 0;
@@ -652,21 +586,53 @@ void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *su
 }
 
 static fz_pixmap *
-fz_find_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matrix *ctm)
+fz_find_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matrix *ctm, int *dw, int *dh)
 {
 	fz_pixmap *tile;
-	do
+	fz_irect rect = key->rect;
+	int l2factor = key->l2factor;
+	int w, h;
+
+	tile = fz_find_cached_image_tile(ctx, image, &l2factor, &rect);
+	if (tile)
 	{
-		tile = fz_find_item(ctx, fz_drop_pixmap_imp, key, &fz_image_store_type);
-		if (tile)
+		/* The tile may cover more of the image than we asked for. */
+		if (dw || dh)
+			fz_compute_image_extent(image, ctm, &rect, &w, &h, dw, dh);
+		if (ctm)
+			update_ctm_for_subarea(ctm, &rect, image->w, image->h);
+	}
+	return tile;
+}
+
+/* A rough measure of the work needed to decode an area of an image again. */
+static float
+fz_image_decode_cost(fz_context *ctx, fz_image *image, const fz_irect *rect)
+{
+	float cost = (float)(rect->x1 - rect->x0) * (rect->y1 - rect->y0) * image->n;
+
+	if (image->get_pixmap == compressed_image_get_pixmap)
+	{
+		fz_compressed_image *cimg = (fz_compressed_image *)image;
+		switch (cimg->buffer ? cimg->buffer->params.type : FZ_IMAGE_UNKNOWN)
 		{
-			update_ctm_for_subarea(ctm, &key->rect, image->w, image->h);
-			return tile;
+		case FZ_IMAGE_JPX:
+		case FZ_IMAGE_JBIG2:
+			cost *= 8;
+			break;
+		case FZ_IMAGE_JPEG:
+		case FZ_IMAGE_JXR:
+		case FZ_IMAGE_FAX:
+			cost *= 4;
+			break;
+		case FZ_IMAGE_RAW:
+			break;
+		default:
+			cost *= 2;
+			break;
 		}
-		key->l2factor--;
 	}
-	while (key->l2factor >= 0);
-	return NULL;
+	return cost;
 }
 
 /*
@@ -695,10 +661,9 @@ fz_find_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matri
 fz_pixmap *
 fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subarea, fz_matrix *ctm, int *dw, int *dh)
 {
-	fz_pixmap *tile;
+	fz_pixmap *tile, *existing_tile;
 	int l2factor, l2factor_remaining;
 	fz_image_key key;
-	fz_image_key *keyp;
 	int w;
 	int h;
 
@@ -756,25 +721,13 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 			l2factor++;
 	}
 
-	/* First, look through the store for existing tiles */
-	if (subarea)
-	{
-		fz_compute_image_key(ctx, image, ctm, &key, subarea, l2factor, &w, &h, dw, dh);
-		tile = fz_find_image_tile(ctx, image, &key, ctm);
-		if (tile)
-			return tile;
-	}
-
-	/* No subarea given, or no tile for subarea found; try entire image */
-	fz_compute_image_key(ctx, image, ctm, &key, NULL, l2factor, &w, &h, dw, dh);
-	tile = fz_find_image_tile(ctx, image, &key, ctm);
+	/* First, look through the cache for a tile that covers the area we
+	 * want, at this or a finer subsampling. */
+	fz_compute_image_key(ctx, image, ctm, &key, subarea, l2factor, &w, &h, dw, dh);
+	tile = fz_find_image_tile(ctx, image, &key, ctm, dw, dh);
 	if (tile)
 		return tile;
 
-	/* Neither subarea nor full image tile found; prepare the subarea key again */
-	if (subarea)
-		fz_compute_image_key(ctx, image, ctm, &key, subarea, l2factor, &w, &h, dw, dh);
-
 	/* We'll have to decode the image; request the correct amount of downscaling. */
 	l2factor_remaining = l2factor;
 	tile = image->get_pixmap(ctx, image, &key.rect, w, h, &l2factor_remaining);
@@ -798,29 +751,13 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 
 	/* Now we try to cache the pixmap. Any failure here will just result
 	 * in us not caching. */
-	keyp = fz_malloc_struct(ctx, fz_image_key);
-	keyp->refs = 1;
-	keyp->image = fz_keep_image_store_key(ctx, image);
-	keyp->l2factor = l2factor;
-	keyp->rect = key.rect;
-	fz_try(ctx)
-	{
-		fz_pixmap *existing_tile = fz_store_item(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type);
-		if (existing_tile)
-		{
-			/* We already have a tile. This must have been produced by a
-			 * racing thread. We'll throw away ours and use that one. */
-			fz_drop_pixmap(ctx, tile);
-			tile = existing_tile;
-		}
-	}
-	fz_always(ctx)
-	{
-		fz_drop_image_key(ctx, keyp);
-	}
-	fz_catch(ctx)
+	existing_tile = fz_store_image_tile(ctx, image, l2factor, &key.rect, tile, fz_image_decode_cost(ctx, image, &key.rect));
+	if (existing_tile)
 	{
-		/* Do nothing */
+		/* We already have a tile. This must have been produced by a
+		 * racing thread. We'll throw away ours and use that one. */
+		fz_drop_pixmap(ctx, tile);
+		tile = existing_tile;
 	}
 
 	return tile;
@@ -1,13 +1,20 @@
 #include "mupdf/fitz.h"
+#include "colorspace-imp.h"
+#include "font-imp.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 typedef struct fz_display_node_s fz_display_node;
 typedef struct fz_list_device_s fz_list_device;
+typedef struct fz_display_index_s fz_display_index;
 
 #define STACK_SIZE 96
 
+/* Number of nodes covered by each leaf of the display list index. */
+#define INDEX_BLOCK_NODES 64
+
 typedef enum fz_display_command_e
 {
 	FZ_CMD_FILL_PATH,
@@ -122,6 +129,57 @@ struct fz_display_list_s
 	fz_rect mediabox;
 	int max;
 	int len;
+	fz_display_index *index;
+};
+
+/* The display list index.
+ *
+ * When the list device is closed, the nodes of the list are split
+ * into blocks of INDEX_BLOCK_NODES nodes. For each block we record
+ * the graphics state in force at its start, so that a run can jump
+ * straight to it without unpacking the nodes before it.
+ *
+ * Over the blocks we build a tree of spans: level 0 has one span per
+ * block, and each span at level L covers the 2 spans below it at
+ * level L-1. Each span records the union of the rectangles of all
+ * the nodes within it, and how it changes the clip/group nesting.
+ *
+ * A span can be skipped in its entirety when its bbox misses the
+ * scissor and it is self-contained: it never pops a clip or group
+ * that it did not push, it leaves the nesting as it found it, and
+ * every END_MASK within it belongs to a BEGIN_MASK within it. Every
+ * node in such a span would be culled by the visibility test in
+ * fz_run_display_list, leaving the clip nesting unchanged, so
+ * skipping it gives exactly the same result. Spans containing nodes
+ * that are never culled (tiles, layers, etc) are never skipped.
+ */
+typedef struct
+{
+	int start; /* Offset of the first node of the block */
+	fz_rect rect;
+	fz_matrix ctm;
+	float alpha;
+	fz_colorspace *colorspace;
+	float color[FZ_MAX_COLORS];
+	fz_stroke_state *stroke;
+	fz_path *path;
+} fz_display_block;
+
+typedef struct
+{
+	fz_rect bbox;
+	int net; /* Change in nesting depth over the span */
+	int low; /* Lowest nesting depth reached within the span */
+	int mask; /* Lowest nesting depth at an END_MASK (INT_MAX for none) */
+	int cullable; /* 0 if the span contains nodes that are never culled */
+} fz_display_span;
+
+struct fz_display_index_s
+{
+	int nblocks;
+	fz_display_block *block;
+	int nlevels;
+	fz_display_span **level;
 };
 
 struct fz_list_device_s
@@ -1270,6 +1328,282 @@ fz_list_end_layer(fz_context *ctx, fz_device *dev)
 		0); /* private_data_len */
 }
 
+static void
+fz_drop_display_index(fz_context *ctx, fz_display_index *index)
+{
+	int i;
+
+	if (!index)
+		return;
+	if (index->level)
+		for (i = 0; i < index->nlevels; i++)
+			fz_free(ctx, index->level[i]);
+	fz_free(ctx, index->level);
+	fz_free(ctx, index->block);
+	fz_free(ctx, index);
+}
+
+static void
+fz_union_display_spans(fz_display_span *out, const fz_display_span *a, const fz_display_span *b)
+{
+	out->bbox = fz_union_rect(a->bbox, b->bbox);
+	out->net = a->net + b->net;
+	out->low = fz_mini(a->low, a->net + b->low);
+	out->mask = (b->mask == INT_MAX) ? a->mask : fz_mini(a->mask, a->net + b->mask);
+	out->cullable = a->cullable && b->cullable;
+}
+
+static fz_display_index *
+fz_new_display_index(fz_context *ctx, fz_display_list *list)
+{
+	fz_display_index *index;
+	fz_display_node *node;
+	fz_display_node *node_end = list->list + list->len;
+	fz_display_block state;
+	fz_display_span *span = NULL;
+	int count, i, k, tiled;
+
+	count = 0;
+	for (node = list->list; node != node_end; node += node->size)
+		count++;
+	k = (count + INDEX_BLOCK_NODES - 1) / INDEX_BLOCK_NODES;
+	if (k < 2)
+		return NULL;
+
+	index = fz_malloc_struct(ctx, fz_display_index);
+	fz_try(ctx)
+	{
+		index->nblocks = k;
+		index->block = fz_malloc_array(ctx, k, sizeof(*index->block));
+		for (index->nlevels = 1; k > 1; k = (k + 1) / 2)
+			index->nlevels++;
+		index->level = fz_calloc(ctx, index->nlevels, sizeof(*index->level));
+		for (i = 0, k = index->nblocks; i < index->nlevels; i++, k = (k + 1) / 2)
+			index->level[i] = fz_malloc_array(ctx, k, sizeof(fz_display_span));
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_index(ctx, index);
+		fz_rethrow(ctx);
+	}
+
+	/* Walk the list, tracking the graphics state just as
+	 * fz_run_display_list does, but without taking references. */
+	memset(&state, 0, sizeof(state));
+	state.ctm = fz_identity;
+	state.alpha = 1.0f;
+	state.colorspace = fz_device_gray(ctx);
+	tiled = 0;
+	count = 0;
+	for (node = list->list; node != node_end; node += node->size)
+	{
+		fz_display_node n = *node;
+		fz_display_node *data = node + 1;
+
+		if (count % INDEX_BLOCK_NODES == 0)
+		{
+			i = count / INDEX_BLOCK_NODES;
+			index->block[i] = state;
+			index->block[i].start = node - list->list;
+			span = &index->level[0][i];
+			span->bbox = fz_empty_rect;
+			span->net = 0;
+			span->low = 0;
+			span->mask = INT_MAX;
+			span->cullable = 1;
+		}
+		count++;
+
+		if (n.rect)
+		{
+			state.rect = *(fz_rect *)data;
+			data += SIZE_IN_NODES(sizeof(fz_rect));
+		}
+		if (n.cs)
+		{
+			memset(state.color, 0, sizeof(state.color));
+			switch (n.cs)
+			{
+			default:
+			case CS_GRAY_0:
+				state.colorspace = fz_device_gray(ctx);
+				break;
+			case CS_GRAY_1:
+				state.colorspace = fz_device_gray(ctx);
+				state.color[0] = 1.0f;
+				break;
+			case CS_RGB_0:
+				state.colorspace = fz_device_rgb(ctx);
+				break;
+			case CS_RGB_1:
+				state.colorspace = fz_device_rgb(ctx);
+				state.color[0] = 1.0f;
+				state.color[1] = 1.0f;
+				state.color[2] = 1.0f;
+				break;
+			case CS_CMYK_0:
+				state.colorspace = fz_device_cmyk(ctx);
+				break;
+			case CS_CMYK_1:
+				state.colorspace = fz_device_cmyk(ctx);
+				state.color[3] = 1.0f;
+				break;
+			case CS_OTHER_0:
+				state.colorspace = *(fz_colorspace **)data;
+				data += SIZE_IN_NODES(sizeof(fz_colorspace *));
+				break;
+			}
+		}
+		if (n.color)
+		{
+			int nc = fz_colorspace_n(ctx, state.colorspace);
+			memcpy(state.color, (float *)data, nc * sizeof(float));
+			data += SIZE_IN_NODES(nc * sizeof(float));
+		}
+		if (n.alpha)
+		{
+			switch (n.alpha)
+			{
+			default:
+			case ALPHA_0:
+				state.alpha = 0.0f;
+				break;
+			case ALPHA_1:
+				state.alpha = 1.0f;
+				break;
+			case ALPHA_PRESENT:
+				state.alpha = *(float *)data;
+				data += SIZE_IN_NODES(sizeof(float));
+				break;
+			}
+		}
+		if (n.ctm != 0)
+		{
+			float *packed_ctm = (float *)data;
+			if (n.ctm & CTM_CHANGE_AD)
+			{
+				state.ctm.a = *packed_ctm++;
+				state.ctm.d = *packed_ctm++;
+				data += SIZE_IN_NODES(2*sizeof(float));
+			}
+			if (n.ctm & CTM_CHANGE_BC)
+			{
+				state.ctm.b = *packed_ctm++;
+				state.ctm.c = *packed_ctm++;
+				data += SIZE_IN_NODES(2*sizeof(float));
+			}
+			if (n.ctm & CTM_CHANGE_EF)
+			{
+				state.ctm.e = *packed_ctm++;
+				state.ctm.f = *packed_ctm;
+				data += SIZE_IN_NODES(2*sizeof(float));
+			}
+		}
+		if (n.stroke)
+		{
+			state.stroke = *(fz_stroke_state **)data;
+			data += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+		}
+		if (n.path)
+			state.path = (fz_path *)data;
+
+		span->bbox = fz_union_rect(span->bbox, state.rect);
+		switch (n.cmd)
+		{
+		case FZ_CMD_CLIP_PATH:
+		case FZ_CMD_CLIP_STROKE_PATH:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+		case FZ_CMD_BEGIN_MASK:
+		case FZ_CMD_BEGIN_GROUP:
+			span->net++;
+			break;
+		case FZ_CMD_POP_CLIP:
+		case FZ_CMD_END_GROUP:
+			span->net--;
+			if (span->low > span->net)
+				span->low = span->net;
+			break;
+		case FZ_CMD_END_MASK:
+			if (span->mask > span->net)
+				span->mask = span->net;
+			break;
+		case FZ_CMD_BEGIN_TILE:
+			tiled++;
+			span->cullable = 0;
+			break;
+		case FZ_CMD_END_TILE:
+			tiled--;
+			span->cullable = 0;
+			break;
+		case FZ_CMD_RENDER_FLAGS:
+		case FZ_CMD_DEFAULT_COLORSPACES:
+		case FZ_CMD_BEGIN_LAYER:
+		case FZ_CMD_END_LAYER:
+			span->cullable = 0;
+			break;
+		default:
+			break;
+		}
+		if (tiled)
+			span->cullable = 0;
+	}
+
+	for (i = 1, k = index->nblocks; i < index->nlevels; i++, k = (k + 1) / 2)
+	{
+		fz_display_span *lo = index->level[i-1];
+		fz_display_span *hi = index->level[i];
+		int j;
+
+		for (j = 0; j < k / 2; j++)
+			fz_union_display_spans(&hi[j], &lo[2*j], &lo[2*j+1]);
+		if (k & 1)
+			hi[j] = lo[2*j];
+	}
+
+	return index;
+}
+
+/*
+	Find how far a run of a display list can skip ahead from the
+	start of a given block. Returns the block to continue from
+	(nblocks for the end of the list), or the given block if none
+	of it can be skipped.
+*/
+static int
+fz_cull_display_blocks(fz_display_index *index, int blk, fz_matrix ctm, fz_rect scissor)
+{
+	int level = 0;
+
+	while (level + 1 < index->nlevels && (blk & ((1 << (level + 1)) - 1)) == 0)
+		level++;
+
+	for (; level >= 0; level--)
+	{
+		fz_display_span *span = &index->level[level][blk >> level];
+		if (span->cullable && span->net == 0 && span->low >= 0 && span->mask >= 1 &&
+			fz_is_empty_rect(fz_intersect_rect(fz_transform_rect(span->bbox, ctm), scissor)))
+			return fz_mini(blk + (1 << level), index->nblocks);
+	}
+
+	return blk;
+}
+
+static void
+fz_list_close_device(fz_context *ctx, fz_device *dev)
+{
+	fz_list_device *writer = (fz_list_device *)dev;
+	fz_display_list *list = writer->list;
+
+	/* The index only speeds up culling, so carry on without it if
+	 * we cannot build it. */
+	fz_try(ctx)
+		list->index = fz_new_display_index(ctx, list);
+	fz_catch(ctx)
+		fz_warn(ctx, "cannot build display list index");
+}
+
 static void
 fz_list_drop_device(fz_context *ctx, fz_device *dev)
 {
@@ -1331,8 +1665,13 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 	dev->super.begin_layer = fz_list_begin_layer;
 	dev->super.end_layer = fz_list_end_layer;
 
+	dev->super.close_device = fz_list_close_device;
 	dev->super.drop_device = fz_list_drop_device;
 
+	/* Any index is rebuilt when this device is closed. */
+	fz_drop_display_index(ctx, list->index);
+	list->index = NULL;
+
 	dev->list = list;
 	dev->path = NULL;
 	dev->alpha = 1.0f;
@@ -1440,6 +1779,7 @@ fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 		}
 		node = next;
 	}
+	fz_drop_display_index(ctx, list->index);
 	fz_free(ctx, list->list);
 	fz_free(ctx, list);
 }
@@ -1461,6 +1801,7 @@ fz_new_display_list(fz_context *ctx, fz_rect mediabox)
 	list->mediabox = mediabox;
 	list->max = 0;
 	list->len = 0;
+	list->index = NULL;
 	return list;
 }
 
@@ -1521,6 +1862,10 @@ int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list)
 	caller may abort an ongoing page run. Cookie also communicates
 	progress information back to the caller. The fields inside
 	cookie are continually updated while the page is being run.
+
+	If the list was indexed when its list device was closed, runs
+	of nodes that lie entirely outside the scissor are skipped
+	without being unpacked.
 */
 void
 fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_matrix top_ctm, fz_rect scissor, fz_cookie *cookie)
@@ -1528,6 +1873,8 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 	fz_display_node *node;
 	fz_display_node *node_end;
 	fz_display_node *next_node;
+	fz_display_index *index = list->index;
+	int blk = 0;
 	int clipped = 0;
 	int tiled = 0;
 	int progress = 0;
@@ -1562,8 +1909,44 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 	for (; node != node_end ; node = next_node)
 	{
 		int empty;
-		fz_display_node n = *node;
+		fz_display_node n;
+
+		/* Skip any runs of blocks that are entirely invisible. */
+		while (index && blk < index->nblocks && node == list->list + index->block[blk].start)
+		{
+			int to = fz_cull_display_blocks(index, blk, top_ctm, scissor);
+			fz_display_block *state;
+
+			if (to == blk)
+			{
+				blk++;
+				break;
+			}
+			blk = to;
+			if (to == index->nblocks)
+			{
+				node = node_end;
+				break;
+			}
+
+			state = &index->block[to];
+			node = list->list + state->start;
+			rect = state->rect;
+			ctm = state->ctm;
+			alpha = state->alpha;
+			memcpy(color, state->color, sizeof(color));
+			fz_drop_colorspace(ctx, colorspace);
+			colorspace = fz_keep_colorspace(ctx, state->colorspace);
+			fz_drop_stroke_state(ctx, stroke);
+			stroke = fz_keep_stroke_state(ctx, state->stroke);
+			fz_drop_path(ctx, path);
+			path = fz_keep_path(ctx, state->path);
+		}
+		progress = node - list->list;
+		if (node == node_end)
+			break;
 
+		n = *node;
 		next_node = node + n.size;
 
 		/* Check the cookie for aborting */
@@ -1862,3 +2245,1481 @@ visible:
 	if (cookie)
 		cookie->progress = progress;
 }
+
+/* Saving and loading display lists.
+ *
+ * The file holds a header, then the resources that the nodes refer
+ * to, then the nodes themselves. Every pointer within the nodes is
+ * replaced by the index of the resource it refers to (or -1 for
+ * NULL). Resources may refer to earlier resources in the same way.
+ *
+ * Packed paths that are held flat within the nodes are position
+ * independent, and are saved as they are. Paths that are packed
+ * 'open' keep their data in separate blocks; they are saved as
+ * resources in the order they appear in the nodes, and packed
+ * afresh when the file is loaded.
+ *
+ * Everything is written in the native byte order and layout, so a
+ * file can only be loaded by a build that matches the one that saved
+ * it. The header records enough to detect a mismatch.
+ */
+
+#define LIST_FILE_MAGIC "MuDL"
+#define LIST_FILE_VERSION 1
+
+enum
+{
+	LIST_RES_END,
+	LIST_RES_COLORSPACE,
+	LIST_RES_FONT,
+	LIST_RES_TEXT,
+	LIST_RES_IMAGE,
+	LIST_RES_SHADE,
+	LIST_RES_STROKE,
+	LIST_RES_DEFAULT_CS,
+	LIST_RES_PATH
+};
+
+enum
+{
+	LIST_CS_GRAY,
+	LIST_CS_RGB,
+	LIST_CS_BGR,
+	LIST_CS_CMYK,
+	LIST_CS_LAB,
+	LIST_CS_ICC,
+	LIST_CS_CAL,
+	LIST_CS_INDEXED
+};
+
+enum
+{
+	LIST_IMAGE_COMPRESSED,
+	LIST_IMAGE_PIXMAP
+};
+
+enum
+{
+	LIST_PATH_END,
+	LIST_PATH_MOVETO,
+	LIST_PATH_LINETO,
+	LIST_PATH_CURVETO,
+	LIST_PATH_CLOSEPATH,
+	LIST_PATH_QUADTO,
+	LIST_PATH_CURVETOV,
+	LIST_PATH_CURVETOY,
+	LIST_PATH_RECTTO
+};
+
+typedef struct
+{
+	fz_output *out;
+	fz_hash_table *table;
+	int count;
+} fz_list_writer;
+
+static void
+write_int(fz_context *ctx, fz_list_writer *w, int x)
+{
+	fz_write_data(ctx, w->out, &x, sizeof(x));
+}
+
+static void
+write_floats(fz_context *ctx, fz_list_writer *w, const float *f, int n)
+{
+	fz_write_data(ctx, w->out, f, n * sizeof(float));
+}
+
+static void
+write_block(fz_context *ctx, fz_list_writer *w, const void *data, size_t len)
+{
+	if (len > INT_MAX)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "display list resource too large to save");
+	write_int(ctx, w, (int)len);
+	fz_write_data(ctx, w->out, data, len);
+}
+
+static void
+write_buffer(fz_context *ctx, fz_list_writer *w, fz_buffer *buf)
+{
+	unsigned char *data;
+	size_t len = fz_buffer_storage(ctx, buf, &data);
+	write_block(ctx, w, data, len);
+}
+
+static void
+write_layout_check(fz_context *ctx, fz_list_writer *w)
+{
+	fz_shade *shade = NULL;
+
+	write_int(ctx, w, 0x01020304);
+	write_int(ctx, w, sizeof(void *));
+	write_int(ctx, w, sizeof(fz_display_node));
+	write_int(ctx, w, FZ_MAX_COLORS);
+	write_int(ctx, w, sizeof(fz_compression_params));
+	write_int(ctx, w, sizeof(fz_font_flags_t));
+	write_int(ctx, w, sizeof(fz_text_item));
+	write_int(ctx, w, sizeof(shade->u));
+}
+
+/* Returns the index of an already saved resource, or -1. */
+static int
+find_resource(fz_context *ctx, fz_list_writer *w, const void *ptr)
+{
+	void *val = fz_hash_find(ctx, w->table, &ptr);
+	return val ? (int)(intptr_t)val - 1 : -1;
+}
+
+/* Start the record for a resource, once everything it refers to has been saved. */
+static int
+begin_resource(fz_context *ctx, fz_list_writer *w, const void *ptr, int kind)
+{
+	int idx = w->count;
+	fz_hash_insert(ctx, w->table, &ptr, (void *)(intptr_t)(idx + 1));
+	w->count++;
+	write_int(ctx, w, kind);
+	return idx;
+}
+
+static int
+write_colorspace(fz_context *ctx, fz_list_writer *w, fz_colorspace *cs)
+{
+	int idx, type;
+
+	if (!cs)
+		return -1;
+	idx = find_resource(ctx, w, cs);
+	if (idx >= 0)
+		return idx;
+
+	if (cs == fz_device_gray(ctx))
+		type = LIST_CS_GRAY;
+	else if (cs == fz_device_rgb(ctx))
+		type = LIST_CS_RGB;
+	else if (cs == fz_device_bgr(ctx))
+		type = LIST_CS_BGR;
+	else if (cs == fz_device_cmyk(ctx))
+		type = LIST_CS_CMYK;
+	else if (cs == fz_device_lab(ctx))
+		type = LIST_CS_LAB;
+	else if (fz_colorspace_is_indexed(ctx, cs))
+	{
+		fz_colorspace *base = fz_colorspace_base(ctx, cs);
+		int high;
+		unsigned char *lookup = fz_indexed_colorspace_palette(ctx, cs, &high);
+		int base_idx = write_colorspace(ctx, w, base);
+
+		idx = begin_resource(ctx, w, cs, LIST_RES_COLORSPACE);
+		write_int(ctx, w, LIST_CS_INDEXED);
+		write_int(ctx, w, base_idx);
+		write_int(ctx, w, high);
+		write_block(ctx, w, lookup, (size_t)fz_colorspace_n(ctx, base) * (high + 1));
+		return idx;
+	}
+	else if (fz_colorspace_is_icc(ctx, cs))
+	{
+		fz_buffer *buf = fz_icc_data_from_icc_colorspace(ctx, cs);
+		int alt_idx = write_colorspace(ctx, w, (fz_colorspace *)fz_alternate_colorspace(ctx, cs));
+
+		if (!buf)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save colorspace without profile");
+		idx = begin_resource(ctx, w, cs, LIST_RES_COLORSPACE);
+		write_int(ctx, w, LIST_CS_ICC);
+		write_int(ctx, w, fz_colorspace_type(ctx, cs));
+		write_int(ctx, w, alt_idx);
+		write_buffer(ctx, w, buf);
+		return idx;
+	}
+	else if (fz_colorspace_is_cal(ctx, cs))
+	{
+		fz_cal_colorspace *cal = cs->data;
+		const char *name = fz_colorspace_name(ctx, cs);
+
+		idx = begin_resource(ctx, w, cs, LIST_RES_COLORSPACE);
+		write_int(ctx, w, LIST_CS_CAL);
+		write_block(ctx, w, name, strlen(name) + 1);
+		write_int(ctx, w, cal->n);
+		write_floats(ctx, w, cal->wp, 3);
+		write_floats(ctx, w, cal->bp, 3);
+		write_floats(ctx, w, cal->gamma, 3);
+		write_floats(ctx, w, cal->matrix, 9);
+		return idx;
+	}
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save colorspace '%s'", fz_colorspace_name(ctx, cs));
+
+	idx = begin_resource(ctx, w, cs, LIST_RES_COLORSPACE);
+	write_int(ctx, w, type);
+	return idx;
+}
+
+static int
+write_font(fz_context *ctx, fz_list_writer *w, fz_font *font)
+{
+	int idx;
+
+	idx = find_resource(ctx, w, font);
+	if (idx >= 0)
+		return idx;
+
+	if (font->t3procs || !font->ft_face || !font->buffer)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save font '%s'", font->name);
+
+	idx = begin_resource(ctx, w, font, LIST_RES_FONT);
+	write_block(ctx, w, font->name, sizeof(font->name));
+	write_int(ctx, w, fz_font_ft_face_index(ctx, font));
+	write_int(ctx, w, font->bbox_table != NULL);
+	fz_write_data(ctx, w->out, &font->flags, sizeof(font->flags));
+	write_floats(ctx, w, &font->bbox.x0, 4);
+	write_int(ctx, w, font->width_default);
+	write_block(ctx, w, font->width_table, font->width_table ? font->width_count * sizeof(short) : 0);
+	write_buffer(ctx, w, font->buffer);
+	return idx;
+}
+
+static int
+write_text(fz_context *ctx, fz_list_writer *w, const fz_text *text)
+{
+	fz_text_span *span;
+	int idx, n;
+
+	idx = find_resource(ctx, w, text);
+	if (idx >= 0)
+		return idx;
+
+	n = 0;
+	for (span = text->head; span; span = span->next)
+	{
+		write_font(ctx, w, span->font);
+		n++;
+	}
+
+	idx = begin_resource(ctx, w, text, LIST_RES_TEXT);
+	write_int(ctx, w, n);
+	for (span = text->head; span; span = span->next)
+	{
+		write_int(ctx, w, find_resource(ctx, w, span->font));
+		write_floats(ctx, w, &span->trm.a, 4);
+		write_int(ctx, w, span->wmode);
+		write_int(ctx, w, span->bidi_level);
+		write_int(ctx, w, span->markup_dir);
+		write_int(ctx, w, span->language);
+		write_block(ctx, w, span->items, span->len * sizeof(fz_text_item));
+	}
+	return idx;
+}
+
+static int
+write_image(fz_context *ctx, fz_list_writer *w, fz_image *image)
+{
+	fz_compressed_buffer *cbuf;
+	fz_pixmap *pix = NULL;
+	int idx, mask_idx, cs_idx, y;
+
+	if (!image)
+		return -1;
+	idx = find_resource(ctx, w, image);
+	if (idx >= 0)
+		return idx;
+
+	mask_idx = write_image(ctx, w, image->mask);
+
+	/* JBIG2 globals cannot be saved, so decode those images. */
+	cbuf = fz_compressed_image_buffer(ctx, image);
+	if (cbuf && !(cbuf->params.type == FZ_IMAGE_JBIG2 && cbuf->params.u.jbig2.globals))
+	{
+		cs_idx = write_colorspace(ctx, w, image->colorspace);
+		idx = begin_resource(ctx, w, image, LIST_RES_IMAGE);
+		write_int(ctx, w, LIST_IMAGE_COMPRESSED);
+		write_int(ctx, w, image->w);
+		write_int(ctx, w, image->h);
+		write_int(ctx, w, image->bpc);
+		write_int(ctx, w, cs_idx);
+		write_int(ctx, w, mask_idx);
+		write_int(ctx, w, image->xres);
+		write_int(ctx, w, image->yres);
+		write_int(ctx, w, image->interpolate);
+		write_int(ctx, w, image->imagemask);
+		write_int(ctx, w, image->invert_cmyk_jpeg);
+		write_int(ctx, w, image->use_decode);
+		write_floats(ctx, w, image->decode, nelem(image->decode));
+		write_int(ctx, w, image->use_colorkey);
+		fz_write_data(ctx, w->out, image->colorkey, sizeof(image->colorkey));
+		fz_write_data(ctx, w->out, &cbuf->params, sizeof(cbuf->params));
+		write_buffer(ctx, w, cbuf->buffer);
+		return idx;
+	}
+
+	fz_var(pix);
+
+	fz_try(ctx)
+	{
+		pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+		if (pix->seps)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save image with separations");
+		cs_idx = write_colorspace(ctx, w, pix->colorspace);
+		idx = begin_resource(ctx, w, image, LIST_RES_IMAGE);
+		write_int(ctx, w, LIST_IMAGE_PIXMAP);
+		write_int(ctx, w, pix->w);
+		write_int(ctx, w, pix->h);
+		write_int(ctx, w, pix->alpha);
+		write_int(ctx, w, cs_idx);
+		write_int(ctx, w, mask_idx);
+		write_int(ctx, w, pix->xres);
+		write_int(ctx, w, pix->yres);
+		write_int(ctx, w, image->interpolate);
+		write_int(ctx, w, image->imagemask);
+		for (y = 0; y < pix->h; y++)
+			fz_write_data(ctx, w->out, pix->samples + y * (size_t)pix->stride, (size_t)pix->w * pix->n);
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return idx;
+}
+
+static int
+write_shade(fz_context *ctx, fz_list_writer *w, fz_shade *shade)
+{
+	int idx, cs_idx;
+
+	idx = find_resource(ctx, w, shade);
+	if (idx >= 0)
+		return idx;
+
+	if (shade->buffer && shade->buffer->params.type == FZ_IMAGE_JBIG2)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save JBIG2 encoded shading");
+
+	cs_idx = write_colorspace(ctx, w, shade->colorspace);
+	idx = begin_resource(ctx, w, shade, LIST_RES_SHADE);
+	write_int(ctx, w, shade->type);
+	write_int(ctx, w, cs_idx);
+	write_floats(ctx, w, &shade->bbox.x0, 4);
+	write_floats(ctx, w, &shade->matrix.a, 6);
+	write_int(ctx, w, shade->use_background);
+	write_floats(ctx, w, shade->background, FZ_MAX_COLORS);
+	write_int(ctx, w, shade->use_function);
+	if (shade->use_function)
+		write_floats(ctx, w, &shade->function[0][0], 256 * (FZ_MAX_COLORS + 1));
+	fz_write_data(ctx, w->out, &shade->u, sizeof(shade->u));
+	if (shade->type == FZ_FUNCTION_BASED)
+		write_floats(ctx, w, shade->u.f.fn_vals, (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * fz_colorspace_n(ctx, shade->colorspace));
+	write_int(ctx, w, shade->buffer != NULL);
+	if (shade->buffer)
+	{
+		fz_write_data(ctx, w->out, &shade->buffer->params, sizeof(shade->buffer->params));
+		write_buffer(ctx, w, shade->buffer->buffer);
+	}
+	return idx;
+}
+
+static int
+write_stroke_state(fz_context *ctx, fz_list_writer *w, fz_stroke_state *stroke)
+{
+	int idx;
+
+	idx = find_resource(ctx, w, stroke);
+	if (idx >= 0)
+		return idx;
+
+	idx = begin_resource(ctx, w, stroke, LIST_RES_STROKE);
+	write_int(ctx, w, stroke->start_cap);
+	write_int(ctx, w, stroke->dash_cap);
+	write_int(ctx, w, stroke->end_cap);
+	write_int(ctx, w, stroke->linejoin);
+	write_floats(ctx, w, &stroke->linewidth, 1);
+	write_floats(ctx, w, &stroke->miterlimit, 1);
+	write_floats(ctx, w, &stroke->dash_phase, 1);
+	write_int(ctx, w, stroke->dash_len);
+	write_floats(ctx, w, stroke->dash_list, stroke->dash_len);
+	return idx;
+}
+
+static int
+write_default_colorspaces(fz_context *ctx, fz_list_writer *w, fz_default_colorspaces *dcs)
+{
+	int idx, gray, rgb, cmyk, oi;
+
+	idx = find_resource(ctx, w, dcs);
+	if (idx >= 0)
+		return idx;
+
+	gray = write_colorspace(ctx, w, dcs->gray);
+	rgb = write_colorspace(ctx, w, dcs->rgb);
+	cmyk = write_colorspace(ctx, w, dcs->cmyk);
+	oi = write_colorspace(ctx, w, dcs->oi);
+	idx = begin_resource(ctx, w, dcs, LIST_RES_DEFAULT_CS);
+	write_int(ctx, w, gray);
+	write_int(ctx, w, rgb);
+	write_int(ctx, w, cmyk);
+	write_int(ctx, w, oi);
+	return idx;
+}
+
+static void
+write_path_op(fz_context *ctx, fz_list_writer *w, int op, const float *f, int n)
+{
+	write_int(ctx, w, op);
+	write_floats(ctx, w, f, n);
+}
+
+static void
+write_path_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+	float f[2] = { x, y };
+	write_path_op(ctx, arg, LIST_PATH_MOVETO, f, 2);
+}
+
+static void
+write_path_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+	float f[2] = { x, y };
+	write_path_op(ctx, arg, LIST_PATH_LINETO, f, 2);
+}
+
+static void
+write_path_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	float f[6] = { x1, y1, x2, y2, x3, y3 };
+	write_path_op(ctx, arg, LIST_PATH_CURVETO, f, 6);
+}
+
+static void
+write_path_closepath(fz_context *ctx, void *arg)
+{
+	write_path_op(ctx, arg, LIST_PATH_CLOSEPATH, NULL, 0);
+}
+
+static void
+write_path_quadto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	float f[4] = { x1, y1, x2, y2 };
+	write_path_op(ctx, arg, LIST_PATH_QUADTO, f, 4);
+}
+
+static void
+write_path_curvetov(fz_context *ctx, void *arg, float x2, float y2, float x3, float y3)
+{
+	float f[4] = { x2, y2, x3, y3 };
+	write_path_op(ctx, arg, LIST_PATH_CURVETOV, f, 4);
+}
+
+static void
+write_path_curvetoy(fz_context *ctx, void *arg, float x1, float y1, float x3, float y3)
+{
+	float f[4] = { x1, y1, x3, y3 };
+	write_path_op(ctx, arg, LIST_PATH_CURVETOY, f, 4);
+}
+
+static void
+write_path_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	float f[4] = { x1, y1, x2, y2 };
+	write_path_op(ctx, arg, LIST_PATH_RECTTO, f, 4);
+}
+
+static const fz_path_walker write_path_walker =
+{
+	write_path_moveto,
+	write_path_lineto,
+	write_path_curveto,
+	write_path_closepath,
+	write_path_quadto,
+	write_path_curvetov,
+	write_path_curvetoy,
+	write_path_rectto
+};
+
+static void
+write_open_path(fz_context *ctx, fz_list_writer *w, const fz_path *path)
+{
+	/* Open paths are never shared between nodes, so need no entry in the table. */
+	w->count++;
+	write_int(ctx, w, LIST_RES_PATH);
+	fz_walk_path(ctx, path, &write_path_walker, w);
+	write_int(ctx, w, LIST_PATH_END);
+}
+
+/* Write each resource used by the nodes, or (if patch) replace the pointers with resource indexes. */
+static void
+write_node_resources(fz_context *ctx, fz_list_writer *w, fz_display_node *node, fz_display_node *node_end, int patch)
+{
+	fz_colorspace *cs = fz_device_gray(ctx);
+
+	while (node != node_end)
+	{
+		fz_display_node n = *node;
+		fz_display_node *next = node + n.size;
+		void **slot;
+		int idx;
+
+		node++;
+		if (n.rect)
+			node += SIZE_IN_NODES(sizeof(fz_rect));
+		switch (n.cs)
+		{
+		default:
+		case CS_UNCHANGED:
+			break;
+		case CS_GRAY_0:
+		case CS_GRAY_1:
+			cs = fz_device_gray(ctx);
+			break;
+		case CS_RGB_0:
+		case CS_RGB_1:
+			cs = fz_device_rgb(ctx);
+			break;
+		case CS_CMYK_0:
+		case CS_CMYK_1:
+			cs = fz_device_cmyk(ctx);
+			break;
+		case CS_OTHER_0:
+			slot = (void **)node;
+			cs = *(fz_colorspace **)slot;
+			idx = write_colorspace(ctx, w, cs);
+			if (patch)
+				*slot = (void *)(intptr_t)idx;
+			node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+			break;
+		}
+		if (n.color)
+			node += SIZE_IN_NODES(fz_colorspace_n(ctx, cs) * sizeof(float));
+		if (n.alpha == ALPHA_PRESENT)
+			node += SIZE_IN_NODES(sizeof(float));
+		if (n.ctm & CTM_CHANGE_AD)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.ctm & CTM_CHANGE_BC)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.ctm & CTM_CHANGE_EF)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.stroke)
+		{
+			slot = (void **)node;
+			idx = write_stroke_state(ctx, w, *(fz_stroke_state **)slot);
+			if (patch)
+				*slot = (void *)(intptr_t)idx;
+			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+		}
+		if (n.path)
+		{
+			/* The contents of an open path are replaced on loading. */
+			if (!patch && fz_packed_path_is_open((fz_path *)node))
+				write_open_path(ctx, w, (fz_path *)node);
+			node += SIZE_IN_NODES(fz_packed_path_size((fz_path *)node));
+		}
+		slot = (void **)node;
+		idx = -2;
+		switch (n.cmd)
+		{
+		case FZ_CMD_FILL_TEXT:
+		case FZ_CMD_STROKE_TEXT:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_IGNORE_TEXT:
+			idx = write_text(ctx, w, *(fz_text **)slot);
+			break;
+		case FZ_CMD_FILL_SHADE:
+			idx = write_shade(ctx, w, *(fz_shade **)slot);
+			break;
+		case FZ_CMD_FILL_IMAGE:
+		case FZ_CMD_FILL_IMAGE_MASK:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+			idx = write_image(ctx, w, *(fz_image **)slot);
+			break;
+		case FZ_CMD_BEGIN_GROUP:
+			idx = write_colorspace(ctx, w, *(fz_colorspace **)slot);
+			break;
+		case FZ_CMD_DEFAULT_COLORSPACES:
+			idx = write_default_colorspaces(ctx, w, *(fz_default_colorspaces **)slot);
+			break;
+		}
+		if (patch && idx != -2)
+			*slot = (void *)(intptr_t)idx;
+		node = next;
+	}
+}
+
+/*
+	Write a display list to an output stream in a form that
+	can later be read back with fz_new_display_list_from_buffer.
+
+	Throws if the list refers to something that cannot be saved
+	(such as a Type3 font, or a separation colorspace).
+*/
+void
+fz_write_display_list(fz_context *ctx, fz_output *out, fz_display_list *list)
+{
+	fz_list_writer w = { 0 };
+	fz_display_node *copy = NULL;
+
+	fz_var(copy);
+
+	w.out = out;
+	w.table = fz_new_hash_table(ctx, 256, sizeof(void *), -1, NULL);
+	fz_try(ctx)
+	{
+		fz_write_data(ctx, out, LIST_FILE_MAGIC, 4);
+		write_int(ctx, &w, LIST_FILE_VERSION);
+		write_layout_check(ctx, &w);
+		write_floats(ctx, &w, &list->mediabox.x0, 4);
+
+		write_node_resources(ctx, &w, list->list, list->list + list->len, 0);
+		write_int(ctx, &w, LIST_RES_END);
+
+		copy = fz_malloc_array(ctx, list->len, sizeof(fz_display_node));
+		memcpy(copy, list->list, list->len * sizeof(fz_display_node));
+		write_node_resources(ctx, &w, copy, copy + list->len, 1);
+		write_int(ctx, &w, list->len);
+		fz_write_data(ctx, out, copy, list->len * sizeof(fz_display_node));
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, copy);
+		fz_drop_hash_table(ctx, w.table);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+	Save a display list to a file, to be loaded again with
+	fz_load_display_list.
+*/
+void
+fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_output *out = fz_new_output_with_path(ctx, filename, 0);
+	fz_try(ctx)
+	{
+		fz_write_display_list(ctx, out, list);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+typedef struct
+{
+	int kind;
+	void *obj;
+} fz_list_resource;
+
+typedef struct
+{
+	const unsigned char *p, *end;
+	int count, max;
+	fz_list_resource *res;
+	int next_path;
+} fz_list_reader;
+
+static const void *
+read_data(fz_context *ctx, fz_list_reader *r, size_t len)
+{
+	const void *data = r->p;
+	if (len > (size_t)(r->end - r->p))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list file");
+	r->p += len;
+	return data;
+}
+
+static int
+read_int(fz_context *ctx, fz_list_reader *r)
+{
+	int x;
+	memcpy(&x, read_data(ctx, r, sizeof(x)), sizeof(x));
+	return x;
+}
+
+static void
+read_floats(fz_context *ctx, fz_list_reader *r, float *f, int n)
+{
+	if (n < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+	memcpy(f, read_data(ctx, r, n * sizeof(float)), n * sizeof(float));
+}
+
+static const unsigned char *
+read_block(fz_context *ctx, fz_list_reader *r, int *len)
+{
+	*len = read_int(ctx, r);
+	if (*len < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+	return read_data(ctx, r, *len);
+}
+
+static void *
+get_resource(fz_context *ctx, fz_list_reader *r, intptr_t idx, int kind)
+{
+	if (idx == -1)
+		return NULL;
+	if (idx < 0 || idx >= r->count || r->res[idx].kind != kind)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+	return r->res[idx].obj;
+}
+
+static void
+drop_resource(fz_context *ctx, fz_list_resource *res)
+{
+	switch (res->kind)
+	{
+	case LIST_RES_COLORSPACE: fz_drop_colorspace(ctx, res->obj); break;
+	case LIST_RES_FONT: fz_drop_font(ctx, res->obj); break;
+	case LIST_RES_TEXT: fz_drop_text(ctx, res->obj); break;
+	case LIST_RES_IMAGE: fz_drop_image(ctx, res->obj); break;
+	case LIST_RES_SHADE: fz_drop_shade(ctx, res->obj); break;
+	case LIST_RES_STROKE: fz_drop_stroke_state(ctx, res->obj); break;
+	case LIST_RES_DEFAULT_CS: fz_drop_default_colorspaces(ctx, res->obj); break;
+	case LIST_RES_PATH: fz_drop_path(ctx, res->obj); break;
+	}
+}
+
+static void *
+read_colorspace(fz_context *ctx, fz_list_reader *r)
+{
+	int type = read_int(ctx, r);
+	const unsigned char *data;
+	fz_colorspace *cs = NULL;
+	fz_buffer *buf;
+	int len;
+
+	switch (type)
+	{
+	case LIST_CS_GRAY: return fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	case LIST_CS_RGB: return fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+	case LIST_CS_BGR: return fz_keep_colorspace(ctx, fz_device_bgr(ctx));
+	case LIST_CS_CMYK: return fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
+	case LIST_CS_LAB: return fz_keep_colorspace(ctx, fz_device_lab(ctx));
+	case LIST_CS_INDEXED:
+	{
+		fz_colorspace *base = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+		int high = read_int(ctx, r);
+		unsigned char *lookup;
+
+		data = read_block(ctx, r, &len);
+		if (!base || high < 0 || high > 255 || len != fz_colorspace_n(ctx, base) * (high + 1))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+		lookup = fz_malloc(ctx, len);
+		memcpy(lookup, data, len);
+		fz_try(ctx)
+			cs = fz_new_indexed_colorspace(ctx, base, high, lookup);
+		fz_catch(ctx)
+		{
+			fz_free(ctx, lookup);
+			fz_rethrow(ctx);
+		}
+		return cs;
+	}
+	case LIST_CS_ICC:
+	{
+		int cstype = read_int(ctx, r);
+		fz_colorspace *alt = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+
+		data = read_block(ctx, r, &len);
+		buf = fz_new_buffer_from_copied_data(ctx, data, len);
+		fz_try(ctx)
+			cs = fz_new_icc_colorspace(ctx, cstype, buf, alt);
+		fz_always(ctx)
+			fz_drop_buffer(ctx, buf);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+		return cs;
+	}
+	case LIST_CS_CAL:
+	{
+		float wp[3], bp[3], gamma[3], matrix[9];
+		const char *name;
+		int n;
+
+		name = (const char *)read_block(ctx, r, &len);
+		if (len == 0 || name[len - 1] != 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+		n = read_int(ctx, r);
+		read_floats(ctx, r, wp, 3);
+		read_floats(ctx, r, bp, 3);
+		read_floats(ctx, r, gamma, 3);
+		read_floats(ctx, r, matrix, 9);
+		return fz_new_cal_colorspace(ctx, name, wp, bp, gamma, n == 3 ? matrix : NULL);
+	}
+	}
+	fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+	return NULL;
+}
+
+static void *
+read_font(fz_context *ctx, fz_list_reader *r)
+{
+	char name[32];
+	const unsigned char *data;
+	fz_font_flags_t flags;
+	fz_rect bbox;
+	fz_buffer *buf;
+	fz_font *font;
+	int index, use_glyph_bbox, width_default, len;
+	const short *widths;
+	int width_len;
+
+	data = read_block(ctx, r, &len);
+	if (len != sizeof(name))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+	memcpy(name, data, sizeof(name));
+	name[sizeof(name) - 1] = 0;
+	index = read_int(ctx, r);
+	use_glyph_bbox = read_int(ctx, r);
+	memcpy(&flags, read_data(ctx, r, sizeof(flags)), sizeof(flags));
+	read_floats(ctx, r, &bbox.x0, 4);
+	width_default = read_int(ctx, r);
+	widths = (const short *)read_block(ctx, r, &width_len);
+	data = read_block(ctx, r, &len);
+
+	buf = fz_new_buffer_from_copied_data(ctx, data, len);
+	fz_try(ctx)
+		font = fz_new_font_from_buffer(ctx, name, buf, index, use_glyph_bbox);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	font->flags = flags;
+	font->bbox = bbox;
+	font->width_default = width_default;
+	if (width_len > 0)
+	{
+		fz_try(ctx)
+			font->width_table = fz_malloc(ctx, width_len);
+		fz_catch(ctx)
+		{
+			fz_drop_font(ctx, font);
+			fz_rethrow(ctx);
+		}
+		memcpy(font->width_table, widths, width_len);
+		font->width_count = width_len / sizeof(short);
+	}
+	return font;
+}
+
+static void *
+read_text(fz_context *ctx, fz_list_reader *r)
+{
+	fz_text *text;
+	int i, k, n, len;
+
+	n = read_int(ctx, r);
+	text = fz_new_text(ctx);
+	fz_try(ctx)
+	{
+		for (i = 0; i < n; i++)
+		{
+			fz_font *font = get_resource(ctx, r, read_int(ctx, r), LIST_RES_FONT);
+			fz_matrix trm;
+			int wmode, bidi_level, markup_dir, language;
+			const unsigned char *items;
+			fz_text_item item;
+
+			read_floats(ctx, r, &trm.a, 4);
+			wmode = read_int(ctx, r);
+			bidi_level = read_int(ctx, r);
+			markup_dir = read_int(ctx, r);
+			language = read_int(ctx, r);
+			items = read_block(ctx, r, &len);
+			if (!font || len % sizeof(fz_text_item))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			for (k = 0; k < len; k += sizeof(fz_text_item))
+			{
+				memcpy(&item, items + k, sizeof(item));
+				trm.e = item.x;
+				trm.f = item.y;
+				fz_show_glyph(ctx, text, font, trm, item.gid, item.ucs, wmode, bidi_level, markup_dir, language);
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+static void *
+read_image(fz_context *ctx, fz_list_reader *r)
+{
+	fz_image *image = NULL;
+	fz_colorspace *cs;
+	fz_image *mask;
+	int type, w, h, xres, yres, interpolate, imagemask, len;
+	const unsigned char *data;
+
+	type = read_int(ctx, r);
+	w = read_int(ctx, r);
+	h = read_int(ctx, r);
+	if (type == LIST_IMAGE_COMPRESSED)
+	{
+		fz_compressed_buffer *cbuf;
+		float decode[FZ_MAX_COLORS * 2];
+		int colorkey[FZ_MAX_COLORS * 2];
+		int bpc, invert_cmyk_jpeg, use_decode, use_colorkey;
+
+		bpc = read_int(ctx, r);
+		cs = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+		mask = get_resource(ctx, r, read_int(ctx, r), LIST_RES_IMAGE);
+		xres = read_int(ctx, r);
+		yres = read_int(ctx, r);
+		interpolate = read_int(ctx, r);
+		imagemask = read_int(ctx, r);
+		invert_cmyk_jpeg = read_int(ctx, r);
+		use_decode = read_int(ctx, r);
+		read_floats(ctx, r, decode, nelem(decode));
+		use_colorkey = read_int(ctx, r);
+		memcpy(colorkey, read_data(ctx, r, sizeof(colorkey)), sizeof(colorkey));
+
+		cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+		memcpy(&cbuf->params, read_data(ctx, r, sizeof(cbuf->params)), sizeof(cbuf->params));
+		if (cbuf->params.type == FZ_IMAGE_JBIG2)
+			cbuf->params.u.jbig2.globals = NULL;
+		fz_try(ctx)
+		{
+			data = read_block(ctx, r, &len);
+			cbuf->buffer = fz_new_buffer_from_copied_data(ctx, data, len);
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_compressed_buffer(ctx, cbuf);
+			fz_rethrow(ctx);
+		}
+
+		/* The decode array is restored afterwards, as it has
+		 * already been adjusted for the colorspace. */
+		image = fz_new_image_from_compressed_buffer(ctx, w, h, bpc, cs, xres, yres, interpolate, imagemask, NULL, use_colorkey ? colorkey : NULL, cbuf, mask);
+		image->invert_cmyk_jpeg = invert_cmyk_jpeg;
+		image->use_decode = use_decode;
+		memcpy(image->decode, decode, sizeof(decode));
+	}
+	else if (type == LIST_IMAGE_PIXMAP)
+	{
+		fz_pixmap *pix;
+		int alpha, y;
+
+		alpha = read_int(ctx, r);
+		cs = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+		mask = get_resource(ctx, r, read_int(ctx, r), LIST_RES_IMAGE);
+		xres = read_int(ctx, r);
+		yres = read_int(ctx, r);
+		interpolate = read_int(ctx, r);
+		imagemask = read_int(ctx, r);
+
+		pix = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+		fz_try(ctx)
+		{
+			data = read_data(ctx, r, (size_t)pix->w * pix->n * pix->h);
+			for (y = 0; y < pix->h; y++)
+				memcpy(pix->samples + y * (size_t)pix->stride, data + y * (size_t)pix->w * pix->n, (size_t)pix->w * pix->n);
+			fz_set_pixmap_resolution(ctx, pix, xres, yres);
+			image = fz_new_image_from_pixmap(ctx, pix, mask);
+		}
+		fz_always(ctx)
+			fz_drop_pixmap(ctx, pix);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+		image->interpolate = interpolate;
+		image->imagemask = imagemask;
+	}
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+
+	return image;
+}
+
+static void *
+read_shade(fz_context *ctx, fz_list_reader *r)
+{
+	fz_shade *shade;
+	const unsigned char *data;
+	int len;
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	fz_try(ctx)
+	{
+		/* Read the type first, so a partial shade can be dropped. */
+		shade->type = read_int(ctx, r);
+		shade->colorspace = fz_keep_colorspace(ctx, get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE));
+		read_floats(ctx, r, &shade->bbox.x0, 4);
+		read_floats(ctx, r, &shade->matrix.a, 6);
+		shade->use_background = read_int(ctx, r);
+		read_floats(ctx, r, shade->background, FZ_MAX_COLORS);
+		shade->use_function = read_int(ctx, r);
+		if (shade->use_function)
+			read_floats(ctx, r, &shade->function[0][0], 256 * (FZ_MAX_COLORS + 1));
+		memcpy(&shade->u, read_data(ctx, r, sizeof(shade->u)), sizeof(shade->u));
+		if (shade->type == FZ_FUNCTION_BASED)
+		{
+			int n = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * fz_colorspace_n(ctx, shade->colorspace);
+			shade->u.f.fn_vals = NULL;
+			if (shade->u.f.xdivs < 0 || shade->u.f.ydivs < 0 || shade->u.f.xdivs > 256 || shade->u.f.ydivs > 256)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			shade->u.f.fn_vals = fz_malloc_array(ctx, n, sizeof(float));
+			read_floats(ctx, r, shade->u.f.fn_vals, n);
+		}
+		if (read_int(ctx, r))
+		{
+			shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+			memcpy(&shade->buffer->params, read_data(ctx, r, sizeof(shade->buffer->params)), sizeof(shade->buffer->params));
+			if (shade->buffer->params.type == FZ_IMAGE_JBIG2)
+				shade->buffer->params.u.jbig2.globals = NULL;
+			data = read_block(ctx, r, &len);
+			shade->buffer->buffer = fz_new_buffer_from_copied_data(ctx, data, len);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+	return shade;
+}
+
+static void *
+read_stroke_state(fz_context *ctx, fz_list_reader *r)
+{
+	fz_stroke_state stroke, *out;
+
+	stroke.start_cap = read_int(ctx, r);
+	stroke.dash_cap = read_int(ctx, r);
+	stroke.end_cap = read_int(ctx, r);
+	stroke.linejoin = read_int(ctx, r);
+	read_floats(ctx, r, &stroke.linewidth, 1);
+	read_floats(ctx, r, &stroke.miterlimit, 1);
+	read_floats(ctx, r, &stroke.dash_phase, 1);
+	stroke.dash_len = read_int(ctx, r);
+	if (stroke.dash_len < 0 || stroke.dash_len > (r->end - r->p) / (int)sizeof(float))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+
+	out = fz_new_stroke_state_with_dash_len(ctx, stroke.dash_len);
+	out->start_cap = stroke.start_cap;
+	out->dash_cap = stroke.dash_cap;
+	out->end_cap = stroke.end_cap;
+	out->linejoin = stroke.linejoin;
+	out->linewidth = stroke.linewidth;
+	out->miterlimit = stroke.miterlimit;
+	out->dash_phase = stroke.dash_phase;
+	out->dash_len = stroke.dash_len;
+	read_floats(ctx, r, out->dash_list, stroke.dash_len);
+	return out;
+}
+
+static void *
+read_default_colorspaces(fz_context *ctx, fz_list_reader *r)
+{
+	fz_colorspace *gray = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+	fz_colorspace *rgb = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+	fz_colorspace *cmyk = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+	fz_colorspace *oi = get_resource(ctx, r, read_int(ctx, r), LIST_RES_COLORSPACE);
+	fz_default_colorspaces *dcs = fz_new_default_colorspaces(ctx);
+
+	if (gray)
+		fz_set_default_gray(ctx, dcs, gray);
+	if (rgb)
+		fz_set_default_rgb(ctx, dcs, rgb);
+	if (cmyk)
+		fz_set_default_cmyk(ctx, dcs, cmyk);
+	if (oi)
+		fz_set_default_output_intent(ctx, dcs, oi);
+	return dcs;
+}
+
+static void *
+read_path(fz_context *ctx, fz_list_reader *r)
+{
+	fz_path *path = fz_new_path(ctx);
+	float f[6];
+	int op;
+
+	fz_try(ctx)
+	{
+		while ((op = read_int(ctx, r)) != LIST_PATH_END)
+		{
+			switch (op)
+			{
+			case LIST_PATH_MOVETO:
+				read_floats(ctx, r, f, 2);
+				fz_moveto(ctx, path, f[0], f[1]);
+				break;
+			case LIST_PATH_LINETO:
+				read_floats(ctx, r, f, 2);
+				fz_lineto(ctx, path, f[0], f[1]);
+				break;
+			case LIST_PATH_CURVETO:
+				read_floats(ctx, r, f, 6);
+				fz_curveto(ctx, path, f[0], f[1], f[2], f[3], f[4], f[5]);
+				break;
+			case LIST_PATH_CLOSEPATH:
+				fz_closepath(ctx, path);
+				break;
+			case LIST_PATH_QUADTO:
+				read_floats(ctx, r, f, 4);
+				fz_quadto(ctx, path, f[0], f[1], f[2], f[3]);
+				break;
+			case LIST_PATH_CURVETOV:
+				read_floats(ctx, r, f, 4);
+				fz_curvetov(ctx, path, f[0], f[1], f[2], f[3]);
+				break;
+			case LIST_PATH_CURVETOY:
+				read_floats(ctx, r, f, 4);
+				fz_curvetoy(ctx, path, f[0], f[1], f[2], f[3]);
+				break;
+			case LIST_PATH_RECTTO:
+				read_floats(ctx, r, f, 4);
+				fz_rectto(ctx, path, f[0], f[1], f[2], f[3]);
+				break;
+			default:
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_rethrow(ctx);
+	}
+	return path;
+}
+
+static void
+read_resources(fz_context *ctx, fz_list_reader *r)
+{
+	int kind;
+
+	while ((kind = read_int(ctx, r)) != LIST_RES_END)
+	{
+		void *obj;
+
+		switch (kind)
+		{
+		case LIST_RES_COLORSPACE: obj = read_colorspace(ctx, r); break;
+		case LIST_RES_FONT: obj = read_font(ctx, r); break;
+		case LIST_RES_TEXT: obj = read_text(ctx, r); break;
+		case LIST_RES_IMAGE: obj = read_image(ctx, r); break;
+		case LIST_RES_SHADE: obj = read_shade(ctx, r); break;
+		case LIST_RES_STROKE: obj = read_stroke_state(ctx, r); break;
+		case LIST_RES_DEFAULT_CS: obj = read_default_colorspaces(ctx, r); break;
+		case LIST_RES_PATH: obj = read_path(ctx, r); break;
+		default: fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+		}
+
+		if (r->count == r->max)
+		{
+			int newmax = r->max ? r->max * 2 : 64;
+			fz_try(ctx)
+				r->res = fz_resize_array(ctx, r->res, newmax, sizeof(*r->res));
+			fz_catch(ctx)
+			{
+				fz_list_resource res;
+				res.kind = kind;
+				res.obj = obj;
+				drop_resource(ctx, &res);
+				fz_rethrow(ctx);
+			}
+			r->max = newmax;
+		}
+		r->res[r->count].kind = kind;
+		r->res[r->count].obj = obj;
+		r->count++;
+	}
+}
+
+/* Check that a slot lies within its node, and return the resource index it holds. */
+static intptr_t
+read_slot(fz_context *ctx, fz_display_node *slot, fz_display_node *next)
+{
+	intptr_t idx;
+	if (slot + SIZE_IN_NODES(sizeof(void *)) > next)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+	memcpy(&idx, slot, sizeof(idx));
+	return idx;
+}
+
+/*
+	Turn the resource indexes in a loaded node array back into
+	pointers. With patch == 0 this only checks the nodes, without
+	changing anything. With patch set, nothing is checked, and the
+	only failure is in packing paths; list->len is advanced past
+	each node as it is finished, so that the list can always be
+	dropped safely.
+*/
+static void
+read_node_resources(fz_context *ctx, fz_list_reader *r, fz_display_list *list, int len, int patch)
+{
+	fz_display_node *node = list->list;
+	fz_display_node *node_end = list->list + len;
+	fz_colorspace *cs = fz_device_gray(ctx);
+	int next_path = 0;
+
+	while (node != node_end)
+	{
+		fz_display_node n = *node;
+		fz_display_node *next = node + n.size;
+		fz_display_node *cs_slot = NULL, *stroke_slot = NULL, *path_slot = NULL, *slot;
+		int path_size = 0;
+		int kind = -1;
+
+		if (n.size == 0 || n.size > node_end - node)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+
+		node++;
+		if (n.rect)
+			node += SIZE_IN_NODES(sizeof(fz_rect));
+		switch (n.cs)
+		{
+		default:
+		case CS_UNCHANGED:
+			break;
+		case CS_GRAY_0:
+		case CS_GRAY_1:
+			cs = fz_device_gray(ctx);
+			break;
+		case CS_RGB_0:
+		case CS_RGB_1:
+			cs = fz_device_rgb(ctx);
+			break;
+		case CS_CMYK_0:
+		case CS_CMYK_1:
+			cs = fz_device_cmyk(ctx);
+			break;
+		case CS_OTHER_0:
+			cs_slot = node;
+			if (!patch)
+				cs = get_resource(ctx, r, read_slot(ctx, node, next), LIST_RES_COLORSPACE);
+			else
+				cs = r->res[read_slot(ctx, node, next)].obj;
+			if (!cs)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+			break;
+		}
+		if (n.color)
+			node += SIZE_IN_NODES(fz_colorspace_n(ctx, cs) * sizeof(float));
+		if (n.alpha == ALPHA_PRESENT)
+			node += SIZE_IN_NODES(sizeof(float));
+		if (n.ctm & CTM_CHANGE_AD)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.ctm & CTM_CHANGE_BC)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.ctm & CTM_CHANGE_EF)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.stroke)
+		{
+			stroke_slot = node;
+			if (!patch && !get_resource(ctx, r, read_slot(ctx, node, next), LIST_RES_STROKE))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+		}
+		if (n.path)
+		{
+			path_slot = node;
+			if (node >= next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			path_size = fz_packed_path_size((fz_path *)node);
+			node += SIZE_IN_NODES(path_size);
+			if (node > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+		}
+		slot = node;
+
+		switch (n.cmd)
+		{
+		case FZ_CMD_FILL_TEXT:
+		case FZ_CMD_STROKE_TEXT:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_IGNORE_TEXT:
+			kind = LIST_RES_TEXT;
+			break;
+		case FZ_CMD_FILL_SHADE:
+			kind = LIST_RES_SHADE;
+			break;
+		case FZ_CMD_FILL_IMAGE:
+		case FZ_CMD_FILL_IMAGE_MASK:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+			kind = LIST_RES_IMAGE;
+			break;
+		case FZ_CMD_BEGIN_GROUP:
+			kind = LIST_RES_COLORSPACE;
+			break;
+		case FZ_CMD_DEFAULT_COLORSPACES:
+			kind = LIST_RES_DEFAULT_CS;
+			break;
+		}
+
+		if (!patch)
+		{
+			if (path_slot && fz_packed_path_is_open((fz_path *)path_slot))
+			{
+				while (next_path < r->count && r->res[next_path].kind != LIST_RES_PATH)
+					next_path++;
+				if (next_path == r->count)
+					fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+				next_path++;
+			}
+			if (kind >= 0)
+			{
+				void *obj = get_resource(ctx, r, read_slot(ctx, slot, next), kind);
+				if (!obj && kind != LIST_RES_COLORSPACE)
+					fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+			}
+		}
+		else
+		{
+			intptr_t idx;
+
+			/* Repack the path first; it is the only step that can fail. */
+			if (path_slot && fz_packed_path_is_open((fz_path *)path_slot))
+			{
+				while (r->res[next_path].kind != LIST_RES_PATH)
+					next_path++;
+				fz_pack_path(ctx, (uint8_t *)path_slot, path_size, r->res[next_path].obj);
+				if (!fz_packed_path_is_open((fz_path *)path_slot))
+					fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+				next_path++;
+			}
+			if (cs_slot)
+				*(fz_colorspace **)cs_slot = fz_keep_colorspace(ctx, cs);
+			if (stroke_slot)
+			{
+				memcpy(&idx, stroke_slot, sizeof(idx));
+				*(fz_stroke_state **)stroke_slot = fz_keep_stroke_state(ctx, r->res[idx].obj);
+			}
+			if (kind >= 0)
+			{
+				void *obj;
+				memcpy(&idx, slot, sizeof(idx));
+				obj = idx < 0 ? NULL : r->res[idx].obj;
+				switch (kind)
+				{
+				case LIST_RES_TEXT: obj = fz_keep_text(ctx, obj); break;
+				case LIST_RES_SHADE: obj = fz_keep_shade(ctx, obj); break;
+				case LIST_RES_IMAGE: obj = fz_keep_image(ctx, obj); break;
+				case LIST_RES_COLORSPACE: obj = fz_keep_colorspace(ctx, obj); break;
+				case LIST_RES_DEFAULT_CS: obj = fz_keep_default_colorspaces(ctx, obj); break;
+				}
+				*(void **)slot = obj;
+			}
+			list->len = next - list->list;
+		}
+
+		node = next;
+	}
+}
+
+/*
+	Create a display list from the contents of a buffer written
+	by fz_write_display_list (or fz_save_display_list).
+
+	Throws if the data is corrupt, or was written by a different
+	version or build of the library.
+*/
+fz_display_list *
+fz_new_display_list_from_buffer(fz_context *ctx, fz_buffer *buf)
+{
+	fz_list_reader r = { 0 };
+	fz_display_list *list = NULL;
+	unsigned char *data;
+	size_t size;
+	fz_rect mediabox;
+	int i, len;
+
+	fz_var(list);
+
+	size = fz_buffer_storage(ctx, buf, &data);
+	r.p = data;
+	r.end = data + size;
+
+	fz_try(ctx)
+	{
+		fz_list_writer check = { 0 };
+		fz_buffer *expect = fz_new_buffer(ctx, 64);
+
+		/* Compare the layout information with what we would write. */
+		fz_try(ctx)
+		{
+			check.out = fz_new_output_with_buffer(ctx, expect);
+			fz_try(ctx)
+			{
+				write_int(ctx, &check, LIST_FILE_VERSION);
+				write_layout_check(ctx, &check);
+				fz_close_output(ctx, check.out);
+			}
+			fz_always(ctx)
+				fz_drop_output(ctx, check.out);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+
+			if (memcmp(read_data(ctx, &r, 4), LIST_FILE_MAGIC, 4))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "not a display list file");
+			len = (int)fz_buffer_storage(ctx, expect, &data);
+			if (memcmp(read_data(ctx, &r, len), data, len))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "display list file is from a different version");
+		}
+		fz_always(ctx)
+			fz_drop_buffer(ctx, expect);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+
+		read_floats(ctx, &r, &mediabox.x0, 4);
+		read_resources(ctx, &r);
+
+		len = read_int(ctx, &r);
+		if (len < 0 || (size_t)len > (size_t)(r.end - r.p) / sizeof(fz_display_node))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+
+		list = fz_new_display_list(ctx, mediabox);
+		list->list = fz_malloc_array(ctx, len > 0 ? len : 1, sizeof(fz_display_node));
+		memcpy(list->list, read_data(ctx, &r, len * sizeof(fz_display_node)), len * sizeof(fz_display_node));
+		list->max = len;
+
+		/* Check everything before changing anything, so that a
+		 * failure leaves nothing for the list to drop. */
+		read_node_resources(ctx, &r, list, len, 0);
+		read_node_resources(ctx, &r, list, len, 1);
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < r.count; i++)
+			drop_resource(ctx, &r.res[i]);
+		fz_free(ctx, r.res);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	fz_try(ctx)
+		list->index = fz_new_display_index(ctx, list);
+	fz_catch(ctx)
+		fz_warn(ctx, "cannot build display list index");
+
+	return list;
+}
+
+/*
+	Load a display list saved with fz_save_display_list.
+*/
+fz_display_list *
+fz_load_display_list(fz_context *ctx, const char *filename)
+{
+	fz_buffer *buf = fz_read_file(ctx, filename);
+	fz_display_list *list = NULL;
+
+	fz_try(ctx)
+		list = fz_new_display_list_from_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return list;
+}
@@ -0,0 +1,257 @@
+/*
+	This file is #included by draw-simd.c once for each vector
+	instruction set, to produce the vector span painters.
+
+	Before including it, define:
+
+	SIMD_NAME(x)	the name of the function x for this instruction set
+	SIMD_TARGET	any attribute needed to compile for it
+	SIMD_LANES	the number of 16 byte lanes in a V
+	V, W		types for 16 (or 32) bytes, and for as many 16 bit words
+	and the V_ and W_ operations used below.
+
+	Each lane holds a whole number of pixels (step of them), laid
+	out as described by an fz_simd_layout; the bytes after the last
+	whole pixel in a lane are the 'tail', and are stored back
+	unchanged. The arithmetic is done in 16 bits, exactly as in the
+	scalar code, so the results are identical.
+*/
+
+/* Blend source over destination */
+static SIMD_TARGET void
+SIMD_NAME(paint_span)(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	const fz_simd_layout *L = &span_layouts[SIMD_LAYOUT(n)][da][sa];
+	int dstep = L->k * (n + da);
+	int sstep = L->k * (n + sa);
+	int need = simd_need(L, n + da, n + sa, 0, SIMD_LANES);
+	V shuf_s = V_TABLE(L->shuf_s);
+	V shuf_a = V_TABLE(L->shuf_a);
+	V or_s = V_TABLE(L->or_s);
+	V tail = V_TABLE(L->tail);
+	W w256 = W_SET(256);
+
+	while (w >= need)
+	{
+		V d = V_LOAD(dp, dstep);
+		V s = V_LOAD(sp, sstep);
+		V S = V_OR(V_SHUF(s, shuf_s), or_s);
+		V r;
+
+		if (sa)
+		{
+			V a = V_SHUF(s, shuf_a);
+			W alo = V_LO(a);
+			W ahi = V_HI(a);
+			W tlo = W_SUB(w256, W_ADD(alo, W_SHR(alo, 7)));
+			W thi = W_SUB(w256, W_ADD(ahi, W_SHR(ahi, 7)));
+			W rlo = W_ADD(V_LO(S), W_SHR(W_MUL(V_LO(d), tlo), 8));
+			W rhi = W_ADD(V_HI(S), W_SHR(W_MUL(V_HI(d), thi), 8));
+			/* Pixels with no source alpha are left alone, as is the tail. */
+			r = V_SELECT(V_ISZERO(a), d, V_NARROW(rlo, rhi));
+		}
+		else
+			r = V_SELECT(tail, d, S);
+
+		V_STORE(dp, dstep, r);
+		dp += dstep * SIMD_LANES;
+		sp += sstep * SIMD_LANES;
+		w -= L->k * SIMD_LANES;
+	}
+	if (w > 0)
+		span_tail(dp, da, sp, sa, n, w);
+}
+
+/* Blend source in constant alpha over destination */
+static SIMD_TARGET void
+SIMD_NAME(paint_span_alpha)(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	const fz_simd_layout *L = &span_layouts[SIMD_LAYOUT(n)][da][sa];
+	int dstep = L->k * (n + da);
+	int sstep = L->k * (n + sa);
+	int need = simd_need(L, n + da, n + sa, 0, SIMD_LANES);
+	int a = sa ? FZ_EXPAND(alpha) : alpha;
+	V shuf_s = V_TABLE(L->shuf_s);
+	V shuf_a = V_TABLE(L->shuf_a);
+	V alpha_pos = V_TABLE(L->alpha_pos);
+	V tail = V_TABLE(L->tail);
+	W wa = W_SET(a);
+	W w255 = W_SET(255);
+	W alo_pos = W_MASK_LO(alpha_pos);
+	W ahi_pos = W_MASK_HI(alpha_pos);
+
+	while (w >= need)
+	{
+		V d = V_LOAD(dp, dstep);
+		V s = V_LOAD(sp, sstep);
+		V S = V_SHUF(s, shuf_s);
+		W mlo, mhi, tlo, thi, xlo, xhi;
+
+		if (sa)
+		{
+			V m = V_SHUF(s, shuf_a);
+			mlo = W_SHR(W_MUL(V_LO(m), wa), 8);
+			mhi = W_SHR(W_MUL(V_HI(m), wa), 8);
+		}
+		else
+			mlo = mhi = wa;
+		tlo = W_SUB(w255, mlo);
+		thi = W_SUB(w255, mhi);
+		tlo = W_ADD(tlo, W_SHR(tlo, 7));
+		thi = W_ADD(thi, W_SHR(thi, 7));
+		xlo = W_SELECT(alo_pos, mlo, W_SHR(W_MUL(V_LO(S), wa), 8));
+		xhi = W_SELECT(ahi_pos, mhi, W_SHR(W_MUL(V_HI(S), wa), 8));
+		xlo = W_ADD(xlo, W_SHR(W_MUL(V_LO(d), tlo), 8));
+		xhi = W_ADD(xhi, W_SHR(W_MUL(V_HI(d), thi), 8));
+
+		V_STORE(dp, dstep, V_SELECT(tail, d, V_NARROW(xlo, xhi)));
+		dp += dstep * SIMD_LANES;
+		sp += sstep * SIMD_LANES;
+		w -= L->k * SIMD_LANES;
+	}
+	if (w > 0)
+		span_alpha_tail(dp, da, sp, sa, n, w, alpha);
+}
+
+/*
+	Blend a color over destination, either through a mask (mp) or,
+	for solid fills, with a constant amount (sa, when mp is NULL).
+	n1 does not include the destination alpha.
+*/
+static SIMD_TARGET void
+SIMD_NAME(blend_color)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n1, int da, int w, const byte * FZ_RESTRICT color, int sa)
+{
+	const fz_simd_layout *L = &span_layouts[SIMD_LAYOUT(n1)][da][da];
+	int dstep = L->k * (n1 + da);
+	int need = simd_need(L, n1 + da, 0, mp != NULL, SIMD_LANES);
+	byte cv[16];
+	V shuf_m = V_TABLE(L->shuf_m);
+	V tail = V_TABLE(L->tail);
+	V c;
+	W clo, chi, wsa = W_SET(sa), w256 = W_SET(256);
+	int j;
+
+	for (j = 0; j < 16; j++)
+	{
+		int k = j % (n1 + da);
+		cv[j] = k < n1 ? color[k] : 255;
+	}
+	c = V_TABLE(cv);
+	clo = V_LO(c);
+	chi = V_HI(c);
+
+	while (w >= need)
+	{
+		V d = V_LOAD(dp, dstep);
+		W mlo, mhi;
+
+		if (mp)
+		{
+			V m = V_SHUF(V_LOAD(mp, L->k), shuf_m);
+			mlo = V_LO(m);
+			mhi = V_HI(m);
+			mlo = W_ADD(mlo, W_SHR(mlo, 7));
+			mhi = W_ADD(mhi, W_SHR(mhi, 7));
+			if (sa != 256)
+			{
+				mlo = W_SHR(W_MUL(mlo, wsa), 8);
+				mhi = W_SHR(W_MUL(mhi, wsa), 8);
+			}
+			mp += L->k * SIMD_LANES;
+		}
+		else
+			mlo = mhi = wsa;
+
+		mlo = W_SHR(W_ADD(W_MUL(V_LO(d), W_SUB(w256, mlo)), W_MUL(clo, mlo)), 8);
+		mhi = W_SHR(W_ADD(W_MUL(V_HI(d), W_SUB(w256, mhi)), W_MUL(chi, mhi)), 8);
+
+		V_STORE(dp, dstep, V_SELECT(tail, d, V_NARROW(mlo, mhi)));
+		dp += dstep * SIMD_LANES;
+		w -= L->k * SIMD_LANES;
+	}
+	if (w > 0)
+		color_tail(dp, mp, n1, da, w, color, sa);
+}
+
+static SIMD_TARGET void
+SIMD_NAME(paint_span_with_color)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int sa = FZ_EXPAND(color[n - da]);
+	if (sa == 0)
+		return;
+	SIMD_NAME(blend_color)(dp, mp, n - da, da, w, color, sa);
+}
+
+static SIMD_TARGET void
+SIMD_NAME(paint_solid_color)(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int sa = FZ_EXPAND(color[n - da]);
+	if (sa == 0)
+		return;
+	SIMD_NAME(blend_color)(dp, NULL, n - da, da, w, color, sa);
+}
+
+/* Blend source in mask over destination */
+static SIMD_TARGET void
+SIMD_NAME(paint_span_with_mask)(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, const byte * FZ_RESTRICT mp, int w, int n, int a, const fz_overprint * FZ_RESTRICT eop)
+{
+	const fz_simd_layout *L = &span_layouts[SIMD_LAYOUT(n)][a][a];
+	int step = L->k * (n + a);
+	int need = simd_need(L, n + a, n + a, 1, SIMD_LANES);
+	V shuf_m = V_TABLE(L->shuf_m);
+	V shuf_a = V_TABLE(L->shuf_a);
+	V tail = V_TABLE(L->tail);
+	V zero = V_SET0();
+	W w256 = W_SET(256);
+
+	while (w >= need)
+	{
+		V d = V_LOAD(dp, step);
+		V s = V_LOAD(sp, step);
+		V m = V_SHUF(V_LOAD(mp, L->k), shuf_m);
+		W mlo, mhi;
+
+		/* Pixels with no source alpha are left alone. */
+		if (a)
+			m = V_SELECT(V_ISZERO(V_SHUF(s, shuf_a)), zero, m);
+		mlo = V_LO(m);
+		mhi = V_HI(m);
+		mlo = W_ADD(mlo, W_SHR(mlo, 7));
+		mhi = W_ADD(mhi, W_SHR(mhi, 7));
+		mlo = W_SHR(W_ADD(W_MUL(V_LO(d), W_SUB(w256, mlo)), W_MUL(V_LO(s), mlo)), 8);
+		mhi = W_SHR(W_ADD(W_MUL(V_HI(d), W_SUB(w256, mhi)), W_MUL(V_HI(s), mhi)), 8);
+
+		V_STORE(dp, step, V_SELECT(tail, d, V_NARROW(mlo, mhi)));
+		dp += step * SIMD_LANES;
+		sp += step * SIMD_LANES;
+		mp += L->k * SIMD_LANES;
+		w -= L->k * SIMD_LANES;
+	}
+	if (w > 0)
+		mask_tail(dp, sp, mp, n, a, w);
+}
+
+#undef SIMD_NAME
+#undef SIMD_TARGET
+#undef SIMD_LANES
+#undef V
+#undef W
+#undef V_TABLE
+#undef V_LOAD
+#undef V_STORE
+#undef V_SHUF
+#undef V_LO
+#undef V_HI
+#undef V_NARROW
+#undef V_SELECT
+#undef V_ISZERO
+#undef V_OR
+#undef V_SET0
+#undef W_SET
+#undef W_ADD
+#undef W_SUB
+#undef W_MUL
+#undef W_SHR
+#undef W_MASK_LO
+#undef W_MASK_HI
+#undef W_SELECT
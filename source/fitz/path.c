@@ -146,6 +146,16 @@ int fz_packed_path_size(const fz_path *path)
 	}
 }
 
+/*
+	Check whether a packed path keeps its commands and
+	coordinates in separate blocks (and so cannot be copied
+	as a simple block of bytes).
+*/
+int fz_packed_path_is_open(const fz_path *path)
+{
+	return path->packed == FZ_PATH_PACKED_OPEN;
+}
+
 /*
 	Pack a path into the given block.
 	To minimise the size of paths, this function allows them to be
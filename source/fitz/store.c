@@ -4,8 +4,17 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
+
+/* Initial number of buckets in each shard's table; must be a power of 2. */
+#define STORE_HASH_INITIAL 512
+
+/* Number of per-type lists. Types beyond this share the last one. */
+#define STORE_TYPES 16
 
 typedef struct fz_item_s fz_item;
+typedef struct fz_store_lru_s fz_store_lru;
+typedef struct fz_store_shard_s fz_store_shard;
 
 struct fz_item_s
 {
@@ -14,32 +23,447 @@ struct fz_item_s
 	size_t size;
 	fz_item *next;
 	fz_item *prev;
-	fz_store *store;
+	fz_item *chain;
+	fz_store_lru *lru;
 	const fz_store_type *type;
+	int shard; /* -1 if the key is not hashable */
+	int referenced;
+	unsigned hval;
+	fz_store_hash hash;
 };
 
-/* Every entry in fz_store is protected by the alloc lock */
-struct fz_store_s
+/*
+	Each type of item is kept on its own list, with its own (optional)
+	share of the store size. The list is swept by a clock: the head is
+	the hand, and an item that has been looked up since the hand last
+	passed it has 'referenced' set and is given a second chance by
+	moving it to the tail rather than being evicted. Looking an item up
+	therefore only sets a flag, and never needs to reorder the list.
+
+	The lists and the size accounting are protected by FZ_LOCK_STORE.
+*/
+struct fz_store_lru_s
 {
-	int refs;
-
-	/* Every item in the store is kept in a doubly linked list, ordered
-	 * by usage (so LRU entries are at the end). */
+	const fz_store_type *type;
 	fz_item *head;
 	fz_item *tail;
+	size_t size;
+	size_t max;
+	int count;
+};
+
+/*
+	Items whose keys are hashable are also found through a chained hash
+	table, split into FZ_STORE_SHARDS shards by key hash. A shard is only
+	ever touched with its own lock (FZ_LOCK_STORE_SHARD + shard index)
+	held, so lookups that fall in different shards do not contend, and
+	do not need FZ_LOCK_STORE at all.
+
+	Tables double in size whenever they have more entries than buckets.
+	The new table is allocated with no store locks held, as allocation
+	failure may need to scavenge the store.
+*/
+struct fz_store_shard_s
+{
+	int busy;
+	int contended;
+	int hits;
+	int misses;
+	int len, cap;
+	fz_item **table;
+};
+
+struct fz_store_s
+{
+	int refs;
 
-	/* We have a hash table that allows to quickly find a subset of the
-	 * entries (those whose keys are indirect objects). */
-	fz_hash_table *hash;
+	/* Protected by FZ_LOCK_STORE */
+	int busy;
+	int contended;
+	int hits;
+	int misses;
+	int num_evictions;
+	size_t evicted;
+	int nlru;
+	fz_store_lru lru[STORE_TYPES];
 
 	/* We keep track of the size of the store, and keep it below max. */
 	size_t max;
 	size_t size;
 
+	/* Protected by FZ_LOCK_ALLOC, as are the store_key_refs of key
+	 * storable objects. */
 	int defer_reap_count;
 	int needs_reaping;
+
+	fz_store_shard shard[FZ_STORE_SHARDS];
 };
 
+static void
+lock_store(fz_context *ctx, fz_store *store)
+{
+	/* This unlocked read is only a hint; if it says another thread
+	 * holds the lock, we are (very probably) about to wait. */
+	int busy = store->busy;
+
+	fz_lock(ctx, FZ_LOCK_STORE);
+	if (busy)
+		store->contended++;
+	store->busy = 1;
+}
+
+static void
+unlock_store(fz_context *ctx, fz_store *store)
+{
+	store->busy = 0;
+	fz_unlock(ctx, FZ_LOCK_STORE);
+}
+
+static void
+lock_shard(fz_context *ctx, fz_store *store, int idx)
+{
+	fz_store_shard *shard = &store->shard[idx];
+	int busy = shard->busy;
+
+	fz_lock(ctx, FZ_LOCK_STORE_SHARD + idx);
+	if (busy)
+		shard->contended++;
+	shard->busy = 1;
+}
+
+static void
+unlock_shard(fz_context *ctx, fz_store *store, int idx)
+{
+	store->shard[idx].busy = 0;
+	fz_unlock(ctx, FZ_LOCK_STORE_SHARD + idx);
+}
+
+static unsigned
+hash_key(const fz_store_hash *hash)
+{
+	const unsigned char *s = (const unsigned char *)hash;
+	unsigned val = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(*hash); i++)
+	{
+		val += s[i];
+		val += (val << 10);
+		val ^= (val >> 6);
+	}
+	val += (val << 3);
+	val ^= (val >> 11);
+	val += (val << 15);
+	return val;
+}
+
+/* The lock for the shard is always held when the following are called. */
+
+static unsigned
+shard_bucket(fz_store_shard *shard, unsigned hval)
+{
+	return (hval / FZ_STORE_SHARDS) & (shard->cap - 1);
+}
+
+static fz_item *
+shard_find(fz_store_shard *shard, unsigned hval, const fz_store_hash *hash)
+{
+	fz_item *item;
+
+	for (item = shard->table[shard_bucket(shard, hval)]; item; item = item->chain)
+		if (item->hval == hval && !memcmp(&item->hash, hash, sizeof(*hash)))
+			return item;
+	return NULL;
+}
+
+static void
+shard_insert(fz_store_shard *shard, fz_item *item)
+{
+	unsigned pos = shard_bucket(shard, item->hval);
+
+	item->chain = shard->table[pos];
+	shard->table[pos] = item;
+	shard->len++;
+}
+
+static void
+shard_remove(fz_store_shard *shard, fz_item *item)
+{
+	fz_item **pp = &shard->table[shard_bucket(shard, item->hval)];
+
+	while (*pp)
+	{
+		if (*pp == item)
+		{
+			*pp = item->chain;
+			shard->len--;
+			return;
+		}
+		pp = &(*pp)->chain;
+	}
+}
+
+/*
+	Double the size of a shard's table. Called with no store locks
+	held. Failure to allocate the new table is harmless; the chains
+	just get a little longer.
+*/
+static void
+grow_shard(fz_context *ctx, fz_store *store, int idx)
+{
+	fz_store_shard *shard = &store->shard[idx];
+	fz_item **table, **old;
+	fz_item *item, *next;
+	int cap, i;
+
+	lock_shard(ctx, store, idx);
+	cap = shard->cap;
+	unlock_shard(ctx, store, idx);
+
+	table = fz_calloc_no_throw(ctx, cap * 2, sizeof(fz_item *));
+	if (table == NULL)
+		return;
+
+	lock_shard(ctx, store, idx);
+	if (shard->cap != cap)
+	{
+		/* Someone else grew it before we could lock! */
+		old = table;
+	}
+	else
+	{
+		old = shard->table;
+		shard->table = table;
+		shard->cap = cap * 2;
+		for (i = 0; i < cap; i++)
+		{
+			for (item = old[i]; item; item = next)
+			{
+				unsigned pos = shard_bucket(shard, item->hval);
+				next = item->chain;
+				item->chain = table[pos];
+				table[pos] = item;
+			}
+		}
+	}
+	unlock_shard(ctx, store, idx);
+
+	fz_free(ctx, old);
+}
+
+/* FZ_LOCK_STORE is always held when the following are called. */
+
+static fz_store_lru *
+get_lru(fz_store *store, const fz_store_type *type, int create)
+{
+	fz_store_lru *lru;
+	int i;
+
+	for (i = 0; i < store->nlru; i++)
+		if (store->lru[i].type == type)
+			return &store->lru[i];
+
+	if (!create)
+	{
+		/* Items of a type that never got a list of its own are
+		 * on the last (shared) list. */
+		return store->nlru == STORE_TYPES ? &store->lru[STORE_TYPES - 1] : NULL;
+	}
+
+	if (store->nlru == STORE_TYPES)
+		return &store->lru[STORE_TYPES - 1];
+
+	lru = &store->lru[store->nlru++];
+	lru->type = type;
+	lru->head = NULL;
+	lru->tail = NULL;
+	lru->size = 0;
+	lru->max = FZ_STORE_UNLIMITED;
+	lru->count = 0;
+	return lru;
+}
+
+static void
+link_item(fz_store *store, fz_store_lru *lru, fz_item *item)
+{
+	item->lru = lru;
+	item->next = NULL;
+	item->prev = lru->tail;
+	if (lru->tail)
+		lru->tail->next = item;
+	else
+		lru->head = item;
+	lru->tail = item;
+	lru->size += item->size;
+	lru->count++;
+	store->size += item->size;
+}
+
+static void
+unlink_item(fz_store *store, fz_item *item)
+{
+	fz_store_lru *lru = item->lru;
+
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		lru->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		lru->head = item->next;
+	lru->size -= item->size;
+	lru->count--;
+	store->size -= item->size;
+}
+
+/*
+	Take an item out of the store (both its list, and its shard of the
+	hash table), and add it to a chain of items to be dropped once the
+	store locks have been released.
+*/
+static void
+remove_item(fz_context *ctx, fz_store *store, fz_item *item, fz_item **chain)
+{
+	if (item->shard >= 0)
+	{
+		lock_shard(ctx, store, item->shard);
+		shard_remove(&store->shard[item->shard], item);
+		unlock_shard(ctx, store, item->shard);
+	}
+	unlink_item(store, item);
+	item->next = *chain;
+	*chain = item;
+}
+
+/*
+	Run the clock over one list, taking unused items out of the store
+	until at least tofree bytes have been collected on the chain. Each
+	item is visited at most twice, so referenced items that are not in
+	use go on the second lap.
+*/
+static size_t
+sweep_lru(fz_context *ctx, fz_store *store, fz_store_lru *lru, size_t tofree, fz_item **chain)
+{
+	size_t count = 0;
+	int steps = 2 * lru->count;
+
+	while (count < tofree && steps-- > 0 && lru->head)
+	{
+		fz_item *item = lru->head;
+		int evict;
+
+		/* The shard lock keeps out lookups, which might otherwise
+		 * take a reference or set 'referenced' behind our back. */
+		if (item->shard >= 0)
+			lock_shard(ctx, store, item->shard);
+		evict = !item->referenced && item->val->refs == 1;
+		item->referenced = 0;
+		if (evict && item->shard >= 0)
+			shard_remove(&store->shard[item->shard], item);
+		if (item->shard >= 0)
+			unlock_shard(ctx, store, item->shard);
+
+		if (evict)
+		{
+			unlink_item(store, item);
+			item->next = *chain;
+			*chain = item;
+			count += item->size;
+			store->num_evictions++;
+			store->evicted += item->size;
+		}
+		else if (item->next)
+		{
+			/* Second chance; move it round to the back. */
+			lru->head = item->next;
+			lru->head->prev = NULL;
+			item->prev = lru->tail;
+			item->next = NULL;
+			lru->tail->next = item;
+			lru->tail = item;
+		}
+	}
+
+	return count;
+}
+
+/*
+	Evict unused items from across all the lists to free at least tofree
+	bytes. Each list first gives up its share in proportion to its size,
+	then any shortfall is made up from whichever lists can spare it.
+*/
+static size_t
+evict(fz_context *ctx, fz_store *store, size_t tofree, fz_item **chain)
+{
+	size_t count = 0;
+	size_t total = store->size;
+	int i;
+
+	if (total == 0)
+		return 0;
+
+	for (i = 0; i < store->nlru && count < tofree; i++)
+	{
+		fz_store_lru *lru = &store->lru[i];
+		size_t share = (size_t)((double)tofree * lru->size / total);
+		if (share > 0)
+			count += sweep_lru(ctx, store, lru, share, chain);
+	}
+	for (i = 0; i < store->nlru && count < tofree; i++)
+		count += sweep_lru(ctx, store, &store->lru[i], tofree - count, chain);
+
+	return count;
+}
+
+static size_t
+ensure_space(fz_context *ctx, fz_store *store, size_t tofree, fz_item **chain)
+{
+	fz_item *item;
+	size_t count;
+	int i;
+
+	/* First check that we *can* free tofree; if not, we'd rather not
+	 * cache this. */
+	count = 0;
+	for (i = 0; i < store->nlru && count < tofree; i++)
+	{
+		for (item = store->lru[i].head; item; item = item->next)
+		{
+			if (item->val->refs == 1)
+			{
+				count += item->size;
+				if (count >= tofree)
+					break;
+			}
+		}
+	}
+
+	/* If we ran out of items to search, then we can never free enough */
+	if (count < tofree)
+		return 0;
+
+	return evict(ctx, store, tofree, chain);
+}
+
+/*
+	Drop a chain of items that have been taken out of the store. Called
+	with no store locks held.
+*/
+static void
+drop_items(fz_context *ctx, fz_item *item)
+{
+	fz_item *next;
+
+	for (; item; item = next)
+	{
+		next = item->next;
+		fz_drop_storable(ctx, item->val);
+		item->type->drop_key(ctx, item->key);
+		fz_free(ctx, item);
+	}
+}
+
 /*
 	Create a new store inside the context
 
@@ -50,19 +474,26 @@ void
 fz_new_store_context(fz_context *ctx, size_t max)
 {
 	fz_store *store;
+	int i;
+
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC, NULL);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+		{
+			store->shard[i].table = fz_malloc_array(ctx, STORE_HASH_INITIAL, sizeof(fz_item *));
+			memset(store->shard[i].table, 0, STORE_HASH_INITIAL * sizeof(fz_item *));
+			store->shard[i].cap = STORE_HASH_INITIAL;
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_free(ctx, store->shard[i].table);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
 	store->size = 0;
 	store->max = max;
 	store->defer_reap_count = 0;
@@ -106,12 +537,16 @@ void *fz_keep_key_storable(fz_context *ctx, const fz_key_storable *sc)
 /*
 	Entered with FZ_LOCK_ALLOC held.
 	Drops FZ_LOCK_ALLOC.
+
+	ks: The object whose drop started the reap, if it is the only
+	one that can need reaping, otherwise NULL.
 */
 static void
-do_reap(fz_context *ctx)
+do_reap(fz_context *ctx, const fz_key_storable *ks)
 {
 	fz_store *store = ctx->store;
-	fz_item *item, *prev, *remove;
+	fz_item *item, *next, *remove;
+	int i;
 
 	if (store == NULL)
 	{
@@ -123,61 +558,36 @@ do_reap(fz_context *ctx)
 
 	ctx->store->needs_reaping = 0;
 
+	/* Image tiles are keyed on images too. May drop and retake the lock. */
+	fz_reap_image_cache(ctx, ks);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
 	/* Reap the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	lock_store(ctx, store);
+	for (i = 0; i < store->nlru; i++)
 	{
-		prev = item->prev;
-
-		if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
-			continue;
-
-		/* We have to drop it */
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
+		for (item = store->lru[i].head; item; item = next)
 		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			int reap;
 
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+			next = item->next;
+			if (item->type->needs_reap == NULL)
+				continue;
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+			/* needs_reap compares the key and store_key_refs of
+			 * the objects in the key, which the alloc lock guards. */
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			reap = item->type->needs_reap(ctx, item->key);
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			if (reap)
+				remove_item(ctx, store, item, &remove);
+		}
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	unlock_store(ctx, store);
 
 	/* Now drop the remove chain */
-	for (item = remove; item != NULL; item = remove)
-	{
-		remove = item->next;
-
-		/* Drop a reference to the value (freeing if required) */
-		if (item->prev)
-			item->val->drop(ctx, item->val);
-
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-	}
+	drop_items(ctx, remove);
 }
 
 void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
@@ -185,18 +595,19 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_key_storable *s = (fz_key_storable *)sc;
-	int drop;
+	int drop, old;
 	int unlock = 1;
 
 	if (s == NULL)
 		return;
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (s->storable.refs > 0)
+	old = fz_drop_refs(&s->storable.refs);
+	if (old > 0)
 	{
 		(void)Memento_dropRef(s);
-		drop = --s->storable.refs == 0;
-		if (!drop && s->storable.refs == s->store_key_refs)
+		drop = old == 1;
+		if (!drop && old - 1 == s->store_key_refs)
 		{
 			if (ctx->store->defer_reap_count > 0)
 			{
@@ -204,7 +615,7 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 			}
 			else
 			{
-				do_reap(ctx);
+				do_reap(ctx, ctx->store->needs_reaping ? NULL : s);
 				unlock = 0;
 			}
 		}
@@ -234,10 +645,9 @@ void *fz_keep_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		return NULL;
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (s->storable.refs > 0)
+	if (fz_keep_refs(&s->storable.refs) > 0)
 	{
 		(void)Memento_takeRef(s);
-		++s->storable.refs;
 		++s->store_key_refs;
 	}
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
@@ -257,7 +667,7 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	assert(s->store_key_refs > 0 && s->storable.refs >= s->store_key_refs);
 	(void)Memento_dropRef(s);
-	drop = --s->storable.refs == 0;
+	drop = fz_drop_refs(&s->storable.refs) == 1;
 	--s->store_key_refs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	/*
@@ -271,167 +681,6 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		s->storable.drop(ctx, &s->storable);
 }
 
-static void
-evict(fz_context *ctx, fz_item *item)
-{
-	fz_store *store = ctx->store;
-	int drop;
-
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
-
-	/* Drop a reference to the value (freeing if required) */
-	if (item->val->refs > 0)
-		(void)Memento_dropRef(item->val);
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
-
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
-	{
-		fz_store_hash hash = { NULL };
-		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop)
-		item->val->drop(ctx, item->val);
-
-	/* Always drops the key and drop the item */
-	item->type->drop_key(ctx, item->key);
-	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-}
-
-static size_t
-ensure_space(fz_context *ctx, size_t tofree)
-{
-	fz_item *item, *prev;
-	size_t count;
-	fz_store *store = ctx->store;
-	fz_item *to_be_freed = NULL;
-
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
-
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
-	{
-		if (item->val->refs == 1)
-		{
-			count += item->size;
-			if (count >= tofree)
-				break;
-		}
-	}
-
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
-	{
-		return 0;
-	}
-
-	/* Now move all the items to be freed onto 'to_be_freed' */
-	count = 0;
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs != 1)
-			continue;
-
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
-
-		/* Link into to_be_freed */
-		item->next = to_be_freed;
-		to_be_freed = item;
-
-		count += item->size;
-		if (count >= tofree)
-			break;
-	}
-
-	/* Now we can safely drop the lock and free our pending items. These
-	 * have all been removed from both the store list, and the hash table,
-	 * so they can't be 'found' by anyone else in the meantime. */
-
-	while (to_be_freed)
-	{
-		fz_item *item = to_be_freed;
-		int drop;
-
-		to_be_freed = to_be_freed->next;
-
-		/* Drop a reference to the value (freeing if required) */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		drop = (item->val->refs > 0 && --item->val->refs == 0);
-
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (drop)
-			item->val->drop(ctx, item->val);
-
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-	}
-
-	return count;
-}
-
-static void
-touch(fz_store *store, fz_item *item)
-{
-	if (item->next != item)
-	{
-		/* Already in the list - unlink it */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-	}
-	/* Now relink it at the start of the LRU chain */
-	item->next = store->head;
-	if (item->next)
-		item->next->prev = item;
-	else
-		store->tail = item;
-	store->head = item;
-	item->prev = NULL;
-}
-
 /*
 	Add an item to the store.
 
@@ -454,11 +703,11 @@ void *
 fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_store_type *type)
 {
 	fz_item *item = NULL;
-	size_t size;
+	fz_item *victims = NULL;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
-	fz_store_hash hash = { NULL };
-	int use_hash = 0;
+	fz_store_lru *lru;
+	int grow = -1;
 
 	if (!store)
 		return NULL;
@@ -477,112 +726,106 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		return NULL;
 	}
 
+	item->shard = -1;
 	if (type->make_hash_key)
 	{
-		hash.drop = val->drop;
-		use_hash = type->make_hash_key(ctx, &hash, key);
+		item->hash.drop = val->drop;
+		if (type->make_hash_key(ctx, &item->hash, key))
+		{
+			item->hval = hash_key(&item->hash);
+			item->shard = item->hval % FZ_STORE_SHARDS;
+		}
 	}
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-
-	/* Fill out the item. To start with, we always set item->next == item
-	 * and item->prev == item. This is so that we can spot items that have
-	 * been put into the hash table without having made it into the linked
-	 * list yet. */
 	item->key = key;
 	item->val = val;
 	item->size = itemsize;
-	item->next = item;
-	item->prev = item;
 	item->type = type;
 
+	/* Take the store's reference before anyone else can see the item */
+	fz_keep_storable(ctx, val);
+
+	/* Do any outstanding reaping first, even if defer_reap_count > 0,
+	 * as it may save us from evicting something useful. */
+	if (store->max != FZ_STORE_UNLIMITED)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		if (store->needs_reaping)
+			do_reap(ctx, NULL); /* Drops alloc lock */
+		else
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+
+	lock_store(ctx, store);
+
 	/* If we can index it fast, put it into the hash table. This serves
 	 * to check whether we have one there already. */
-	if (use_hash)
+	if (item->shard >= 0)
 	{
-		fz_item *existing = NULL;
+		fz_store_shard *shard = &store->shard[item->shard];
+		fz_item *existing;
+		fz_storable *existing_val = NULL;
 
-		fz_try(ctx)
+		lock_shard(ctx, store, item->shard);
+		existing = shard_find(shard, item->hval, &item->hash);
+		if (existing)
 		{
-			/* May drop and retake the lock */
-			existing = fz_hash_insert(ctx, store->hash, &hash, item);
+			/* There was one there already! Take a new reference
+			 * to the existing one, and drop our current one. */
+			existing->referenced = 1;
+			existing_val = fz_keep_storable(ctx, existing->val);
 		}
-		fz_catch(ctx)
+		else
 		{
-			/* Any error here means that item never made it into the
-			 * hash - so no one else can have a reference. */
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
-			fz_free(ctx, item);
-			type->drop_key(ctx, key);
-			return NULL;
+			shard_insert(shard, item);
+			if (shard->len > shard->cap)
+				grow = item->shard;
 		}
-		if (existing)
+		unlock_shard(ctx, store, item->shard);
+
+		if (existing_val)
 		{
-			/* There was one there already! Take a new reference
-			 * to the existing one, and drop our current one. */
-			touch(store, existing);
-			if (existing->val->refs > 0)
-			{
-				(void)Memento_takeRef(existing->val);
-				existing->val->refs++;
-			}
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
-			fz_free(ctx, item);
+			unlock_store(ctx, store);
+			fz_drop_storable(ctx, val);
 			type->drop_key(ctx, key);
-			return existing->val;
+			fz_free(ctx, item);
+			return existing_val;
 		}
 	}
 
-	/* Now bump the ref */
-	if (val->refs > 0)
-	{
-		(void)Memento_takeRef(val);
-		val->refs++;
-	}
+	lru = get_lru(store, type, 1);
 
 	/* If we haven't got an infinite store, check for space within it */
-	if (store->max != FZ_STORE_UNLIMITED)
+	if (store->max != FZ_STORE_UNLIMITED && store->size + itemsize > store->max)
 	{
-		size = store->size + itemsize;
-		while (size > store->max)
-		{
-			size_t saved;
+		/* If we fail to free any space, we used to 'unstore' it
+		 * here, but that's wrong. If we've already spent the memory
+		 * to malloc it then not putting it in the store just means
+		 * that a resource used multiple times will just be malloced
+		 * again. Better to put it in the store, have the store
+		 * account for it, and for it to potentially be reused. When
+		 * the caller drops the reference to it, it can then be
+		 * dropped from the store on the next attempt to store
+		 * anything else. */
+		ensure_space(ctx, store, store->size + itemsize - store->max, &victims);
+	}
 
-			/* First, do any outstanding reaping, even if defer_reap_count > 0 */
-			if (store->needs_reaping)
-			{
-				do_reap(ctx); /* Drops alloc lock */
-				fz_lock(ctx, FZ_LOCK_ALLOC);
-			}
-			size = store->size + itemsize;
-			if (size <= store->max)
-				break;
+	/* Likewise for the share allowed to this type */
+	if (lru->max != FZ_STORE_UNLIMITED && lru->size + itemsize > lru->max)
+		sweep_lru(ctx, store, lru, lru->size + itemsize - lru->max, &victims);
 
-			/* ensure_space may drop, then retake the lock */
-			saved = ensure_space(ctx, size - store->max);
-			size -= saved;
-			if (saved == 0)
-			{
-				/* Failed to free any space. */
-				/* We used to 'unstore' it here, but that's wrong.
-				 * If we've already spent the memory to malloc it
-				 * then not putting it in the store just means that
-				 * a resource used multiple times will just be malloced
-				 * again. Better to put it in the store, have the
-				 * store account for it, and for it to potentially be reused.
-				 * When the caller drops the reference to it, it can then
-				 * be dropped from the store on the next attempt to store
-				 * anything else. */
-				break;
-			}
-		}
-	}
-	store->size += itemsize;
+	/* Regardless of whether it's indexed, it goes into the list */
+	link_item(store, lru, item);
+	unlock_store(ctx, store);
 
-	/* Regardless of whether it's indexed, it goes into the linked list */
-	touch(store, item);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	/* Now we can safely drop the items we evicted. These have all been
+	 * removed from both the lists and the hash table, so they can't be
+	 * 'found' by anyone else in the meantime. */
+	drop_items(ctx, victims);
+
+	if (grow >= 0)
+		grow_shard(ctx, store, grow);
 
 	return NULL;
 }
@@ -605,8 +848,8 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
-	fz_store_hash hash = { NULL };
-	int use_hash = 0;
+	fz_storable *val = NULL;
+	fz_store_hash hash;
 
 	if (!store)
 		return NULL;
@@ -614,46 +857,57 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 	if (!key)
 		return NULL;
 
+	memset(&hash, 0, sizeof(hash));
 	if (type->make_hash_key)
 	{
 		hash.drop = drop;
-		use_hash = type->make_hash_key(ctx, &hash, key);
+		if (type->make_hash_key(ctx, &hash, key))
+		{
+			/* We can find objects keyed on indirected objects quickly,
+			 * with only their shard locked. */
+			unsigned hval = hash_key(&hash);
+			int idx = hval % FZ_STORE_SHARDS;
+			fz_store_shard *shard = &store->shard[idx];
+
+			lock_shard(ctx, store, idx);
+			item = shard_find(shard, hval, &hash);
+			if (item)
+			{
+				/* Mark the block as recently used, and bump the
+				 * refcount before returning. */
+				item->referenced = 1;
+				val = fz_keep_storable(ctx, item->val);
+				shard->hits++;
+			}
+			else
+				shard->misses++;
+			unlock_shard(ctx, store, idx);
+			return val;
+		}
 	}
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (use_hash)
-	{
-		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
-	}
-	else
+	/* Others we have to hunt for slowly */
+	lock_store(ctx, store);
+	item = NULL;
+	if (get_lru(store, type, 0))
 	{
-		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = get_lru(store, type, 0)->head; item; item = item->next)
 		{
-			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
+			if (item->type == type && item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 		}
 	}
 	if (item)
 	{
-		/* LRU the block. This also serves to ensure that any item
-		 * picked up from the hash before it has made it into the
-		 * linked list does not get whipped out again due to the
-		 * store being full. */
-		touch(store, item);
-		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-		{
-			(void)Memento_takeRef(item->val);
-			item->val->refs++;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return (void *)item->val;
+		item->referenced = 1;
+		val = fz_keep_storable(ctx, item->val);
+		store->hits++;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	else
+		store->misses++;
+	unlock_store(ctx, store);
 
-	return NULL;
+	return val;
 }
 
 /*
@@ -671,75 +925,67 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 void
 fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_type *type)
 {
-	fz_item *item;
+	fz_item *item = NULL;
+	fz_item *remove = NULL;
 	fz_store *store = ctx->store;
-	int dodrop;
-	fz_store_hash hash = { NULL };
+	fz_store_hash hash;
 	int use_hash = 0;
 
+	if (!store)
+		return;
+
+	memset(&hash, 0, sizeof(hash));
 	if (type->make_hash_key)
 	{
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	lock_store(ctx, store);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
-		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+		unsigned hval = hash_key(&hash);
+		int idx = hval % FZ_STORE_SHARDS;
+
+		lock_shard(ctx, store, idx);
+		item = shard_find(&store->shard[idx], hval, &hash);
+		unlock_shard(ctx, store, idx);
 	}
-	else
+	else if (get_lru(store, type, 0))
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
-			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
+		for (item = get_lru(store, type, 0)->head; item; item = item->next)
+			if (item->type == type && item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 	}
 	if (item)
-	{
-		/* Momentarily things can be in the hash table without being
-		 * in the list. Don't attempt to unlink these. We indicate
-		 * such items by setting item->next == item. */
-		if (item->next != item)
-		{
-			if (item->next)
-				item->next->prev = item->prev;
-			else
-				store->tail = item->prev;
-			if (item->prev)
-				item->prev->next = item->next;
-			else
-				store->head = item->next;
-		}
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (dodrop)
-			item->val->drop(ctx, item->val);
-		type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-	}
-	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		remove_item(ctx, store, item, &remove);
+	unlock_store(ctx, store);
+
+	drop_items(ctx, remove);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	fz_item *remove = NULL;
+	int i;
+
+	fz_purge_image_cache(ctx);
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	lock_store(ctx, store);
 	/* Run through all the items in the store */
-	while (store->head)
-		evict(ctx, store->head); /* Drops then retakes lock */
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < store->nlru; i++)
+		while (store->lru[i].head)
+			remove_item(ctx, store, store->lru[i].head, &remove);
+	unlock_store(ctx, store);
+
+	drop_items(ctx, remove);
 }
 
 fz_store *
@@ -753,31 +999,44 @@ fz_keep_store_context(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
+	int i;
+
 	if (!ctx)
 		return;
 	if (fz_drop_imp(ctx, ctx->store, &ctx->store->refs))
 	{
 		fz_empty_store(ctx);
-		fz_drop_hash_table(ctx, ctx->store->hash);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_free(ctx, ctx->store->shard[i].table);
 		fz_free(ctx, ctx->store);
 		ctx->store = NULL;
 	}
 }
 
-static void
-fz_debug_store_item(fz_context *ctx, void *state, void *key_, int keylen, void *item_)
+/*
+	Set the maximum size (in bytes) that items of a given type may take
+	up within the store. Items of that type are evicted to stay within
+	this, independently of the overall limit of the store.
+	FZ_STORE_UNLIMITED (the default) means no limit of its own.
+*/
+void
+fz_set_store_type_max(fz_context *ctx, const fz_store_type *type, size_t max)
 {
-	unsigned char *key = key_;
-	fz_item *item = item_;
-	int i;
-	char buf[256];
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	item->type->format_key(ctx, buf, sizeof buf, item->key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	printf("hash[");
-	for (i=0; i < keylen; ++i)
-		printf("%02x", key[i]);
-	printf("][refs=%d][size=%d] key=%s val=%p\n", item->val->refs, (int)item->size, buf, item->val);
+	fz_store *store = ctx->store;
+	fz_item *victims = NULL;
+	fz_store_lru *lru;
+
+	if (store == NULL)
+		return;
+
+	lock_store(ctx, store);
+	lru = get_lru(store, type, 1);
+	lru->max = max;
+	if (max != FZ_STORE_UNLIMITED && lru->size > max)
+		sweep_lru(ctx, store, lru, lru->size - max, &victims);
+	unlock_store(ctx, store);
+
+	drop_items(ctx, victims);
 }
 
 static void
@@ -786,71 +1045,88 @@ fz_debug_store_locked(fz_context *ctx)
 	fz_item *item, *next;
 	char buf[256];
 	fz_store *store = ctx->store;
+	int i, j;
 
 	printf("-- resource store contents --\n");
 
-	for (item = store->head; item; item = next)
+	for (i = 0; i < store->nlru; i++)
 	{
-		next = item->next;
-		if (next)
-		{
-			(void)Memento_takeRef(next->val);
-			next->val->refs++;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		item->type->format_key(ctx, buf, sizeof buf, item->key);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		printf("store[*][refs=%d][size=%d] key=%s val=%p\n",
-				item->val->refs, (int)item->size, buf, item->val);
-		if (next)
+		for (item = store->lru[i].head; item; item = next)
 		{
-			(void)Memento_dropRef(next->val);
-			next->val->refs--;
+			next = item->next;
+			if (next)
+				(void)fz_keep_storable(ctx, next->val);
+			unlock_store(ctx, store);
+			item->type->format_key(ctx, buf, sizeof buf, item->key);
+			lock_store(ctx, store);
+			printf("store[%d][refs=%d][size=%d] key=%s val=%p\n",
+					i, item->val->refs, (int)item->size, buf, item->val);
+			if (next)
+				fz_drop_storable(ctx, next->val);
 		}
 	}
 
 	printf("-- resource store hash contents --\n");
-	fz_hash_for_each(ctx, store->hash, NULL, fz_debug_store_item);
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		lock_shard(ctx, store, i);
+		for (j = 0; j < store->shard[i].cap; j++)
+			for (item = store->shard[i].table[j]; item; item = item->chain)
+				printf("hash[%d][%08x][refs=%d][size=%d] val=%p\n",
+						i, item->hval, item->val->refs, (int)item->size, item->val);
+		unlock_shard(ctx, store, i);
+	}
 	printf("-- end --\n");
 }
 
 void
 fz_debug_store(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (ctx->store == NULL)
+		return;
+	lock_store(ctx, ctx->store);
 	fz_debug_store_locked(ctx);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	unlock_store(ctx, ctx->store);
 }
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
-static int
-scavenge(fz_context *ctx, size_t tofree)
+void
+fz_dump_store_stats(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
-	size_t count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
+	int hits, misses, contended = 0, len = 0, cap = 0;
+	int i;
 
-			if (count >= tofree)
-				break;
+	if (!store)
+		return;
 
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
+	/* The counters are read without taking the store locks, so
+	 * the figures may be slightly stale if other threads are still
+	 * rendering. */
+	hits = store->hits;
+	misses = store->misses;
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+		hits += shard->hits;
+		misses += shard->misses;
+		contended += shard->contended;
+		len += shard->len;
+		cap += shard->cap;
 	}
-	/* Success is managing to evict any blocks */
-	return count != 0;
+
+	if (store->max == FZ_STORE_UNLIMITED)
+		fz_write_printf(ctx, fz_stderr(ctx), "Store Size: %zu (unlimited)\n", store->size);
+	else
+		fz_write_printf(ctx, fz_stderr(ctx), "Store Size: %zu (limit %zu)\n", store->size, store->max);
+	for (i = 0; i < store->nlru; i++)
+		fz_write_printf(ctx, fz_stderr(ctx), "Store Type %d: %zu in %d entries\n", i, store->lru[i].size, store->lru[i].count);
+	fz_write_printf(ctx, fz_stderr(ctx), "Store Hashed Entries: %d (%d slots in %d shards)\n", len, cap, FZ_STORE_SHARDS);
+	fz_write_printf(ctx, fz_stderr(ctx), "Store Hits: %d (%d by searching)\n", hits, store->hits);
+	fz_write_printf(ctx, fz_stderr(ctx), "Store Misses: %d (%d by searching)\n", misses, store->misses);
+	if (hits + misses > 0)
+		fz_write_printf(ctx, fz_stderr(ctx), "Store Hit Rate: %d%%\n", (int)(100.0 * hits / (hits + misses)));
+	fz_write_printf(ctx, fz_stderr(ctx), "Store Evictions: %d (%zu bytes)\n", store->num_evictions, store->evicted);
+	fz_write_printf(ctx, fz_stderr(ctx), "Store Lock Contention: %d (%d on shard locks)\n", store->contended + contended, contended);
 }
 
 /*
@@ -880,6 +1156,9 @@ int fz_store_scavenge_external(fz_context *ctx, size_t size, int *phase)
 	failure to the caller, we try to scavenge space within the store by
 	evicting at least 'size' bytes. The allocator then retries.
 
+	Entered with FZ_LOCK_ALLOC held, which is dropped while the store
+	is locked and any evicted items are freed.
+
 	size: The number of bytes we are trying to have free.
 
 	phase: What phase of the scavenge we are in. Updated on exit.
@@ -889,12 +1168,22 @@ int fz_store_scavenge_external(fz_context *ctx, size_t size, int *phase)
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 {
 	fz_store *store;
+	fz_item *victims = NULL;
 	size_t max;
+	int success = 0;
+
+	/* Decoded image tiles are usually the biggest things we can
+	 * free, so they go first. */
+	if (fz_scavenge_image_cache(ctx, size))
+		return 1;
 
 	store = ctx->store;
 	if (store == NULL)
 		return 0;
 
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	lock_store(ctx, store);
+
 #ifdef DEBUG_SCAVENGING
 	printf("Scavenging: store=" FZ_FMT_zu " size=" FZ_FMT_zu " phase=%d\n", store->size, size, *phase);
 	fz_debug_store_locked(ctx);
@@ -921,30 +1210,37 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 		else
 			tofree = size + store->size - max;
 
-		if (scavenge(ctx, tofree))
+		if (evict(ctx, store, tofree, &victims))
 		{
 #ifdef DEBUG_SCAVENGING
 			printf("scavenged: store=" FZ_FMT_zu "\n", store->size);
-			fz_debug_store(ctx);
-			Memento_stats();
 #endif
-			return 1;
+			success = 1;
+			break;
 		}
 	}
 	while (max > 0);
 
 #ifdef DEBUG_SCAVENGING
-	printf("scavenging failed\n");
-	fz_debug_store(ctx);
-	Memento_listBlocks();
+	if (!success)
+	{
+		printf("scavenging failed\n");
+		fz_debug_store_locked(ctx);
+		Memento_listBlocks();
+	}
 #endif
-	return 0;
+	unlock_store(ctx, store);
+
+	drop_items(ctx, victims);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+
+	return success;
 }
 
 /*
 	Evict items from the store until the total size of
 	the objects in the store is reduced to a given percentage of its
-	current size.
+	current size. The image tile cache is shrunk in the same way.
 
 	percent: %age of current size to reduce the store to.
 
@@ -955,6 +1251,7 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 {
 	int success;
 	fz_store *store;
+	fz_item *victims = NULL;
 	size_t new_size;
 
 	if (percent >= 100)
@@ -967,14 +1264,19 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 #ifdef DEBUG_SCAVENGING
 	printf("fz_shrink_store: " FZ_FMT_zu "\n", store->size/(1024*1024));
 #endif
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	lock_store(ctx, store);
 
 	new_size = (size_t)(((uint64_t)store->size * percent) / 100);
 	if (store->size > new_size)
-		scavenge(ctx, store->size - new_size);
+		evict(ctx, store, store->size - new_size, &victims);
 
 	success = (store->size <= new_size) ? 1 : 0;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	unlock_store(ctx, store);
+
+	drop_items(ctx, victims);
+
+	if (!fz_shrink_image_cache(ctx, percent))
+		success = 0;
 #ifdef DEBUG_SCAVENGING
 	printf("fz_shrink_store after: " FZ_FMT_zu "\n", store->size/(1024*1024));
 #endif
@@ -985,17 +1287,19 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const fz_store_type *type)
 {
 	fz_store *store;
+	fz_store_lru *lru;
 	fz_item *item, *prev, *remove;
 
 	store = ctx->store;
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	lock_store(ctx, store);
 
 	/* Filter the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	lru = get_lru(store, type, 0);
+	for (item = lru ? lru->tail : NULL; item; item = prev)
 	{
 		prev = item->prev;
 		if (item->type != type)
@@ -1005,51 +1309,12 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const f
 			continue;
 
 		/* We have to drop it */
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
-
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
-
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+		remove_item(ctx, store, item, &remove);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	unlock_store(ctx, store);
 
 	/* Now drop the remove chain */
-	for (item = remove; item != NULL; item = remove)
-	{
-		remove = item->next;
-
-		/* Drop a reference to the value (freeing if required) */
-		if (item->prev) /* See above for our abuse of prev here */
-			item->val->drop(ctx, item->val);
-
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-	}
+	drop_items(ctx, remove);
 }
 
 /*
@@ -1098,7 +1363,7 @@ void fz_defer_reap_end(fz_context *ctx)
 	--ctx->store->defer_reap_count;
 	reap = ctx->store->defer_reap_count == 0 && ctx->store->needs_reaping;
 	if (reap)
-		do_reap(ctx); /* Drops FZ_LOCK_ALLOC */
+		do_reap(ctx, NULL); /* Drops FZ_LOCK_ALLOC */
 	else
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
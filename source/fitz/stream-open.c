@@ -9,6 +9,14 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#if FZ_ENABLE_MMAP && !defined(_WIN32)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <stdint.h>
+#endif
 
 /*
 	Return true if the named file exists and is readable.
@@ -27,6 +35,31 @@ fz_file_exists(fz_context *ctx, const char *path)
 	return !!file;
 }
 
+/*
+	Return the time the named file was last modified, in seconds
+	since the epoch, or 0 if it cannot be found.
+*/
+int64_t
+fz_stat_mtime(const char *path)
+{
+#ifdef _WIN32
+	struct _stat info;
+	wchar_t *wpath = fz_wchar_from_utf8(path);
+	int n;
+	if (wpath == NULL)
+		return 0;
+	n = _wstat(wpath, &info);
+	free(wpath);
+	if (n < 0)
+		return 0;
+#else
+	struct stat info;
+	if (stat(path, &info) < 0)
+		return 0;
+#endif
+	return info.st_mtime;
+}
+
 /*
 	Create a new stream object with the given
 	internal state and function pointers.
@@ -160,6 +193,94 @@ fz_open_file_ptr(fz_context *ctx, FILE *file)
 	return stm;
 }
 
+#ifdef HAVE_MMAP
+
+/* Mapped file stream */
+
+/*
+	The whole file is the stream's buffer, so reads need no copying
+	and seeks are just pointer arithmetic.
+*/
+typedef struct fz_mmap_stream_s
+{
+	unsigned char *base;
+	size_t len;
+} fz_mmap_stream;
+
+static int next_mmap(fz_context *ctx, fz_stream *stm, size_t n)
+{
+	return EOF;
+}
+
+static void seek_mmap(fz_context *ctx, fz_stream *stm, int64_t offset, int whence)
+{
+	fz_mmap_stream *state = stm->state;
+
+	if (whence == 1)
+		offset += stm->rp - state->base;
+	else if (whence == 2)
+		offset += (int64_t)state->len;
+
+	if (offset < 0)
+		offset = 0;
+	if (offset > (int64_t)state->len)
+		offset = (int64_t)state->len;
+	stm->rp = state->base + offset;
+}
+
+static void drop_mmap(fz_context *ctx, void *state_)
+{
+	fz_mmap_stream *state = state_;
+	if (munmap(state->base, state->len) < 0)
+		fz_warn(ctx, "cannot unmap file: %s", strerror(errno));
+	fz_free(ctx, state);
+}
+
+/*
+	Map an open file into memory and wrap it in a stream. Returns
+	NULL, leaving the file to be read through stdio, for anything
+	other than a non-empty regular file that fits in the address
+	space.
+*/
+static fz_stream *
+fz_open_file_mmap(fz_context *ctx, FILE *file)
+{
+	fz_mmap_stream *state;
+	fz_stream *stm;
+	struct stat info;
+	void *base;
+
+	if (fstat(fileno(file), &info) < 0 || !S_ISREG(info.st_mode))
+		return NULL;
+	if (info.st_size <= 0 || (uint64_t)info.st_size > SIZE_MAX)
+		return NULL;
+
+	base = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	fz_try(ctx)
+		state = fz_malloc_struct(ctx, fz_mmap_stream);
+	fz_catch(ctx)
+	{
+		munmap(base, (size_t)info.st_size);
+		fz_rethrow(ctx);
+	}
+	state->base = base;
+	state->len = (size_t)info.st_size;
+
+	stm = fz_new_stream(ctx, state, next_mmap, drop_mmap);
+	stm->seek = seek_mmap;
+
+	stm->rp = state->base;
+	stm->wp = state->base + state->len;
+	stm->pos = (int64_t)state->len;
+
+	return stm;
+}
+
+#endif
+
 fz_stream *fz_open_file_ptr_no_close(fz_context *ctx, FILE *file)
 {
 	fz_stream *stm = fz_open_file_ptr(ctx, file);
@@ -177,11 +298,17 @@ fz_stream *fz_open_file_ptr_no_close(fz_context *ctx, FILE *file)
 	represented. Other platforms do the encoding as standard anyway (and
 	in most cases, particularly for MacOS and Linux, the encoding they
 	use is UTF-8 anyway).
+
+	Where possible, regular files are mapped into memory rather than
+	read through stdio (see FZ_ENABLE_MMAP).
 */
 fz_stream *
 fz_open_file(fz_context *ctx, const char *name)
 {
 	FILE *file;
+#ifdef HAVE_MMAP
+	fz_stream *stm;
+#endif
 #ifdef _WIN32
 	file = fz_fopen_utf8(name, "rb");
 #else
@@ -189,6 +316,21 @@ fz_open_file(fz_context *ctx, const char *name)
 #endif
 	if (file == NULL)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open %s: %s", name, strerror(errno));
+#ifdef HAVE_MMAP
+	fz_try(ctx)
+		stm = fz_open_file_mmap(ctx, file);
+	fz_catch(ctx)
+	{
+		fclose(file);
+		fz_rethrow(ctx);
+	}
+	if (stm)
+	{
+		/* The mapping stays valid once the file is closed. */
+		fclose(file);
+		return stm;
+	}
+#endif
 	return fz_open_file_ptr(ctx, file);
 }
 
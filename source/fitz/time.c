@@ -126,6 +126,39 @@ fz_remove_utf8(const char *name)
 	return n;
 }
 
+int
+fz_rename_utf8(const char *oldname, const char *newname)
+{
+	wchar_t *wold, *wnew;
+	int n = 0;
+
+	wold = fz_wchar_from_utf8(oldname);
+	if (wold == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	wnew = fz_wchar_from_utf8(newname);
+	if (wnew == NULL)
+	{
+		free(wold);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Unlike rename, replace any file already called newname. */
+	if (!MoveFileExW(wold, wnew, MOVEFILE_REPLACE_EXISTING))
+	{
+		errno = EACCES;
+		n = -1;
+	}
+
+	free(wold);
+	free(wnew);
+	return n;
+}
+
 char **
 fz_argv_from_wargv(int argc, wchar_t **wargv)
 {
@@ -324,7 +324,10 @@ void pdf_clean_file(fz_context *ctx, char *infile, char *outfile, char *password
 	fz_var(page);
 	fz_try(ctx)
 	{
-		glo.doc = pdf_open_document(ctx, infile);
+		if (opts && opts->parallel)
+			glo.doc = pdf_open_document_with_parallel_repair(ctx, infile, opts->parallel, opts->parallel_opaque);
+		else
+			glo.doc = pdf_open_document(ctx, infile);
 		if (pdf_needs_password(ctx, glo.doc))
 			if (!pdf_authenticate_password(ctx, glo.doc, password))
 				fz_throw(glo.ctx, FZ_ERROR_GENERIC, "cannot authenticate password: %s", infile);
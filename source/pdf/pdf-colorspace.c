@@ -592,8 +592,18 @@ fz_colorspace *
 pdf_document_output_intent(fz_context *ctx, pdf_document *doc)
 {
 #ifndef NOICC
-	if (!doc->oi)
-		doc->oi = pdf_load_output_intent(ctx, doc);
+	/* Every thread running a page of a threaded document gets here,
+	 * but only one of them must load the output intent. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		if (!doc->oi)
+			doc->oi = pdf_load_output_intent(ctx, doc);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 #endif
 	return doc->oi;
 }
@@ -103,7 +103,7 @@ parse_inline_image(fz_context *ctx, pdf_csi *csi, fz_stream *stm, char *csname,
 
 	fz_try(ctx)
 	{
-		obj = pdf_parse_dict(ctx, doc, stm, &doc->lexbuf.base);
+		obj = pdf_parse_dict(ctx, doc, stm, csi->buf);
 
 		if (csname)
 		{
@@ -552,12 +552,27 @@ pdf_process_end(fz_context *ctx, pdf_processor *proc, pdf_csi *csi)
 		proc->op_END(ctx, proc);
 }
 
+/* Show an inline image, and drop it. */
+static void
+pdf_process_BI(fz_context *ctx, pdf_processor *proc, fz_image *img, const char *csname)
+{
+	fz_try(ctx)
+	{
+		if (proc->op_BI)
+			proc->op_BI(ctx, proc, img, csname[0] ? csname : NULL);
+	}
+	fz_always(ctx)
+		fz_drop_image(ctx, img);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 #define A(a) (a)
 #define B(a,b) (a | b << 8)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
 static void
-pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, char *word)
+pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, const char *word)
 {
 	float *s = csi->stack;
 	char csname[40];
@@ -726,15 +741,7 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 	case B('B','I'):
 		{
 			fz_image *img = parse_inline_image(ctx, csi, stm, csname, sizeof csname);
-			fz_try(ctx)
-			{
-				if (proc->op_BI)
-					proc->op_BI(ctx, proc, img, csname[0] ? csname : NULL);
-			}
-			fz_always(ctx)
-				fz_drop_image(ctx, img);
-			fz_catch(ctx)
-				fz_rethrow(ctx);
+			pdf_process_BI(ctx, proc, img, csname);
 		}
 		break;
 
@@ -772,8 +779,304 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 	}
 }
 
+/*
+	Compiled content streams.
+
+	Lexing a content stream (and inflating it first) is a large part
+	of the cost of running it, and the same streams are run many times
+	over: for thumbnails, rendering, text extraction and searching. So
+	pdf_process_contents compiles each stream once into a compact list
+	of operations, which is kept in the store and replayed to any
+	processor afterwards.
+
+	Each operation is a keyword together with a copy of the operands
+	that were on the stack when it was seen; an inline image, already
+	loaded; or an error that was caught while lexing. Errors are kept
+	so that replaying them gives the processor exactly the same calls
+	(and the cookie the same counts) as running the stream itself.
+
+	The operations are written one after another into a byte buffer,
+	each starting with its type and the number of tokens it took. The
+	objects and images they refer to are kept in arrays alongside.
+*/
+
+enum
+{
+	PDF_OP_END,
+	PDF_OP_KEYWORD,
+	PDF_OP_ARRAY_KEYWORD, /* Tw or Tc in a TJ array, always followed by an error */
+	PDF_OP_BI,
+	PDF_OP_ERROR
+};
+
+enum
+{
+	PDF_OP_HAS_STACK = 1,
+	PDF_OP_HAS_NAME = 2,
+	PDF_OP_HAS_STRING = 4,
+	PDF_OP_HAS_OBJ = 8
+};
+
+typedef struct
+{
+	fz_storable storable;
+	size_t size;
+
+	/* What the stream was compiled from, to check it is still current. */
+	pdf_obj *rdb;
+	int is_array;
+	int part_count;
+	pdf_obj **part_obj;
+	fz_buffer **part_buf;
+
+	fz_buffer *code;
+	int obj_len, obj_cap;
+	pdf_obj **obj;
+	int image_len, image_cap;
+	fz_image **image;
+
+	/* Tokens read since the last operation, while compiling. */
+	int ntok;
+} pdf_compiled_stream;
+
+static void
+pdf_drop_compiled_stream_imp(fz_context *ctx, fz_storable *stor)
+{
+	pdf_compiled_stream *prog = (pdf_compiled_stream *)stor;
+	int i;
+
+	pdf_drop_obj(ctx, prog->rdb);
+	for (i = 0; i < prog->part_count; i++)
+	{
+		pdf_drop_obj(ctx, prog->part_obj[i]);
+		fz_drop_buffer(ctx, prog->part_buf[i]);
+	}
+	fz_free(ctx, prog->part_obj);
+	fz_free(ctx, prog->part_buf);
+	fz_drop_buffer(ctx, prog->code);
+	for (i = 0; i < prog->obj_len; i++)
+		pdf_drop_obj(ctx, prog->obj[i]);
+	fz_free(ctx, prog->obj);
+	for (i = 0; i < prog->image_len; i++)
+		fz_drop_image(ctx, prog->image[i]);
+	fz_free(ctx, prog->image);
+	fz_free(ctx, prog);
+}
+
+static void
+pdf_drop_compiled_stream(fz_context *ctx, pdf_compiled_stream *prog)
+{
+	fz_drop_storable(ctx, &prog->storable);
+}
+
+static void
+compile_int(fz_context *ctx, pdf_compiled_stream *prog, int v)
+{
+	fz_append_data(ctx, prog->code, &v, sizeof v);
+}
+
+static void
+compile_data(fz_context *ctx, pdf_compiled_stream *prog, const char *data, int len)
+{
+	compile_int(ctx, prog, len);
+	fz_append_data(ctx, prog->code, data, len);
+	fz_append_byte(ctx, prog->code, 0);
+}
+
+static void
+compile_op(fz_context *ctx, pdf_compiled_stream *prog, int op)
+{
+	fz_append_byte(ctx, prog->code, op);
+	compile_int(ctx, prog, prog->ntok);
+	prog->ntok = 0;
+}
+
+static int
+read_int(const unsigned char **pc)
+{
+	int v;
+	memcpy(&v, *pc, sizeof v);
+	*pc += sizeof v;
+	return v;
+}
+
+static float
+read_float(const unsigned char **pc)
+{
+	float v;
+	memcpy(&v, *pc, sizeof v);
+	*pc += sizeof v;
+	return v;
+}
+
+static const char *
+read_data(const unsigned char **pc, int *lenp)
+{
+	const char *data;
+	int len = read_int(pc);
+	data = (const char *)*pc;
+	*pc += len + 1;
+	if (lenp)
+		*lenp = len;
+	return data;
+}
+
+/* Record a keyword, along with the operands that go with it. */
 static void
-pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm)
+compile_keyword(fz_context *ctx, pdf_compiled_stream *prog, pdf_csi *csi, const char *word)
+{
+	int flags = 0;
+	int i;
+
+	if (csi->top > 0)
+		flags |= PDF_OP_HAS_STACK;
+	if (csi->name[0])
+		flags |= PDF_OP_HAS_NAME;
+	if (csi->string_len > 0)
+		flags |= PDF_OP_HAS_STRING;
+	if (csi->obj)
+		flags |= PDF_OP_HAS_OBJ;
+
+	compile_op(ctx, prog, PDF_OP_KEYWORD);
+	fz_append_byte(ctx, prog->code, flags);
+	compile_data(ctx, prog, word, (int)strlen(word));
+	if (flags & PDF_OP_HAS_STACK)
+	{
+		fz_append_byte(ctx, prog->code, csi->top);
+		fz_append_data(ctx, prog->code, csi->stack, csi->top * sizeof(float));
+	}
+	if (flags & PDF_OP_HAS_NAME)
+		compile_data(ctx, prog, csi->name, (int)strlen(csi->name));
+	if (flags & PDF_OP_HAS_STRING)
+		compile_data(ctx, prog, csi->string, csi->string_len);
+	if (flags & PDF_OP_HAS_OBJ)
+	{
+		if (prog->obj_len == prog->obj_cap)
+		{
+			int cap = prog->obj_cap ? prog->obj_cap * 2 : 16;
+			prog->obj = fz_resize_array(ctx, prog->obj, cap, sizeof(*prog->obj));
+			prog->obj_cap = cap;
+		}
+		i = prog->obj_len;
+		prog->obj[prog->obj_len++] = pdf_keep_obj(ctx, csi->obj);
+		compile_int(ctx, prog, i);
+	}
+
+	/* The only keywords that change how the rest of the stream is lexed. */
+	if (!strcmp(word, "BT"))
+		csi->in_text = 1;
+	else if (!strcmp(word, "ET"))
+		csi->in_text = 0;
+}
+
+static void
+compile_inline_image(fz_context *ctx, pdf_compiled_stream *prog, pdf_csi *csi, fz_stream *stm)
+{
+	char csname[40];
+	fz_image *img = parse_inline_image(ctx, csi, stm, csname, sizeof csname);
+
+	if (prog->image_len == prog->image_cap)
+	{
+		int cap = prog->image_cap ? prog->image_cap * 2 : 4;
+		fz_try(ctx)
+			prog->image = fz_resize_array(ctx, prog->image, cap, sizeof(*prog->image));
+		fz_catch(ctx)
+		{
+			fz_drop_image(ctx, img);
+			fz_rethrow(ctx);
+		}
+		prog->image_cap = cap;
+	}
+	prog->image[prog->image_len++] = img;
+	prog->size += fz_image_size(ctx, img);
+
+	compile_op(ctx, prog, PDF_OP_BI);
+	compile_int(ctx, prog, prog->image_len - 1);
+	compile_data(ctx, prog, csname, (int)strlen(csname));
+}
+
+static void
+compile_error(fz_context *ctx, pdf_compiled_stream *prog, int code, const char *message)
+{
+	compile_op(ctx, prog, PDF_OP_ERROR);
+	compile_int(ctx, prog, code);
+	compile_data(ctx, prog, message, (int)strlen(message));
+}
+
+/*
+	Deal with an error caught while running a content stream.
+	Returns 1 if the rest of the stream should be ignored.
+*/
+static int
+pdf_process_error(fz_context *ctx, fz_cookie *cookie, int *syntax_errors)
+{
+	int caught = fz_caught(ctx);
+
+	if (cookie)
+	{
+		if (caught == FZ_ERROR_TRYLATER)
+		{
+			if (cookie->incomplete_ok)
+				cookie->incomplete++;
+			else
+				fz_rethrow(ctx);
+		}
+		else if (caught == FZ_ERROR_ABORT)
+		{
+			fz_rethrow(ctx);
+		}
+		else if (caught == FZ_ERROR_MINOR)
+		{
+			cookie->errors++;
+		}
+		else if (caught == FZ_ERROR_SYNTAX)
+		{
+			cookie->errors++;
+			if (++*syntax_errors >= MAX_SYNTAX_ERRORS)
+			{
+				fz_warn(ctx, "too many syntax errors; ignoring rest of page");
+				return 1;
+			}
+		}
+		else
+		{
+			cookie->errors++;
+			fz_warn(ctx, "unrecoverable error; ignoring rest of page: %s", fz_caught_message(ctx));
+			return 1;
+		}
+	}
+	else
+	{
+		if (caught == FZ_ERROR_TRYLATER)
+			fz_rethrow(ctx);
+		else if (caught == FZ_ERROR_ABORT)
+			fz_rethrow(ctx);
+		else if (caught == FZ_ERROR_MINOR)
+			/* ignore minor errors */ ;
+		else if (caught == FZ_ERROR_SYNTAX)
+		{
+			if (++*syntax_errors >= MAX_SYNTAX_ERRORS)
+			{
+				fz_warn(ctx, "too many syntax errors; ignoring rest of page");
+				return 1;
+			}
+		}
+		else
+		{
+			fz_warn(ctx, "unrecoverable error; ignoring rest of page: %s", fz_caught_message(ctx));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Run a content stream through a processor or, if prog is given,
+	compile it into prog instead (and proc is not used).
+*/
+static void
+pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, pdf_compiled_stream *prog)
 {
 	pdf_document *doc = csi->doc;
 	pdf_lexbuf *buf = csi->buf;
@@ -811,6 +1114,8 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 					}
 					cookie->progress++;
 				}
+				if (prog)
+					prog->ntok++;
 
 				tok = pdf_lex(ctx, stm, buf);
 
@@ -843,7 +1148,14 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 								{
 									csi->stack[0] = pdf_to_real(ctx, o);
 									pdf_array_delete(ctx, csi->obj, n-1);
-									pdf_process_keyword(ctx, proc, csi, stm, buf->scratch);
+									if (prog)
+									{
+										compile_op(ctx, prog, PDF_OP_ARRAY_KEYWORD);
+										compile_data(ctx, prog, buf->scratch, 2);
+										fz_append_data(ctx, prog->code, &csi->stack[0], sizeof(float));
+									}
+									else
+										pdf_process_keyword(ctx, proc, csi, stm, buf->scratch);
 								}
 							}
 						}
@@ -932,7 +1244,12 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 					break;
 
 				case PDF_TOK_KEYWORD:
-					pdf_process_keyword(ctx, proc, csi, stm, buf->scratch);
+					if (!prog)
+						pdf_process_keyword(ctx, proc, csi, stm, buf->scratch);
+					else if (!strcmp(buf->scratch, "BI"))
+						compile_inline_image(ctx, prog, csi, stm);
+					else
+						compile_keyword(ctx, prog, csi, buf->scratch);
 					pdf_clear_stack(ctx, csi);
 					break;
 
@@ -948,75 +1265,330 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 		}
 		fz_catch(ctx)
 		{
-			int caught = fz_caught(ctx);
-
-			if (cookie)
+			if (prog)
 			{
-				if (caught == FZ_ERROR_TRYLATER)
-				{
-					if (cookie->incomplete_ok)
-						cookie->incomplete++;
-					else
-						fz_rethrow(ctx);
-				}
-				else if (caught == FZ_ERROR_ABORT)
-				{
+				/* Keep the error to throw again when replaying. Which
+				 * errors to give up on is decided then. */
+				int caught = fz_caught(ctx);
+				if (caught == FZ_ERROR_TRYLATER || caught == FZ_ERROR_ABORT || caught == FZ_ERROR_MEMORY)
 					fz_rethrow(ctx);
-				}
-				else if (caught == FZ_ERROR_MINOR)
-				{
-					cookie->errors++;
-				}
-				else if (caught == FZ_ERROR_SYNTAX)
-				{
-					cookie->errors++;
-					if (++syntax_errors >= MAX_SYNTAX_ERRORS)
-					{
-						fz_warn(ctx, "too many syntax errors; ignoring rest of page");
-						tok = PDF_TOK_EOF;
-					}
-				}
-				else
-				{
-					cookie->errors++;
-					fz_warn(ctx, "unrecoverable error; ignoring rest of page: %s", fz_caught_message(ctx));
+				compile_error(ctx, prog, caught, fz_caught_message(ctx));
+				if (caught != FZ_ERROR_MINOR && caught != FZ_ERROR_SYNTAX)
 					tok = PDF_TOK_EOF;
-				}
 			}
-			else
+			else if (pdf_process_error(ctx, cookie, &syntax_errors))
+				tok = PDF_TOK_EOF;
+
+			/* If we do catch an error, then reset ourselves to a base lexing state */
+			in_text_array = 0;
+		}
+	}
+	while (tok != PDF_TOK_EOF);
+
+	if (prog)
+		compile_op(ctx, prog, PDF_OP_END);
+}
+
+/* Replay a compiled content stream through a processor. */
+static void
+pdf_replay_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, pdf_compiled_stream *prog)
+{
+	fz_cookie *cookie = csi->cookie;
+	const unsigned char *pc;
+	unsigned char *code;
+	int syntax_errors = 0;
+	int done = 0;
+
+	fz_buffer_storage(ctx, prog->code, &code);
+	pc = code;
+
+	pdf_clear_stack(ctx, csi);
+
+	fz_var(pc);
+	fz_var(done);
+
+	if (cookie)
+	{
+		cookie->progress_max = -1;
+		cookie->progress = 0;
+	}
+
+	do
+	{
+		fz_try(ctx)
+		{
+			while (!done)
 			{
-				if (caught == FZ_ERROR_TRYLATER)
-					fz_rethrow(ctx);
-				else if (caught == FZ_ERROR_ABORT)
-					fz_rethrow(ctx);
-				else if (caught == FZ_ERROR_MINOR)
-					/* ignore minor errors */ ;
-				else if (caught == FZ_ERROR_SYNTAX)
+				const char *word, *data;
+				int op, ntok, flags, len, code;
+
+				op = *pc++;
+				ntok = read_int(&pc);
+
+				/* Check the cookie */
+				if (cookie)
 				{
-					if (++syntax_errors >= MAX_SYNTAX_ERRORS)
+					if (cookie->abort)
 					{
-						fz_warn(ctx, "too many syntax errors; ignoring rest of page");
-						tok = PDF_TOK_EOF;
+						done = 1;
+						break;
 					}
+					cookie->progress += ntok;
 				}
-				else
+
+				switch (op)
 				{
-					fz_warn(ctx, "unrecoverable error; ignoring rest of page: %s", fz_caught_message(ctx));
-					tok = PDF_TOK_EOF;
+				case PDF_OP_END:
+					done = 1;
+					break;
+
+				case PDF_OP_KEYWORD:
+					flags = *pc++;
+					word = read_data(&pc, NULL);
+					if (flags & PDF_OP_HAS_STACK)
+					{
+						int i, top = *pc++;
+						for (i = 0; i < top; i++)
+							csi->stack[i] = read_float(&pc);
+						csi->top = top;
+					}
+					if (flags & PDF_OP_HAS_NAME)
+						fz_strlcpy(csi->name, read_data(&pc, NULL), sizeof csi->name);
+					if (flags & PDF_OP_HAS_STRING)
+					{
+						data = read_data(&pc, &len);
+						memcpy(csi->string, data, len);
+						csi->string_len = len;
+					}
+					if (flags & PDF_OP_HAS_OBJ)
+						csi->obj = pdf_keep_obj(ctx, prog->obj[read_int(&pc)]);
+					pdf_process_keyword(ctx, proc, csi, NULL, word);
+					pdf_clear_stack(ctx, csi);
+					break;
+
+				case PDF_OP_ARRAY_KEYWORD:
+					word = read_data(&pc, NULL);
+					csi->stack[0] = read_float(&pc);
+					/* Take the error that follows now, so that it is not
+					 * thrown twice if the keyword throws one of its own. */
+					op = *pc++;
+					(void)read_int(&pc);
+					code = read_int(&pc);
+					data = read_data(&pc, NULL);
+					pdf_process_keyword(ctx, proc, csi, NULL, word);
+					fz_throw(ctx, code, "%s", data);
+					break;
+
+				case PDF_OP_BI:
+					{
+						fz_image *img = fz_keep_image(ctx, prog->image[read_int(&pc)]);
+						pdf_process_BI(ctx, proc, img, read_data(&pc, NULL));
+					}
+					pdf_clear_stack(ctx, csi);
+					break;
+
+				case PDF_OP_ERROR:
+					code = read_int(&pc);
+					data = read_data(&pc, NULL);
+					fz_throw(ctx, code, "%s", data);
+					break;
 				}
 			}
+		}
+		fz_always(ctx)
+		{
+			pdf_clear_stack(ctx, csi);
+		}
+		fz_catch(ctx)
+		{
+			if (pdf_process_error(ctx, cookie, &syntax_errors))
+				done = 1;
+		}
+	}
+	while (!done);
+}
 
-			/* If we do catch an error, then reset ourselves to a base lexing state */
-			in_text_array = 0;
+/* Get the part of a contents stream that the compiled stream checks. */
+static void
+compiled_stream_part(fz_context *ctx, pdf_document *doc, pdf_obj *ref, pdf_obj **objp, fz_buffer **bufp)
+{
+	pdf_xref_entry *x;
+
+	/* The entry is only ours while the document is locked. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		x = pdf_get_xref_entry(ctx, doc, pdf_to_num(ctx, ref));
+		*objp = x->obj;
+		*bufp = x->stm_buf;
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+	Check that a compiled stream was made from the same stream
+	objects and stream data (which replacing or updating an object
+	changes) and the same resources as it would be now.
+*/
+static int
+compiled_stream_is_current(fz_context *ctx, pdf_document *doc, pdf_compiled_stream *prog, pdf_obj *rdb, pdf_obj *stmobj)
+{
+	int i, is_array = pdf_is_array(ctx, stmobj);
+	int n = is_array ? pdf_array_len(ctx, stmobj) : 1;
+
+	if (prog->rdb != rdb || prog->is_array != is_array || prog->part_count != n)
+		return 0;
+	for (i = 0; i < n; i++)
+	{
+		pdf_obj *obj;
+		fz_buffer *buf;
+		compiled_stream_part(ctx, doc, is_array ? pdf_array_get(ctx, stmobj, i) : stmobj, &obj, &buf);
+		if (obj != prog->part_obj[i] || buf != prog->part_buf[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+	Compile a contents stream. Returns NULL if the cookie asked for
+	the compilation to stop, as what was compiled is incomplete.
+*/
+static pdf_compiled_stream *
+pdf_compile_stream(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *stmobj, fz_cookie *cookie)
+{
+	pdf_compiled_stream *prog;
+	pdf_csi csi;
+	pdf_lexbuf buf;
+	fz_stream *stm = NULL;
+	int i, n, aborted = 0;
+
+	fz_var(stm);
+
+	prog = fz_malloc_struct(ctx, pdf_compiled_stream);
+	FZ_INIT_STORABLE(prog, 1, pdf_drop_compiled_stream_imp);
+
+	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
+	pdf_init_csi(ctx, &csi, doc, rdb, &buf, cookie);
+
+	fz_try(ctx)
+	{
+		prog->rdb = pdf_keep_obj(ctx, rdb);
+		prog->is_array = pdf_is_array(ctx, stmobj);
+		n = prog->is_array ? pdf_array_len(ctx, stmobj) : 1;
+		prog->part_obj = fz_calloc(ctx, n, sizeof(*prog->part_obj));
+		prog->part_buf = fz_calloc(ctx, n, sizeof(*prog->part_buf));
+		prog->code = fz_new_buffer(ctx, 256);
+
+		stm = pdf_open_contents_stream(ctx, doc, stmobj);
+		pdf_process_stream(ctx, NULL, &csi, stm, prog);
+		aborted = cookie && cookie->abort;
+
+		/* Opening the stream has loaded all its parts. */
+		for (i = 0; i < n; i++)
+		{
+			pdf_obj *obj;
+			fz_buffer *sbuf;
+			compiled_stream_part(ctx, doc, prog->is_array ? pdf_array_get(ctx, stmobj, i) : stmobj, &obj, &sbuf);
+			prog->part_obj[i] = pdf_keep_obj(ctx, obj);
+			prog->part_buf[i] = fz_keep_buffer(ctx, sbuf);
+			prog->part_count = i + 1;
 		}
+
+		fz_trim_buffer(ctx, prog->code);
+		prog->size += sizeof(*prog) + fz_buffer_storage(ctx, prog->code, NULL);
+		prog->size += prog->obj_len * 64;
 	}
-	while (tok != PDF_TOK_EOF);
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		pdf_clear_stack(ctx, &csi);
+		pdf_lexbuf_fin(ctx, &buf);
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_compiled_stream(ctx, prog);
+		fz_rethrow(ctx);
+	}
+
+	if (aborted)
+	{
+		pdf_drop_compiled_stream(ctx, prog);
+		return NULL;
+	}
+
+	return prog;
+}
+
+/*
+	Find the compiled form of a contents stream, compiling it if
+	need be. Returns NULL if it cannot be kept in the store, or
+	cannot be compiled; it should then be run directly. Running it
+	would fail in the same way when data is still to arrive or the
+	work is being aborted, so those errors are thrown, unless the
+	cookie accepts an incomplete page: then the part of the stream
+	that has arrived is run directly, and nothing is compiled.
+*/
+static pdf_compiled_stream *
+pdf_load_compiled_stream(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *stmobj, fz_cookie *cookie)
+{
+	pdf_compiled_stream *prog;
+	pdf_obj *key;
+	int i, n;
+
+	fz_var(prog);
+
+	/* Streams are stored under their object, and arrays of them
+	 * under the array, or its first stream if it is not indirect. */
+	key = stmobj;
+	if (pdf_is_array(ctx, stmobj))
+	{
+		n = pdf_array_len(ctx, stmobj);
+		for (i = 0; i < n; i++)
+			if (!pdf_is_indirect(ctx, pdf_array_get(ctx, stmobj, i)))
+				return NULL;
+		if (!pdf_is_indirect(ctx, stmobj))
+			key = pdf_array_get(ctx, stmobj, 0);
+	}
+	if (!pdf_is_indirect(ctx, key))
+		return NULL;
+
+	prog = pdf_find_item(ctx, pdf_drop_compiled_stream_imp, key);
+	if (prog)
+	{
+		if (compiled_stream_is_current(ctx, doc, prog, rdb, stmobj))
+			return prog;
+		pdf_drop_compiled_stream(ctx, prog);
+		pdf_remove_item(ctx, pdf_drop_compiled_stream_imp, key);
+		prog = NULL;
+	}
+
+	fz_try(ctx)
+	{
+		prog = pdf_compile_stream(ctx, doc, rdb, stmobj, cookie);
+		if (prog)
+			pdf_store_item(ctx, key, prog, prog->size);
+	}
+	fz_catch(ctx)
+	{
+		if (fz_caught(ctx) == FZ_ERROR_TRYLATER && cookie && cookie->incomplete_ok)
+			return NULL;
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+		fz_rethrow_if(ctx, FZ_ERROR_ABORT);
+		/* If it was compiled but could not be stored, use it anyway. */
+		return prog;
+	}
+
+	return prog;
 }
 
 /* Functions to actually process annotations, glyphs and general stream objects */
 void
 pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_obj *rdb, pdf_obj *stmobj, fz_cookie *cookie)
 {
+	pdf_compiled_stream *prog = NULL;
 	pdf_csi csi;
 	pdf_lexbuf buf;
 	fz_stream *stm = NULL;
@@ -1025,6 +1597,7 @@ pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pd
 		return;
 
 	fz_var(stm);
+	fz_var(prog);
 
 	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
 	pdf_init_csi(ctx, &csi, doc, rdb, &buf, cookie);
@@ -1032,13 +1605,21 @@ pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pd
 	fz_try(ctx)
 	{
 		fz_defer_reap_start(ctx);
-		stm = pdf_open_contents_stream(ctx, doc, stmobj);
-		pdf_process_stream(ctx, proc, &csi, stm);
+		prog = pdf_load_compiled_stream(ctx, doc, rdb, stmobj, cookie);
+		if (prog)
+			pdf_replay_stream(ctx, proc, &csi, prog);
+		else
+		{
+			stm = pdf_open_contents_stream(ctx, doc, stmobj);
+			pdf_process_stream(ctx, proc, &csi, stm, NULL);
+		}
 		pdf_process_end(ctx, proc, &csi);
 	}
 	fz_always(ctx)
 	{
 		fz_defer_reap_end(ctx);
+		if (prog)
+			pdf_drop_compiled_stream(ctx, prog);
 		fz_drop_stream(ctx, stm);
 		pdf_clear_stack(ctx, &csi);
 		pdf_lexbuf_fin(ctx, &buf);
@@ -1106,7 +1687,7 @@ pdf_process_glyph(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_o
 	fz_try(ctx)
 	{
 		stm = fz_open_buffer(ctx, contents);
-		pdf_process_stream(ctx, proc, &csi, stm);
+		pdf_process_stream(ctx, proc, &csi, stm, NULL);
 		pdf_process_end(ctx, proc, &csi);
 	}
 	fz_always(ctx)
@@ -162,6 +162,20 @@ static int fast_atoi(char *s)
 	return neg ? -i : i;
 }
 
+static float
+lex_real(pdf_lexbuf *buf, char *isreal, int neg)
+{
+	/* We'd like to use the fastest possible atof
+	 * routine, but we'd rather match acrobats
+	 * handling of broken numbers. As such, we
+	 * spot common broken cases and call an
+	 * acrobat compatible routine where required. */
+	if (neg > 1 || isreal - buf->scratch >= 10)
+		return acrobat_compatible_atof(buf->scratch);
+	else
+		return fz_atof(buf->scratch);
+}
+
 static int
 lex_number(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf, int c)
 {
@@ -215,15 +229,7 @@ end:
 		return PDF_TOK_ERROR;
 	if (isreal)
 	{
-		/* We'd like to use the fastest possible atof
-		 * routine, but we'd rather match acrobats
-		 * handling of broken numbers. As such, we
-		 * spot common broken cases and call an
-		 * acrobat compatible routine where required. */
-		if (neg > 1 || isreal - buf->scratch >= 10)
-			buf->f = acrobat_compatible_atof(buf->scratch);
-		else
-			buf->f = fz_atof(buf->scratch);
+		buf->f = lex_real(buf, isreal, neg);
 		return PDF_TOK_REAL;
 	}
 	else
@@ -535,9 +541,193 @@ ptrdiff_t pdf_lexbuf_grow(fz_context *ctx, pdf_lexbuf *lb)
 	return lb->scratch - old;
 }
 
+/*
+	Fast paths for the lexer.
+
+	Content streams are mostly numbers and operators, separated by
+	single spaces. Rather than reading these a byte at a time, scan
+	them directly in the data the stream has buffered. Anything out
+	of the ordinary (strings, escapes in names, broken numbers, or a
+	token running up to the end of the buffered data) is left to the
+	byte at a time code.
+*/
+
+enum
+{
+	LEX_WHITE = 1,
+	LEX_DELIM = 2,
+	LEX_NUMBER = 4,
+	LEX_DIGIT = 8,
+	LEX_FALLBACK = -1
+};
+
+static const unsigned char lex_class[256] =
+{
+	1,0,0,0,0,0,0,0,0,1,1,0,1,1,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,0,0,0,0,2,0,0,2,2,0,4,0,4,4,2,
+	12,12,12,12,12,12,12,12,12,12,0,0,2,0,2,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+};
+
+/* As lex_number, for a number that starts at f->rp. */
+static int
+lex_number_fast(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
+{
+	unsigned char *p = f->rp;
+	unsigned char *e = f->wp;
+	char *s = buf->scratch;
+	char *se = buf->scratch + buf->size - 1;
+	char *isreal = NULL;
+	int neg = 0;
+	int i = 0;
+	int c;
+
+	c = *p++;
+	*s++ = c;
+	if (c == '-')
+	{
+		neg = 1;
+		while (p < e && *p == '-')
+			p++;
+	}
+	else if (c == '.')
+		isreal = buf->scratch;
+	else if (c != '+')
+		i = c - '0';
+
+	while (p < e && s < se)
+	{
+		c = *p;
+		if (lex_class[c] & LEX_DIGIT)
+		{
+			/* We deliberately ignore overflow here, as fast_atoi does. */
+			i = i * 10 + (c - '0');
+			*s++ = c;
+		}
+		else if (c == '.' && !isreal)
+		{
+			isreal = s;
+			*s++ = c;
+		}
+		else if (lex_class[c] & (LEX_WHITE | LEX_DELIM))
+		{
+			*s = '\0';
+			f->rp = p;
+			if (isreal)
+			{
+				buf->f = lex_real(buf, isreal, neg);
+				return PDF_TOK_REAL;
+			}
+			buf->i = neg ? -i : i;
+			return PDF_TOK_INT;
+		}
+		else
+			break;
+		p++;
+	}
+
+	return LEX_FALLBACK;
+}
+
+/* As lex_name, for a name that starts at p. */
+static int
+lex_name_fast(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf, unsigned char *p)
+{
+	unsigned char *s = p;
+	unsigned char *e = f->wp;
+	int n;
+
+	while (s < e && !(lex_class[*s] & (LEX_WHITE | LEX_DELIM)) && *s != '#')
+		s++;
+	n = s - p;
+	if (s == e || *s == '#' || n >= 127)
+		return LEX_FALLBACK;
+
+	memcpy(buf->scratch, p, n);
+	buf->scratch[n] = 0;
+	buf->len = n;
+	f->rp = s;
+	return 0;
+}
+
+static int
+lex_fast(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
+{
+	unsigned char *p = f->rp;
+	unsigned char *e = f->wp;
+	unsigned char *comment;
+	int c;
+
+	while (1)
+	{
+		while (p < e && (lex_class[*p] & LEX_WHITE))
+			p++;
+		if (p == e || *p != '%')
+			break;
+		comment = p;
+		while (p < e && *p != '\012' && *p != '\015')
+			p++;
+		if (p == e)
+		{
+			p = comment;
+			break;
+		}
+	}
+	f->rp = p;
+	if (p == e)
+		return LEX_FALLBACK;
+
+	c = *p;
+	switch (c)
+	{
+	case '[':
+		f->rp++;
+		return PDF_TOK_OPEN_ARRAY;
+	case ']':
+		f->rp++;
+		return PDF_TOK_CLOSE_ARRAY;
+	case '{':
+		f->rp++;
+		return PDF_TOK_OPEN_BRACE;
+	case '}':
+		f->rp++;
+		return PDF_TOK_CLOSE_BRACE;
+	case '/':
+		if (lex_name_fast(ctx, f, buf, p + 1) == LEX_FALLBACK)
+			return LEX_FALLBACK;
+		return PDF_TOK_NAME;
+	}
+
+	if (lex_class[c] & LEX_NUMBER)
+		return lex_number_fast(ctx, f, buf);
+	if (lex_class[c] & LEX_DELIM)
+		return LEX_FALLBACK;
+	if (lex_name_fast(ctx, f, buf, p) == LEX_FALLBACK)
+		return LEX_FALLBACK;
+	return pdf_token_from_keyword(buf->scratch);
+}
+
 pdf_token
 pdf_lex(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
 {
+#ifndef DUMP_LEXER_STREAM
+	int tok = lex_fast(ctx, f, buf);
+	if (tok != LEX_FALLBACK)
+		return tok;
+#endif
+
 	while (1)
 	{
 		int c = lex_byte(ctx, f);
@@ -593,6 +783,12 @@ pdf_lex(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
 pdf_token
 pdf_lex_no_string(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
 {
+#ifndef DUMP_LEXER_STREAM
+	int tok = lex_fast(ctx, f, buf);
+	if (tok != LEX_FALLBACK)
+		return tok;
+#endif
+
 	while (1)
 	{
 		int c = lex_byte(ctx, f);
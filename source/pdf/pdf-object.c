@@ -44,6 +44,7 @@ struct pdf_obj_s
 	short refs;
 	unsigned char kind;
 	unsigned char flags;
+	unsigned int arena; /* offset into its arena block, or 0 if malloced */
 };
 
 typedef struct pdf_obj_num_s
@@ -105,32 +106,177 @@ typedef struct pdf_obj_ref_s
 #define ARRAY(obj) ((pdf_obj_array *)(obj))
 #define REF(obj) ((pdf_obj_ref *)(obj))
 
+/*
+	Object arenas.
+
+	The objects parsed for one xref entry are carved out of a few
+	blocks rather than each being malloced on its own. They keep
+	their own reference counts as usual; each block counts the live
+	objects within it (plus one while the arena is still allocating
+	from it), and is freed when the last of them is dropped. As
+	objects of a shared document may be dropped by several threads
+	at once, the count is updated in the same way as reference
+	counts are.
+
+	A dict or array in an arena has its items stored straight after
+	it. If it needs to grow, the items are copied out to the heap.
+*/
+
+#define ARENA_ALIGN 8
+#define ARENA_FIRST_BLOCK 256
+#define ARENA_MAX_BLOCK (4<<10)
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(pdf_arena_block))
+
+typedef struct pdf_arena_block_s
+{
+	int live;
+} pdf_arena_block;
+
+struct pdf_obj_arena_s
+{
+	pdf_arena_block *block;
+	size_t pos, size;
+};
+
+pdf_obj_arena *
+pdf_new_obj_arena(fz_context *ctx)
+{
+	return fz_malloc_struct(ctx, pdf_obj_arena);
+}
+
+static void
+pdf_release_arena_block(fz_context *ctx, pdf_arena_block *block)
+{
+	int old;
+
+	FZ_REFS_LOCK(ctx);
+	old = fz_drop_refs(&block->live);
+	FZ_REFS_UNLOCK(ctx);
+	if (old == 1)
+		fz_free(ctx, block);
+}
+
+/*
+	Stop allocating from an arena. Objects already allocated from it
+	live on until they are dropped.
+*/
+void
+pdf_drop_obj_arena(fz_context *ctx, pdf_obj_arena *arena)
+{
+	if (!arena)
+		return;
+	if (arena->block)
+		pdf_release_arena_block(ctx, arena->block);
+	fz_free(ctx, arena);
+}
+
+static pdf_obj *
+pdf_arena_alloc(fz_context *ctx, pdf_obj_arena *arena, size_t size)
+{
+	pdf_arena_block *block;
+	pdf_obj *obj;
+
+	size = ARENA_ROUND(size);
+
+	/* Large objects get a block of their own. */
+	if (size > ARENA_MAX_BLOCK / 2)
+	{
+		block = fz_malloc(ctx, ARENA_HEADER + size);
+		block->live = 1;
+		obj = (pdf_obj *)((char *)block + ARENA_HEADER);
+		obj->arena = ARENA_HEADER;
+		return obj;
+	}
+
+	if (!arena->block || arena->pos + size > arena->size)
+	{
+		size_t next = arena->block ? arena->size * 2 : ARENA_FIRST_BLOCK;
+		while (next < ARENA_HEADER + size)
+			next *= 2;
+		if (next > ARENA_MAX_BLOCK)
+			next = ARENA_MAX_BLOCK;
+		block = fz_malloc(ctx, next);
+		block->live = 1;
+		if (arena->block)
+			pdf_release_arena_block(ctx, arena->block);
+		arena->block = block;
+		arena->pos = ARENA_HEADER;
+		arena->size = next;
+	}
+
+	obj = (pdf_obj *)((char *)arena->block + arena->pos);
+	obj->arena = (unsigned int)arena->pos;
+	FZ_REFS_LOCK(ctx);
+	(void)fz_keep_refs(&arena->block->live);
+	FZ_REFS_UNLOCK(ctx);
+	arena->pos += size;
+	return obj;
+}
+
+static void *
+pdf_alloc_obj(fz_context *ctx, pdf_obj_arena *arena, size_t size, int kind, const char *label)
+{
+	pdf_obj *obj;
+
+	if (arena)
+		obj = pdf_arena_alloc(ctx, arena, size);
+	else
+	{
+		obj = Memento_label(fz_malloc(ctx, size), label);
+		obj->arena = 0;
+	}
+	obj->refs = 1;
+	obj->kind = kind;
+	obj->flags = 0;
+	return obj;
+}
+
+static void
+pdf_free_obj(fz_context *ctx, pdf_obj *obj)
+{
+	if (obj->arena)
+		pdf_release_arena_block(ctx, (pdf_arena_block *)((char *)obj - obj->arena));
+	else
+		fz_free(ctx, obj);
+}
+
+/* Items stored straight after an arena dict or array, rather than malloced. */
+#define ARRAY_ITEMS_INLINE(obj) ((obj)->super.arena && (void *)(obj)->items == (void *)((obj) + 1))
+#define DICT_ITEMS_INLINE(obj) ((obj)->super.arena && (void *)(obj)->items == (void *)((obj) + 1))
+
 pdf_obj *
-pdf_new_int(fz_context *ctx, int64_t i)
+pdf_new_arena_int(fz_context *ctx, pdf_obj_arena *arena, int64_t i)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(int)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INT;
-	obj->super.flags = 0;
+	obj = pdf_alloc_obj(ctx, arena, sizeof(pdf_obj_num), PDF_INT, "pdf_obj(int)");
 	obj->u.i = i;
 	return &obj->super;
 }
 
 pdf_obj *
-pdf_new_real(fz_context *ctx, float f)
+pdf_new_int(fz_context *ctx, int64_t i)
+{
+	return pdf_new_arena_int(ctx, NULL, i);
+}
+
+pdf_obj *
+pdf_new_arena_real(fz_context *ctx, pdf_obj_arena *arena, float f)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(real)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_REAL;
-	obj->super.flags = 0;
+	obj = pdf_alloc_obj(ctx, arena, sizeof(pdf_obj_num), PDF_REAL, "pdf_obj(real)");
 	obj->u.f = f;
 	return &obj->super;
 }
 
 pdf_obj *
-pdf_new_string(fz_context *ctx, const char *str, size_t len)
+pdf_new_real(fz_context *ctx, float f)
+{
+	return pdf_new_arena_real(ctx, NULL, f);
+}
+
+pdf_obj *
+pdf_new_arena_string(fz_context *ctx, pdf_obj_arena *arena, const char *str, size_t len)
 {
 	pdf_obj_string *obj;
 	unsigned int l = (unsigned int)len;
@@ -138,10 +284,7 @@ pdf_new_string(fz_context *ctx, const char *str, size_t len)
 	if ((size_t)l != len)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Overflow in pdf string");
 
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj_string, buf) + len + 1), "pdf_obj(string)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_STRING;
-	obj->super.flags = 0;
+	obj = pdf_alloc_obj(ctx, arena, offsetof(pdf_obj_string, buf) + len + 1, PDF_STRING, "pdf_obj(string)");
 	obj->text = NULL;
 	obj->len = l;
 	memcpy(obj->buf, str, len);
@@ -150,7 +293,13 @@ pdf_new_string(fz_context *ctx, const char *str, size_t len)
 }
 
 pdf_obj *
-pdf_new_name(fz_context *ctx, const char *str)
+pdf_new_string(fz_context *ctx, const char *str, size_t len)
+{
+	return pdf_new_arena_string(ctx, NULL, str, len);
+}
+
+pdf_obj *
+pdf_new_arena_name(fz_context *ctx, pdf_obj_arena *arena, const char *str)
 {
 	pdf_obj_name *obj;
 	int l = 3; /* skip dummy slots */
@@ -167,28 +316,34 @@ pdf_new_name(fz_context *ctx, const char *str)
 			return (pdf_obj*)(intptr_t)m;
 	}
 
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj_name, n) + strlen(str) + 1), "pdf_obj(name)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_NAME;
-	obj->super.flags = 0;
+	obj = pdf_alloc_obj(ctx, arena, offsetof(pdf_obj_name, n) + strlen(str) + 1, PDF_NAME, "pdf_obj(name)");
 	strcpy(obj->n, str);
 	return &obj->super;
 }
 
 pdf_obj *
-pdf_new_indirect(fz_context *ctx, pdf_document *doc, int num, int gen)
+pdf_new_name(fz_context *ctx, const char *str)
+{
+	return pdf_new_arena_name(ctx, NULL, str);
+}
+
+pdf_obj *
+pdf_new_arena_indirect(fz_context *ctx, pdf_obj_arena *arena, pdf_document *doc, int num, int gen)
 {
 	pdf_obj_ref *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_ref)), "pdf_obj(indirect)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INDIRECT;
-	obj->super.flags = 0;
+	obj = pdf_alloc_obj(ctx, arena, sizeof(pdf_obj_ref), PDF_INDIRECT, "pdf_obj(indirect)");
 	obj->doc = doc;
 	obj->num = num;
 	obj->gen = gen;
 	return &obj->super;
 }
 
+pdf_obj *
+pdf_new_indirect(fz_context *ctx, pdf_document *doc, int num, int gen)
+{
+	return pdf_new_arena_indirect(ctx, NULL, doc, num, gen);
+}
+
 #define OBJ_IS_NULL(obj) (obj == PDF_NULL)
 #define OBJ_IS_BOOL(obj) (obj == PDF_TRUE || obj == PDF_FALSE)
 #define OBJ_IS_NAME(obj) ((obj > PDF_FALSE && obj < PDF_LIMIT) || (obj >= PDF_LIMIT && obj->kind == PDF_NAME))
@@ -551,43 +706,61 @@ pdf_objkindstr(pdf_obj *obj)
 }
 
 pdf_obj *
-pdf_new_array(fz_context *ctx, pdf_document *doc, int initialcap)
+pdf_new_arena_array(fz_context *ctx, pdf_obj_arena *arena, pdf_document *doc, int initialcap)
 {
 	pdf_obj_array *obj;
-	int i;
+	int i, cap = initialcap > 1 ? initialcap : 6;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_array)), "pdf_obj(array)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_ARRAY;
-	obj->super.flags = 0;
+	if (arena)
+	{
+		obj = pdf_alloc_obj(ctx, arena, sizeof(pdf_obj_array) + cap * sizeof(pdf_obj*), PDF_ARRAY, NULL);
+		obj->items = (pdf_obj **)(obj + 1);
+	}
+	else
+	{
+		obj = pdf_alloc_obj(ctx, NULL, sizeof(pdf_obj_array), PDF_ARRAY, "pdf_obj(array)");
+		fz_try(ctx)
+		{
+			obj->items = Memento_label(fz_malloc_array(ctx, cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
+		}
+		fz_catch(ctx)
+		{
+			fz_free(ctx, obj);
+			fz_rethrow(ctx);
+		}
+	}
 	obj->doc = doc;
 	obj->parent_num = 0;
 
 	obj->len = 0;
-	obj->cap = initialcap > 1 ? initialcap : 6;
+	obj->cap = cap;
 
-	fz_try(ctx)
-	{
-		obj->items = Memento_label(fz_malloc_array(ctx, obj->cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
-	}
-	fz_catch(ctx)
-	{
-		fz_free(ctx, obj);
-		fz_rethrow(ctx);
-	}
 	for (i = 0; i < obj->cap; i++)
 		obj->items[i] = NULL;
 
 	return &obj->super;
 }
 
+pdf_obj *
+pdf_new_array(fz_context *ctx, pdf_document *doc, int initialcap)
+{
+	return pdf_new_arena_array(ctx, NULL, doc, initialcap);
+}
+
 static void
 pdf_array_grow(fz_context *ctx, pdf_obj_array *obj)
 {
 	int i;
 	int new_cap = (obj->cap * 3) / 2;
 
-	obj->items = fz_resize_array(ctx, obj->items, new_cap, sizeof(pdf_obj*));
+	if (ARRAY_ITEMS_INLINE(obj))
+	{
+		pdf_obj **items = fz_malloc_array(ctx, new_cap, sizeof(pdf_obj*));
+		memcpy(items, obj->items, obj->len * sizeof(pdf_obj*));
+		obj->items = items;
+	}
+	else
+		obj->items = fz_resize_array(ctx, obj->items, new_cap, sizeof(pdf_obj*));
 	obj->cap = new_cap;
 
 	for (i = obj->len ; i < obj->cap; i++)
@@ -850,7 +1023,13 @@ pdf_obj *pdf_new_matrix(fz_context *ctx, pdf_document *doc, fz_matrix mtx)
 	return arr;
 }
 
-/* dicts may only have names as keys! */
+/*
+	dicts may only have names as keys!
+
+	Dictionaries are kept sorted by key as they are built, so that
+	lookups can binary search. The builtin names are listed in
+	strcmp order, so two of them compare by their enum values alone.
+*/
 
 static int keyvalcmp(const void *ap, const void *bp)
 {
@@ -879,30 +1058,36 @@ static int keyvalcmp(const void *ap, const void *bp)
 }
 
 pdf_obj *
-pdf_new_dict(fz_context *ctx, pdf_document *doc, int initialcap)
+pdf_new_arena_dict(fz_context *ctx, pdf_obj_arena *arena, pdf_document *doc, int initialcap)
 {
 	pdf_obj_dict *obj;
-	int i;
+	int i, cap = initialcap > 1 ? initialcap : 10;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_dict)), "pdf_obj(dict)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_DICT;
-	obj->super.flags = 0;
+	if (arena)
+	{
+		obj = pdf_alloc_obj(ctx, arena, sizeof(pdf_obj_dict) + cap * sizeof(struct keyval), PDF_DICT, NULL);
+		obj->items = (struct keyval *)(obj + 1);
+	}
+	else
+	{
+		obj = pdf_alloc_obj(ctx, NULL, sizeof(pdf_obj_dict), PDF_DICT, "pdf_obj(dict)");
+		fz_try(ctx)
+		{
+			obj->items = Memento_label(fz_malloc_array(ctx, cap, sizeof(struct keyval)), "pdf_obj(dict items)");
+		}
+		fz_catch(ctx)
+		{
+			fz_free(ctx, obj);
+			fz_rethrow(ctx);
+		}
+	}
+	obj->super.flags = PDF_FLAGS_SORTED;
 	obj->doc = doc;
 	obj->parent_num = 0;
 
 	obj->len = 0;
-	obj->cap = initialcap > 1 ? initialcap : 10;
+	obj->cap = cap;
 
-	fz_try(ctx)
-	{
-		DICT(obj)->items = Memento_label(fz_malloc_array(ctx, DICT(obj)->cap, sizeof(struct keyval)), "pdf_obj(dict items)");
-	}
-	fz_catch(ctx)
-	{
-		fz_free(ctx, obj);
-		fz_rethrow(ctx);
-	}
 	for (i = 0; i < DICT(obj)->cap; i++)
 	{
 		DICT(obj)->items[i].k = NULL;
@@ -912,13 +1097,26 @@ pdf_new_dict(fz_context *ctx, pdf_document *doc, int initialcap)
 	return &obj->super;
 }
 
+pdf_obj *
+pdf_new_dict(fz_context *ctx, pdf_document *doc, int initialcap)
+{
+	return pdf_new_arena_dict(ctx, NULL, doc, initialcap);
+}
+
 static void
 pdf_dict_grow(fz_context *ctx, pdf_obj *obj)
 {
 	int i;
 	int new_cap = (DICT(obj)->cap * 3) / 2;
 
-	DICT(obj)->items = fz_resize_array(ctx, DICT(obj)->items, new_cap, sizeof(struct keyval));
+	if (DICT_ITEMS_INLINE(DICT(obj)))
+	{
+		struct keyval *items = fz_malloc_array(ctx, new_cap, sizeof(struct keyval));
+		memcpy(items, DICT(obj)->items, DICT(obj)->len * sizeof(struct keyval));
+		DICT(obj)->items = items;
+	}
+	else
+		DICT(obj)->items = fz_resize_array(ctx, DICT(obj)->items, new_cap, sizeof(struct keyval));
 	DICT(obj)->cap = new_cap;
 
 	for (i = DICT(obj)->len; i < DICT(obj)->cap; i++)
@@ -1050,7 +1248,9 @@ pdf_dict_find(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 		int r = len - 1;
 		pdf_obj *k = DICT(obj)->items[r].k;
 
-		if (k == key || (k >= PDF_LIMIT && strcmp(NAME(k)->n, PDF_NAME_LIST[(intptr_t)key]) < 0))
+		if (k == key)
+			return r;
+		if (k < PDF_LIMIT ? k < key : strcmp(NAME(k)->n, PDF_NAME_LIST[(intptr_t)key]) < 0)
 		{
 			return -1 - (r+1);
 		}
@@ -1489,9 +1689,13 @@ pdf_dict_dels(fz_context *ctx, pdf_obj *obj, const char *key)
 	{
 		pdf_drop_obj(ctx, DICT(obj)->items[i].k);
 		pdf_drop_obj(ctx, DICT(obj)->items[i].v);
-		obj->flags &= ~PDF_FLAGS_SORTED;
-		DICT(obj)->items[i] = DICT(obj)->items[DICT(obj)->len-1];
+		/* Close the gap so that the order (sorted or not) is kept. */
+		memmove(&DICT(obj)->items[i],
+				&DICT(obj)->items[i + 1],
+				(DICT(obj)->len - i - 1) * sizeof(struct keyval));
 		DICT(obj)->len --;
+		DICT(obj)->items[DICT(obj)->len].k = NULL;
+		DICT(obj)->items[DICT(obj)->len].v = NULL;
 	}
 }
 
@@ -1576,22 +1780,143 @@ pdf_deep_copy_obj(fz_context *ctx, pdf_obj *obj)
 }
 
 /* obj marking and unmarking functions - to avoid infinite recursions. */
+
+/*
+	When a document is used by several threads at once, one thread
+	marking an object must not make it look marked to the others. So
+	the marks are then kept in a list for each context instead of in
+	the objects' flags. Marks nest, so the lists stay short; a list
+	is freed again when its last mark is removed.
+*/
+struct pdf_mark_list_s
+{
+	fz_context *ctx;
+	int len, max;
+	pdf_obj **list;
+	pdf_mark_list *next;
+};
+
+static pdf_document *
+threaded_doc(fz_context *ctx, pdf_obj *obj)
+{
+	pdf_document *doc = pdf_get_bound_document(ctx, obj);
+	return (doc && doc->threaded) ? doc : NULL;
+}
+
+/* Call with the document locked. */
+static pdf_mark_list **
+find_mark_list(fz_context *ctx, pdf_document *doc)
+{
+	pdf_mark_list **marks;
+	for (marks = &doc->marks; *marks; marks = &(*marks)->next)
+		if ((*marks)->ctx == ctx)
+			break;
+	return marks;
+}
+
+static int
+find_mark(pdf_mark_list *marks, pdf_obj *obj)
+{
+	int i;
+	if (marks)
+		for (i = marks->len - 1; i >= 0; i--)
+			if (marks->list[i] == obj)
+				return i;
+	return -1;
+}
+
+static int
+threaded_obj_marked(fz_context *ctx, pdf_document *doc, pdf_obj *obj)
+{
+	int marked;
+	pdf_lock_document(ctx, doc);
+	marked = find_mark(*find_mark_list(ctx, doc), obj) >= 0;
+	pdf_unlock_document(ctx, doc);
+	return marked;
+}
+
+static int
+threaded_mark_obj(fz_context *ctx, pdf_document *doc, pdf_obj *obj)
+{
+	pdf_mark_list **marksp, *marks;
+	int marked = 1;
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		marksp = find_mark_list(ctx, doc);
+		marks = *marksp;
+		if (find_mark(marks, obj) < 0)
+		{
+			if (!marks)
+			{
+				marks = fz_malloc_struct(ctx, pdf_mark_list);
+				marks->ctx = ctx;
+				*marksp = marks;
+			}
+			if (marks->len == marks->max)
+			{
+				int new_max = marks->max ? marks->max * 2 : 16;
+				marks->list = fz_resize_array(ctx, marks->list, new_max, sizeof(*marks->list));
+				marks->max = new_max;
+			}
+			marks->list[marks->len++] = obj;
+			marked = 0;
+		}
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return marked;
+}
+
+static void
+threaded_unmark_obj(fz_context *ctx, pdf_document *doc, pdf_obj *obj)
+{
+	pdf_mark_list **marksp, *marks;
+	int i;
+
+	pdf_lock_document(ctx, doc);
+	marksp = find_mark_list(ctx, doc);
+	marks = *marksp;
+	i = find_mark(marks, obj);
+	if (i >= 0)
+	{
+		memmove(&marks->list[i], &marks->list[i+1], (marks->len - i - 1) * sizeof(*marks->list));
+		if (--marks->len == 0)
+		{
+			*marksp = marks->next;
+			fz_free(ctx, marks->list);
+			fz_free(ctx, marks);
+		}
+	}
+	pdf_unlock_document(ctx, doc);
+}
+
 int
 pdf_obj_marked(fz_context *ctx, pdf_obj *obj)
 {
+	pdf_document *doc;
 	RESOLVE(obj);
 	if (obj < PDF_LIMIT)
 		return 0;
+	if ((doc = threaded_doc(ctx, obj)) != NULL)
+		return threaded_obj_marked(ctx, doc, obj);
 	return !!(obj->flags & PDF_FLAGS_MARKED);
 }
 
 int
 pdf_mark_obj(fz_context *ctx, pdf_obj *obj)
 {
+	pdf_document *doc;
 	int marked;
 	RESOLVE(obj);
 	if (obj < PDF_LIMIT)
 		return 0;
+	if ((doc = threaded_doc(ctx, obj)) != NULL)
+		return threaded_mark_obj(ctx, doc, obj);
 	marked = !!(obj->flags & PDF_FLAGS_MARKED);
 	obj->flags |= PDF_FLAGS_MARKED;
 	return marked;
@@ -1600,9 +1925,15 @@ pdf_mark_obj(fz_context *ctx, pdf_obj *obj)
 void
 pdf_unmark_obj(fz_context *ctx, pdf_obj *obj)
 {
+	pdf_document *doc;
 	RESOLVE(obj);
 	if (obj < PDF_LIMIT)
 		return;
+	if ((doc = threaded_doc(ctx, obj)) != NULL)
+	{
+		threaded_unmark_obj(ctx, doc, obj);
+		return;
+	}
 	obj->flags &= ~PDF_FLAGS_MARKED;
 }
 
@@ -1661,11 +1992,12 @@ pdf_drop_array(fz_context *ctx, pdf_obj *obj)
 {
 	int i;
 
-	for (i = 0; i < DICT(obj)->len; i++)
+	for (i = 0; i < ARRAY(obj)->len; i++)
 		pdf_drop_obj(ctx, ARRAY(obj)->items[i]);
 
-	fz_free(ctx, DICT(obj)->items);
-	fz_free(ctx, obj);
+	if (!ARRAY_ITEMS_INLINE(ARRAY(obj)))
+		fz_free(ctx, ARRAY(obj)->items);
+	pdf_free_obj(ctx, obj);
 }
 
 static void
@@ -1678,8 +2010,9 @@ pdf_drop_dict(fz_context *ctx, pdf_obj *obj)
 		pdf_drop_obj(ctx, DICT(obj)->items[i].v);
 	}
 
-	fz_free(ctx, DICT(obj)->items);
-	fz_free(ctx, obj);
+	if (!DICT_ITEMS_INLINE(DICT(obj)))
+		fz_free(ctx, DICT(obj)->items);
+	pdf_free_obj(ctx, obj);
 }
 
 pdf_obj *
@@ -1704,10 +2037,10 @@ pdf_drop_obj(fz_context *ctx, pdf_obj *obj)
 			else if (obj->kind == PDF_STRING)
 			{
 				fz_free(ctx, STRING(obj)->text);
-				fz_free(ctx, obj);
+				pdf_free_obj(ctx, obj);
 			}
 			else
-				fz_free(ctx, obj);
+				pdf_free_obj(ctx, obj);
 		}
 	}
 }
@@ -199,6 +199,8 @@ pdf_lookup_page_loc(fz_context *ctx, pdf_document *doc, int needle, pdf_obj **pa
 pdf_obj *
 pdf_lookup_page_obj(fz_context *ctx, pdf_document *doc, int needle)
 {
+	if (needle >= 0 && needle < doc->fwd_page_count && !doc->fwd_page_map_stale)
+		return doc->fwd_page_map[needle];
 	return pdf_lookup_page_loc(ctx, doc, needle, NULL, NULL);
 }
 
@@ -1057,18 +1059,8 @@ pdf_update_default_colorspaces(fz_context *ctx, fz_default_colorspaces *old_cs,
 	return new_cs;
 }
 
-/*
-	Load a page and its resources.
-
-	Locates the page in the PDF document and loads the page and its
-	resources. After pdf_load_page is it possible to retrieve the size
-	of the page using pdf_bound_page, or to render the page using
-	pdf_run_page_*.
-
-	number: page number, where 0 is the first page of the document.
-*/
-pdf_page *
-pdf_load_page(fz_context *ctx, pdf_document *doc, int number)
+static pdf_page *
+load_page(fz_context *ctx, pdf_document *doc, int number)
 {
 	pdf_page *page;
 	pdf_annot *annot;
@@ -1141,6 +1133,34 @@ pdf_load_page(fz_context *ctx, pdf_document *doc, int number)
 	return page;
 }
 
+/*
+	Load a page and its resources.
+
+	Locates the page in the PDF document and loads the page and its
+	resources. After pdf_load_page is it possible to retrieve the size
+	of the page using pdf_bound_page, or to render the page using
+	pdf_run_page_*.
+
+	number: page number, where 0 is the first page of the document.
+*/
+pdf_page *
+pdf_load_page(fz_context *ctx, pdf_document *doc, int number)
+{
+	pdf_page *page;
+
+	/* Loading annotations may update their appearance streams, so
+	 * keep other threads out of a threaded document meanwhile. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		page = load_page(ctx, doc, number);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return page;
+}
+
 /*
 	Delete a page from the page tree of
 	a document. This does not remove the page contents
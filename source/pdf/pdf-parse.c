@@ -313,8 +313,10 @@ pdf_new_text_string(fz_context *ctx, const char *s)
 	return pdf_new_string(ctx, s, i);
 }
 
-pdf_obj *
-pdf_parse_array(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf)
+static pdf_obj *parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf, pdf_obj_arena *arena);
+
+static pdf_obj *
+parse_array(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf, pdf_obj_arena *arena)
 {
 	pdf_obj *ary = NULL;
 	pdf_obj *obj = NULL;
@@ -324,7 +326,7 @@ pdf_parse_array(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf
 
 	fz_var(obj);
 
-	ary = pdf_new_array(ctx, doc, 4);
+	ary = pdf_new_arena_array(ctx, arena, doc, 4);
 
 	fz_try(ctx)
 	{
@@ -335,15 +337,15 @@ pdf_parse_array(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf
 			if (tok != PDF_TOK_INT && tok != PDF_TOK_R)
 			{
 				if (n > 0)
-					pdf_array_push_int(ctx, ary, a);
+					pdf_array_push_drop(ctx, ary, pdf_new_arena_int(ctx, arena, a));
 				if (n > 1)
-					pdf_array_push_int(ctx, ary, b);
+					pdf_array_push_drop(ctx, ary, pdf_new_arena_int(ctx, arena, b));
 				n = 0;
 			}
 
 			if (tok == PDF_TOK_INT && n == 2)
 			{
-				pdf_array_push_int(ctx, ary, a);
+				pdf_array_push_drop(ctx, ary, pdf_new_arena_int(ctx, arena, a));
 				a = b;
 				n --;
 			}
@@ -368,28 +370,28 @@ pdf_parse_array(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf
 			case PDF_TOK_R:
 				if (n != 2)
 					fz_throw(ctx, FZ_ERROR_SYNTAX, "cannot parse indirect reference in array");
-				pdf_array_push_drop(ctx, ary, pdf_new_indirect(ctx, doc, a, b));
+				pdf_array_push_drop(ctx, ary, pdf_new_arena_indirect(ctx, arena, doc, a, b));
 				n = 0;
 				break;
 
 			case PDF_TOK_OPEN_ARRAY:
-				obj = pdf_parse_array(ctx, doc, file, buf);
+				obj = parse_array(ctx, doc, file, buf, arena);
 				pdf_array_push_drop(ctx, ary, obj);
 				break;
 
 			case PDF_TOK_OPEN_DICT:
-				obj = pdf_parse_dict(ctx, doc, file, buf);
+				obj = parse_dict(ctx, doc, file, buf, arena);
 				pdf_array_push_drop(ctx, ary, obj);
 				break;
 
 			case PDF_TOK_NAME:
-				pdf_array_push_name(ctx, ary, buf->scratch);
+				pdf_array_push_drop(ctx, ary, pdf_new_arena_name(ctx, arena, buf->scratch));
 				break;
 			case PDF_TOK_REAL:
-				pdf_array_push_real(ctx, ary, buf->f);
+				pdf_array_push_drop(ctx, ary, pdf_new_arena_real(ctx, arena, buf->f));
 				break;
 			case PDF_TOK_STRING:
-				pdf_array_push_string(ctx, ary, buf->scratch, buf->len);
+				pdf_array_push_drop(ctx, ary, pdf_new_arena_string(ctx, arena, buf->scratch, buf->len));
 				break;
 			case PDF_TOK_TRUE:
 				pdf_array_push_bool(ctx, ary, 1);
@@ -417,8 +419,8 @@ end:
 	return op;
 }
 
-pdf_obj *
-pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf)
+static pdf_obj *
+parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf, pdf_obj_arena *arena)
 {
 	pdf_obj *dict;
 	pdf_obj *key = NULL;
@@ -426,7 +428,7 @@ pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *
 	pdf_token tok;
 	int64_t a, b;
 
-	dict = pdf_new_dict(ctx, doc, 8);
+	dict = pdf_new_arena_dict(ctx, arena, doc, 8);
 
 	fz_var(key);
 	fz_var(val);
@@ -447,23 +449,23 @@ pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *
 			if (tok != PDF_TOK_NAME)
 				fz_throw(ctx, FZ_ERROR_SYNTAX, "invalid key in dict");
 
-			key = pdf_new_name(ctx, buf->scratch);
+			key = pdf_new_arena_name(ctx, arena, buf->scratch);
 
 			tok = pdf_lex(ctx, file, buf);
 
 			switch (tok)
 			{
 			case PDF_TOK_OPEN_ARRAY:
-				val = pdf_parse_array(ctx, doc, file, buf);
+				val = parse_array(ctx, doc, file, buf, arena);
 				break;
 
 			case PDF_TOK_OPEN_DICT:
-				val = pdf_parse_dict(ctx, doc, file, buf);
+				val = parse_dict(ctx, doc, file, buf, arena);
 				break;
 
-			case PDF_TOK_NAME: val = pdf_new_name(ctx, buf->scratch); break;
-			case PDF_TOK_REAL: val = pdf_new_real(ctx, buf->f); break;
-			case PDF_TOK_STRING: val = pdf_new_string(ctx, buf->scratch, buf->len); break;
+			case PDF_TOK_NAME: val = pdf_new_arena_name(ctx, arena, buf->scratch); break;
+			case PDF_TOK_REAL: val = pdf_new_arena_real(ctx, arena, buf->f); break;
+			case PDF_TOK_STRING: val = pdf_new_arena_string(ctx, arena, buf->scratch, buf->len); break;
 			case PDF_TOK_TRUE: val = PDF_TRUE; break;
 			case PDF_TOK_FALSE: val = PDF_FALSE; break;
 			case PDF_TOK_NULL: val = PDF_NULL; break;
@@ -475,7 +477,7 @@ pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *
 				if (tok == PDF_TOK_CLOSE_DICT || tok == PDF_TOK_NAME ||
 					(tok == PDF_TOK_KEYWORD && !strcmp(buf->scratch, "ID")))
 				{
-					val = pdf_new_int(ctx, a);
+					val = pdf_new_arena_int(ctx, arena, a);
 					pdf_dict_put(ctx, dict, key, val);
 					pdf_drop_obj(ctx, val);
 					val = NULL;
@@ -489,7 +491,7 @@ pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *
 					tok = pdf_lex(ctx, file, buf);
 					if (tok == PDF_TOK_R)
 					{
-						val = pdf_new_indirect(ctx, doc, a, b);
+						val = pdf_new_arena_indirect(ctx, arena, doc, a, b);
 						break;
 					}
 				}
@@ -519,8 +521,8 @@ pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *
 	return dict;
 }
 
-pdf_obj *
-pdf_parse_stm_obj(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf)
+static pdf_obj *
+parse_stm_obj(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf, pdf_obj_arena *arena)
 {
 	pdf_token tok;
 
@@ -529,20 +531,49 @@ pdf_parse_stm_obj(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbu
 	switch (tok)
 	{
 	case PDF_TOK_OPEN_ARRAY:
-		return pdf_parse_array(ctx, doc, file, buf);
+		return parse_array(ctx, doc, file, buf, arena);
 	case PDF_TOK_OPEN_DICT:
-		return pdf_parse_dict(ctx, doc, file, buf);
-	case PDF_TOK_NAME: return pdf_new_name(ctx, buf->scratch);
-	case PDF_TOK_REAL: return pdf_new_real(ctx, buf->f);
-	case PDF_TOK_STRING: return pdf_new_string(ctx, buf->scratch, buf->len);
+		return parse_dict(ctx, doc, file, buf, arena);
+	case PDF_TOK_NAME: return pdf_new_arena_name(ctx, arena, buf->scratch);
+	case PDF_TOK_REAL: return pdf_new_arena_real(ctx, arena, buf->f);
+	case PDF_TOK_STRING: return pdf_new_arena_string(ctx, arena, buf->scratch, buf->len);
 	case PDF_TOK_TRUE: return PDF_TRUE;
 	case PDF_TOK_FALSE: return PDF_FALSE;
 	case PDF_TOK_NULL: return PDF_NULL;
-	case PDF_TOK_INT: return pdf_new_int(ctx, buf->i);
+	case PDF_TOK_INT: return pdf_new_arena_int(ctx, arena, buf->i);
 	default: fz_throw(ctx, FZ_ERROR_SYNTAX, "unknown token in object stream");
 	}
 }
 
+pdf_obj *
+pdf_parse_array(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf)
+{
+	return parse_array(ctx, doc, file, buf, NULL);
+}
+
+pdf_obj *
+pdf_parse_dict(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf)
+{
+	return parse_dict(ctx, doc, file, buf, NULL);
+}
+
+/* Parse an object from an object stream, into an arena of its own. */
+pdf_obj *
+pdf_parse_stm_obj(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf)
+{
+	pdf_obj_arena *arena = pdf_new_obj_arena(ctx);
+	pdf_obj *obj = NULL;
+
+	fz_try(ctx)
+		obj = parse_stm_obj(ctx, doc, file, buf, arena);
+	fz_always(ctx)
+		pdf_drop_obj_arena(ctx, arena);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return obj;
+}
+
 pdf_obj *
 pdf_parse_ind_obj(fz_context *ctx, pdf_document *doc,
 	fz_stream *file, pdf_lexbuf *buf,
@@ -554,8 +585,11 @@ pdf_parse_ind_obj(fz_context *ctx, pdf_document *doc,
 	pdf_token tok;
 	int64_t a, b;
 	int read_next_token = 1;
+	pdf_obj_arena *arena;
 
 	fz_var(obj);
+	fz_var(tok);
+	fz_var(read_next_token);
 
 	tok = pdf_lex(ctx, file, buf);
 	if (tok != PDF_TOK_INT)
@@ -585,55 +619,64 @@ pdf_parse_ind_obj(fz_context *ctx, pdf_document *doc,
 		fz_throw(ctx, FZ_ERROR_SYNTAX, "expected 'obj' keyword (%d %d ?)", num, gen);
 	}
 
-	tok = pdf_lex(ctx, file, buf);
-
-	switch (tok)
+	/* The object tree gets an arena of its own, so it is freed in one go. */
+	arena = pdf_new_obj_arena(ctx);
+	fz_try(ctx)
 	{
-	case PDF_TOK_OPEN_ARRAY:
-		obj = pdf_parse_array(ctx, doc, file, buf);
-		break;
-
-	case PDF_TOK_OPEN_DICT:
-		obj = pdf_parse_dict(ctx, doc, file, buf);
-		break;
-
-	case PDF_TOK_NAME: obj = pdf_new_name(ctx, buf->scratch); break;
-	case PDF_TOK_REAL: obj = pdf_new_real(ctx, buf->f); break;
-	case PDF_TOK_STRING: obj = pdf_new_string(ctx, buf->scratch, buf->len); break;
-	case PDF_TOK_TRUE: obj = PDF_TRUE; break;
-	case PDF_TOK_FALSE: obj = PDF_FALSE; break;
-	case PDF_TOK_NULL: obj = PDF_NULL; break;
-
-	case PDF_TOK_INT:
-		a = buf->i;
 		tok = pdf_lex(ctx, file, buf);
 
-		if (tok == PDF_TOK_STREAM || tok == PDF_TOK_ENDOBJ)
+		switch (tok)
 		{
-			obj = pdf_new_int(ctx, a);
-			read_next_token = 0;
+		case PDF_TOK_OPEN_ARRAY:
+			obj = parse_array(ctx, doc, file, buf, arena);
 			break;
-		}
-		else if (tok == PDF_TOK_INT)
-		{
-			b = buf->i;
+
+		case PDF_TOK_OPEN_DICT:
+			obj = parse_dict(ctx, doc, file, buf, arena);
+			break;
+
+		case PDF_TOK_NAME: obj = pdf_new_arena_name(ctx, arena, buf->scratch); break;
+		case PDF_TOK_REAL: obj = pdf_new_arena_real(ctx, arena, buf->f); break;
+		case PDF_TOK_STRING: obj = pdf_new_arena_string(ctx, arena, buf->scratch, buf->len); break;
+		case PDF_TOK_TRUE: obj = PDF_TRUE; break;
+		case PDF_TOK_FALSE: obj = PDF_FALSE; break;
+		case PDF_TOK_NULL: obj = PDF_NULL; break;
+
+		case PDF_TOK_INT:
+			a = buf->i;
 			tok = pdf_lex(ctx, file, buf);
-			if (tok == PDF_TOK_R)
+
+			if (tok == PDF_TOK_STREAM || tok == PDF_TOK_ENDOBJ)
 			{
-				obj = pdf_new_indirect(ctx, doc, a, b);
+				obj = pdf_new_arena_int(ctx, arena, a);
+				read_next_token = 0;
 				break;
 			}
-		}
-		fz_throw(ctx, FZ_ERROR_SYNTAX, "expected 'R' keyword (%d %d R)", num, gen);
+			else if (tok == PDF_TOK_INT)
+			{
+				b = buf->i;
+				tok = pdf_lex(ctx, file, buf);
+				if (tok == PDF_TOK_R)
+				{
+					obj = pdf_new_arena_indirect(ctx, arena, doc, a, b);
+					break;
+				}
+			}
+			fz_throw(ctx, FZ_ERROR_SYNTAX, "expected 'R' keyword (%d %d R)", num, gen);
 
-	case PDF_TOK_ENDOBJ:
-		obj = PDF_NULL;
-		read_next_token = 0;
-		break;
+		case PDF_TOK_ENDOBJ:
+			obj = PDF_NULL;
+			read_next_token = 0;
+			break;
 
-	default:
-		fz_throw(ctx, FZ_ERROR_SYNTAX, "syntax error in object (%d %d R)", num, gen);
+		default:
+			fz_throw(ctx, FZ_ERROR_SYNTAX, "syntax error in object (%d %d R)", num, gen);
+		}
 	}
+	fz_always(ctx)
+		pdf_drop_obj_arena(ctx, arena);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
 	fz_try(ctx)
 	{
@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "../fitz/fitz-imp.h"
 
 #include <string.h>
 
@@ -27,10 +28,9 @@ static void add_root(fz_context *ctx, pdf_obj *obj, pdf_obj ***roots, int *num_r
 	(*roots)[(*num_roots)++] = pdf_keep_obj(ctx, obj);
 }
 
-int
-pdf_repair_obj(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, int64_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id, pdf_obj **page, int64_t *tmpofs, pdf_obj **root)
+static int
+repair_obj(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf, int64_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id, pdf_obj **page, int64_t *tmpofs, pdf_obj **root)
 {
-	fz_stream *file = doc->file;
 	pdf_token tok;
 	int stm_len;
 
@@ -192,6 +192,12 @@ atobjend:
 	return tok;
 }
 
+int
+pdf_repair_obj(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, int64_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id, pdf_obj **page, int64_t *tmpofs, pdf_obj **root)
+{
+	return repair_obj(ctx, doc, doc->file, buf, stmofsp, stmlenp, encrypt, id, page, tmpofs, root);
+}
+
 static void
 pdf_repair_obj_stm(fz_context *ctx, pdf_document *doc, int stm_num)
 {
@@ -286,246 +292,606 @@ static int is_white(int c)
 	return c == '\x00' || c == '\x09' || c == '\x0a' || c == '\x0c' || c == '\x0d' || c == '\x20';
 }
 
-void
-pdf_repair_xref(fz_context *ctx, pdf_document *doc)
+/*
+	Scanning the file is split into finding the objects and trailer
+	dictionaries, which produces a sequence of events in file order,
+	and acting on those events in that order to build up the list of
+	objects and the trailer entries. This lets the finding be shared
+	out between threads.
+*/
+
+enum
 {
-	pdf_obj *dict, *obj = NULL;
-	pdf_obj *length;
+	REPAIR_EOF,
+	REPAIR_ERROR,
+	REPAIR_OBJ,
+	REPAIR_DICT
+};
+
+typedef struct
+{
+	int type;
+	/* '<num> <gen> obj', with the integers at numofs and genofs, and
+	 * the keyword (with any whitespace before it) from ofs to end. */
+	int num, gen;
+	int64_t numofs, genofs, ofs, end;
+	int64_t stm_ofs;
+	int stm_len;
+	/* Entries from a trailer or xref stream dictionary. */
+	pdf_obj *encrypt, *id, *root, *info;
+} repair_event;
+
+/* Why a scan stopped, and the object it stopped at (if any). */
+typedef struct
+{
+	int type; /* REPAIR_EOF, REPAIR_ERROR or REPAIR_OBJ */
+	repair_event ev;
+	int code;
+	char error[256];
+} repair_stop;
 
-	pdf_obj *encrypt = NULL;
-	pdf_obj *id = NULL;
-	pdf_obj **roots = NULL;
-	pdf_obj *info = NULL;
+typedef void (repair_emit_fn)(fz_context *ctx, void *arg, repair_event *ev);
 
-	struct entry *list = NULL;
+typedef struct
+{
+	pdf_obj *encrypt;
+	pdf_obj *id;
+	pdf_obj *info;
+	pdf_obj **roots;
+	int num_roots;
+	int max_roots;
+	struct entry *list;
 	int listlen;
 	int listcap;
-	int maxnum = 0;
+	int maxnum;
+} repair_state;
+
+static void
+drop_repair_event(fz_context *ctx, repair_event *ev)
+{
+	pdf_drop_obj(ctx, ev->encrypt);
+	pdf_drop_obj(ctx, ev->id);
+	pdf_drop_obj(ctx, ev->root);
+	pdf_drop_obj(ctx, ev->info);
+	ev->encrypt = ev->id = ev->root = ev->info = NULL;
+}
+
+/* Two scans that reach the same object in the same state carry on identically from there. */
+static int
+same_repair_obj(const repair_event *a, const repair_event *b)
+{
+	return a->num == b->num && a->gen == b->gen &&
+		a->numofs == b->numofs && a->genofs == b->genofs &&
+		a->ofs == b->ofs && a->end == b->end;
+}
+
+/*
+	Scan file from its current position for objects and trailer
+	dictionaries, passing each one to emit as it is found. emit
+	takes ownership of the objects in the event, even if it throws.
 
+	from: If not NULL, an object that an earlier scan stopped at,
+	to carry on from instead.
+
+	stop: If not -1, stop at the first object whose 'obj' keyword
+	is at or after this offset, without emitting it.
+
+	Returns why the scan stopped, and where, in *end. An object
+	that cannot be parsed stops the scan with REPAIR_ERROR; whether
+	to give up or make do with what has been found is left to the
+	caller.
+*/
+static void
+repair_scan(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_lexbuf *buf, const repair_event *from, int64_t stop, repair_emit_fn *emit, void *arg, repair_stop *end)
+{
+	repair_event ev;
 	int num = 0;
 	int gen = 0;
-	int64_t tmpofs, stm_ofs, numofs = 0, genofs = 0;
-	int stm_len;
+	int64_t tmpofs, numofs = 0, genofs = 0;
 	pdf_token tok;
-	int next;
-	int i;
-	size_t j, n;
 	int c;
-	pdf_lexbuf *buf = &doc->lexbuf.base;
-	int num_roots = 0;
-	int max_roots = 0;
-
-	fz_var(encrypt);
-	fz_var(id);
-	fz_var(roots);
-	fz_var(num_roots);
-	fz_var(max_roots);
-	fz_var(info);
-	fz_var(list);
-	fz_var(obj);
 
-	fz_warn(ctx, "repairing PDF document");
+	if (from)
+	{
+		num = from->num;
+		gen = from->gen;
+		numofs = from->numofs;
+		genofs = from->genofs;
+		tmpofs = from->ofs;
+		fz_seek(ctx, file, from->end, 0);
+		memset(end, 0, sizeof *end);
+		tok = PDF_TOK_OBJ;
+		goto have_next_token;
+	}
 
-	if (doc->repair_attempted)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "Repair failed already - not trying again");
-	doc->repair_attempted = 1;
+	memset(end, 0, sizeof *end);
 
-	doc->dirty = 1;
-	doc->freeze_updates = 1; /* Can't support incremental update after repair */
+	while (1)
+	{
+		tmpofs = fz_tell(ctx, file);
+		if (tmpofs < 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot tell in file");
 
-	pdf_forget_xref(ctx, doc);
+		fz_try(ctx)
+			tok = pdf_lex_no_string(ctx, file, buf);
+		fz_catch(ctx)
+		{
+			fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+			fz_warn(ctx, "skipping ahead to next token");
+			do
+				c = fz_read_byte(ctx, file);
+			while (c != EOF && !is_white(c));
+			continue;
+		}
 
-	fz_seek(ctx, doc->file, 0, 0);
+		/* If we have the next token already, then we'll jump
+		 * back here, rather than going through the top of
+		 * the loop. */
+	have_next_token:
 
-	fz_try(ctx)
-	{
-		pdf_xref_entry *entry;
-		listlen = 0;
-		listcap = 1024;
-		list = fz_malloc_array(ctx, listcap, sizeof(struct entry));
-
-		/* look for '%PDF' version marker within first kilobyte of file */
-		n = fz_read(ctx, doc->file, (unsigned char *)buf->scratch, fz_mini(buf->size, 1024));
+		if (tok == PDF_TOK_INT)
+		{
+			if (buf->i < 0)
+			{
+				num = 0;
+				gen = 0;
+				continue;
+			}
+			numofs = genofs;
+			num = gen;
+			genofs = tmpofs;
+			gen = buf->i;
+		}
 
-		fz_seek(ctx, doc->file, 0, 0);
-		if (n >= 4)
+		else if (tok == PDF_TOK_OBJ)
 		{
-			for (j = 0; j < n - 4; j++)
+			memset(&ev, 0, sizeof ev);
+			ev.type = REPAIR_OBJ;
+			ev.num = num;
+			ev.gen = gen;
+			ev.numofs = numofs;
+			ev.genofs = genofs;
+			ev.ofs = tmpofs;
+			ev.end = fz_tell(ctx, file);
+
+			if (stop >= 0 && ev.ofs >= stop)
 			{
-				if (memcmp(&buf->scratch[j], "%PDF", 4) == 0)
+				end->type = REPAIR_OBJ;
+				end->ev = ev;
+				return;
+			}
+
+			fz_try(ctx)
+				tok = repair_obj(ctx, doc, file, buf, &ev.stm_ofs, &ev.stm_len, &ev.encrypt, &ev.id, NULL, &tmpofs, &ev.root);
+			fz_catch(ctx)
+			{
+				if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
 				{
-					fz_seek(ctx, doc->file, (int64_t)(j + 8), 0); /* skip "%PDF-X.Y" */
-					break;
+					drop_repair_event(ctx, &ev);
+					fz_rethrow(ctx);
 				}
+				pdf_drop_obj(ctx, ev.root);
+				ev.root = NULL;
+				ev.type = REPAIR_ERROR;
+				end->type = REPAIR_ERROR;
+				end->ev = ev;
+				end->code = fz_caught(ctx);
+				fz_strlcpy(end->error, fz_caught_message(ctx), sizeof end->error);
+				return;
 			}
-		}
 
-		/* skip comment line after version marker since some generators
-		 * forget to terminate the comment with a newline */
-		c = fz_read_byte(ctx, doc->file);
-		while (c >= 0 && (c == ' ' || c == '%'))
-			c = fz_read_byte(ctx, doc->file);
-		fz_unread_byte(ctx, doc->file);
+			emit(ctx, arg, &ev);
+			goto have_next_token;
+		}
 
-		while (1)
+		/* If we find a dictionary it is probably the trailer,
+		 * but could be a stream (or bogus) dictionary caused
+		 * by a corrupt file. */
+		else if (tok == PDF_TOK_OPEN_DICT)
 		{
-			tmpofs = fz_tell(ctx, doc->file);
-			if (tmpofs < 0)
-				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot tell in file");
+			pdf_obj *dict;
 
 			fz_try(ctx)
-				tok = pdf_lex_no_string(ctx, doc->file, buf);
+			{
+				dict = pdf_parse_dict(ctx, doc, file, buf);
+			}
 			fz_catch(ctx)
 			{
 				fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
-				fz_warn(ctx, "skipping ahead to next token");
-				do
-					c = fz_read_byte(ctx, doc->file);
-				while (c != EOF && !is_white(c));
+				/* If this was the real trailer dict
+				 * it was broken, in which case we are
+				 * in trouble. Keep going though in
+				 * case this was just a bogus dict. */
 				continue;
 			}
 
-			/* If we have the next token already, then we'll jump
-			 * back here, rather than going through the top of
-			 * the loop. */
-		have_next_token:
+			memset(&ev, 0, sizeof ev);
+			ev.type = REPAIR_DICT;
+			ev.encrypt = pdf_keep_obj(ctx, pdf_dict_get(ctx, dict, PDF_NAME(Encrypt)));
+			ev.id = pdf_keep_obj(ctx, pdf_dict_get(ctx, dict, PDF_NAME(ID)));
+			ev.root = pdf_keep_obj(ctx, pdf_dict_get(ctx, dict, PDF_NAME(Root)));
+			ev.info = pdf_keep_obj(ctx, pdf_dict_get(ctx, dict, PDF_NAME(Info)));
+			pdf_drop_obj(ctx, dict);
+
+			emit(ctx, arg, &ev);
+		}
+
+		else if (tok == PDF_TOK_EOF)
+		{
+			end->type = REPAIR_EOF;
+			return;
+		}
+
+		else
+		{
+			num = 0;
+			gen = 0;
+		}
+	}
+}
 
-			if (tok == PDF_TOK_INT)
+/* Act on an event from a scan; events must come in file order. */
+static void
+apply_repair_event(fz_context *ctx, void *arg, repair_event *ev)
+{
+	repair_state *rs = arg;
+
+	fz_try(ctx)
+	{
+		if (ev->encrypt)
+		{
+			pdf_drop_obj(ctx, rs->encrypt);
+			rs->encrypt = pdf_keep_obj(ctx, ev->encrypt);
+		}
+
+		/* An ID in a trailer only replaces one we already have if
+		 * it goes with an Encrypt entry, or there is none yet. */
+		if (ev->id && (ev->type != REPAIR_DICT || !rs->id || !rs->encrypt || ev->encrypt))
+		{
+			pdf_drop_obj(ctx, rs->id);
+			rs->id = pdf_keep_obj(ctx, ev->id);
+		}
+
+		if (ev->root)
+			add_root(ctx, ev->root, &rs->roots, &rs->num_roots, &rs->max_roots);
+
+		if (ev->info)
+		{
+			pdf_drop_obj(ctx, rs->info);
+			rs->info = pdf_keep_obj(ctx, ev->info);
+		}
+
+		if (ev->type == REPAIR_OBJ)
+		{
+			if (ev->num <= 0 || ev->num > PDF_MAX_OBJECT_NUMBER)
+				fz_warn(ctx, "ignoring object with invalid object number (%d %d R)", ev->num, ev->gen);
+			else
 			{
-				if (buf->i < 0)
+				if (rs->listlen + 1 == rs->listcap)
 				{
-					num = 0;
-					gen = 0;
-					continue;
+					int listcap = (rs->listcap * 3) / 2;
+					rs->list = fz_resize_array(ctx, rs->list, listcap, sizeof(struct entry));
+					rs->listcap = listcap;
 				}
-				numofs = genofs;
-				num = gen;
-				genofs = tmpofs;
-				gen = buf->i;
+
+				rs->list[rs->listlen].num = ev->num;
+				rs->list[rs->listlen].gen = fz_clampi(ev->gen, 0, 65535);
+				rs->list[rs->listlen].ofs = ev->numofs;
+				rs->list[rs->listlen].stm_ofs = ev->stm_ofs;
+				rs->list[rs->listlen].stm_len = ev->stm_len;
+				rs->listlen ++;
+
+				if (ev->num > rs->maxnum)
+					rs->maxnum = ev->num;
 			}
+		}
+	}
+	fz_always(ctx)
+		drop_repair_event(ctx, ev);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
 
-			else if (tok == PDF_TOK_OBJ)
-			{
-				pdf_obj *root = NULL;
+static void
+apply_repair_stop(fz_context *ctx, repair_state *rs, repair_stop *end)
+{
+	if (end->type != REPAIR_ERROR)
+		return;
 
-				fz_try(ctx)
-				{
-					stm_len = 0;
-					stm_ofs = 0;
-					tok = pdf_repair_obj(ctx, doc, buf, &stm_ofs, &stm_len, &encrypt, &id, NULL, &tmpofs, &root);
-					if (root)
-						add_root(ctx, root, &roots, &num_roots, &max_roots);
-				}
-				fz_always(ctx)
-				{
-					pdf_drop_obj(ctx, root);
-				}
-				fz_catch(ctx)
-				{
-					fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
-					/* If we haven't seen a root yet, there is nothing
-					 * we can do, but give up. Otherwise, we'll make
-					 * do. */
-					if (!roots)
-						fz_rethrow(ctx);
-					fz_warn(ctx, "cannot parse object (%d %d R) - ignoring rest of file", num, gen);
-					break;
-				}
+	apply_repair_event(ctx, rs, &end->ev);
 
-				if (num <= 0 || num > PDF_MAX_OBJECT_NUMBER)
-				{
-					fz_warn(ctx, "ignoring object with invalid object number (%d %d R)", num, gen);
-					goto have_next_token;
-				}
+	/* If we haven't seen a root yet, there is nothing
+	 * we can do, but give up. Otherwise, we'll make
+	 * do. */
+	if (!rs->roots)
+		fz_throw(ctx, end->code, "%s", end->error);
+	fz_warn(ctx, "cannot parse object (%d %d R) - ignoring rest of file", end->ev.num, end->ev.gen);
+}
 
-				gen = fz_clampi(gen, 0, 65535);
+/*
+	Repairing a large file on several threads.
 
-				if (listlen + 1 == listcap)
-				{
-					listcap = (listcap * 3) / 2;
-					list = fz_resize_array(ctx, list, listcap, sizeof(struct entry));
-				}
+	The file is cut into chunks, and each is scanned separately from
+	an in-memory stream over the same data. Chunk 0 is scanned from
+	where the serial scan would start. The others are scanned from
+	their first byte, which may be in the middle of a token or a
+	stream, so their first few events may be wrong; but once a scan
+	reaches an object that the scan of the previous chunk stopped at,
+	in the same state, everything after is what the serial scan
+	would have found. So the events of each chunk are acted on from
+	that object; if they never fell into step, the chunk is scanned
+	again on this thread instead.
+*/
 
-				list[listlen].num = num;
-				list[listlen].gen = gen;
-				list[listlen].ofs = numofs;
-				list[listlen].stm_ofs = stm_ofs;
-				list[listlen].stm_len = stm_len;
-				listlen ++;
+#define REPAIR_CHUNK_SIZE (4 << 20)
 
-				if (num > maxnum)
-					maxnum = num;
+typedef struct
+{
+	int64_t start, end;
+	int failed;
+	int len, cap;
+	repair_event *ev;
+	repair_stop stop;
+} repair_chunk;
+
+typedef struct
+{
+	pdf_document *doc;
+	const unsigned char *data;
+	size_t len;
+	int count, next;
+	repair_chunk *chunk;
+} repair_job;
 
-				goto have_next_token;
-			}
+static void
+store_repair_event(fz_context *ctx, void *arg, repair_event *ev)
+{
+	repair_chunk *chunk = arg;
 
-			/* If we find a dictionary it is probably the trailer,
-			 * but could be a stream (or bogus) dictionary caused
-			 * by a corrupt file. */
-			else if (tok == PDF_TOK_OPEN_DICT)
-			{
-				fz_try(ctx)
-				{
-					dict = pdf_parse_dict(ctx, doc, doc->file, buf);
-				}
-				fz_catch(ctx)
-				{
-					fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
-					/* If this was the real trailer dict
-					 * it was broken, in which case we are
-					 * in trouble. Keep going though in
-					 * case this was just a bogus dict. */
-					continue;
-				}
+	if (chunk->len == chunk->cap)
+	{
+		int cap = chunk->cap ? chunk->cap * 2 : 256;
+		fz_try(ctx)
+			chunk->ev = fz_resize_array(ctx, chunk->ev, cap, sizeof(*chunk->ev));
+		fz_catch(ctx)
+		{
+			drop_repair_event(ctx, ev);
+			fz_rethrow(ctx);
+		}
+		chunk->cap = cap;
+	}
+	chunk->ev[chunk->len++] = *ev;
+}
 
-				fz_try(ctx)
-				{
-					obj = pdf_dict_get(ctx, dict, PDF_NAME(Encrypt));
-					if (obj)
-					{
-						pdf_drop_obj(ctx, encrypt);
-						encrypt = pdf_keep_obj(ctx, obj);
-					}
+static void
+scan_repair_chunk(fz_context *ctx, repair_job *job, repair_chunk *chunk)
+{
+	pdf_lexbuf_large *buf = NULL;
+	fz_stream *file = NULL;
 
-					obj = pdf_dict_get(ctx, dict, PDF_NAME(ID));
-					if (obj && (!id || !encrypt || pdf_dict_get(ctx, dict, PDF_NAME(Encrypt))))
-					{
-						pdf_drop_obj(ctx, id);
-						id = pdf_keep_obj(ctx, obj);
-					}
+	fz_var(buf);
+	fz_var(file);
 
-					obj = pdf_dict_get(ctx, dict, PDF_NAME(Root));
-					if (obj)
-						add_root(ctx, obj, &roots, &num_roots, &max_roots);
+	fz_try(ctx)
+	{
+		buf = fz_malloc_struct(ctx, pdf_lexbuf_large);
+		pdf_lexbuf_init(ctx, &buf->base, PDF_LEXBUF_LARGE);
+		file = fz_open_memory(ctx, job->data, job->len);
+		fz_seek(ctx, file, chunk->start, 0);
+		repair_scan(ctx, job->doc, file, &buf->base, NULL, chunk->end, store_repair_event, chunk, &chunk->stop);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, file);
+		if (buf)
+			pdf_lexbuf_fin(ctx, &buf->base);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+		chunk->failed = 1;
+}
 
-					obj = pdf_dict_get(ctx, dict, PDF_NAME(Info));
-					if (obj)
-					{
-						pdf_drop_obj(ctx, info);
-						info = pdf_keep_obj(ctx, obj);
-					}
-				}
-				fz_always(ctx)
-					pdf_drop_obj(ctx, dict);
-				fz_catch(ctx)
-					fz_rethrow(ctx);
+static void
+repair_worker(fz_context *ctx, void *arg)
+{
+	repair_job *job = arg;
+	int k;
 
-				obj = NULL;
-			}
+	while (1)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		k = job->next < job->count ? job->next++ : -1;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (k < 0)
+			break;
+		scan_repair_chunk(ctx, job, &job->chunk[k]);
+	}
+}
 
-			else if (tok == PDF_TOK_EOF)
-			{
+static int
+find_repair_obj(repair_chunk *chunk, const repair_event *obj)
+{
+	int i;
+	for (i = 0; i < chunk->len; i++)
+		if (chunk->ev[i].type == REPAIR_OBJ && same_repair_obj(&chunk->ev[i], obj))
+			return i;
+	return -1;
+}
+
+/*
+	Scan the file from ofs on several threads, acting on the events
+	as the serial scan would. Returns 0 (with the file still at ofs)
+	if the document has no function to run threads, or the file is
+	too small or not held in memory, so the serial scan should be
+	used instead.
+*/
+static int
+repair_scan_parallel(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, int64_t ofs, repair_state *rs, repair_stop *end)
+{
+	fz_stream *file = doc->file;
+	repair_job job = { 0 };
+	repair_event from;
+	int64_t len;
+	int i, k;
+
+	if (!doc->repair_parallel || doc->file_reading_linearly)
+		return 0;
+
+	/* The whole file is in the stream's buffer when it is mapped, or
+	 * opened from memory. */
+	fz_seek(ctx, file, 0, 2);
+	len = fz_tell(ctx, file);
+	fz_seek(ctx, file, 0, 0);
+	if (len < 2 * REPAIR_CHUNK_SIZE || file->wp - file->rp != len)
+	{
+		fz_seek(ctx, file, ofs, 0);
+		return 0;
+	}
+
+	job.doc = doc;
+	job.data = file->rp;
+	job.len = (size_t)len;
+	job.count = (int)(len / REPAIR_CHUNK_SIZE);
+	job.chunk = fz_calloc(ctx, job.count, sizeof(*job.chunk));
+	for (k = 0; k < job.count; k++)
+	{
+		job.chunk[k].start = k > 0 ? (int64_t)k * REPAIR_CHUNK_SIZE : ofs;
+		job.chunk[k].end = k + 1 < job.count ? (int64_t)(k + 1) * REPAIR_CHUNK_SIZE : -1;
+	}
+
+	fz_try(ctx)
+	{
+		doc->repair_parallel(ctx, doc->repair_parallel_opaque, repair_worker, &job);
+
+		for (k = 0; k < job.count; k++)
+		{
+			repair_chunk *chunk = &job.chunk[k];
+
+			if (k > 0 && end->type != REPAIR_OBJ)
 				break;
-			}
 
+			if (chunk->failed)
+				i = -1;
+			else if (k == 0)
+				i = 0;
 			else
+				i = find_repair_obj(chunk, &end->ev);
+
+			if (i >= 0)
 			{
-				num = 0;
-				gen = 0;
+				for (; i < chunk->len; i++)
+					apply_repair_event(ctx, rs, &chunk->ev[i]);
+				*end = chunk->stop;
+				memset(&chunk->stop, 0, sizeof chunk->stop);
+			}
+			else if (k > 0 && !chunk->failed && chunk->stop.type == REPAIR_OBJ && same_repair_obj(&chunk->stop.ev, &end->ev))
+			{
+				/* The object we are at runs right over this chunk. */
+			}
+			else
+			{
+				if (k > 0)
+					fz_warn(ctx, "rescanning part of file during repair");
+				from = end->ev;
+				if (k == 0)
+					fz_seek(ctx, file, ofs, 0);
+				repair_scan(ctx, doc, file, buf, k > 0 ? &from : NULL, chunk->end, apply_repair_event, rs, end);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		for (k = 0; k < job.count; k++)
+		{
+			for (i = 0; i < job.chunk[k].len; i++)
+				drop_repair_event(ctx, &job.chunk[k].ev[i]);
+			drop_repair_event(ctx, &job.chunk[k].stop.ev);
+			fz_free(ctx, job.chunk[k].ev);
+		}
+		fz_free(ctx, job.chunk);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return 1;
+}
+
+void
+pdf_repair_xref(fz_context *ctx, pdf_document *doc)
+{
+	pdf_obj *dict, *obj = NULL;
+	pdf_obj *length;
+
+	repair_state rs = { 0 };
+	repair_stop end;
+
+	pdf_xref_entry *entry;
+	int64_t ofs;
+	int next;
+	int i;
+	size_t j, n;
+	int c;
+	pdf_lexbuf *buf = &doc->lexbuf.base;
+
+	fz_var(obj);
+
+	memset(&end, 0, sizeof end);
+
+	fz_warn(ctx, "repairing PDF document");
+
+	if (doc->repair_attempted)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Repair failed already - not trying again");
+	doc->repair_attempted = 1;
+
+	doc->dirty = 1;
+	doc->freeze_updates = 1; /* Can't support incremental update after repair */
+
+	/* The page tree may come out different, so the page map from an
+	 * xref index can no longer be trusted. */
+	doc->fwd_page_map_stale = 1;
+
+	pdf_forget_xref(ctx, doc);
+
+	fz_seek(ctx, doc->file, 0, 0);
+
+	fz_try(ctx)
+	{
+		rs.listlen = 0;
+		rs.listcap = 1024;
+		rs.list = fz_malloc_array(ctx, rs.listcap, sizeof(struct entry));
+
+		/* look for '%PDF' version marker within first kilobyte of file */
+		n = fz_read(ctx, doc->file, (unsigned char *)buf->scratch, fz_mini(buf->size, 1024));
+
+		fz_seek(ctx, doc->file, 0, 0);
+		if (n >= 4)
+		{
+			for (j = 0; j < n - 4; j++)
+			{
+				if (memcmp(&buf->scratch[j], "%PDF", 4) == 0)
+				{
+					fz_seek(ctx, doc->file, (int64_t)(j + 8), 0); /* skip "%PDF-X.Y" */
+					break;
+				}
 			}
 		}
 
-		if (listlen == 0)
+		/* skip comment line after version marker since some generators
+		 * forget to terminate the comment with a newline */
+		c = fz_read_byte(ctx, doc->file);
+		while (c >= 0 && (c == ' ' || c == '%'))
+			c = fz_read_byte(ctx, doc->file);
+		fz_unread_byte(ctx, doc->file);
+
+		ofs = fz_tell(ctx, doc->file);
+		if (ofs < 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot tell in file");
+
+		if (!repair_scan_parallel(ctx, doc, buf, ofs, &rs, &end))
+			repair_scan(ctx, doc, doc->file, buf, NULL, -1, apply_repair_event, &rs, &end);
+		apply_repair_stop(ctx, &rs, &end);
+
+		if (rs.listlen == 0)
 			fz_throw(ctx, FZ_ERROR_GENERIC, "no objects found");
 
 		/* make xref reasonable */
@@ -536,9 +902,9 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 		*/
 		/* Ensure that the first xref table is a 'solid' one from
 		 * 0 to maxnum. */
-		pdf_ensure_solid_xref(ctx, doc, maxnum);
+		pdf_ensure_solid_xref(ctx, doc, rs.maxnum);
 
-		for (i = 1; i < maxnum; i++)
+		for (i = 1; i < rs.maxnum; i++)
 		{
 			entry = pdf_get_populating_xref_entry(ctx, doc, i);
 			if (entry->obj != NULL)
@@ -551,25 +917,25 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 			entry->stm_ofs = 0;
 		}
 
-		for (i = 0; i < listlen; i++)
+		for (i = 0; i < rs.listlen; i++)
 		{
-			entry = pdf_get_populating_xref_entry(ctx, doc, list[i].num);
+			entry = pdf_get_populating_xref_entry(ctx, doc, rs.list[i].num);
 			entry->type = 'n';
-			entry->ofs = list[i].ofs;
-			entry->gen = list[i].gen;
-			entry->num = list[i].num;
+			entry->ofs = rs.list[i].ofs;
+			entry->gen = rs.list[i].gen;
+			entry->num = rs.list[i].num;
 
-			entry->stm_ofs = list[i].stm_ofs;
+			entry->stm_ofs = rs.list[i].stm_ofs;
 
 			/* correct stream length for unencrypted documents */
-			if (!encrypt && list[i].stm_len >= 0)
+			if (!rs.encrypt && rs.list[i].stm_len >= 0)
 			{
 				pdf_obj *old_obj = NULL;
-				dict = pdf_load_object(ctx, doc, list[i].num);
+				dict = pdf_load_object(ctx, doc, rs.list[i].num);
 
 				fz_try(ctx)
 				{
-					length = pdf_new_int(ctx, list[i].stm_len);
+					length = pdf_new_int(ctx, rs.list[i].stm_len);
 					pdf_dict_get_put_drop(ctx, dict, PDF_NAME(Length), length, &old_obj);
 					if (old_obj)
 						orphan_object(ctx, doc, old_obj);
@@ -609,75 +975,77 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 		pdf_drop_obj(ctx, obj);
 		obj = NULL;
 
-		obj = pdf_new_int(ctx, maxnum + 1);
+		obj = pdf_new_int(ctx, rs.maxnum + 1);
 		pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Size), obj);
 		pdf_drop_obj(ctx, obj);
 		obj = NULL;
 
-		if (roots)
+		if (rs.roots)
 		{
-			for (i = num_roots-1; i > 0; i--)
+			for (i = rs.num_roots-1; i > 0; i--)
 			{
-				if (pdf_is_dict(ctx, roots[i]))
+				if (pdf_is_dict(ctx, rs.roots[i]))
 					break;
 			}
 			if (i >= 0)
 			{
-				pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Root), roots[i]);
+				pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Root), rs.roots[i]);
 			}
 		}
-		if (info)
+		if (rs.info)
 		{
-			pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Info), info);
-			pdf_drop_obj(ctx, info);
-			info = NULL;
+			pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Info), rs.info);
+			pdf_drop_obj(ctx, rs.info);
+			rs.info = NULL;
 		}
 
-		if (encrypt)
+		if (rs.encrypt)
 		{
-			if (pdf_is_indirect(ctx, encrypt))
+			if (pdf_is_indirect(ctx, rs.encrypt))
 			{
 				/* create new reference with non-NULL xref pointer */
-				obj = pdf_new_indirect(ctx, doc, pdf_to_num(ctx, encrypt), pdf_to_gen(ctx, encrypt));
-				pdf_drop_obj(ctx, encrypt);
-				encrypt = obj;
+				obj = pdf_new_indirect(ctx, doc, pdf_to_num(ctx, rs.encrypt), pdf_to_gen(ctx, rs.encrypt));
+				pdf_drop_obj(ctx, rs.encrypt);
+				rs.encrypt = obj;
 				obj = NULL;
 			}
-			pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Encrypt), encrypt);
-			pdf_drop_obj(ctx, encrypt);
-			encrypt = NULL;
+			pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(Encrypt), rs.encrypt);
+			pdf_drop_obj(ctx, rs.encrypt);
+			rs.encrypt = NULL;
 		}
 
-		if (id)
+		if (rs.id)
 		{
-			if (pdf_is_indirect(ctx, id))
+			if (pdf_is_indirect(ctx, rs.id))
 			{
 				/* create new reference with non-NULL xref pointer */
-				obj = pdf_new_indirect(ctx, doc, pdf_to_num(ctx, id), pdf_to_gen(ctx, id));
-				pdf_drop_obj(ctx, id);
-				id = obj;
+				obj = pdf_new_indirect(ctx, doc, pdf_to_num(ctx, rs.id), pdf_to_gen(ctx, rs.id));
+				pdf_drop_obj(ctx, rs.id);
+				rs.id = obj;
 				obj = NULL;
 			}
-			pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(ID), id);
-			pdf_drop_obj(ctx, id);
-			id = NULL;
+			pdf_dict_put(ctx, pdf_trailer(ctx, doc), PDF_NAME(ID), rs.id);
+			pdf_drop_obj(ctx, rs.id);
+			rs.id = NULL;
 		}
 
-		fz_free(ctx, list);
+		fz_free(ctx, rs.list);
+		rs.list = NULL;
 	}
 	fz_always(ctx)
 	{
-		for (i = 0; i < num_roots; i++)
-			pdf_drop_obj(ctx, roots[i]);
-		fz_free(ctx, roots);
+		drop_repair_event(ctx, &end.ev);
+		for (i = 0; i < rs.num_roots; i++)
+			pdf_drop_obj(ctx, rs.roots[i]);
+		fz_free(ctx, rs.roots);
 	}
 	fz_catch(ctx)
 	{
-		pdf_drop_obj(ctx, encrypt);
-		pdf_drop_obj(ctx, id);
+		pdf_drop_obj(ctx, rs.encrypt);
+		pdf_drop_obj(ctx, rs.id);
 		pdf_drop_obj(ctx, obj);
-		pdf_drop_obj(ctx, info);
-		fz_free(ctx, list);
+		pdf_drop_obj(ctx, rs.info);
+		fz_free(ctx, rs.list);
 		fz_rethrow(ctx);
 	}
 }
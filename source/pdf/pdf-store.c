@@ -67,8 +67,11 @@ pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, size_t itemsize)
 
 	assert(pdf_is_name(ctx, key) || pdf_is_array(ctx, key) || pdf_is_dict(ctx, key) || pdf_is_indirect(ctx, key));
 	existing = fz_store_item(ctx, key, val, itemsize, &pdf_obj_store_type);
-	assert(existing == NULL);
-	(void)existing; /* Silence warning in release builds */
+	/* Another thread using a threaded document may have stored its own
+	 * copy since we looked. Keep using ours; the store keeps theirs. */
+	assert(existing == NULL || pdf_get_bound_document(ctx, key)->threaded);
+	if (existing)
+		fz_drop_storable(ctx, existing);
 }
 
 void *
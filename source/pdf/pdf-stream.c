@@ -10,13 +10,24 @@ int
 pdf_obj_num_is_stream(fz_context *ctx, pdf_document *doc, int num)
 {
 	pdf_xref_entry *entry;
+	int is_stream;
 
 	if (num <= 0 || num >= pdf_xref_len(ctx, doc))
 		return 0;
 
-	entry = pdf_cache_object(ctx, doc, num);
+	/* The entry is only ours while the document is locked. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		entry = pdf_cache_object(ctx, doc, num);
+		is_stream = entry->stm_ofs != 0 || entry->stm_buf;
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
-	return entry->stm_ofs != 0 || entry->stm_buf;
+	return is_stream;
 }
 
 int
@@ -271,6 +282,40 @@ build_filter_chain(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_obj
 	return build_filter_chain_drop(ctx, fz_keep_stream(ctx, chain), doc, fs, ps, num, gen, params);
 }
 
+/*
+ * Other threads may be reading the file of a threaded document at
+ * the same time, so read all of the raw data at once while holding
+ * the document lock, and decode it from memory. Drops stm.
+ */
+static fz_stream *
+pdf_read_shared_stream(fz_context *ctx, pdf_document *doc, fz_stream *stm)
+{
+	fz_buffer *buf = NULL;
+	fz_stream *mem;
+
+	fz_var(buf);
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		buf = fz_read_all(ctx, stm, 0);
+	fz_always(ctx)
+	{
+		pdf_unlock_document(ctx, doc);
+		fz_drop_stream(ctx, stm);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	fz_try(ctx)
+		mem = fz_open_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return mem;
+}
+
 /*
  * Build a filter for reading raw stream data.
  * This is a null filter to constrain reading to the stream length (and to
@@ -306,6 +351,8 @@ pdf_open_raw_filter(fz_context *ctx, fz_stream *file_stm, pdf_document *doc, pdf
 	hascrypt = pdf_stream_has_crypt(ctx, stmobj);
 	len = pdf_dict_get_int(ctx, stmobj, PDF_NAME(Length));
 	null_stm = fz_open_endstream_filter(ctx, file_stm, len, offset);
+	if (doc->threaded && file_stm == doc->file)
+		null_stm = pdf_read_shared_stream(ctx, doc, null_stm);
 	if (doc->crypt && !hascrypt)
 	{
 		fz_try(ctx)
@@ -414,31 +461,51 @@ fz_stream *
 pdf_open_raw_stream_number(fz_context *ctx, pdf_document *doc, int num)
 {
 	pdf_xref_entry *x;
+	fz_stream *stm;
 	int orig_num, orig_gen;
 
 	if (num <= 0 || num >= pdf_xref_len(ctx, doc))
 		fz_throw(ctx, FZ_ERROR_GENERIC, "object id out of range (%d 0 R)", num);
 
-	x = pdf_cache_object(ctx, doc, num);
-	if (x->stm_ofs == 0)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "object is not a stream");
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		x = pdf_cache_object(ctx, doc, num);
+		if (x->stm_ofs == 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "object is not a stream");
+		stm = pdf_open_raw_filter(ctx, doc->file, doc, x->obj, num, &orig_num, &orig_gen, x->stm_ofs);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
-	return pdf_open_raw_filter(ctx, doc->file, doc, x->obj, num, &orig_num, &orig_gen, x->stm_ofs);
+	return stm;
 }
 
 static fz_stream *
 pdf_open_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compression_params *params)
 {
 	pdf_xref_entry *x;
+	fz_stream *stm;
 
 	if (num <= 0 || num >= pdf_xref_len(ctx, doc))
 		fz_throw(ctx, FZ_ERROR_GENERIC, "object id out of range (%d 0 R)", num);
 
-	x = pdf_cache_object(ctx, doc, num);
-	if (x->stm_ofs == 0 && x->stm_buf == NULL)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "object is not a stream");
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		x = pdf_cache_object(ctx, doc, num);
+		if (x->stm_ofs == 0 && x->stm_buf == NULL)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "object is not a stream");
+		stm = pdf_open_filter(ctx, doc, doc->file, x->obj, num, x->stm_ofs, params);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
-	return pdf_open_filter(ctx, doc, doc->file, x->obj, num, x->stm_ofs, params);
+	return stm;
 }
 
 /*
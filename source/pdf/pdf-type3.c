@@ -34,17 +34,6 @@ pdf_load_type3_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *d
 
 	fz_var(fontdesc);
 
-	/* Make a new type3 font entry in the document */
-	if (doc->num_type3_fonts == doc->max_type3_fonts)
-	{
-		int new_max = doc->max_type3_fonts * 2;
-
-		if (new_max == 0)
-			new_max = 4;
-		doc->type3_fonts = fz_resize_array(ctx, doc->type3_fonts, new_max, sizeof(*doc->type3_fonts));
-		doc->max_type3_fonts = new_max;
-	}
-
 	fz_try(ctx)
 	{
 		obj = pdf_dict_get(ctx, dict, PDF_NAME(Name));
@@ -185,7 +174,28 @@ pdf_load_type3_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *d
 		fz_rethrow(ctx);
 	}
 
-	doc->type3_fonts[doc->num_type3_fonts++] = fz_keep_font(ctx, font);
+	/* Make a new type3 font entry in the document */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		if (doc->num_type3_fonts == doc->max_type3_fonts)
+		{
+			int new_max = doc->max_type3_fonts * 2;
+
+			if (new_max == 0)
+				new_max = 4;
+			doc->type3_fonts = fz_resize_array(ctx, doc->type3_fonts, new_max, sizeof(*doc->type3_fonts));
+			doc->max_type3_fonts = new_max;
+		}
+		doc->type3_fonts[doc->num_type3_fonts++] = fz_keep_font(ctx, font);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+	{
+		pdf_drop_font(ctx, fontdesc);
+		fz_rethrow(ctx);
+	}
 
 	return fontdesc;
 }
@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "../fitz/fitz-imp.h"
 
 #include <zlib.h>
 
@@ -53,6 +54,23 @@ typedef struct {
 	page_objects *page[1];
 } page_objects_list;
 
+/*
+	When saving with a parallel function, the streams of the next batch
+	of objects to be written are loaded on the calling thread, and then
+	deflated together by the workers. copystream and expandstream pick
+	up the results as they reach each object, so the output is exactly
+	as if each stream had been deflated as it was written.
+*/
+typedef struct {
+	int num;
+	fz_buffer *buf; /* the stream data, as it would be loaded for writing */
+	fz_buffer *deflated; /* NULL if the worker failed */
+} deflate_job;
+
+/* Limits on the work loaded into memory at once for the workers. */
+#define DEFLATE_BATCH_JOBS 1024
+#define DEFLATE_BATCH_SIZE (64 << 20)
+
 struct pdf_write_state_s
 {
 	fz_output *out;
@@ -68,11 +86,20 @@ struct pdf_write_state_s
 	int do_linear;
 	int do_clean;
 	int do_decrypt;
+	int do_objstms;
+	int do_low_memory;
+
+	/* Streams deflated ahead of time on several threads */
+	pdf_parallel_fn *parallel;
+	void *parallel_opaque;
+	deflate_job *jobs;
+	int njobs, next_job, job_cursor;
 
 	int list_len;
 	int *use_list;
 	int64_t *ofs_list;
 	int *gen_list;
+	int *objstm_list;
 	int *renumber_map;
 	int continue_on_error;
 	int *errors;
@@ -642,6 +669,7 @@ expand_lists(fz_context *ctx, pdf_write_state *opts, int num)
 	opts->use_list = fz_resize_array(ctx, opts->use_list, num, sizeof(*opts->use_list));
 	opts->ofs_list = fz_resize_array(ctx, opts->ofs_list, num, sizeof(*opts->ofs_list));
 	opts->gen_list = fz_resize_array(ctx, opts->gen_list, num, sizeof(*opts->gen_list));
+	opts->objstm_list = fz_resize_array(ctx, opts->objstm_list, num, sizeof(*opts->objstm_list));
 	opts->renumber_map = fz_resize_array(ctx, opts->renumber_map, num, sizeof(*opts->renumber_map));
 	opts->rev_renumber_map = fz_resize_array(ctx, opts->rev_renumber_map, num, sizeof(*opts->rev_renumber_map));
 
@@ -650,6 +678,7 @@ expand_lists(fz_context *ctx, pdf_write_state *opts, int num)
 		opts->use_list[i] = 0;
 		opts->ofs_list[i] = 0;
 		opts->gen_list[i] = 0;
+		opts->objstm_list[i] = 0;
 		opts->renumber_map[i] = i;
 		opts->rev_renumber_map[i] = i;
 	}
@@ -657,111 +686,248 @@ expand_lists(fz_context *ctx, pdf_write_state *opts, int num)
 }
 
 /*
- * Scan for and remove duplicate objects (slow)
+ * Scan for and remove duplicate objects
  */
 
-static void removeduplicateobjs(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
+static void hashint(fz_md5 *md5, int tag, int64_t v)
 {
-	int num, other, max_num;
-	int xref_len = pdf_xref_len(ctx, doc);
+	unsigned char buf[9];
+	int i;
 
-	for (num = 1; num < xref_len; num++)
+	buf[0] = tag;
+	for (i = 1; i < 9; i++, v >>= 8)
+		buf[i] = v & 0xff;
+	fz_md5_update(md5, buf, 9);
+}
+
+/*
+	Fingerprint an object, such that any two objects that pdf_objcmp
+	considers equal hash the same.
+*/
+static void hashobj(fz_context *ctx, fz_md5 *md5, pdf_obj *obj)
+{
+	int i, n;
+
+	if (pdf_is_indirect(ctx, obj))
 	{
-		/* Only compare an object to objects preceding it */
-		for (other = 1; other < num; other++)
+		hashint(md5, 'R', pdf_to_num(ctx, obj));
+		hashint(md5, 'G', pdf_to_gen(ctx, obj));
+	}
+	else if (pdf_is_int(ctx, obj))
+		hashint(md5, 'i', pdf_to_int64(ctx, obj));
+	else if (pdf_is_real(ctx, obj))
+	{
+		float f = pdf_to_real(ctx, obj);
+		if (f != f)
+			hashint(md5, 'N', 0);
+		else
 		{
-			pdf_obj *a, *b;
-			int newnum, streama = 0, streamb = 0, differ = 0;
+			unsigned char buf[sizeof f];
+			if (f == 0)
+				f = 0; /* -0 compares equal to 0 */
+			memcpy(buf, &f, sizeof f);
+			fz_md5_update(md5, (const unsigned char *)"f", 1);
+			fz_md5_update(md5, buf, sizeof buf);
+		}
+	}
+	else if (pdf_is_name(ctx, obj))
+	{
+		const char *name = pdf_to_name(ctx, obj);
+		fz_md5_update(md5, (const unsigned char *)"n", 1);
+		fz_md5_update(md5, (const unsigned char *)name, strlen(name) + 1);
+	}
+	else if (pdf_is_string(ctx, obj))
+	{
+		n = pdf_to_str_len(ctx, obj);
+		hashint(md5, 's', n);
+		fz_md5_update(md5, (const unsigned char *)pdf_to_str_buf(ctx, obj), n);
+	}
+	else if (pdf_is_array(ctx, obj))
+	{
+		n = pdf_array_len(ctx, obj);
+		hashint(md5, 'a', n);
+		for (i = 0; i < n; i++)
+			hashobj(ctx, md5, pdf_array_get(ctx, obj, i));
+	}
+	else if (pdf_is_dict(ctx, obj))
+	{
+		/* pdf_objcmp compares entries in order, so we hash them in order too. */
+		n = pdf_dict_len(ctx, obj);
+		hashint(md5, 'd', n);
+		for (i = 0; i < n; i++)
+		{
+			hashobj(ctx, md5, pdf_dict_get_key(ctx, obj, i));
+			hashobj(ctx, md5, pdf_dict_get_val(ctx, obj, i));
+		}
+	}
+	else if (pdf_is_bool(ctx, obj))
+		hashint(md5, 'b', pdf_to_bool(ctx, obj));
+	else
+		hashint(md5, 'z', 0);
+}
 
-			if (num == other || !opts->use_list[num] || !opts->use_list[other])
-				continue;
+/*
+	Work out the fingerprint of an object, including the raw contents
+	of streams if we are going to compare those. Returns 0 if the
+	object is not a candidate for merging.
+*/
+static int hashobjnum(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, unsigned char digest[16])
+{
+	fz_buffer *buf = NULL;
+	fz_md5 md5;
+	int is_stream;
+	int ok = 0;
 
-			/* TODO: resolve indirect references to see if we can omit them */
+	fz_var(buf);
 
-			/*
-			 * Comparing stream objects data contents would take too long.
-			 *
-			 * pdf_obj_num_is_stream calls pdf_cache_object and ensures
-			 * that the xref table has the objects loaded.
-			 */
-			fz_try(ctx)
-			{
-				streama = pdf_obj_num_is_stream(ctx, doc, num);
-				streamb = pdf_obj_num_is_stream(ctx, doc, other);
-				differ = streama || streamb;
-				if (streama && streamb && opts->do_garbage >= 4)
-					differ = 0;
-			}
-			fz_catch(ctx)
+	fz_try(ctx)
+	{
+		/* pdf_obj_num_is_stream calls pdf_cache_object and ensures
+		 * that the xref table has the object loaded. */
+		is_stream = pdf_obj_num_is_stream(ctx, doc, num);
+
+		/* Comparing stream contents is only done when asked for. */
+		if (!is_stream || opts->do_garbage >= 4)
+		{
+			fz_md5_init(&md5);
+			hashint(&md5, 'S', is_stream);
+			hashobj(ctx, &md5, pdf_get_xref_entry(ctx, doc, num)->obj);
+			if (is_stream)
 			{
-				/* Assume different */
-				differ = 1;
+				unsigned char *data;
+				size_t len;
+				buf = pdf_load_raw_stream_number(ctx, doc, num);
+				len = fz_buffer_storage(ctx, buf, &data);
+				fz_md5_update(&md5, data, len);
 			}
-			if (differ)
+			fz_md5_final(&md5, digest);
+			ok = 1;
+		}
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+	{
+		/* Assume different */
+		ok = 0;
+	}
+
+	return ok;
+}
+
+static int sameobjs(fz_context *ctx, pdf_document *doc, int num, int other)
+{
+	pdf_obj *a = pdf_get_xref_entry(ctx, doc, num)->obj;
+	pdf_obj *b = pdf_get_xref_entry(ctx, doc, other)->obj;
+	fz_buffer *sa = NULL;
+	fz_buffer *sb = NULL;
+	int same = 0;
+
+	if (pdf_objcmp(ctx, a, b))
+		return 0;
+	if (!pdf_obj_num_is_stream(ctx, doc, num))
+		return 1;
+
+	/* Check to see if streams match too. */
+	fz_var(sa);
+	fz_var(sb);
+
+	fz_try(ctx)
+	{
+		unsigned char *dataa, *datab;
+		size_t lena, lenb;
+		sa = pdf_load_raw_stream_number(ctx, doc, num);
+		sb = pdf_load_raw_stream_number(ctx, doc, other);
+		lena = fz_buffer_storage(ctx, sa, &dataa);
+		lenb = fz_buffer_storage(ctx, sb, &datab);
+		if (lena == lenb && memcmp(dataa, datab, lena) == 0)
+			same = 1;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, sa);
+		fz_drop_buffer(ctx, sb);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return same;
+}
+
+/*
+	Objects are fingerprinted, and only compared in full with the
+	earlier objects that have the same fingerprint. Each object is
+	merged into the lowest numbered object that it matches.
+*/
+static void removeduplicateobjs(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
+{
+	int num, other, max_num;
+	int xref_len = pdf_xref_len(ctx, doc);
+	fz_hash_table *table = NULL;
+	int *next = NULL;
+	unsigned char digest[16];
+
+	fz_var(table);
+	fz_var(next);
+
+	fz_try(ctx)
+	{
+		table = fz_new_hash_table(ctx, 1024, sizeof digest, -1, NULL);
+
+		/* Chains of the distinct objects with each fingerprint */
+		next = fz_calloc(ctx, xref_len, sizeof(*next));
+
+		for (num = 1; num < xref_len; num++)
+		{
+			int last = 0;
+
+			if (!opts->use_list[num])
 				continue;
 
-			a = pdf_get_xref_entry(ctx, doc, num)->obj;
-			b = pdf_get_xref_entry(ctx, doc, other)->obj;
+			/* TODO: resolve indirect references to see if we can omit them */
 
-			if (pdf_objcmp(ctx, a, b))
+			if (!hashobjnum(ctx, doc, opts, num, digest))
 				continue;
 
-			if (streama && streamb)
+			other = (int)(intptr_t)fz_hash_insert(ctx, table, digest, (void *)(intptr_t)num);
+			for (; other != 0; other = next[other])
 			{
-				/* Check to see if streams match too. */
-				fz_buffer *sa = NULL;
-				fz_buffer *sb = NULL;
-
-				fz_var(sa);
-				fz_var(sb);
+				if (sameobjs(ctx, doc, num, other))
+					break;
+				last = other;
+			}
 
-				differ = 1;
-				fz_try(ctx)
-				{
-					unsigned char *dataa, *datab;
-					size_t lena, lenb;
-					sa = pdf_load_raw_stream_number(ctx, doc, num);
-					sb = pdf_load_raw_stream_number(ctx, doc, other);
-					lena = fz_buffer_storage(ctx, sa, &dataa);
-					lenb = fz_buffer_storage(ctx, sb, &datab);
-					if (lena == lenb && memcmp(dataa, datab, lena) == 0)
-						differ = 0;
-				}
-				fz_always(ctx)
-				{
-					fz_drop_buffer(ctx, sa);
-					fz_drop_buffer(ctx, sb);
-				}
-				fz_catch(ctx)
-				{
-					fz_rethrow(ctx);
-				}
-				if (differ)
-					continue;
+			if (other == 0)
+			{
+				/* A new object, unless this is the first with its fingerprint. */
+				if (last)
+					next[last] = num;
+				continue;
 			}
 
 			/* Keep the lowest numbered object */
-			newnum = fz_mini(num, other);
 			max_num = fz_maxi(num, other);
 			if (max_num >= opts->list_len)
 				expand_lists(ctx, opts, max_num);
-			opts->renumber_map[num] = newnum;
-			opts->renumber_map[other] = newnum;
-			opts->rev_renumber_map[newnum] = num; /* Either will do */
-			opts->use_list[fz_maxi(num, other)] = 0;
-
-			/* One duplicate was found, do not look for another */
-			break;
+			opts->renumber_map[num] = other;
+			opts->renumber_map[other] = other;
+			opts->rev_renumber_map[other] = num; /* Either will do */
+			opts->use_list[num] = 0;
 		}
 	}
+	fz_always(ctx)
+	{
+		fz_drop_hash_table(ctx, table);
+		fz_free(ctx, next);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
-/*
- * Renumber objects sequentially so the xref is more compact
- *
- * This code assumes that any opts->renumber_map[n] <= n for all n.
- */
-
 static void compactxref(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
 {
 	int num, newnum;
@@ -1662,6 +1828,73 @@ static fz_buffer *deflatebuf(fz_context *ctx, const unsigned char *p, size_t n)
 	return buf;
 }
 
+static void drop_deflate_jobs(fz_context *ctx, pdf_write_state *opts)
+{
+	int i;
+
+	for (i = 0; i < opts->njobs; i++)
+	{
+		fz_drop_buffer(ctx, opts->jobs[i].buf);
+		fz_drop_buffer(ctx, opts->jobs[i].deflated);
+	}
+	opts->njobs = 0;
+	opts->next_job = 0;
+	opts->job_cursor = 0;
+}
+
+/*
+	Called on each worker thread with its own context. Takes jobs
+	from the batch until there are none left.
+*/
+static void deflate_worker(fz_context *ctx, void *arg)
+{
+	pdf_write_state *opts = arg;
+	deflate_job *job;
+	unsigned char *data;
+	size_t len;
+
+	for (;;)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		job = opts->next_job < opts->njobs ? &opts->jobs[opts->next_job++] : NULL;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (!job)
+			break;
+
+		len = fz_buffer_storage(ctx, job->buf, &data);
+		fz_try(ctx)
+			job->deflated = deflatebuf(ctx, data, len);
+		fz_catch(ctx)
+		{
+			/* Leave it to be deflated (and any error reported) as it is written. */
+		}
+	}
+}
+
+/*
+	Hand over the stream data for an object loaded for the current
+	batch, and its deflated form if the workers managed to make it.
+	Returns NULL if the object has no job.
+*/
+static fz_buffer *take_deflate_job(fz_context *ctx, pdf_write_state *opts, int num, fz_buffer **deflated)
+{
+	deflate_job *job;
+	fz_buffer *buf;
+
+	/* Objects are written in the order the jobs were made. */
+	while (opts->job_cursor < opts->njobs && opts->jobs[opts->job_cursor].num < num)
+		opts->job_cursor++;
+	if (opts->job_cursor == opts->njobs || opts->jobs[opts->job_cursor].num != num)
+		return NULL;
+
+	job = &opts->jobs[opts->job_cursor++];
+	buf = job->buf;
+	*deflated = job->deflated;
+	job->buf = NULL;
+	job->deflated = NULL;
+	return buf;
+}
+
 static void write_data(fz_context *ctx, void *arg, const unsigned char *data, int len)
 {
 	fz_write_data(ctx, (fz_output *)arg, data, len);
@@ -1669,18 +1902,21 @@ static void write_data(fz_context *ctx, void *arg, const unsigned char *data, in
 
 static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int gen, int do_deflate)
 {
-	fz_buffer *tmp = NULL, *buf = NULL;
+	fz_buffer *tmp = NULL, *buf = NULL, *deflated = NULL;
 	pdf_obj *obj = NULL;
 	size_t len;
 	unsigned char *data;
 
 	fz_var(buf);
 	fz_var(tmp);
+	fz_var(deflated);
 	fz_var(obj);
 
 	fz_try(ctx)
 	{
-		buf = pdf_load_raw_stream_number(ctx, doc, num);
+		buf = take_deflate_job(ctx, opts, num, &deflated);
+		if (!buf)
+			buf = pdf_load_raw_stream_number(ctx, doc, num);
 		obj = pdf_copy_dict(ctx, obj_orig);
 
 		len = fz_buffer_storage(ctx, buf, &data);
@@ -1688,7 +1924,10 @@ static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 		{
 			size_t clen;
 			unsigned char *cdata;
-			tmp = deflatebuf(ctx, data, len);
+			if (deflated)
+				tmp = fz_keep_buffer(ctx, deflated);
+			else
+				tmp = deflatebuf(ctx, data, len);
 			clen = fz_buffer_storage(ctx, tmp, &cdata);
 			if (clen < len)
 			{
@@ -1728,6 +1967,7 @@ static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	fz_always(ctx)
 	{
 		fz_drop_buffer(ctx, tmp);
+		fz_drop_buffer(ctx, deflated);
 		fz_drop_buffer(ctx, buf);
 		pdf_drop_obj(ctx, obj);
 	}
@@ -1739,7 +1979,7 @@ static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 
 static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int gen, int do_deflate)
 {
-	fz_buffer *buf = NULL, *tmp = NULL;
+	fz_buffer *buf = NULL, *tmp = NULL, *deflated = NULL;
 	pdf_obj *obj = NULL;
 	int truncated = 0;
 	size_t len;
@@ -1747,13 +1987,18 @@ static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *op
 
 	fz_var(buf);
 	fz_var(tmp);
+	fz_var(deflated);
 	fz_var(obj);
 
 	fz_try(ctx)
 	{
-		buf = pdf_load_stream_truncated(ctx, doc, num, (opts->continue_on_error ? &truncated : NULL));
-		if (truncated && opts->errors)
-			(*opts->errors)++;
+		buf = take_deflate_job(ctx, opts, num, &deflated);
+		if (!buf)
+		{
+			buf = pdf_load_stream_truncated(ctx, doc, num, (opts->continue_on_error ? &truncated : NULL));
+			if (truncated && opts->errors)
+				(*opts->errors)++;
+		}
 
 		obj = pdf_copy_dict(ctx, obj_orig);
 		pdf_dict_del(ctx, obj, PDF_NAME(Filter));
@@ -1764,7 +2009,10 @@ static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *op
 		{
 			unsigned char *cdata;
 			size_t clen;
-			tmp = deflatebuf(ctx, data, len);
+			if (deflated)
+				tmp = fz_keep_buffer(ctx, deflated);
+			else
+				tmp = deflatebuf(ctx, data, len);
 			clen = fz_buffer_storage(ctx, tmp, &cdata);
 			if (clen < len)
 			{
@@ -1803,6 +2051,7 @@ static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *op
 	fz_always(ctx)
 	{
 		fz_drop_buffer(ctx, tmp);
+		fz_drop_buffer(ctx, deflated);
 		fz_drop_buffer(ctx, buf);
 		pdf_drop_obj(ctx, obj);
 	}
@@ -1902,6 +2151,21 @@ static int is_xml_metadata(fz_context *ctx, pdf_obj *obj)
 	return 0;
 }
 
+/* Decide whether a stream will be decompressed, and whether it will be deflated. */
+static void stream_write_mode(fz_context *ctx, pdf_write_state *opts, pdf_obj *obj, int *do_deflate, int *do_expand)
+{
+	*do_deflate = opts->do_compress;
+	*do_expand = opts->do_expand;
+	if (opts->do_compress_images && is_image_stream(ctx, obj))
+		*do_deflate = 1, *do_expand = 0;
+	if (opts->do_compress_fonts && is_font_stream(ctx, obj))
+		*do_deflate = 1, *do_expand = 0;
+	if (is_xml_metadata(ctx, obj))
+		*do_deflate = 0, *do_expand = 0;
+	if (is_jpx_stream(ctx, obj))
+		*do_deflate = 0, *do_expand = 0;
+}
+
 static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int gen, int skip_xrefs, int unenc)
 {
 	pdf_xref_entry *entry;
@@ -1965,16 +2229,8 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 	{
 		fz_try(ctx)
 		{
-			int do_deflate = opts->do_compress;
-			int do_expand = opts->do_expand;
-			if (opts->do_compress_images && is_image_stream(ctx, obj))
-				do_deflate = 1, do_expand = 0;
-			if (opts->do_compress_fonts && is_font_stream(ctx, obj))
-				do_deflate = 1, do_expand = 0;
-			if (is_xml_metadata(ctx, obj))
-				do_deflate = 0, do_expand = 0;
-			if (is_jpx_stream(ctx, obj))
-				do_deflate = 0, do_expand = 0;
+			int do_deflate, do_expand;
+			stream_write_mode(ctx, opts, obj, &do_deflate, &do_expand);
 			if (do_expand)
 				expandstream(ctx, doc, opts, obj, num, gen, do_deflate);
 			else
@@ -2112,7 +2368,10 @@ static void writexrefstreamsubsect(fz_context *ctx, pdf_document *doc, pdf_write
 	pdf_array_push_int(ctx, index, to - from);
 	for (num = from; num < to; num++)
 	{
-		fz_append_byte(ctx, fzbuf, opts->use_list[num] ? 1 : 0);
+		if (opts->objstm_list[num])
+			fz_append_byte(ctx, fzbuf, 2);
+		else
+			fz_append_byte(ctx, fzbuf, opts->use_list[num] ? 1 : 0);
 		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]>>24);
 		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]>>16);
 		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]>>8);
@@ -2237,6 +2496,174 @@ static void writexrefstream(fz_context *ctx, pdf_document *doc, pdf_write_state
 	}
 
 	doc->has_old_style_xrefs = 0;
+	doc->has_xref_streams = 1;
+}
+
+/*
+	In low memory mode, drop our copy of an object once it has been
+	written, so that only the offsets are kept. Objects that were
+	already loaded when the save began may have been changed, and
+	those with new stream contents exist only in memory, so they are
+	kept; anything else can be loaded from the file again if needed.
+*/
+static void
+evictobject(fz_context *ctx, pdf_document *doc, int num)
+{
+	pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+
+	if (entry->obj != NULL && !entry->marked && entry->stm_buf == NULL)
+	{
+		if (pdf_obj_refs(ctx, entry->obj) == 1)
+		{
+			pdf_drop_obj(ctx, entry->obj);
+			entry->obj = NULL;
+		}
+	}
+}
+
+/*
+ * Object streams
+ */
+
+/* Keep each object stream small enough to be decoded quickly on access,
+ * and its indices within the single byte used for them in the xref stream. */
+#define OBJSTM_MAX_OBJECTS 100
+
+static int
+can_pack_object(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num)
+{
+	int is_stream = 1;
+
+	/* Only generation 0 objects other than streams may be packed, and
+	 * the encryption dictionary must always stand alone. */
+	if (num == 0 || opts->gen_list[num] != 0 || num == opts->crypt_object_number)
+		return 0;
+
+	fz_try(ctx)
+		is_stream = pdf_obj_num_is_stream(ctx, doc, num);
+	fz_catch(ctx)
+	{
+		/* Leave broken objects to writeobject to deal with. */
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+	}
+
+	return !is_stream;
+}
+
+static void
+packobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, fz_output *out, int num)
+{
+	pdf_obj *obj = NULL;
+
+	fz_try(ctx)
+	{
+		obj = pdf_load_object(ctx, doc, num);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+		if (!opts->continue_on_error)
+			fz_rethrow(ctx);
+		if (opts->errors)
+			(*opts->errors)++;
+		fz_warn(ctx, "%s", fz_caught_message(ctx));
+	}
+
+	fz_try(ctx)
+	{
+		pdf_print_obj(ctx, out, obj, opts->do_tight, opts->do_ascii);
+		fz_write_byte(ctx, out, '\n');
+	}
+	fz_always(ctx)
+		pdf_drop_obj(ctx, obj);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	if (opts->do_low_memory)
+		evictobject(ctx, doc, num);
+}
+
+/* Pack the marked objects from num onwards into a new object stream, and
+ * write it. Returns the number of the first object not yet considered. */
+static int
+writeobjstm(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int xref_len)
+{
+	fz_buffer *index = NULL;
+	fz_buffer *body = NULL;
+	fz_output *out = NULL;
+	pdf_obj *dict = NULL;
+	int stm, n = 0;
+
+	fz_var(index);
+	fz_var(body);
+	fz_var(out);
+	fz_var(dict);
+
+	fz_try(ctx)
+	{
+		stm = pdf_create_object(ctx, doc);
+		expand_lists(ctx, opts, stm);
+
+		index = fz_new_buffer(ctx, 1024);
+		body = fz_new_buffer(ctx, 8192);
+		out = fz_new_output_with_buffer(ctx, body);
+
+		for (; num < xref_len && n < OBJSTM_MAX_OBJECTS; num++)
+		{
+			if (!opts->objstm_list[num])
+				continue;
+			fz_append_printf(ctx, index, "%d %d ", num, (int)fz_tell_output(ctx, out));
+			packobject(ctx, doc, opts, out, num);
+
+			/* The xref stream wants the stream number and index here. */
+			opts->ofs_list[num] = stm;
+			opts->gen_list[num] = n++;
+		}
+		fz_close_output(ctx, out);
+
+		dict = pdf_new_dict(ctx, doc, 4);
+		pdf_dict_put(ctx, dict, PDF_NAME(Type), PDF_NAME(ObjStm));
+		pdf_dict_put_int(ctx, dict, PDF_NAME(N), n);
+		pdf_dict_put_int(ctx, dict, PDF_NAME(First), fz_buffer_storage(ctx, index, NULL));
+		fz_append_buffer(ctx, index, body);
+		pdf_update_object(ctx, doc, stm, dict);
+		pdf_update_stream(ctx, doc, dict, index, 0);
+
+		opts->use_list[stm] = 1;
+		opts->gen_list[stm] = 0;
+		opts->ofs_list[stm] = fz_tell_output(ctx, opts->out);
+		copystream(ctx, doc, opts, dict, stm, 0, opts->do_compress || !opts->do_expand);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_buffer(ctx, body);
+		fz_drop_buffer(ctx, index);
+		pdf_drop_obj(ctx, dict);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return num;
+}
+
+/* Write all the objects held back by dowriteobject into object streams.
+ * Returns the new length of the xref. */
+static int
+writeobjstms(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int xref_len)
+{
+	int num = 1;
+
+	for (;;)
+	{
+		while (num < xref_len && !opts->objstm_list[num])
+			num++;
+		if (num == xref_len)
+			break;
+		num = writeobjstm(ctx, doc, opts, num, xref_len);
+	}
+
+	return pdf_xref_len(ctx, doc);
 }
 
 static void
@@ -2280,14 +2707,126 @@ dowriteobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num
 			padto(ctx, opts->out, opts->ofs_list[num]);
 		if (!opts->do_incremental || pdf_xref_is_incremental(ctx, doc, num))
 		{
+			/* Objects that can go into an object stream are written later. */
+			if (opts->do_objstms && can_pack_object(ctx, doc, opts, num))
+			{
+				opts->objstm_list[num] = 1;
+				return;
+			}
 			opts->ofs_list[num] = fz_tell_output(ctx, opts->out);
 			writeobject(ctx, doc, opts, num, opts->gen_list[num], 1, num == opts->crypt_object_number);
 		}
+		if (opts->do_low_memory)
+			evictobject(ctx, doc, num);
 	}
 	else
 		opts->use_list[num] = 0;
 }
 
+/* Load the stream data for an object, if it is a stream that will be deflated. */
+static fz_buffer *
+load_deflate_job(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num)
+{
+	pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+	fz_buffer *buf = NULL;
+	pdf_obj *obj = NULL;
+	pdf_obj *type;
+	int do_deflate, do_expand, truncated = 0;
+
+	if (entry->type != 'n')
+		return NULL;
+	if (opts->do_garbage && !opts->use_list[num])
+		return NULL;
+	if (opts->do_incremental && !pdf_xref_is_incremental(ctx, doc, num))
+		return NULL;
+
+	fz_var(buf);
+	fz_var(obj);
+
+	fz_try(ctx)
+	{
+		if (pdf_obj_num_is_stream(ctx, doc, num) && (entry->stm_ofs >= 0 || entry->stm_buf))
+		{
+			obj = pdf_load_object(ctx, doc, num);
+			type = pdf_dict_get(ctx, obj, PDF_NAME(Type));
+			stream_write_mode(ctx, opts, obj, &do_deflate, &do_expand);
+			if (!do_deflate || pdf_name_eq(ctx, type, PDF_NAME(ObjStm)) || pdf_name_eq(ctx, type, PDF_NAME(XRef)))
+				break;
+			if (do_expand)
+			{
+				buf = pdf_load_stream_truncated(ctx, doc, num, &truncated);
+				if (truncated)
+				{
+					/* Leave it to writeobject to report. */
+					fz_drop_buffer(ctx, buf);
+					buf = NULL;
+				}
+			}
+			else if (!pdf_dict_get(ctx, obj, PDF_NAME(Filter)))
+				buf = pdf_load_raw_stream_number(ctx, doc, num);
+		}
+	}
+	fz_always(ctx)
+		pdf_drop_obj(ctx, obj);
+	fz_catch(ctx)
+	{
+		/* Any errors will be met again, and dealt with, by writeobject. */
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+		fz_drop_buffer(ctx, buf);
+		buf = NULL;
+	}
+
+	return buf;
+}
+
+/*
+	Load the streams that will need deflating from the objects starting
+	at num, and have the workers deflate them. Returns the number of the
+	first object not covered by the batch.
+*/
+static int
+deflate_ahead(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int to)
+{
+	size_t size = 0;
+	fz_buffer *buf;
+
+	drop_deflate_jobs(ctx, opts);
+	if (!opts->jobs)
+		opts->jobs = fz_malloc_array(ctx, DEFLATE_BATCH_JOBS, sizeof(*opts->jobs));
+
+	for (; num < to && opts->njobs < DEFLATE_BATCH_JOBS && size < DEFLATE_BATCH_SIZE; num++)
+	{
+		buf = load_deflate_job(ctx, doc, opts, num);
+		if (buf)
+		{
+			deflate_job *job = &opts->jobs[opts->njobs++];
+			job->num = num;
+			job->buf = buf;
+			job->deflated = NULL;
+			size += fz_buffer_storage(ctx, buf, NULL);
+		}
+	}
+
+	if (opts->njobs > 0)
+		opts->parallel(ctx, opts->parallel_opaque, deflate_worker, opts);
+
+	return num;
+}
+
+static void
+writeobjectrange(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int from, int to, int pass)
+{
+	int num, batch_end = from;
+
+	for (num = from; num < to; num++)
+	{
+		if (opts->parallel && num == batch_end)
+			batch_end = deflate_ahead(ctx, doc, opts, num, to);
+		dowriteobject(ctx, doc, opts, num, pass);
+	}
+	drop_deflate_jobs(ctx, opts);
+}
+
 static void
 writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass)
 {
@@ -2312,19 +2851,16 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 		writexref(ctx, doc, opts, opts->start, pdf_xref_len(ctx, doc), 1, opts->main_xref_offset, 0);
 	}
 
-	for (num = opts->start+1; num < xref_len; num++)
-		dowriteobject(ctx, doc, opts, num, pass);
+	writeobjectrange(ctx, doc, opts, opts->start+1, xref_len, pass);
 	if (opts->do_linear && pass == 1)
 	{
 		int64_t offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
 		padto(ctx, opts->out, offset);
 	}
-	for (num = 1; num < opts->start; num++)
-	{
-		if (pass == 1)
+	if (pass == 1)
+		for (num = 1; num < opts->start; num++)
 			opts->ofs_list[num] += opts->hintstream_len;
-		dowriteobject(ctx, doc, opts, num, pass);
-	}
+	writeobjectrange(ctx, doc, opts, 1, opts->start, pass);
 }
 
 static int
@@ -2852,6 +3388,15 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->do_linear = in_opts->do_linear;
 	opts->do_clean = in_opts->do_clean;
 	opts->do_decrypt = in_opts->do_decrypt;
+	opts->do_objstms = in_opts->do_objstms;
+	opts->do_low_memory = in_opts->do_low_memory;
+	opts->parallel = in_opts->parallel;
+	opts->parallel_opaque = in_opts->parallel_opaque;
+	if (opts->do_objstms && doc->crypt && !opts->do_decrypt)
+	{
+		fz_warn(ctx, "cannot write object streams in encrypted files");
+		opts->do_objstms = 0;
+	}
 	opts->start = 0;
 	opts->main_xref_offset = INT_MIN;
 
@@ -2862,6 +3407,7 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->use_list = NULL;
 	opts->ofs_list = NULL;
 	opts->gen_list = NULL;
+	opts->objstm_list = NULL;
 	opts->renumber_map = NULL;
 	opts->rev_renumber_map = NULL;
 	opts->continue_on_error = in_opts->continue_on_error;
@@ -2876,6 +3422,9 @@ static void finalise_write_state(fz_context *ctx, pdf_write_state *opts)
 	fz_free(ctx, opts->use_list);
 	fz_free(ctx, opts->ofs_list);
 	fz_free(ctx, opts->gen_list);
+	fz_free(ctx, opts->objstm_list);
+	drop_deflate_jobs(ctx, opts);
+	fz_free(ctx, opts->jobs);
 	fz_free(ctx, opts->renumber_map);
 	fz_free(ctx, opts->rev_renumber_map);
 	pdf_drop_obj(ctx, opts->linear_l);
@@ -2903,6 +3452,8 @@ const char *fz_pdf_write_options_usage =
 	"\tsanitize: sanitize graphics commands in content streams\n"
 	"\tgarbage: garbage collect unused objects\n"
 	"\tincremental: write changes as incremental update\n"
+	"\tobjstms: pack objects into compressed object streams\n"
+	"\tlow-memory: drop objects from memory once written (not with compact or linearize)\n"
 	"\tcontinue-on-error: continue saving the document even if there is an error\n"
 	"\tor garbage=compact: ... and compact cross reference table\n"
 	"\tor garbage=deduplicate: ... and remove duplicate objects\n"
@@ -2950,6 +3501,10 @@ pdf_parse_write_options(fz_context *ctx, pdf_write_options *opts, const char *ar
 		opts->continue_on_error = fz_option_eq(val, "yes");
 	if (fz_has_option(ctx, args, "decrypt", &val))
 		opts->do_decrypt = fz_option_eq(val, "yes");
+	if (fz_has_option(ctx, args, "objstms", &val))
+		opts->do_objstms = fz_option_eq(val, "yes");
+	if (fz_has_option(ctx, args, "low-memory", &val))
+		opts->do_low_memory = fz_option_eq(val, "yes");
 	if (fz_has_option(ctx, args, "garbage", &val))
 	{
 		if (fz_option_eq(val, "yes"))
@@ -3051,15 +3606,27 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 		if (!opts->do_incremental)
 		{
 			pdf_ensure_solid_xref(ctx, doc, xref_len);
-			preloadobjstms(ctx, doc);
+			/* Objects in object streams only need loading before they
+			 * are renumbered, which the low memory mode never does. */
+			if (!opts->do_low_memory)
+				preloadobjstms(ctx, doc);
 			change_identity(ctx, doc);
 			xref_len = pdf_xref_len(ctx, doc); /* May have changed due to repair */
 			expand_lists(ctx, opts, xref_len);
 		}
 
+		/* Remember which objects were loaded before we started, so
+		 * that we only drop the ones we load ourselves. */
+		if (opts->do_low_memory)
+			pdf_mark_xref(ctx, doc);
+
 		/* Sweep & mark objects from the trailer */
 		if (opts->do_garbage >= 1 || opts->do_linear)
+		{
 			(void)markobj(ctx, doc, opts, pdf_trailer(ctx, doc));
+			if (opts->do_low_memory)
+				pdf_clear_xref_to_mark(ctx, doc);
+		}
 		else
 		{
 			xref_len = pdf_xref_len(ctx, doc); /* May have changed due to repair */
@@ -3140,7 +3707,16 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 		}
 		else
 		{
+			/* Object streams need PDF 1.5 */
+			if (opts->do_objstms && doc->version < 15)
+				doc->version = 15;
+
 			writeobjects(ctx, doc, opts, 0);
+			if (opts->do_objstms)
+			{
+				xref_len = writeobjstms(ctx, doc, opts, xref_len);
+				expand_lists(ctx, opts, xref_len);
+			}
 
 #ifdef DEBUG_WRITING
 			dump_object_details(ctx, doc, opts);
@@ -3182,7 +3758,10 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 			else
 			{
 				opts->first_xref_offset = fz_tell_output(ctx, opts->out);
-				writexref(ctx, doc, opts, 0, xref_len, 1, 0, opts->first_xref_offset);
+				if (opts->do_objstms)
+					writexrefstream(ctx, doc, opts, 0, xref_len, 1, 0, opts->first_xref_offset);
+				else
+					writexref(ctx, doc, opts, 0, xref_len, 1, 0, opts->first_xref_offset);
 			}
 
 			doc->xref_sections[0].end_ofs = fz_tell_output(ctx, opts->out);
@@ -3247,6 +3826,12 @@ void pdf_write_document(fz_context *ctx, pdf_document *doc, fz_output *out, pdf_
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with linearisation");
 	if (in_opts->do_incremental && in_opts->do_decrypt)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with decryption");
+	if (in_opts->do_incremental && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with object streams");
+	if (in_opts->do_linear && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't use object streams with linearisation");
+	if (in_opts->do_low_memory && (in_opts->do_garbage >= 2 || in_opts->do_linear))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't renumber objects when saving with low memory");
 	if (pdf_has_unsaved_sigs(ctx, doc) && !out->as_stream)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't write pdf that has unsaved sigs to a fz_output unless it supports fz_stream_from_output!");
 
@@ -3281,6 +3866,12 @@ void pdf_save_document(fz_context *ctx, pdf_document *doc, const char *filename,
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with linearisation");
 	if (in_opts->do_incremental && in_opts->do_decrypt)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with decryption");
+	if (in_opts->do_incremental && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with object streams");
+	if (in_opts->do_linear && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't use object streams with linearisation");
+	if (in_opts->do_low_memory && (in_opts->do_garbage >= 2 || in_opts->do_linear))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't renumber objects when saving with low memory");
 
 	if (in_opts->do_appearance > 0)
 	{
@@ -1,7 +1,9 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "../fitz/fitz-imp.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <string.h>
 
@@ -22,6 +24,459 @@ static inline int iswhite(int ch)
 		ch == '\014' || ch == '\015' || ch == '\040';
 }
 
+static void
+extend_xref_index(fz_context *ctx, pdf_document *doc, int newlen)
+{
+	int i;
+
+	doc->xref_index = fz_resize_array(ctx, doc->xref_index, newlen, sizeof(int));
+	for (i = doc->max_xref_len; i < newlen; i++)
+	{
+		doc->xref_index[i] = 0;
+	}
+	doc->max_xref_len = newlen;
+}
+
+/*
+ * on-demand xref sections
+ *
+ * An xref section describing a great many objects is only indexed
+ * when it is read: we note where each subsection of a table lies in
+ * the file, and keep the decoded data of an xref stream, but build
+ * no entries. Entries are read in a page at a time, as ordinary
+ * subsections, the first time one of them is asked for. Sources are
+ * applied in the order they were read, each only filling in entries
+ * that are still unset, exactly as when reading eagerly.
+ *
+ * Pages that hold no cached objects and have not been changed can
+ * be released again by pdf_clear_xref. Anything that changes an entry
+ * of a page must mark the page dirty, so that it is kept.
+ *
+ * A page that cannot be read in properly marks its section broken.
+ * Reading eagerly would have failed, and repaired the file, so the
+ * next object to be loaded repairs it instead of leaving holes.
+ */
+
+#define LAZY_XREF_MIN_OBJECTS (1<<16)
+#define LAZY_XREF_PAGE 1024
+
+typedef struct
+{
+	int start, len;
+	int64_t ofs; /* file offset of first table entry, or offset into data */
+	int width; /* bytes per table entry */
+	fz_buffer *data; /* decoded xref stream, or NULL for a table */
+	int w0, w1, w2;
+} pdf_xref_lazy_source;
+
+struct pdf_xref_lazy_s
+{
+	int num_sources, cap_sources;
+	pdf_xref_lazy_source *sources;
+	int num_pages;
+	pdf_xref_subsec **pages;
+	unsigned char *dirty;
+	int broken;
+};
+
+static void
+pdf_drop_xref_lazy(fz_context *ctx, pdf_xref_lazy *lazy)
+{
+	int i;
+
+	if (!lazy)
+		return;
+	for (i = 0; i < lazy->num_sources; i++)
+		fz_drop_buffer(ctx, lazy->sources[i].data);
+	fz_free(ctx, lazy->sources);
+	fz_free(ctx, lazy->pages);
+	fz_free(ctx, lazy->dirty);
+	fz_free(ctx, lazy);
+}
+
+/* Parse one 'oooooooooo ggggg n' entry of an xref table. */
+static void
+pdf_parse_old_xref_entry(fz_context *ctx, pdf_xref_entry *entry, char *s, char *e, int num)
+{
+	entry->num = num;
+
+	/* broken pdfs where line start with white space */
+	while (s < e && iswhite(*s))
+		s++;
+
+	if (s == e || !isdigit(*s))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "xref offset missing");
+	while (s < e && isdigit(*s))
+		entry->ofs = entry->ofs * 10 + *s++ - '0';
+
+	while (s < e && iswhite(*s))
+		s++;
+	if (s == e || !isdigit(*s))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "xref generation number missing");
+	while (s < e && isdigit(*s))
+		entry->gen = entry->gen * 10 + *s++ - '0';
+
+	while (s < e && iswhite(*s))
+		s++;
+	if (s == e || (*s != 'f' && *s != 'n' && *s != 'o'))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected xref type: 0x%x (%d %d R)", s == e ? 0 : *s, entry->num, entry->gen);
+	entry->type = *s;
+}
+
+static void
+pdf_decode_new_xref_entry(pdf_xref_entry *entry, const unsigned char *p, int w0, int w1, int w2, int num)
+{
+	int a = 0;
+	int64_t b = 0;
+	int c = 0;
+	int n, t;
+
+	for (n = 0; n < w0; n++)
+		a = (a << 8) + *p++;
+	for (n = 0; n < w1; n++)
+		b = (b << 8) + *p++;
+	for (n = 0; n < w2; n++)
+		c = (c << 8) + *p++;
+
+	t = w0 ? a : 1;
+	entry->type = t == 0 ? 'f' : t == 1 ? 'n' : t == 2 ? 'o' : 0;
+	entry->ofs = w1 ? b : 0;
+	entry->gen = w2 ? c : 0;
+	entry->num = num;
+}
+
+/* Fill in the unset entries of a page from one source. */
+static void
+pdf_fill_lazy_xref_page(fz_context *ctx, pdf_document *doc, pdf_xref_lazy *lazy, pdf_xref_lazy_source *src, pdf_xref_subsec *sub)
+{
+	int lo = fz_maxi(src->start, sub->start);
+	int hi = fz_mini(src->start + src->len, sub->start + sub->len);
+	unsigned char *data = NULL;
+	int64_t pos;
+	int i;
+
+	if (lo >= hi)
+		return;
+
+	if (src->data)
+	{
+		int w = src->w0 + src->w1 + src->w2;
+		unsigned char *p;
+		fz_buffer_storage(ctx, src->data, &p);
+		p += src->ofs + (int64_t)(lo - src->start) * w;
+		for (i = lo; i < hi; i++, p += w)
+		{
+			pdf_xref_entry *entry = &sub->table[i - sub->start];
+			if (!entry->type)
+			{
+				pdf_decode_new_xref_entry(entry, p, src->w0, src->w1, src->w2, i);
+				if (entry->type == 'n' && entry->ofs == 0)
+					entry->type = 'f';
+			}
+		}
+		return;
+	}
+
+	fz_var(data);
+
+	pos = fz_tell(ctx, doc->file);
+	fz_try(ctx)
+	{
+		size_t n = (size_t)(hi - lo) * src->width;
+		data = fz_malloc(ctx, n);
+		fz_seek(ctx, doc->file, src->ofs + (int64_t)(lo - src->start) * src->width, SEEK_SET);
+		if (fz_read(ctx, doc->file, data, n) != n)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected EOF in xref table");
+
+		for (i = lo; i < hi; i++)
+		{
+			pdf_xref_entry *entry = &sub->table[i - sub->start];
+			char rec[21];
+
+			if (entry->type)
+				continue;
+
+			memcpy(rec, data + (size_t)(i - lo) * src->width, src->width);
+			rec[src->width] = 0;
+			memset(entry, 0, sizeof *entry);
+			fz_try(ctx)
+			{
+				/* Every entry must be as wide as the first. */
+				if (!iswhite(rec[src->width - 1]))
+					fz_throw(ctx, FZ_ERROR_GENERIC, "xref entry has the wrong length");
+				pdf_parse_old_xref_entry(ctx, entry, rec, rec + src->width, i);
+				/* "0000000000 * n" means free, according to some producers */
+				if (entry->type == 'n' && entry->ofs == 0)
+					entry->type = 'f';
+			}
+			fz_catch(ctx)
+			{
+				fz_warn(ctx, "broken xref entry (%d 0 R): %s", i, fz_caught_message(ctx));
+				memset(entry, 0, sizeof *entry);
+				lazy->broken = 1;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, data);
+		fz_seek(ctx, doc->file, pos, SEEK_SET);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot read xref entries %d to %d: %s", lo, hi - 1, fz_caught_message(ctx));
+		lazy->broken = 1;
+	}
+}
+
+/*
+	Return the page holding entry num of an on-demand section, reading
+	it in if needed. Unless create is set, returns NULL if no source
+	covers that page.
+*/
+static pdf_xref_subsec *
+pdf_lazy_xref_page(fz_context *ctx, pdf_document *doc, pdf_xref *xref, int num, int create)
+{
+	pdf_xref_lazy *lazy = xref->lazy;
+	pdf_xref_subsec *sub;
+	int p = num / LAZY_XREF_PAGE;
+	int lo = p * LAZY_XREF_PAGE;
+	int i;
+
+	if (p < lazy->num_pages && lazy->pages[p])
+		return lazy->pages[p];
+
+	if (!create)
+	{
+		for (i = 0; i < lazy->num_sources; i++)
+		{
+			pdf_xref_lazy_source *src = &lazy->sources[i];
+			if (src->start < lo + LAZY_XREF_PAGE && src->start + src->len > lo)
+				break;
+		}
+		if (i == lazy->num_sources)
+			return NULL;
+	}
+
+	if (p >= lazy->num_pages)
+	{
+		lazy->pages = fz_resize_array(ctx, lazy->pages, p + 1, sizeof(*lazy->pages));
+		lazy->dirty = fz_resize_array(ctx, lazy->dirty, p + 1, sizeof(*lazy->dirty));
+		for (i = lazy->num_pages; i <= p; i++)
+		{
+			lazy->pages[i] = NULL;
+			lazy->dirty[i] = 0;
+		}
+		lazy->num_pages = p + 1;
+	}
+
+	sub = fz_malloc_struct(ctx, pdf_xref_subsec);
+	fz_try(ctx)
+		sub->table = fz_calloc(ctx, LAZY_XREF_PAGE, sizeof(pdf_xref_entry));
+	fz_catch(ctx)
+	{
+		fz_free(ctx, sub);
+		fz_rethrow(ctx);
+	}
+	sub->start = lo;
+	sub->len = LAZY_XREF_PAGE;
+
+	for (i = 0; i < lazy->num_sources; i++)
+		pdf_fill_lazy_xref_page(ctx, doc, lazy, &lazy->sources[i], sub);
+
+	sub->next = xref->subsec;
+	xref->subsec = sub;
+	lazy->pages[p] = sub;
+	lazy->dirty[p] = 0;
+
+	if (num >= xref->num_objects)
+	{
+		xref->num_objects = num + 1;
+		if (doc->max_xref_len < num + 1)
+			extend_xref_index(ctx, doc, num + 1);
+	}
+
+	return sub;
+}
+
+static void
+pdf_add_lazy_xref_source(fz_context *ctx, pdf_document *doc, pdf_xref *xref, pdf_xref_lazy_source *src)
+{
+	pdf_xref_lazy *lazy;
+	int p, end = src->start + src->len;
+
+	if (!xref->lazy)
+		xref->lazy = fz_malloc_struct(ctx, pdf_xref_lazy);
+	lazy = xref->lazy;
+
+	if (lazy->num_sources == lazy->cap_sources)
+	{
+		int new_cap = lazy->cap_sources ? lazy->cap_sources * 2 : 8;
+		lazy->sources = fz_resize_array(ctx, lazy->sources, new_cap, sizeof(*lazy->sources));
+		lazy->cap_sources = new_cap;
+	}
+	lazy->sources[lazy->num_sources] = *src;
+	fz_keep_buffer(ctx, src->data);
+	lazy->num_sources++;
+
+	if (xref->num_objects < end)
+	{
+		xref->num_objects = end;
+		if (doc->max_xref_len < end)
+			extend_xref_index(ctx, doc, end);
+	}
+
+	/* Pages already read in still get entries they lack from later sources. */
+	for (p = src->start / LAZY_XREF_PAGE; p < lazy->num_pages && p * LAZY_XREF_PAGE < end; p++)
+		if (lazy->pages[p])
+			pdf_fill_lazy_xref_page(ctx, doc, lazy, src, lazy->pages[p]);
+}
+
+/* Whether the xref section being read should be indexed rather than read in full. */
+static int
+pdf_want_lazy_xref(fz_context *ctx, pdf_document *doc, int size)
+{
+	pdf_xref *xref = &doc->xref_sections[doc->num_xref_sections-1];
+
+	if (xref->lazy)
+		return 1;
+	if (xref->subsec || doc->file_reading_linearly)
+		return 0;
+	return size >= LAZY_XREF_MIN_OBJECTS;
+}
+
+static int
+pdf_has_lazy_xref(fz_context *ctx, pdf_document *doc)
+{
+	int i;
+
+	for (i = 0; i < doc->num_xref_sections; i++)
+		if (doc->xref_sections[i].lazy)
+			return 1;
+	return 0;
+}
+
+/* Whether an on-demand section has had a page that could not be read. */
+static int
+pdf_has_broken_lazy_xref(fz_context *ctx, pdf_document *doc)
+{
+	int i;
+
+	for (i = 0; i < doc->num_xref_sections; i++)
+		if (doc->xref_sections[i].lazy && doc->xref_sections[i].lazy->broken)
+			return 1;
+	return 0;
+}
+
+/* Read in the rest of an on-demand section, and make it an ordinary one. */
+static void
+pdf_load_lazy_xref(fz_context *ctx, pdf_document *doc, pdf_xref *xref)
+{
+	pdf_xref_lazy *lazy = xref->lazy;
+	pdf_xref_subsec *sub;
+	int i;
+
+	for (i = 0; i < xref->num_objects; i += LAZY_XREF_PAGE)
+		pdf_lazy_xref_page(ctx, doc, xref, i, 0);
+
+	/* Trim the last page to the end of the section. */
+	for (sub = xref->subsec; sub != NULL; sub = sub->next)
+		if (sub->start + sub->len > xref->num_objects)
+			sub->len = xref->num_objects - sub->start;
+
+	xref->lazy = NULL;
+	pdf_drop_xref_lazy(ctx, lazy);
+}
+
+/*
+	Note that an entry has been changed, so that the page holding it
+	(if it is in an on-demand section) cannot be read in again.
+*/
+static void
+pdf_lazy_xref_entry_changed(fz_context *ctx, pdf_document *doc, pdf_xref_entry *entry, int num)
+{
+	int x, p = num / LAZY_XREF_PAGE;
+
+	for (x = 0; x < doc->num_xref_sections; x++)
+	{
+		pdf_xref_lazy *lazy = doc->xref_sections[x].lazy;
+		pdf_xref_subsec *sub;
+
+		if (!lazy || p >= lazy->num_pages)
+			continue;
+		sub = lazy->pages[p];
+		if (sub && entry == &sub->table[num - sub->start])
+		{
+			lazy->dirty[p] = 1;
+			return;
+		}
+	}
+}
+
+/* Whether a page could be read in again exactly as it is now. */
+static int
+pdf_lazy_xref_page_is_clean(pdf_xref_lazy *lazy, int p)
+{
+	pdf_xref_subsec *sub = lazy->pages[p];
+	int i;
+
+	if (lazy->dirty[p])
+		return 0;
+	for (i = 0; i < sub->len; i++)
+	{
+		pdf_xref_entry *entry = &sub->table[i];
+		if (entry->obj || entry->stm_buf || entry->marked)
+			return 0;
+	}
+	return 1;
+}
+
+static void
+pdf_release_lazy_xref_pages(fz_context *ctx, pdf_document *doc)
+{
+	int x, p;
+
+	for (x = 0; x < doc->num_xref_sections; x++)
+	{
+		pdf_xref *xref = &doc->xref_sections[x];
+		pdf_xref_lazy *lazy = xref->lazy;
+		pdf_xref_subsec **subp;
+		int released = 0;
+
+		if (!lazy)
+			continue;
+
+		/* Pages are the only subsections of an on-demand section, so
+		 * mark the ones to go with a zero length. */
+		for (p = 0; p < lazy->num_pages; p++)
+		{
+			pdf_xref_subsec *sub = lazy->pages[p];
+			if (sub && pdf_lazy_xref_page_is_clean(lazy, p))
+			{
+				sub->len = 0;
+				lazy->pages[p] = NULL;
+				released++;
+			}
+		}
+		if (!released)
+			continue;
+
+		subp = &xref->subsec;
+		while (*subp)
+		{
+			pdf_xref_subsec *sub = *subp;
+			if (sub->len == 0)
+			{
+				*subp = sub->next;
+				fz_free(ctx, sub->table);
+				fz_free(ctx, sub);
+			}
+			else
+				subp = &sub->next;
+		}
+	}
+}
+
 /*
  * xref tables
  */
@@ -52,6 +507,7 @@ static void pdf_drop_xref_sections_imp(fz_context *ctx, pdf_document *doc, pdf_x
 			fz_free(ctx, sub);
 			sub = next_sub;
 		}
+		pdf_drop_xref_lazy(ctx, xref->lazy);
 
 		pdf_drop_obj(ctx, xref->pre_repair_trailer);
 		pdf_drop_obj(ctx, xref->trailer);
@@ -80,19 +536,6 @@ static void pdf_drop_xref_sections(fz_context *ctx, pdf_document *doc)
 	doc->num_incremental_sections = 0;
 }
 
-static void
-extend_xref_index(fz_context *ctx, pdf_document *doc, int newlen)
-{
-	int i;
-
-	doc->xref_index = fz_resize_array(ctx, doc->xref_index, newlen, sizeof(int));
-	for (i = doc->max_xref_len; i < newlen; i++)
-	{
-		doc->xref_index[i] = 0;
-	}
-	doc->max_xref_len = newlen;
-}
-
 /* This is only ever called when we already have an incremental
  * xref. This means there will only be 1 subsec, and it will be
  * a complete subsec. */
@@ -132,6 +575,7 @@ static void pdf_populate_next_xref_level(fz_context *ctx, pdf_document *doc)
 
 	xref = &doc->xref_sections[doc->num_xref_sections - 1];
 	xref->subsec = NULL;
+	xref->lazy = NULL;
 	xref->num_objects = 0;
 	xref->trailer = NULL;
 	xref->pre_repair_trailer = NULL;
@@ -173,6 +617,12 @@ ensure_solid_xref(fz_context *ctx, pdf_document *doc, int num, int which)
 	pdf_xref_subsec *sub = xref->subsec;
 	pdf_xref_subsec *new_sub;
 
+	if (xref->lazy)
+	{
+		pdf_load_lazy_xref(ctx, doc, xref);
+		sub = xref->subsec;
+	}
+
 	if (num < xref->num_objects)
 		num = xref->num_objects;
 
@@ -235,6 +685,14 @@ pdf_xref_entry *pdf_get_populating_xref_entry(fz_context *ctx, pdf_document *doc
 	/* Return the pointer to the entry in the last section. */
 	xref = &doc->xref_sections[doc->num_xref_sections-1];
 
+	if (xref->lazy)
+	{
+		/* Entries are only asked for here to be changed. */
+		sub = pdf_lazy_xref_page(ctx, doc, xref, num, 1);
+		xref->lazy->dirty[num / LAZY_XREF_PAGE] = 1;
+		return &sub->table[num-sub->start];
+	}
+
 	for (sub = xref->subsec; sub != NULL; sub = sub->next)
 	{
 		if (num >= sub->start && num < sub->start + sub->len)
@@ -249,11 +707,65 @@ pdf_xref_entry *pdf_get_populating_xref_entry(fz_context *ctx, pdf_document *doc
 	return &sub->table[num-sub->start];
 }
 
+/*
+	Threaded documents.
+
+	Once pdf_enable_threading has been called, the xref (and the
+	objects cached in it), the file, and the document's other state
+	are only used while holding FZ_LOCK_DOCUMENT. Loading one object
+	can need others to be loaded, so the lock is made recursive by
+	remembering which context holds it. Other threads look at that
+	without holding the lock, so it is read and written atomically.
+*/
+void pdf_enable_threading(fz_context *ctx, pdf_document *doc)
+{
+	doc->threaded = 1;
+}
+
+static void
+set_lock_owner(fz_context *ctx, pdf_document *doc, fz_context *owner)
+{
+	FZ_REFS_LOCK(ctx);
+	fz_atomic_store(fz_context *, &doc->lock_owner, owner);
+	FZ_REFS_UNLOCK(ctx);
+}
+
+void pdf_lock_document(fz_context *ctx, pdf_document *doc)
+{
+	fz_context *owner;
+
+	if (!doc->threaded)
+		return;
+	FZ_REFS_LOCK(ctx);
+	owner = fz_atomic_load(fz_context *, &doc->lock_owner);
+	FZ_REFS_UNLOCK(ctx);
+	if (owner == ctx)
+	{
+		doc->lock_depth++;
+		return;
+	}
+	fz_lock(ctx, FZ_LOCK_DOCUMENT);
+	set_lock_owner(ctx, doc, ctx);
+	doc->lock_depth = 1;
+}
+
+void pdf_unlock_document(fz_context *ctx, pdf_document *doc)
+{
+	if (!doc->threaded)
+		return;
+	if (--doc->lock_depth == 0)
+	{
+		set_lock_owner(ctx, doc, NULL);
+		fz_unlock(ctx, FZ_LOCK_DOCUMENT);
+	}
+}
+
 /* Used after loading a document to access entries */
 /* This will never throw anything, or return NULL if it is
  * only asked to return objects in range within a 'solid'
  * xref. */
-pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
+static pdf_xref_entry *
+get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
 {
 	pdf_xref *xref = NULL;
 	pdf_xref_subsec *sub;
@@ -277,7 +789,17 @@ pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
 	{
 		xref = &doc->xref_sections[j];
 
-		if (i < xref->num_objects)
+		if (i < xref->num_objects && xref->lazy)
+		{
+			sub = pdf_lazy_xref_page(ctx, doc, xref, i, 0);
+			if (sub && sub->table[i - sub->start].type)
+			{
+				if (doc->xref_base == 0)
+					doc->xref_index[i] = j;
+				return &sub->table[i - sub->start];
+			}
+		}
+		else if (i < xref->num_objects)
 		{
 			for (sub = xref->subsec; sub != NULL; sub = sub->next)
 			{
@@ -305,6 +827,11 @@ pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
 	if (xref == NULL || i < xref->num_objects)
 	{
 		xref = &doc->xref_sections[doc->xref_base];
+		if (xref->lazy)
+		{
+			sub = pdf_lazy_xref_page(ctx, doc, xref, i, 1);
+			return &sub->table[i - sub->start];
+		}
 		for (sub = xref->subsec; sub != NULL; sub = sub->next)
 		{
 			if (i >= sub->start && i < sub->start + sub->len)
@@ -322,6 +849,37 @@ pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
 	return &sub->table[i - sub->start];
 }
 
+pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
+{
+	pdf_xref_entry *x;
+
+	if (!doc->threaded)
+		return get_xref_entry(ctx, doc, i);
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		x = get_xref_entry(ctx, doc, i);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return x;
+}
+
+static void
+pdf_drop_fwd_page_map(fz_context *ctx, pdf_document *doc)
+{
+	int i;
+
+	for (i = 0; i < doc->fwd_page_count; i++)
+		pdf_drop_obj(ctx, doc->fwd_page_map[i]);
+	fz_free(ctx, doc->fwd_page_map);
+	doc->fwd_page_map = NULL;
+	doc->fwd_page_count = 0;
+	doc->fwd_page_map_stale = 0;
+}
+
 /*
 	Ensure we have an incremental xref section where we can store
 	updated versions of indirect objects. This is a new xref section
@@ -329,6 +887,11 @@ pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
 */
 static void ensure_incremental_xref(fz_context *ctx, pdf_document *doc)
 {
+	/* Any change may move pages about, so stop trusting the page map
+	 * from an xref index. Callers may still hold objects from it, so
+	 * it is only dropped with the document. */
+	doc->fwd_page_map_stale = 1;
+
 	/* If there are as yet no incremental sections, or if the most recent
 	 * one has been used to sign a signature field, then we need a new one.
 	 * After a signing, any further document changes require a new increment */
@@ -354,6 +917,7 @@ static void ensure_incremental_xref(fz_context *ctx, pdf_document *doc)
 			memmove(pxref, xref, doc->num_xref_sections * sizeof(pdf_xref));
 			/* xref->num_objects is already correct */
 			xref->subsec = sub;
+			xref->lazy = NULL;
 			sub = NULL;
 			xref->trailer = trailer;
 			xref->pre_repair_trailer = NULL;
@@ -476,6 +1040,15 @@ void pdf_xref_ensure_incremental_object(fz_context *ctx, pdf_document *doc, int
 
 		if (num < 0 && num >= xref->num_objects)
 			break;
+		if (xref->lazy)
+		{
+			sub = num < xref->num_objects ? pdf_lazy_xref_page(ctx, doc, xref, num, 0) : NULL;
+			if (sub && !sub->table[num - sub->start].type)
+				sub = NULL;
+			if (sub != NULL)
+				break;
+			continue;
+		}
 		for (sub = xref->subsec; sub != NULL; sub = sub->next)
 		{
 			if (sub->start <= num && num < sub->start + sub->len && sub->table[num - sub->start].type)
@@ -542,6 +1115,7 @@ void pdf_replace_xref(fz_context *ctx, pdf_document *doc, pdf_xref_entry *entrie
 
 	/* The new table completely replaces the previous separate sections */
 	pdf_drop_xref_sections(ctx, doc);
+	doc->fwd_page_map_stale = 1;
 
 	doc->xref_sections = xref;
 	doc->num_xref_sections = 1;
@@ -828,17 +1402,52 @@ pdf_xref_find_subsection(fz_context *ctx, pdf_document *doc, int start, int len)
 	return &sub->table[start-sub->start];
 }
 
+/* Note where an xref table subsection lies, and skip over it. */
+static void
+pdf_index_old_xref_subsection(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, int start, int len)
+{
+	pdf_xref *xref = &doc->xref_sections[doc->num_xref_sections-1];
+	pdf_xref_lazy_source src = { 0 };
+	int64_t t;
+	size_t n;
+
+	t = fz_tell(ctx, doc->file);
+	if (t < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot tell in file");
+
+	if (len == 0)
+		return;
+
+	/* Take the width of the first entry for all of them. */
+	n = fz_read(ctx, doc->file, (unsigned char *)buf->scratch, 20);
+	if (n < 19)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "malformed xref table");
+	if (n == 20 && buf->scratch[19] > 32)
+		n = 19;
+
+	if (t + (int64_t)n * len > doc->file_size)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected EOF in xref table");
+	fz_seek(ctx, doc->file, t + (int64_t)n * len, SEEK_SET);
+
+	src.start = start;
+	src.len = len;
+	src.ofs = t;
+	src.width = (int)n;
+	pdf_add_lazy_xref_source(ctx, doc, xref, &src);
+}
+
 static pdf_obj *
 pdf_read_old_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 {
-	int start, len, c, i, xref_len, carried;
+	int start, len, c, i, xref_len, carried, lazy;
 	fz_stream *file = doc->file;
 	pdf_xref_entry *table;
 	pdf_token tok;
 	size_t n;
-	char *s, *e;
+	char *s;
 
 	xref_len = pdf_xref_size_from_old_trailer(ctx, doc, buf);
+	lazy = pdf_want_lazy_xref(ctx, doc, xref_len);
 
 	fz_skip_space(ctx, doc->file);
 	if (fz_skip_string(ctx, doc->file, "xref"))
@@ -875,6 +1484,12 @@ pdf_read_old_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 			fz_warn(ctx, "broken xref subsection, proceeding anyway.");
 		}
 
+		if (lazy)
+		{
+			pdf_index_old_xref_subsection(ctx, doc, buf, start, len);
+			continue;
+		}
+
 		table = pdf_xref_find_subsection(ctx, doc, start, len);
 
 		/* Xref entries SHOULD be 20 bytes long, but we see 19 byte
@@ -891,32 +1506,7 @@ pdf_read_old_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 			buf->scratch[n] = '\0';
 			if (!entry->type)
 			{
-				s = buf->scratch;
-				e = s + n;
-
-				entry->num = start + i;
-
-				/* broken pdfs where line start with white space */
-				while (s < e && iswhite(*s))
-					s++;
-
-				if (s == e || !isdigit(*s))
-					fz_throw(ctx, FZ_ERROR_GENERIC, "xref offset missing");
-				while (s < e && isdigit(*s))
-					entry->ofs = entry->ofs * 10 + *s++ - '0';
-
-				while (s < e && iswhite(*s))
-					s++;
-				if (s == e || !isdigit(*s))
-					fz_throw(ctx, FZ_ERROR_GENERIC, "xref generation number missing");
-				while (s < e && isdigit(*s))
-					entry->gen = entry->gen * 10 + *s++ - '0';
-
-				while (s < e && iswhite(*s))
-					s++;
-				if (s == e || (*s != 'f' && *s != 'n' && *s != 'o'))
-					fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected xref type: 0x%x (%d %d R)", s == e ? 0 : *s, entry->num, entry->gen);
-				entry->type = *s++;
+				pdf_parse_old_xref_entry(ctx, entry, buf->scratch, buf->scratch + n, start + i);
 
 				/* If the last byte of our buffer isn't an EOL (or space), carry one byte forward */
 				carried = buf->scratch[19] > 32;
@@ -981,6 +1571,54 @@ pdf_read_new_xref_section(fz_context *ctx, pdf_document *doc, fz_stream *stm, in
 	doc->has_xref_streams = 1;
 }
 
+/* Keep the decoded data of an xref stream, and note where each subsection lies in it. */
+static void
+pdf_index_new_xref(fz_context *ctx, pdf_document *doc, fz_stream *stm, pdf_obj *index, int size, int w0, int w1, int w2)
+{
+	pdf_xref *xref = &doc->xref_sections[doc->num_xref_sections-1];
+	pdf_xref_lazy_source src = { 0 };
+	int64_t pos = 0;
+	size_t avail;
+	int w = w0 + w1 + w2;
+	int t, n;
+
+	src.data = fz_read_all(ctx, stm, 0);
+	src.w0 = w0;
+	src.w1 = w1;
+	src.w2 = w2;
+
+	fz_try(ctx)
+	{
+		avail = fz_buffer_storage(ctx, src.data, NULL);
+		n = index ? pdf_array_len(ctx, index) : 2;
+		for (t = 0; t < n; t += 2)
+		{
+			int i0 = index ? pdf_array_get_int(ctx, index, t + 0) : 0;
+			int i1 = index ? pdf_array_get_int(ctx, index, t + 1) : size;
+
+			if (i0 < 0 || i0 > PDF_MAX_OBJECT_NUMBER || i1 < 0 || i1 > PDF_MAX_OBJECT_NUMBER || i0 + i1 - 1 > PDF_MAX_OBJECT_NUMBER)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "xref subsection object numbers are out of range");
+			if (pos + (int64_t)i1 * w > (int64_t)avail)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "truncated xref stream");
+
+			if (i1 > 0)
+			{
+				src.start = i0;
+				src.len = i1;
+				src.ofs = pos;
+				pdf_add_lazy_xref_source(ctx, doc, xref, &src);
+			}
+			pos += (int64_t)i1 * w;
+		}
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, src.data);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	doc->has_xref_streams = 1;
+}
+
 /* Entered with file locked, remains locked throughout. */
 static pdf_obj *
 pdf_read_new_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
@@ -1040,7 +1678,11 @@ pdf_read_new_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 
 		stm = pdf_open_stream_with_offset(ctx, doc, num, trailer, stm_ofs);
 
-		if (!index)
+		if (pdf_want_lazy_xref(ctx, doc, size))
+		{
+			pdf_index_new_xref(ctx, doc, stm, index, size, w0, w1, w2);
+		}
+		else if (!index)
 		{
 			pdf_read_new_xref_section(ctx, doc, stm, 0, size, w0, w1, w2);
 		}
@@ -1245,11 +1887,20 @@ pdf_load_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 		entry->type = 'f';
 		entry->gen = 65535;
 		entry->num = 0;
+		pdf_lazy_xref_entry_changed(ctx, doc, entry, 0);
 	}
 	/* broken pdfs where first object is not free */
 	else if (entry->type != 'f')
 		fz_warn(ctx, "first object in xref is not free");
 
+	/* On-demand sections are only checked as they are read in. An
+	 * offset out of range is found when the object is loaded, and the
+	 * file is then repaired as usual. */
+	if (pdf_has_broken_lazy_xref(ctx, doc))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "broken xref section");
+	if (pdf_has_lazy_xref(ctx, doc))
+		return;
+
 	/* broken pdfs where object offsets are out of range */
 	xref_len = pdf_xref_len(ctx, doc);
 	for (i = 0; i < xref_len; i++)
@@ -1331,22 +1982,334 @@ pdf_load_linear(fz_context *ctx, pdf_document *doc)
 	}
 }
 
+/*
+ * xref index files
+ *
+ * An xref index is a sidecar file holding what opening a document
+ * works out from its xref sections (or from repairing it): the
+ * trailer, the entry each object resolves to, and the object number
+ * and generation of each page. It is keyed by the size and modification time of the
+ * file and by its startxref offset, which moves on every incremental
+ * save. The entries are stored as in an xref stream with W [1 8 4],
+ * and are read in on demand like a large xref section, so reopening a
+ * file through its index costs little more than reading the index.
+ *
+ * Other processes may be reading an index while it is rewritten, so
+ * it is written to a new file next to it, which then replaces it.
+ */
+
+#define XREF_INDEX_MAGIC "%MUPDF-XREF-INDEX-2\n"
+#define XREF_INDEX_W0 1
+#define XREF_INDEX_W1 8
+#define XREF_INDEX_W2 4
+#define XREF_INDEX_W (XREF_INDEX_W0 + XREF_INDEX_W1 + XREF_INDEX_W2)
+#define XREF_INDEX_PAGE_W 6 /* 4 bytes object number, 2 bytes generation */
+
+/* Find the entry an object resolves to, without creating or solidifying anything. */
+static pdf_xref_entry *
+pdf_find_xref_entry(fz_context *ctx, pdf_document *doc, int num)
+{
+	pdf_xref_subsec *sub;
+	int j;
+
+	for (j = 0; j < doc->num_xref_sections; j++)
+	{
+		pdf_xref *xref = &doc->xref_sections[j];
+
+		if (num >= xref->num_objects)
+			continue;
+		if (xref->lazy)
+		{
+			sub = pdf_lazy_xref_page(ctx, doc, xref, num, 0);
+			if (sub && sub->table[num - sub->start].type)
+				return &sub->table[num - sub->start];
+			continue;
+		}
+		for (sub = xref->subsec; sub != NULL; sub = sub->next)
+			if (num >= sub->start && num < sub->start + sub->len && sub->table[num - sub->start].type)
+				return &sub->table[num - sub->start];
+	}
+	return NULL;
+}
+
+static void
+put_xref_index_bytes(unsigned char *p, int64_t v, int n)
+{
+	while (n-- > 0)
+	{
+		p[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*
+	Find the startxref offset of the file, which is part of the key
+	of its index. A file without one (which needed repair) is keyed
+	on its size and time alone. This also sets doc->file_size.
+*/
+static int64_t
+pdf_xref_index_key(fz_context *ctx, pdf_document *doc)
+{
+	int64_t saved = doc->startxref;
+	int64_t startxref;
+
+	fz_try(ctx)
+	{
+		pdf_read_start_xref(ctx, doc);
+		startxref = doc->startxref;
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+		startxref = 0;
+	}
+	doc->startxref = saved;
+	return startxref;
+}
+
+static void
+pdf_save_xref_index(fz_context *ctx, pdf_document *doc, const char *index, int64_t mtime)
+{
+	fz_output *out = NULL;
+	pdf_obj *head = NULL;
+	pdf_obj **pages = NULL;
+	char *tmp = NULL;
+	unsigned char rec[XREF_INDEX_W];
+	int i, n, count, written = 0;
+
+	fz_var(out);
+	fz_var(head);
+	fz_var(pages);
+	fz_var(tmp);
+	fz_var(written);
+
+	fz_try(ctx)
+	{
+		n = pdf_xref_len(ctx, doc);
+
+		/* A broken page tree just means no page map. */
+		count = pdf_count_pages(ctx, doc);
+		fz_try(ctx)
+		{
+			pages = fz_malloc_array(ctx, count, sizeof(*pages));
+			for (i = 0; i < count; i++)
+				pages[i] = pdf_lookup_page_obj(ctx, doc, i);
+		}
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "not indexing pages: %s", fz_caught_message(ctx));
+			count = 0;
+		}
+
+		head = pdf_new_dict(ctx, doc, 10);
+		pdf_dict_puts_drop(ctx, head, "FileSize", pdf_new_int(ctx, doc->file_size));
+		pdf_dict_puts_drop(ctx, head, "MTime", pdf_new_int(ctx, mtime));
+		pdf_dict_puts_drop(ctx, head, "StartXRef", pdf_new_int(ctx, pdf_xref_index_key(ctx, doc)));
+		pdf_dict_puts(ctx, head, "Repaired", doc->repair_attempted ? PDF_TRUE : PDF_FALSE);
+		pdf_dict_puts(ctx, head, "XRefStreams", doc->has_xref_streams ? PDF_TRUE : PDF_FALSE);
+		pdf_dict_puts(ctx, head, "OldXRefs", doc->has_old_style_xrefs ? PDF_TRUE : PDF_FALSE);
+		pdf_dict_put_int(ctx, head, PDF_NAME(Size), n);
+		pdf_dict_put_int(ctx, head, PDF_NAME(Pages), count);
+		pdf_dict_puts(ctx, head, "Trailer", pdf_trailer(ctx, doc));
+
+		tmp = fz_asprintf(ctx, "%s.tmp", index);
+		out = fz_new_output_with_path(ctx, tmp, 0);
+		written = 1;
+		fz_write_string(ctx, out, XREF_INDEX_MAGIC);
+		pdf_print_obj(ctx, out, head, 1, 0);
+		fz_write_string(ctx, out, "\nstream\n");
+
+		for (i = 0; i < n; i++)
+		{
+			pdf_xref_entry *entry = pdf_find_xref_entry(ctx, doc, i);
+			int type = 3;
+			if (entry)
+				type = entry->type == 'f' ? 0 : entry->type == 'n' ? 1 : entry->type == 'o' ? 2 : 3;
+			rec[0] = type;
+			put_xref_index_bytes(rec + XREF_INDEX_W0, entry ? entry->ofs : 0, XREF_INDEX_W1);
+			put_xref_index_bytes(rec + XREF_INDEX_W0 + XREF_INDEX_W1, entry ? entry->gen : 0, XREF_INDEX_W2);
+			fz_write_data(ctx, out, rec, XREF_INDEX_W);
+		}
+		for (i = 0; i < count; i++)
+		{
+			fz_write_int32_be(ctx, out, pdf_to_num(ctx, pages[i]));
+			fz_write_int16_be(ctx, out, pdf_to_gen(ctx, pages[i]));
+		}
+
+		fz_write_string(ctx, out, "\nendstream\n");
+		fz_close_output(ctx, out);
+		fz_drop_output(ctx, out);
+		out = NULL;
+
+#ifdef _WIN32
+		if (fz_rename_utf8(tmp, index) < 0)
+#else
+		if (rename(tmp, index) < 0)
+#endif
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot rename '%s' to '%s': %s", tmp, index, strerror(errno));
+		written = 0;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		if (written)
+		{
+#ifdef _WIN32
+			fz_remove_utf8(tmp);
+#else
+			remove(tmp);
+#endif
+		}
+		fz_free(ctx, tmp);
+		pdf_drop_obj(ctx, head);
+		fz_free(ctx, pages);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+	Set up the xref and page map of a document from an xref index.
+	Returns 0, leaving the document untouched, if there is no index
+	or it does not match the file.
+*/
+static int
+pdf_load_xref_index(fz_context *ctx, pdf_document *doc, const char *index, int64_t mtime)
+{
+	pdf_lexbuf *buf = &doc->lexbuf.base;
+	pdf_xref_lazy_source src = { 0 };
+	fz_stream *stm = NULL;
+	pdf_obj *head = NULL;
+	fz_buffer *data = NULL;
+	unsigned char *p = NULL;
+	unsigned char *q;
+	char magic[sizeof XREF_INDEX_MAGIC];
+	int i, size, count, ok = 0;
+	int64_t startxref;
+	size_t len;
+
+	if (mtime == 0 || !fz_file_exists(ctx, index))
+		return 0;
+
+	fz_var(stm);
+	fz_var(head);
+	fz_var(data);
+	fz_var(p);
+	fz_var(ok);
+
+	fz_try(ctx)
+	{
+		startxref = pdf_xref_index_key(ctx, doc);
+
+		stm = fz_open_file(ctx, index);
+		len = fz_read(ctx, stm, (unsigned char *)magic, sizeof magic - 1);
+		if (len != sizeof magic - 1 || memcmp(magic, XREF_INDEX_MAGIC, len))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "not an xref index");
+		if (pdf_lex(ctx, stm, buf) != PDF_TOK_OPEN_DICT)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt xref index");
+		head = pdf_parse_dict(ctx, doc, stm, buf);
+
+		if (pdf_to_int64(ctx, pdf_dict_gets(ctx, head, "FileSize")) == doc->file_size &&
+			pdf_to_int64(ctx, pdf_dict_gets(ctx, head, "MTime")) == mtime &&
+			pdf_to_int64(ctx, pdf_dict_gets(ctx, head, "StartXRef")) == startxref)
+		{
+			size = pdf_dict_get_int(ctx, head, PDF_NAME(Size));
+			count = pdf_dict_get_int(ctx, head, PDF_NAME(Pages));
+			if (size <= 0 || size > PDF_MAX_OBJECT_NUMBER + 1 || count < 0 || count > INT_MAX / XREF_INDEX_PAGE_W)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt xref index");
+			if (!pdf_is_dict(ctx, pdf_dict_gets(ctx, head, "Trailer")))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "xref index has no trailer");
+			if (pdf_lex(ctx, stm, buf) != PDF_TOK_STREAM || fz_read_byte(ctx, stm) != '\n')
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt xref index");
+
+			len = (size_t)size * XREF_INDEX_W + (size_t)count * XREF_INDEX_PAGE_W;
+			p = fz_malloc(ctx, len);
+			if (fz_read(ctx, stm, p, len) != len)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "truncated xref index");
+			data = fz_new_buffer_from_data(ctx, p, len);
+			p = NULL;
+
+			pdf_populate_next_xref_level(ctx, doc);
+			doc->xref_sections[0].trailer = pdf_keep_obj(ctx, pdf_dict_gets(ctx, head, "Trailer"));
+			src.start = 0;
+			src.len = size;
+			src.ofs = 0;
+			src.data = data;
+			src.w0 = XREF_INDEX_W0;
+			src.w1 = XREF_INDEX_W1;
+			src.w2 = XREF_INDEX_W2;
+			pdf_add_lazy_xref_source(ctx, doc, &doc->xref_sections[0], &src);
+
+			fz_buffer_storage(ctx, data, &q);
+			q += (size_t)size * XREF_INDEX_W;
+			doc->fwd_page_map = fz_malloc_array(ctx, count, sizeof(*doc->fwd_page_map));
+			for (i = 0; i < count; i++, q += XREF_INDEX_PAGE_W)
+			{
+				int num = (q[0] << 24) | (q[1] << 16) | (q[2] << 8) | q[3];
+				int gen = (q[4] << 8) | q[5];
+				doc->fwd_page_map[i] = pdf_new_indirect(ctx, doc, num, gen);
+				doc->fwd_page_count = i + 1;
+			}
+
+			/* Leave a repaired file as pdf_repair_xref would. */
+			if (pdf_to_bool(ctx, pdf_dict_gets(ctx, head, "Repaired")))
+			{
+				doc->repair_attempted = 1;
+				doc->freeze_updates = 1;
+				doc->dirty = 1;
+			}
+			else
+				doc->startxref = startxref;
+			doc->has_xref_streams = pdf_to_bool(ctx, pdf_dict_gets(ctx, head, "XRefStreams"));
+			doc->has_old_style_xrefs = pdf_to_bool(ctx, pdf_dict_gets(ctx, head, "OldXRefs"));
+			ok = 1;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		pdf_drop_obj(ctx, head);
+		fz_drop_buffer(ctx, data);
+		fz_free(ctx, p);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "ignoring xref index: %s", fz_caught_message(ctx));
+		pdf_drop_xref_sections(ctx, doc);
+		fz_free(ctx, doc->xref_index);
+		doc->xref_index = NULL;
+		doc->max_xref_len = 0;
+		pdf_drop_fwd_page_map(ctx, doc);
+		doc->repair_attempted = 0;
+		doc->freeze_updates = 0;
+		doc->dirty = 0;
+		doc->startxref = 0;
+		doc->has_xref_streams = 0;
+		doc->has_old_style_xrefs = 0;
+		ok = 0;
+	}
+
+	return ok;
+}
+
 /*
  * Initialize and load xref tables.
  * If password is not null, try to decrypt.
+ * If index is not null, use (or write) that xref index.
  */
 
 static void
-pdf_init_document(fz_context *ctx, pdf_document *doc)
+pdf_init_document(fz_context *ctx, pdf_document *doc, const char *index, int64_t mtime)
 {
 	pdf_obj *encrypt, *id;
 	pdf_obj *dict = NULL;
 	pdf_obj *obj;
 	pdf_obj *nobj = NULL;
-	int i, repaired = 0;
+	int i, repaired = 0, indexed = 0;
 
 	fz_var(dict);
 	fz_var(nobj);
+	fz_var(indexed);
 
 	fz_try(ctx)
 	{
@@ -1356,8 +2319,11 @@ pdf_init_document(fz_context *ctx, pdf_document *doc)
 		if (doc->file_length < 0)
 			doc->file_length = 0;
 
+		if (index)
+			indexed = pdf_load_xref_index(ctx, doc, index, mtime);
+
 		/* Check to see if we should work in progressive mode */
-		if (fz_stream_meta(ctx, doc->file, FZ_STREAM_META_PROGRESSIVE, 0, NULL) > 0)
+		if (!indexed && fz_stream_meta(ctx, doc->file, FZ_STREAM_META_PROGRESSIVE, 0, NULL) > 0)
 			doc->file_reading_linearly = 1;
 
 		/* Try to load the linearized file if we are in progressive
@@ -1368,7 +2334,7 @@ pdf_init_document(fz_context *ctx, pdf_document *doc)
 		/* If we aren't in progressive mode (or the linear load failed
 		 * and has set us back to non-progressive mode), load normally.
 		 */
-		if (!doc->file_reading_linearly)
+		if (!indexed && !doc->file_reading_linearly)
 			pdf_load_xref(ctx, doc, &doc->lexbuf.base);
 	}
 	fz_catch(ctx)
@@ -1461,6 +2427,14 @@ pdf_init_document(fz_context *ctx, pdf_document *doc)
 		fz_rethrow(ctx);
 	}
 
+	if (index && !indexed)
+	{
+		fz_try(ctx)
+			pdf_save_xref_index(ctx, doc, index, mtime);
+		fz_catch(ctx)
+			fz_warn(ctx, "cannot write xref index: %s", fz_caught_message(ctx));
+	}
+
 	fz_try(ctx)
 	{
 		pdf_read_ocg(ctx, doc);
@@ -1554,6 +2528,7 @@ pdf_drop_document_imp(fz_context *ctx, pdf_document *doc)
 	fz_free(ctx, doc->orphans);
 
 	fz_free(ctx, doc->rev_page_map);
+	pdf_drop_fwd_page_map(ctx, doc);
 
 	fz_defer_reap_end(ctx);
 }
@@ -1948,8 +2923,8 @@ read_hinted_object(fz_context *ctx, pdf_document *doc, int num)
 	return expected != 0;
 }
 
-pdf_xref_entry *
-pdf_cache_object(fz_context *ctx, pdf_document *doc, int num)
+static pdf_xref_entry *
+cache_object(fz_context *ctx, pdf_document *doc, int num)
 {
 	pdf_xref_entry *x;
 	int rnum, rgen, try_repair;
@@ -1968,6 +2943,20 @@ object_updated:
 	if (x->obj != NULL)
 		return x;
 
+	/* Reading the entry in may have found the xref to be broken. */
+	if (doc->repair_attempted == 0 && pdf_has_broken_lazy_xref(ctx, doc))
+	{
+		fz_try(ctx)
+		{
+			pdf_repair_xref(ctx, doc);
+			pdf_prime_xref_index(ctx, doc);
+			pdf_repair_obj_stms(ctx, doc);
+		}
+		fz_catch(ctx)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot repair xref to load object (%d 0 R)", num);
+		goto object_updated;
+	}
+
 	if (x->type == 'f')
 	{
 		x->obj = PDF_NULL;
@@ -1996,6 +2985,7 @@ object_updated:
 			x->num = 0;
 			x->stm_ofs = 0;
 			x->obj = NULL;
+			pdf_lazy_xref_entry_changed(ctx, doc, x, num);
 			try_repair = (doc->repair_attempted == 0);
 		}
 
@@ -2048,11 +3038,60 @@ object_updated:
 	return x;
 }
 
+pdf_xref_entry *
+pdf_cache_object(fz_context *ctx, pdf_document *doc, int num)
+{
+	pdf_xref_entry *x;
+
+	if (!doc->threaded)
+		return cache_object(ctx, doc, num);
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		x = cache_object(ctx, doc, num);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return x;
+}
+
+/*
+	Load an object into the cache and return it, kept if keep is set.
+	The entry holding it may be moved or freed as soon as the document
+	is unlocked, so its object is taken (and kept) while still locked.
+*/
+static pdf_obj *
+pdf_cache_object_obj(fz_context *ctx, pdf_document *doc, int num, int keep)
+{
+	pdf_obj *obj;
+
+	if (!doc->threaded)
+	{
+		obj = cache_object(ctx, doc, num)->obj;
+		return keep ? pdf_keep_obj(ctx, obj) : obj;
+	}
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		obj = cache_object(ctx, doc, num)->obj;
+		if (keep)
+			pdf_keep_obj(ctx, obj);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return obj;
+}
+
 pdf_obj *
 pdf_load_object(fz_context *ctx, pdf_document *doc, int num)
 {
-	pdf_xref_entry *entry = pdf_cache_object(ctx, doc, num);
-	return pdf_keep_obj(ctx, entry->obj);
+	return pdf_cache_object_obj(ctx, doc, num, 1);
 }
 
 pdf_obj *
@@ -2062,7 +3101,6 @@ pdf_resolve_indirect(fz_context *ctx, pdf_obj *ref)
 	{
 		pdf_document *doc = pdf_get_indirect_document(ctx, ref);
 		int num = pdf_to_num(ctx, ref);
-		pdf_xref_entry *entry;
 
 		if (!doc)
 			return NULL;
@@ -2073,15 +3111,13 @@ pdf_resolve_indirect(fz_context *ctx, pdf_obj *ref)
 		}
 
 		fz_try(ctx)
-			entry = pdf_cache_object(ctx, doc, num);
+			ref = pdf_cache_object_obj(ctx, doc, num, 0);
 		fz_catch(ctx)
 		{
 			fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
 			fz_warn(ctx, "cannot load object (%d 0 R) into cache", num);
 			return NULL;
 		}
-
-		ref = entry->obj;
 	}
 	return ref;
 }
@@ -2317,7 +3353,7 @@ pdf_open_document_with_stream(fz_context *ctx, fz_stream *file)
 	pdf_document *doc = pdf_new_document(ctx, file);
 	fz_try(ctx)
 	{
-		pdf_init_document(ctx, doc);
+		pdf_init_document(ctx, doc, NULL, 0);
 	}
 	fz_catch(ctx)
 	{
@@ -2357,7 +3393,93 @@ pdf_open_document(fz_context *ctx, const char *filename)
 	{
 		file = fz_open_file(ctx, filename);
 		doc = pdf_new_document(ctx, file);
-		pdf_init_document(ctx, doc);
+		pdf_init_document(ctx, doc, NULL, 0);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, file);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_document(ctx, &doc->super);
+		fz_rethrow(ctx);
+	}
+	return doc;
+}
+
+/*
+	Open a PDF document, using an xref index to skip reading (or
+	repairing) its xref.
+
+	Same as pdf_open_document, except that if index names an xref
+	index that matches the file, the xref, trailer and page map are
+	set up from it. Otherwise the file is opened as usual and a new
+	index is written to index for next time; failing to write it is
+	only a warning.
+
+	filename: a path to a file as it would be given to open(2).
+
+	index: a path for the xref index of that file.
+*/
+pdf_document *
+pdf_open_document_with_xref_index(fz_context *ctx, const char *filename, const char *index)
+{
+	fz_stream *file = NULL;
+	pdf_document *doc = NULL;
+
+	fz_var(file);
+	fz_var(doc);
+
+	fz_try(ctx)
+	{
+		file = fz_open_file(ctx, filename);
+		doc = pdf_new_document(ctx, file);
+		pdf_init_document(ctx, doc, index, fz_stat_mtime(filename));
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, file);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_document(ctx, &doc->super);
+		fz_rethrow(ctx);
+	}
+	return doc;
+}
+
+/*
+	Open a PDF document, repairing it on several threads if it is
+	broken.
+
+	Same as pdf_open_document, except that if the xref has to be
+	rebuilt (now, or later on while using the document), the scan
+	of the file for objects is shared out by calling parallel. The
+	result is the same as for a repair on a single thread.
+
+	filename: a path to a file as it would be given to open(2).
+
+	parallel: The function to run the scan on several threads.
+
+	opaque: Passed to parallel. It must remain valid until the
+	document is dropped.
+*/
+pdf_document *
+pdf_open_document_with_parallel_repair(fz_context *ctx, const char *filename, pdf_parallel_fn *parallel, void *opaque)
+{
+	fz_stream *file = NULL;
+	pdf_document *doc = NULL;
+
+	fz_var(file);
+	fz_var(doc);
+
+	fz_try(ctx)
+	{
+		file = fz_open_file(ctx, filename);
+		doc = pdf_new_document(ctx, file);
+		doc->repair_parallel = parallel;
+		doc->repair_parallel_opaque = opaque;
+		pdf_init_document(ctx, doc, NULL, 0);
 	}
 	fz_always(ctx)
 	{
@@ -2876,6 +3998,7 @@ void pdf_clear_xref(fz_context *ctx, pdf_document *doc)
 {
 	int x, e;
 
+	pdf_lock_document(ctx, doc);
 	for (x = 0; x < doc->num_xref_sections; x++)
 	{
 		pdf_xref *xref = &doc->xref_sections[x];
@@ -2899,12 +4022,16 @@ void pdf_clear_xref(fz_context *ctx, pdf_document *doc)
 			}
 		}
 	}
+
+	pdf_release_lazy_xref_pages(ctx, doc);
+	pdf_unlock_document(ctx, doc);
 }
 
 void pdf_clear_xref_to_mark(fz_context *ctx, pdf_document *doc)
 {
 	int x, e;
 
+	pdf_lock_document(ctx, doc);
 	for (x = 0; x < doc->num_xref_sections; x++)
 	{
 		pdf_xref *xref = &doc->xref_sections[x];
@@ -2929,4 +4056,5 @@ void pdf_clear_xref_to_mark(fz_context *ctx, pdf_document *doc)
 			}
 		}
 	}
+	pdf_unlock_document(ctx, doc);
 }
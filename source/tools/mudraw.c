@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #ifdef _MSC_VER
 struct timeval;
 struct timezone;
@@ -205,6 +206,7 @@ typedef struct worker_t {
 	fz_pixmap *pix;
 	fz_bitmap *bit;
 	fz_cookie cookie;
+	fz_tile_renderer *tiles; /* non-NULL to help draw tiles instead of a band */
 #ifndef DISABLE_MUTHREADS
 	mu_semaphore start;
 	mu_semaphore stop;
@@ -212,6 +214,23 @@ typedef struct worker_t {
 #endif
 } worker_t;
 
+typedef struct recorder_t {
+	fz_context *ctx;
+	int num;
+	int pagenum; /* -1 to shutdown, 0 when idle, or page to record */
+	fz_document *doc;
+	fz_page *page; /* NULL if the page could not be recorded */
+	fz_display_list *list;
+	int errors;
+	int interptime;
+	char error[256];
+#ifndef DISABLE_MUTHREADS
+	mu_semaphore start;
+	mu_semaphore stop;
+	mu_thread thread;
+#endif
+} recorder_t;
+
 static char *output = NULL;
 static fz_output *out = NULL;
 static int output_pagenum = 0;
@@ -245,6 +264,7 @@ static pdf_document *pdfout = NULL;
 
 static int ignore_errors = 0;
 static int uselist = 1;
+static const char *list_cache_dir = NULL;
 static int alphabits_text = 8;
 static int alphabits_graphics = 8;
 
@@ -271,6 +291,10 @@ static char *filename;
 static int files = 0;
 static int num_workers = 0;
 static worker_t *workers;
+static int num_recorders = 0;
+static recorder_t *recorders;
+static int next_recorder = 0;
+static int record_threaded = 0;
 static fz_band_writer *bander = NULL;
 
 #if FZ_ENABLE_ICC
@@ -334,9 +358,14 @@ static void usage(void)
 		"\t-f -\tfit width and/or height exactly; ignore original aspect ratio\n"
 		"\t-B -\tmaximum band_height (pXm, pcl, pclm, ps, psd and png output only)\n"
 #ifndef DISABLE_MUTHREADS
-		"\t-T -\tnumber of threads to use for rendering (banded mode only)\n"
+		"\t-T -\tnumber of threads to use for rendering (bands, or tiles without -B)\n"
 #else
 		"\t-T -\tnumber of threads to use for rendering (disabled in this non-threading build)\n"
+#endif
+#ifndef DISABLE_MUTHREADS
+		"\t-J -\tnumber of threads to interpret PDF pages with\n"
+#else
+		"\t-J -\tnumber of threads to interpret PDF pages with (disabled in this non-threading build)\n"
 #endif
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
@@ -354,6 +383,7 @@ static void usage(void)
 		"\t-A -/-\tnumber of bits of antialiasing (0 to 8) (graphics, text)\n"
 		"\t-l -\tminimum stroked line width (in pixels)\n"
 		"\t-D\tdisable use of display list\n"
+		"\t-C -\tdirectory in which to save and reuse display lists\n"
 		"\t-i\tignore errors\n"
 		"\t-L\tlow memory mode (avoid caching, clear objects after each page)\n"
 #ifndef DISABLE_MUTHREADS
@@ -459,6 +489,17 @@ file_level_trailers(fz_context *ctx)
 		fz_drop_band_writer(ctx, bander);
 }
 
+static void finishband(fz_context *ctx, fz_pixmap *pix, int band_start, fz_bitmap **bit)
+{
+	if (invert)
+		fz_invert_pixmap(ctx, pix);
+	if (gamma_value != 1)
+		fz_gamma_pixmap(ctx, pix, gamma_value);
+
+	if (((output_format == OUT_PCL || output_format == OUT_PWG) && out_cs == CS_MONO) || (output_format == OUT_PBM) || (output_format == OUT_PKM))
+		*bit = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL, band_start);
+}
+
 static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, fz_matrix ctm, fz_rect tbounds, fz_cookie *cookie, int band_start, fz_pixmap *pix, fz_bitmap **bit)
 {
 	fz_device *dev = NULL;
@@ -487,13 +528,7 @@ static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, fz_m
 		fz_drop_device(ctx, dev);
 		dev = NULL;
 
-		if (invert)
-			fz_invert_pixmap(ctx, pix);
-		if (gamma_value != 1)
-			fz_gamma_pixmap(ctx, pix, gamma_value);
-
-		if (((output_format == OUT_PCL || output_format == OUT_PWG) && out_cs == CS_MONO) || (output_format == OUT_PBM) || (output_format == OUT_PKM))
-			*bit = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL, band_start);
+		finishband(ctx, pix, band_start, bit);
 	}
 	fz_catch(ctx)
 	{
@@ -502,6 +537,44 @@ static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, fz_m
 	}
 }
 
+/* Draw a whole page at once by splitting it into tiles shared between the workers. */
+static void drawtiled(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_cookie *cookie, fz_pixmap *pix, fz_bitmap **bit)
+{
+	fz_tile_renderer *tiles;
+	int i;
+
+	*bit = NULL;
+
+	if (pix->alpha)
+		fz_clear_pixmap(ctx, pix);
+	else
+		fz_clear_pixmap_with_value(ctx, pix, 255);
+
+	tiles = fz_new_tile_renderer(ctx, list, ctm, pix, 0, num_workers);
+	for (i = 0; i < num_workers; i++)
+	{
+		workers[i].band = 0;
+		workers[i].tiles = tiles;
+		memset(&workers[i].cookie, 0, sizeof(fz_cookie));
+#ifndef DISABLE_MUTHREADS
+		DEBUG_THREADS(("Triggering worker %d for tiles\n", i));
+		mu_trigger_semaphore(&workers[i].start);
+#endif
+	}
+	for (i = 0; i < num_workers; i++)
+	{
+#ifndef DISABLE_MUTHREADS
+		DEBUG_THREADS(("Waiting for worker %d to complete tiles\n", i));
+		mu_wait_semaphore(&workers[i].stop);
+#endif
+		workers[i].tiles = NULL;
+		cookie->errors += workers[i].cookie.errors;
+	}
+	fz_drop_tile_renderer(ctx, tiles);
+
+	finishband(ctx, pix, 0, bit);
+}
+
 static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, int pagenum, fz_cookie *cookie, int start, int interptime, char *filename, int bg, fz_separations *seps)
 {
 	fz_rect mediabox;
@@ -713,6 +786,8 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 		fz_pixmap *pix = NULL;
 		int w, h;
 		fz_bitmap *bit = NULL;
+		/* Without banding, share the single band out between the workers as tiles. */
+		int tiled = (num_workers > 0 && band_height == 0 && !proof_cs && !lowmemory && alphabits_graphics != 0);
 
 		fz_var(pix);
 		fz_var(bander);
@@ -795,7 +870,7 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 				DEBUG_THREADS(("Using %d Bands\n", bands));
 			}
 
-			if (num_workers > 0)
+			if (num_workers > 0 && !tiled)
 			{
 				for (band = 0; band < fz_mini(num_workers, bands); band++)
 				{
@@ -859,7 +934,9 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 
 			for (band = 0; band < bands; band++)
 			{
-				if (num_workers > 0)
+				if (tiled)
+					drawtiled(ctx, list, ctm, cookie, pix, &bit);
+				else if (num_workers > 0)
 				{
 					worker_t *w = &workers[band % num_workers];
 #ifndef DISABLE_MUTHREADS
@@ -915,11 +992,14 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 				fz_drop_band_writer(ctx, bander);
 			fz_drop_bitmap(ctx, bit);
 			bit = NULL;
-			if (num_workers > 0)
+			if (num_workers > 0 && !tiled)
 			{
 				int band;
 				for (band = 0; band < num_workers; band++)
+				{
 					fz_drop_pixmap(ctx, workers[band].pix);
+					workers[band].pix = NULL;
+				}
 			}
 			else
 				fz_drop_pixmap(ctx, pix);
@@ -995,7 +1075,11 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 		fz_empty_store(ctx);
 
 	if (showmemory)
+	{
 		fz_dump_glyph_cache_stats(ctx);
+		fz_dump_image_cache_stats(ctx);
+		fz_dump_store_stats(ctx);
+	}
 
 	fz_flush_warnings(ctx);
 
@@ -1014,12 +1098,127 @@ static void bgprint_flush(void)
 	bgprint.started = 0;
 }
 
-static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
+/* Make the name of the file that caches the display list of a page.
+ * The name changes whenever the input file, or the options that
+ * affect the contents of the display list (layout, user CSS, colour
+ * management and the layer config), change. */
+static void list_cache_path(char *path, size_t size, int pagenum)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char digest[16];
+	char name[33];
+	struct stat info;
+	fz_md5 md5;
+	int i;
+
+	memset(&info, 0, sizeof(info));
+	stat(filename, &info);
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (unsigned char *)filename, strlen(filename));
+	fz_md5_update(&md5, (unsigned char *)&info.st_size, sizeof(info.st_size));
+	fz_md5_update(&md5, (unsigned char *)&info.st_mtime, sizeof(info.st_mtime));
+	fz_md5_update(&md5, (unsigned char *)&pagenum, sizeof(pagenum));
+	fz_md5_update(&md5, (unsigned char *)&layout_w, sizeof(layout_w));
+	fz_md5_update(&md5, (unsigned char *)&layout_h, sizeof(layout_h));
+	fz_md5_update(&md5, (unsigned char *)&layout_em, sizeof(layout_em));
+	fz_md5_update(&md5, (unsigned char *)&layout_use_doc_css, sizeof(layout_use_doc_css));
+	if (layout_css)
+		fz_md5_update(&md5, (unsigned char *)layout_css, strlen(layout_css));
+	i = (icc_engine != NULL);
+	fz_md5_update(&md5, (unsigned char *)&i, sizeof(i));
+	i = (layer_config != NULL);
+	fz_md5_update(&md5, (unsigned char *)&i, sizeof(i));
+	if (layer_config)
+		fz_md5_update(&md5, (unsigned char *)layer_config, strlen(layer_config));
+	fz_md5_final(&md5, digest);
+
+	for (i = 0; i < 16; i++)
+	{
+		name[i*2] = hex[digest[i] >> 4];
+		name[i*2+1] = hex[digest[i] & 15];
+	}
+	name[32] = 0;
+
+	fz_snprintf(path, size, "%s/%s.mudl", list_cache_dir, name);
+}
+
+static fz_display_list *record_page(fz_context *ctx, fz_page *page, int pagenum, fz_cookie *cookie)
 {
-	fz_page *page;
 	fz_display_list *list = NULL;
 	fz_device *dev = NULL;
-	int start;
+	char cache_path[1024];
+	char tmp_path[1030];
+
+	fz_var(list);
+	fz_var(dev);
+
+	if (list_cache_dir)
+	{
+		list_cache_path(cache_path, sizeof cache_path, pagenum);
+		if (fz_file_exists(ctx, cache_path))
+		{
+			fz_try(ctx)
+				list = fz_load_display_list(ctx, cache_path);
+			fz_catch(ctx)
+				fz_warn(ctx, "cannot load cached display list for page %d", pagenum);
+			if (list)
+				return list;
+		}
+	}
+
+	fz_try(ctx)
+	{
+		list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+		dev = fz_new_list_device(ctx, list);
+		if (lowmemory)
+			fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
+		fz_run_page(ctx, page, dev, fz_identity, cookie);
+		fz_close_device(ctx, dev);
+
+		/* Other processes may be reading the cache, so
+		 * only put complete files into it. */
+		if (list_cache_dir && !cookie->errors)
+		{
+			fz_snprintf(tmp_path, sizeof tmp_path, "%s.tmp", cache_path);
+			fz_try(ctx)
+			{
+				fz_save_display_list(ctx, list, tmp_path);
+#ifdef _WIN32
+				if (fz_rename_utf8(tmp_path, cache_path) < 0)
+#else
+				if (rename(tmp_path, cache_path) < 0)
+#endif
+					fz_throw(ctx, FZ_ERROR_GENERIC, "cannot rename '%s'", tmp_path);
+			}
+			fz_catch(ctx)
+			{
+				remove(tmp_path);
+				fz_warn(ctx, "cannot cache display list for page %d", pagenum);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	return list;
+}
+
+/*
+	Draw a page that has already been loaded. If list is given, it
+	has been recorded from the page by a recorder thread, with the
+	given number of errors. Takes ownership of both.
+*/
+static void drawloadedpage(fz_context *ctx, fz_page *page, fz_display_list *list, int pagenum, int start, int errors)
+{
+	fz_device *dev = NULL;
 	fz_cookie cookie = { 0 };
 	fz_separations *seps = NULL;
 	const char *features = "";
@@ -1028,9 +1227,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	fz_var(dev);
 	fz_var(seps);
 
-	start = (showtime ? gettime() : 0);
-
-	page = fz_load_page(ctx, doc, pagenum - 1);
+	cookie.errors = errors;
 
 	if (spots != SPOTS_NONE)
 	{
@@ -1064,6 +1261,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		}
 		fz_catch(ctx)
 		{
+			fz_drop_display_list(ctx, list);
 			fz_drop_page(ctx, page);
 			fz_rethrow(ctx);
 		}
@@ -1071,26 +1269,16 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 
 	if (uselist)
 	{
-		fz_try(ctx)
-		{
-			list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
-			dev = fz_new_list_device(ctx, list);
-			if (lowmemory)
-				fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
-			fz_run_page(ctx, page, dev, fz_identity, &cookie);
-			fz_close_device(ctx, dev);
-		}
-		fz_always(ctx)
-		{
-			fz_drop_device(ctx, dev);
-			dev = NULL;
-		}
-		fz_catch(ctx)
+		if (!list)
 		{
-			fz_drop_display_list(ctx, list);
-			fz_drop_separations(ctx, seps);
-			fz_drop_page(ctx, page);
-			fz_rethrow(ctx);
+			fz_try(ctx)
+				list = record_page(ctx, page, pagenum, &cookie);
+			fz_catch(ctx)
+			{
+				fz_drop_separations(ctx, seps);
+				fz_drop_page(ctx, page);
+				fz_rethrow(ctx);
+			}
 		}
 
 		if (bgprint.active && showtime)
@@ -1174,12 +1362,161 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	}
 }
 
+static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
+{
+	int start = (showtime ? gettime() : 0);
+	fz_page *page = fz_load_page(ctx, doc, pagenum - 1);
+
+	drawloadedpage(ctx, page, NULL, pagenum, start, 0);
+}
+
+#ifndef DISABLE_MUTHREADS
+static void recorder_thread(void *arg)
+{
+	recorder_t *me = (recorder_t *)arg;
+	fz_cookie cookie;
+	int pagenum, start;
+
+	do
+	{
+		DEBUG_THREADS(("Recorder %d waiting\n", me->num));
+		mu_wait_semaphore(&me->start);
+		pagenum = me->pagenum;
+		DEBUG_THREADS(("Recorder %d woken for page %d\n", me->num, pagenum));
+		if (pagenum > 0)
+		{
+			memset(&cookie, 0, sizeof(cookie));
+			start = (showtime ? gettime() : 0);
+			fz_try(me->ctx)
+			{
+				me->page = fz_load_page(me->ctx, me->doc, pagenum - 1);
+				me->list = record_page(me->ctx, me->page, pagenum, &cookie);
+			}
+			fz_catch(me->ctx)
+			{
+				fz_drop_page(me->ctx, me->page);
+				me->page = NULL;
+				fz_strlcpy(me->error, fz_caught_message(me->ctx), sizeof me->error);
+			}
+			me->errors = cookie.errors;
+			me->interptime = (showtime ? gettime() - start : 0);
+		}
+		DEBUG_THREADS(("Recorder %d completed page %d\n", me->num, pagenum));
+		mu_trigger_semaphore(&me->stop);
+	}
+	while (pagenum >= 0);
+}
+
+/* Wait for a recorder to finish its page, and draw it. */
+static void finish_recording(fz_context *ctx, recorder_t *rec)
+{
+	fz_page *page;
+	fz_display_list *list;
+	int pagenum = rec->pagenum;
+
+	if (pagenum <= 0)
+		return;
+
+	DEBUG_THREADS(("Waiting for recorder %d to complete page %d\n", rec->num, pagenum));
+	mu_wait_semaphore(&rec->stop);
+	page = rec->page;
+	list = rec->list;
+	rec->page = NULL;
+	rec->list = NULL;
+	rec->pagenum = 0;
+
+	fz_try(ctx)
+	{
+		if (!page)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "%s", rec->error);
+		drawloadedpage(ctx, page, list, pagenum, (showtime ? gettime() - rec->interptime : 0), rec->errors);
+	}
+	fz_catch(ctx)
+	{
+		if (ignore_errors)
+			fz_warn(ctx, "ignoring error on page %d in '%s'", pagenum, filename);
+		else
+			fz_rethrow(ctx);
+	}
+}
+
+/*
+	Hand a page to the next recorder, once it has finished with its
+	last one. The recorders are used in turn, so the pages are drawn
+	in the order they were asked for.
+*/
+static void recordpage(fz_context *ctx, fz_document *doc, int pagenum)
+{
+	recorder_t *rec = &recorders[next_recorder];
+
+	finish_recording(ctx, rec);
+
+	rec->doc = doc;
+	rec->pagenum = pagenum;
+	DEBUG_THREADS(("Triggering recorder %d for page %d\n", rec->num, pagenum));
+	mu_trigger_semaphore(&rec->start);
+	next_recorder = (next_recorder + 1) % num_recorders;
+}
+
+static void finish_recorders(fz_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < num_recorders; i++)
+		finish_recording(ctx, &recorders[(next_recorder + i) % num_recorders]);
+}
+
+/* Wait for the recorders to stop using the document, dropping their pages. */
+static void abandon_recorders(fz_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < num_recorders; i++)
+	{
+		recorder_t *rec = &recorders[i];
+		if (rec->pagenum > 0)
+		{
+			mu_wait_semaphore(&rec->stop);
+			fz_drop_display_list(ctx, rec->list);
+			fz_drop_page(ctx, rec->page);
+			rec->list = NULL;
+			rec->page = NULL;
+			rec->pagenum = 0;
+		}
+	}
+}
+#endif
+
 static void drawrange(fz_context *ctx, fz_document *doc, const char *range)
 {
 	int page, spage, epage, pagecount;
 
 	pagecount = fz_count_pages(ctx, doc);
 
+#ifndef DISABLE_MUTHREADS
+	if (record_threaded)
+	{
+		fz_try(ctx)
+		{
+			while ((range = fz_parse_page_range(ctx, range, &spage, &epage, pagecount)))
+			{
+				if (spage < epage)
+					for (page = spage; page <= epage; page++)
+						recordpage(ctx, doc, page);
+				else
+					for (page = spage; page >= epage; page--)
+						recordpage(ctx, doc, page);
+			}
+			finish_recorders(ctx);
+		}
+		fz_catch(ctx)
+		{
+			abandon_recorders(ctx);
+			fz_rethrow(ctx);
+		}
+		return;
+	}
+#endif
 	while ((range = fz_parse_page_range(ctx, range, &spage, &epage, pagecount)))
 	{
 		if (spage < epage)
@@ -1309,7 +1646,9 @@ static void worker_thread(void *arg)
 		DEBUG_THREADS(("Worker %d waiting\n", me->num));
 		mu_wait_semaphore(&me->start);
 		DEBUG_THREADS(("Worker %d woken for band %d\n", me->num, me->band));
-		if (me->band >= 0)
+		if (me->tiles)
+			me->cookie.errors += fz_run_tile_renderer(me->ctx, me->tiles, me->num, &me->cookie);
+		else if (me->band >= 0)
 			drawband(me->ctx, NULL, me->list, me->ctm, me->tbounds, &me->cookie, me->band * band_height, me->pix, &me->bit);
 		DEBUG_THREADS(("Worker %d completed band %d\n", me->num, me->band));
 		mu_trigger_semaphore(&me->stop);
@@ -1466,7 +1805,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "qp:o:F:R:r:w:h:fB:c:e:G:Is:A:DiW:H:S:T:U:XLvPl:y:NO:")) != -1)
+	while ((c = fz_getopt(argc, argv, "qp:o:F:R:r:w:h:fB:c:e:G:Is:A:DiW:H:S:T:J:U:XLvPl:y:NO:C:")) != -1)
 	{
 		switch (c)
 		{
@@ -1523,6 +1862,7 @@ int mudraw_main(int argc, char **argv)
 			break;
 		}
 		case 'D': uselist = 0; break;
+		case 'C': list_cache_dir = fz_optarg; break;
 		case 'l': min_line_width = fz_atof(fz_optarg); break;
 		case 'i': ignore_errors = 1; break;
 		case 'N': icc_engine = NULL; break;
@@ -1533,6 +1873,13 @@ int mudraw_main(int argc, char **argv)
 #else
 			fprintf(stderr, "Threads not enabled in this build\n");
 			break;
+#endif
+		case 'J':
+#ifndef DISABLE_MUTHREADS
+			num_recorders = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
 #endif
 		case 'L': lowmemory = 1; break;
 		case 'P':
@@ -1559,9 +1906,9 @@ int mudraw_main(int argc, char **argv)
 			exit(1);
 		}
 
-		if (band_height == 0)
+		if (band_height == 0 && (proof_filename || lowmemory || alphabits_graphics == 0))
 		{
-			fprintf(stderr, "Using multiple threads without banding is pointless\n");
+			fprintf(stderr, "Using multiple threads without banding is pointless with these options\n");
 		}
 	}
 
@@ -1574,6 +1921,15 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	if (num_recorders > 0)
+	{
+		if (uselist == 0)
+		{
+			fprintf(stderr, "cannot interpret pages on multiple threads without using display list\n");
+			exit(1);
+		}
+	}
+
 #ifndef DISABLE_MUTHREADS
 	locks = init_mudraw_locks();
 	if (locks == NULL)
@@ -1619,6 +1975,7 @@ int mudraw_main(int argc, char **argv)
 		{
 			int i;
 			int fail = 0;
+			fz_set_font_face_pool_size(ctx, num_workers);
 			workers = fz_calloc(ctx, num_workers, sizeof(*workers));
 			for (i = 0; i < num_workers; i++)
 			{
@@ -1634,6 +1991,26 @@ int mudraw_main(int argc, char **argv)
 				exit(1);
 			}
 		}
+
+		if (num_recorders > 0)
+		{
+			int i;
+			int fail = 0;
+			recorders = fz_calloc(ctx, num_recorders, sizeof(*recorders));
+			for (i = 0; i < num_recorders; i++)
+			{
+				recorders[i].ctx = fz_clone_context(ctx);
+				recorders[i].num = i;
+				fail |= mu_create_semaphore(&recorders[i].start);
+				fail |= mu_create_semaphore(&recorders[i].stop);
+				fail |= mu_create_thread(&recorders[i].thread, recorder_thread, &recorders[i]);
+			}
+			if (fail)
+			{
+				fprintf(stderr, "recorder startup failed\n");
+				exit(1);
+			}
+		}
 #endif /* DISABLE_MUTHREADS */
 
 		if (layout_css)
@@ -1912,6 +2289,15 @@ int mudraw_main(int argc, char **argv)
 					if (layer_config)
 						apply_layer_config(ctx, doc, layer_config);
 
+#if FZ_ENABLE_PDF
+					/* Only PDF documents can be shared between threads. */
+					if (num_recorders > 0 && pdf_specifics(ctx, doc))
+					{
+						pdf_enable_threading(ctx, pdf_specifics(ctx, doc));
+						record_threaded = 1;
+					}
+#endif
+
 					if (output_format == OUT_GPROOF)
 					{
 						fz_save_gproof(ctx, filename, doc, output, resolution, "", "");
@@ -1927,11 +2313,13 @@ int mudraw_main(int argc, char **argv)
 					bgprint_flush();
 					fz_drop_document(ctx, doc);
 					doc = NULL;
+					record_threaded = 0;
 				}
 				fz_catch(ctx)
 				{
 					fz_drop_document(ctx, doc);
 					doc = NULL;
+					record_threaded = 0;
 
 					if (!ignore_errors)
 						fz_rethrow(ctx);
@@ -2021,6 +2409,22 @@ int mudraw_main(int argc, char **argv)
 			fz_free(ctx, workers);
 		}
 
+		if (num_recorders > 0)
+		{
+			int i;
+			for (i = 0; i < num_recorders; i++)
+			{
+				recorders[i].pagenum = -1;
+				mu_trigger_semaphore(&recorders[i].start);
+				mu_wait_semaphore(&recorders[i].stop);
+				mu_destroy_semaphore(&recorders[i].start);
+				mu_destroy_semaphore(&recorders[i].stop);
+				mu_destroy_thread(&recorders[i].thread);
+				fz_drop_context(recorders[i].ctx);
+			}
+			fz_free(ctx, recorders);
+		}
+
 		if (bgprint.active)
 		{
 			bgprint.pagenum = -1;
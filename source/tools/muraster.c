@@ -835,6 +835,8 @@ static int try_render_page(fz_context *ctx, int pagenum, fz_cookie *cookie, int
 	if (showmemory)
 	{
 		fz_dump_glyph_cache_stats(ctx);
+		fz_dump_image_cache_stats(ctx);
+		fz_dump_store_stats(ctx);
 	}
 
 	fz_flush_warnings(ctx);
@@ -1551,6 +1553,7 @@ int main(int argc, char **argv)
 	{
 		int i;
 		int fail = 0;
+		fz_set_font_face_pool_size(ctx, num_workers);
 		workers = fz_calloc(ctx, num_workers, sizeof(*workers));
 		for (i = 0; i < num_workers; i++)
 		{
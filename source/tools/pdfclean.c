@@ -12,10 +12,100 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
 
+#ifndef DISABLE_MUTHREADS
+#include "mupdf/helpers/mu-threads.h"
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+/*
+	With threads, streams can be compressed on several of them at
+	once; without, we run everything on the calling thread.
+*/
+#ifndef DISABLE_MUTHREADS
+
+static int num_workers = 0;
+static mu_mutex mutexes[FZ_LOCK_MAX];
+
+static void pdfclean_lock(void *user, int lock)
+{
+	mu_lock_mutex(&mutexes[lock]);
+}
+
+static void pdfclean_unlock(void *user, int lock)
+{
+	mu_unlock_mutex(&mutexes[lock]);
+}
+
+static fz_locks_context pdfclean_locks =
+{
+	NULL, pdfclean_lock, pdfclean_unlock
+};
+
+static void fin_pdfclean_locks(void)
+{
+	int i;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		mu_destroy_mutex(&mutexes[i]);
+}
+
+static fz_locks_context *init_pdfclean_locks(void)
+{
+	int i;
+	int failed = 0;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		failed |= mu_create_mutex(&mutexes[i]);
+
+	if (failed)
+	{
+		fin_pdfclean_locks();
+		return NULL;
+	}
+
+	return &pdfclean_locks;
+}
+
+typedef struct
+{
+	fz_context *ctx;
+	void (*work)(fz_context *ctx, void *arg);
+	void *arg;
+	mu_thread thread;
+} worker_t;
+
+static void worker_thread(void *arg)
+{
+	worker_t *me = (worker_t *)arg;
+
+	me->work(me->ctx, me->arg);
+}
+
+/* Run the work on the worker threads, and on this one too. */
+static void run_parallel(fz_context *ctx, void *opaque, void (*work)(fz_context *ctx, void *arg), void *arg)
+{
+	worker_t *workers = opaque;
+	int i;
+
+	for (i = 0; i < num_workers; i++)
+	{
+		workers[i].work = work;
+		workers[i].arg = arg;
+		if (!workers[i].ctx || mu_create_thread(&workers[i].thread, worker_thread, &workers[i]))
+			break;
+	}
+
+	work(ctx, arg);
+
+	while (i-- > 0)
+		mu_destroy_thread(&workers[i].thread);
+}
+
+#endif
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -26,16 +116,23 @@ static void usage(void)
 		"\t-ggg\tin addition to -gg merge duplicate objects\n"
 		"\t-gggg\tin addition to -ggg check streams for duplication\n"
 		"\t-l\tlinearize PDF\n"
+		"\t-L\tlow memory mode (drop objects once written; not with -gg or -l)\n"
 		"\t-D\tsave file without encryption\n"
 		"\t-a\tascii hex encode binary streams\n"
 		"\t-d\tdecompress streams\n"
 		"\t-z\tdeflate uncompressed streams\n"
+		"\t-Z\tpack objects into compressed object streams\n"
 		"\t-f\tcompress font streams\n"
 		"\t-i\tcompress image streams\n"
 		"\t-c\tclean content streams\n"
 		"\t-s\tsanitize content streams\n"
 		"\t-A\tcreate appearance streams for annotations\n"
 		"\t-AA\trecreate appearance streams for annotations\n"
+#ifndef DISABLE_MUTHREADS
+		"\t-T -\tnumber of extra threads to use for compressing streams and repairing\n"
+#else
+		"\t-T -\tnumber of extra threads to use for compressing streams and repairing (disabled in this non-threading build)\n"
+#endif
 		"\tpages\tcomma separated list of page numbers and ranges\n"
 		);
 	exit(1);
@@ -50,11 +147,16 @@ int pdfclean_main(int argc, char **argv)
 	pdf_write_options opts = { 0 };
 	int errors = 0;
 	fz_context *ctx;
+	fz_locks_context *locks = NULL;
+#ifndef DISABLE_MUTHREADS
+	worker_t *workers = NULL;
+	int i;
+#endif
 
 	opts.continue_on_error = 1;
 	opts.errors = &errors;
 
-	while ((c = fz_getopt(argc, argv, "adfgilp:sczDA")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgilLp:sczZDAT:")) != -1)
 	{
 		switch (c)
 		{
@@ -62,15 +164,22 @@ int pdfclean_main(int argc, char **argv)
 
 		case 'd': opts.do_decompress += 1; break;
 		case 'z': opts.do_compress += 1; break;
+		case 'Z': opts.do_objstms += 1; break;
 		case 'f': opts.do_compress_fonts += 1; break;
 		case 'i': opts.do_compress_images += 1; break;
 		case 'a': opts.do_ascii += 1; break;
 		case 'g': opts.do_garbage += 1; break;
 		case 'l': opts.do_linear += 1; break;
+		case 'L': opts.do_low_memory += 1; break;
 		case 'c': opts.do_clean += 1; break;
 		case 's': opts.do_sanitize += 1; break;
 		case 'D': opts.do_decrypt += 1; break;
 		case 'A': opts.do_appearance += 1; break;
+#ifndef DISABLE_MUTHREADS
+		case 'T': num_workers = atoi(fz_optarg); break;
+#else
+		case 'T': break;
+#endif
 		default: usage(); break;
 		}
 	}
@@ -89,22 +198,61 @@ int pdfclean_main(int argc, char **argv)
 		outfile = argv[fz_optind++];
 	}
 
-	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+#ifndef DISABLE_MUTHREADS
+	if (num_workers > 0)
+	{
+		locks = init_pdfclean_locks();
+		if (locks == NULL)
+		{
+			fprintf(stderr, "mutex initialisation failed\n");
+			exit(1);
+		}
+	}
+#endif
+
+	ctx = fz_new_context(NULL, locks, FZ_STORE_UNLIMITED);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
 		exit(1);
 	}
 
+#ifndef DISABLE_MUTHREADS
+	fz_var(workers);
+#endif
+
 	fz_try(ctx)
 	{
+#ifndef DISABLE_MUTHREADS
+		if (num_workers > 0)
+		{
+			workers = fz_calloc(ctx, num_workers, sizeof(*workers));
+			for (i = 0; i < num_workers; i++)
+				workers[i].ctx = fz_clone_context(ctx);
+			opts.parallel = run_parallel;
+			opts.parallel_opaque = workers;
+		}
+#endif
 		pdf_clean_file(ctx, infile, outfile, password, &opts, &argv[fz_optind], argc - fz_optind);
 	}
 	fz_catch(ctx)
 	{
 		errors++;
 	}
+
+#ifndef DISABLE_MUTHREADS
+	if (workers)
+	{
+		for (i = 0; i < num_workers; i++)
+			fz_drop_context(workers[i].ctx);
+		fz_free(ctx, workers);
+	}
+#endif
 	fz_drop_context(ctx);
+#ifndef DISABLE_MUTHREADS
+	if (locks)
+		fin_pdfclean_locks();
+#endif
 
 	return errors != 0;
 }